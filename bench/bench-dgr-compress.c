@@ -0,0 +1,202 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures the cost of compressing DGR frames (see
+ * dgr.compress) against the number of bytes and packets that it
+ * saves. Frames are built in the same format that dgr_serialize()
+ * uses and contain data that is typical for DGR programs: camera
+ * poses, an animated vertex array, a skinning palette, a few integer
+ * flags and (as a worst case) random bytes.
+ *
+ * Usage: bench-dgr-compress [frames]
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "kuhl-util.h"
+#include "vecmat.h"
+#include "lzcompress.h"
+#include "dgr-packet.h"
+
+#define MTU 1500
+
+static char *frame = NULL;
+static int frameSize = 0;
+static int frameCapacity = 0;
+
+/** Appends a record to the frame in the format that dgr_serialize() uses. */
+static void add_record(const char *name, const void *data, int size)
+{
+	int needed = frameSize + (int) strlen(name) + 1 + (int) sizeof(int) + size;
+	if(needed > frameCapacity)
+	{
+		frameCapacity = needed*2;
+		frame = realloc(frame, frameCapacity);
+	}
+	strcpy(frame+frameSize, name);
+	frameSize += strlen(name)+1;
+	memcpy(frame+frameSize, &size, sizeof(int));
+	frameSize += sizeof(int);
+	memcpy(frame+frameSize, data, size);
+	frameSize += size;
+}
+
+/** Builds a frame containing the records that a program with tracked
+ * objects sends: a pose for each object. */
+static void frame_poses(int f)
+{
+	for(int i=0; i<20; i++)
+	{
+		char name[64];
+		snprintf(name, 64, "!!viewmat%d", i);
+		float m[16];
+		mat4f_rotateEuler_new(m, f*.1f+i, f*.05f, 0, "XYZ");
+		m[12] = sinf(f*.01f)+i;
+		m[13] = 1.5f;
+		m[14] = cosf(f*.01f);
+		add_record(name, m, sizeof(m));
+	}
+}
+
+/** Builds a frame containing an animated vertex array (a grid of
+ * vertices that move like a wave). */
+static void frame_vertices(int f)
+{
+	static float *v = NULL;
+	const int n = 100*100;
+	if(v == NULL)
+		v = malloc(sizeof(float)*3*n);
+	for(int i=0; i<n; i++)
+	{
+		float x = (float) (i % 100);
+		float z = (float) (i / 100);
+		v[i*3+0] = x;
+		v[i*3+1] = sinf(x*.1f + f*.05f) * .5f;
+		v[i*3+2] = z;
+	}
+	add_record("mesh.positions", v, sizeof(float)*3*n);
+}
+
+/** Builds a frame containing a skinning palette (one matrix per bone). */
+static void frame_skinning(int f)
+{
+	float palette[64*16];
+	for(int i=0; i<64; i++)
+	{
+		mat4f_rotateEuler_new(palette+i*16, sinf(f*.02f+i)*30, 0, 0, "XYZ");
+		palette[i*16+13] = i*.1f;
+	}
+	add_record("model.bones", palette, sizeof(palette));
+}
+
+/** Builds a frame containing a few integer variables. */
+static void frame_flags(int f)
+{
+	int flags[256];
+	memset(flags, 0, sizeof(flags));
+	flags[0] = f;
+	flags[1] = f % 7 == 0;
+	flags[17] = 3;
+	add_record("app.flags", flags, sizeof(flags));
+}
+
+/** Builds a frame containing random bytes, which don't compress. */
+static void frame_random(int f)
+{
+	(void) f;
+	static char r[16384];
+	for(unsigned int i=0; i<sizeof(r); i++)
+		r[i] = (char) (drand48()*256);
+	add_record("random", r, sizeof(r));
+}
+
+/** Returns the number of packets that are needed to send size bytes. */
+static int packets(int size)
+{
+	int maxFragment = MTU - 28 - (int) sizeof(dgr_packet_header);
+	int p = (size + maxFragment - 1) / maxFragment;
+	return p > 0 ? p : 1;
+}
+
+static void bench(const char *label, void (*build)(int), int numFrames)
+{
+	long rawBytes = 0, compressedBytes = 0, rawPackets = 0, compressedPackets = 0;
+	long compressTime = 0, decompressTime = 0;
+	char *compressed = NULL;
+	char *decompressed = NULL;
+	int capacity = 0;
+
+	for(int f=0; f<numFrames; f++)
+	{
+		frameSize = 0;
+		build(f);
+		if(lzcompress_bound(frameSize) > capacity)
+		{
+			capacity = lzcompress_bound(frameSize);
+			compressed = realloc(compressed, capacity);
+			decompressed = realloc(decompressed, capacity);
+		}
+
+		long start = kuhl_microseconds();
+		int csize = lzcompress(frame, frameSize, compressed, capacity);
+		long mid = kuhl_microseconds();
+		int dsize = lzdecompress(compressed, csize, decompressed, frameSize);
+		long end = kuhl_microseconds();
+		if(dsize != frameSize || memcmp(frame, decompressed, frameSize) != 0)
+		{
+			printf("ERROR: %s: frame %d didn't decompress correctly.\n", label, f);
+			exit(EXIT_FAILURE);
+		}
+		compressTime += mid-start;
+		decompressTime += end-mid;
+
+		/* dgr_send() sends the uncompressed frame if compression
+		 * doesn't make it smaller. */
+		int sent = csize + (int) sizeof(uint32_t);
+		if(sent > frameSize)
+			sent = frameSize;
+		rawBytes += frameSize;
+		compressedBytes += sent;
+		rawPackets += packets(frameSize);
+		compressedPackets += packets(sent);
+	}
+
+	printf("%-10s %8ld %8ld %6.1f%% %7.1f %7.1f %8.1f %9.1f %9.0f %9.0f\n", label,
+	       rawBytes/numFrames, compressedBytes/numFrames, 100.0*compressedBytes/rawBytes,
+	       rawPackets/(double)numFrames, compressedPackets/(double)numFrames,
+	       compressTime/(double)numFrames, decompressTime/(double)numFrames,
+	       rawBytes/(compressTime > 0 ? compressTime : 1)/1.048576,
+	       rawBytes/(decompressTime > 0 ? decompressTime : 1)/1.048576);
+	free(compressed);
+	free(decompressed);
+}
+
+int main(int argc, char **argv)
+{
+	int numFrames = 2000;
+	if(argc > 1)
+		numFrames = atoi(argv[1]);
+	if(numFrames < 1)
+	{
+		printf("Usage: %s [frames]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Compressing %d frames of each type (packet counts assume a %d byte MTU).\n", numFrames, MTU);
+	printf("%-10s %8s %8s %7s %7s %7s %8s %9s %9s %9s\n", "stream", "bytes", "sent", "ratio",
+	       "pkts", "pkts(c)", "comp us", "decomp us", "comp MB/s", "dec MB/s");
+	bench("poses", frame_poses, numFrames);
+	bench("vertices", frame_vertices, numFrames);
+	bench("skinning", frame_skinning, numFrames);
+	bench("flags", frame_flags, numFrames);
+	bench("random", frame_random, numFrames);
+	free(frame);
+	return 0;
+}
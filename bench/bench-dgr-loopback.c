@@ -0,0 +1,406 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Runs a DGR master and several DGR slaves on this machine and
+ * measures how long it takes for a frame to get from the master to
+ * the slaves. Every process uses the real dgr_init(), dgr_setget()
+ * and dgr_update() functions. The master sends packets directly to
+ * the slaves (with unicast if there is one slave, with multicast on
+ * 127.0.0.1 otherwise) and then through dgr-relay. Each run uses a
+ * different number of records, record size and frame rate.
+ *
+ * Usage: bench-dgr-loopback [slaves] [seconds] [path-to-dgr-relay]
+ *
+ * For each run, the following are printed:
+ * - The frame rate the master achieved and the bandwidth and packet
+ *   rate that it reported (see dgr_stats()).
+ * - The percentage of frames that the slaves used. Slaves skip
+ *   frames that are superseded before they use them.
+ * - Latency percentiles (from the master calling dgr_update() to a
+ *   slave seeing the frame) for all of the slaves together. Slaves
+ *   check for new frames every POLL_USEC microseconds, which adds up
+ *   to that amount to each latency.
+ * - CPU time (user+system, all threads) per frame for the master and
+ *   the average for the slaves.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "kuhl-util.h"
+#include "dgr.h"
+
+#define MASTER_PORT 5710 /**< Port the relay listens on */
+#define SLAVE_PORT  5711 /**< Port of the first slave */
+#define MULTICAST_GROUP "239.255.43.71"
+#define POLL_USEC 100
+#define MAX_SLAVES 32
+
+/** One combination of settings to measure. */
+typedef struct {
+	int records; /**< Number of records the master sets each frame */
+	int size;    /**< Size of each record */
+	int rate;    /**< Frames per second the master sends */
+} bench_config;
+
+static const bench_config configs[] = {
+	{  10,   64,  60 },
+	{  10,   64, 240 },
+	{  10, 1024,  60 },
+	{  10, 1024, 240 },
+	{ 200,   64,  60 },
+	{ 200,   64, 240 },
+	{ 200, 1024,  60 },
+	{ 200, 1024, 240 },
+};
+
+static int numSlaves = 2;
+static double seconds = 3;
+
+/** Results that the master sends to the parent process. */
+typedef struct {
+	long frames;
+	long elapsed; /**< Microseconds */
+	long cpu;     /**< Microseconds */
+	dgr_stats_info stats;
+} master_result;
+
+/* Slave state used when the slave exits. */
+static int slaveFd = -1;
+static long slaveCpuStart = 0;
+static long *latencies = NULL;
+static int numLatencies = 0;
+static int latencyCapacity = 0;
+
+/** Returns the CPU time (user and system, all threads) this process
+ * has used in microseconds. */
+static long cpu_usec(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/** Writes a buffer to a pipe. */
+static void write_all(int fd, const void *buf, size_t size)
+{
+	const char *ptr = buf;
+	while(size > 0)
+	{
+		ssize_t n = write(fd, ptr, size);
+		if(n <= 0)
+			return;
+		ptr += n;
+		size -= n;
+	}
+}
+
+/** Reads a buffer from a pipe. Returns 1 if successful. */
+static int read_all(int fd, void *buf, size_t size)
+{
+	char *ptr = buf;
+	while(size > 0)
+	{
+		ssize_t n = read(fd, ptr, size);
+		if(n <= 0)
+			return 0;
+		ptr += n;
+		size -= n;
+	}
+	return 1;
+}
+
+/** Prevents output from DGR from interfering with the results. Errors
+ * are still printed to stderr. */
+static void quiet(void)
+{
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+	close(devnull);
+	kuhl_config_set("log.filename", "/dev/null");
+}
+
+/** Slave: Sends the results to the parent process. DGR calls exit()
+ * when the master exits, so this is called by atexit(). */
+static void slave_report(void)
+{
+	long cpu = cpu_usec() - slaveCpuStart;
+	write_all(slaveFd, &numLatencies, sizeof(int));
+	write_all(slaveFd, &cpu, sizeof(long));
+	write_all(slaveFd, latencies, sizeof(long)*numLatencies);
+	close(slaveFd);
+}
+
+/** Slave: Uses frames as they arrive and records their latency. */
+static void run_slave(const bench_config *cfg, int index, int multicast, int fd)
+{
+	char port[32];
+	snprintf(port, 32, "%d", multicast ? SLAVE_PORT : SLAVE_PORT+index);
+	quiet();
+	kuhl_config_set("dgr.mode", "slave");
+	kuhl_config_set("dgr.slave.listenport", port);
+	if(multicast)
+	{
+		kuhl_config_set("dgr.transport", "multicast");
+		kuhl_config_set("dgr.multicast.group", MULTICAST_GROUP);
+		kuhl_config_set("dgr.multicast.interface", "127.0.0.1");
+	}
+	dgr_init(); // returns once the first keyframe arrives
+
+	slaveFd = fd;
+	slaveCpuStart = cpu_usec();
+	atexit(slave_report);
+
+	char name[32];
+	char *buf = malloc(cfg->size);
+	long lastSent = 0;
+	while(1)
+	{
+		dgr_update(0,1);
+		long sent = 0;
+		dgr_setget("bench.time", &sent, sizeof(long));
+		if(sent != lastSent)
+		{
+			if(numLatencies == latencyCapacity)
+			{
+				latencyCapacity = latencyCapacity*2 + 1024;
+				latencies = realloc(latencies, sizeof(long)*latencyCapacity);
+			}
+			latencies[numLatencies++] = kuhl_microseconds() - sent;
+			lastSent = sent;
+
+			for(int i=0; i<cfg->records; i++)
+			{
+				snprintf(name, 32, "bench.record%d", i);
+				dgr_setget(name, buf, cfg->size);
+			}
+		}
+		usleep(POLL_USEC);
+	}
+}
+
+/** Master: Sends frames at the requested rate and then exits (which
+ * tells the slaves to exit). */
+static void run_master(const bench_config *cfg, int useRelay, int fd)
+{
+	char port[32];
+	snprintf(port, 32, "%d", useRelay ? MASTER_PORT : SLAVE_PORT);
+	quiet();
+	kuhl_config_set("dgr.mode", "master");
+	kuhl_config_set("dgr.master.destport", port);
+	if(useRelay || numSlaves == 1)
+		kuhl_config_set("dgr.master.destip", "127.0.0.1");
+	else
+	{
+		kuhl_config_set("dgr.transport", "multicast");
+		kuhl_config_set("dgr.multicast.group", MULTICAST_GROUP);
+		kuhl_config_set("dgr.multicast.interface", "127.0.0.1");
+	}
+	dgr_init();
+
+	char name[32];
+	char *buf = malloc(cfg->size);
+	master_result result;
+	result.frames = (long) (seconds * cfg->rate);
+	long cpuStart = cpu_usec();
+	long start = kuhl_microseconds();
+	for(long f=0; f<result.frames; f++)
+	{
+		/* Change every record so that it is sent every frame. */
+		memset(buf, f & 0xff, cfg->size);
+		for(int i=0; i<cfg->records; i++)
+		{
+			snprintf(name, 32, "bench.record%d", i);
+			dgr_setget(name, buf, cfg->size);
+		}
+		long now = kuhl_microseconds();
+		dgr_setget("bench.time", &now, sizeof(long));
+		dgr_update(1,0);
+
+		long wait = start + (f+1)*1000000L/cfg->rate - kuhl_microseconds();
+		if(wait > 0)
+			usleep(wait);
+	}
+	result.elapsed = kuhl_microseconds() - start;
+	result.cpu = cpu_usec() - cpuStart;
+	dgr_stats(&result.stats);
+	write_all(fd, &result, sizeof(result));
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+	long x = *(const long*) a;
+	long y = *(const long*) b;
+	return (x > y) - (x < y);
+}
+
+/** Runs a master, the slaves and (optionally) a relay and prints the results. */
+static void run(const bench_config *cfg, const char *relay)
+{
+	int fds[MAX_SLAVES];
+	pid_t slaves[MAX_SLAVES];
+	for(int i=0; i<numSlaves; i++)
+	{
+		int p[2];
+		if(pipe(p) == -1)
+		{
+			perror("pipe");
+			exit(EXIT_FAILURE);
+		}
+		slaves[i] = fork();
+		if(slaves[i] == 0)
+		{
+			close(p[0]);
+			run_slave(cfg, i, relay == NULL && numSlaves > 1, p[1]);
+		}
+		close(p[1]);
+		fds[i] = p[0];
+	}
+
+	pid_t relayPid = -1;
+	if(relay != NULL)
+	{
+		relayPid = fork();
+		if(relayPid == 0)
+		{
+			char *args[MAX_SLAVES+4];
+			char ports[MAX_SLAVES+1][32];
+			int n = 0;
+			args[n++] = (char*) relay;
+			snprintf(ports[0], 32, "%d", MASTER_PORT);
+			args[n++] = ports[0];
+			args[n++] = "127.0.0.1";
+			for(int i=0; i<numSlaves; i++)
+			{
+				snprintf(ports[i+1], 32, "%d", SLAVE_PORT+i);
+				args[n++] = ports[i+1];
+			}
+			args[n] = NULL;
+			quiet();
+			execv(relay, args);
+			perror("execv");
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Give the slaves and relay time to open their sockets. */
+	usleep(300000);
+
+	int p[2];
+	if(pipe(p) == -1)
+	{
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	pid_t master = fork();
+	if(master == 0)
+	{
+		close(p[0]);
+		run_master(cfg, relay != NULL, p[1]);
+	}
+	close(p[1]);
+
+	master_result result;
+	int haveResult = read_all(p[0], &result, sizeof(result));
+	close(p[0]);
+	waitpid(master, NULL, 0);
+
+	/* Collect the latencies from every slave. */
+	long *all = NULL;
+	long total = 0;
+	long slaveCpu = 0;
+	int slavesReported = 0;
+	for(int i=0; i<numSlaves; i++)
+	{
+		int count;
+		long cpu;
+		if(read_all(fds[i], &count, sizeof(int)) && read_all(fds[i], &cpu, sizeof(long)))
+		{
+			all = realloc(all, sizeof(long)*(total+count+1));
+			if(read_all(fds[i], all+total, sizeof(long)*count))
+			{
+				total += count;
+				slaveCpu += cpu;
+				slavesReported++;
+			}
+		}
+		close(fds[i]);
+		waitpid(slaves[i], NULL, 0);
+	}
+	if(relayPid != -1)
+		waitpid(relayPid, NULL, 0);
+
+	printf("%-6s %5d %5d %5d ", relay ? "relay" : "direct", cfg->records, cfg->size, cfg->rate);
+	if(!haveResult || slavesReported < numSlaves || total == 0)
+	{
+		printf("FAILED (%d of %d slaves reported)\n", slavesReported, numSlaves);
+		free(all);
+		return;
+	}
+	qsort(all, total, sizeof(long), compare_long);
+	double fps = result.frames / (result.elapsed / 1000000.0);
+	printf("%7.1f %8.2f %8.0f %6.1f%% %7.3f %7.3f %7.3f %7.3f %8.1f %8.1f\n",
+	       fps, result.stats.bytesPerSecond/1024.0/1024.0, result.stats.packetsPerSecond,
+	       100.0*total/numSlaves/result.frames,
+	       all[total/2]/1000.0, all[total*9/10]/1000.0, all[total*99/100]/1000.0, all[total-1]/1000.0,
+	       result.cpu/(double)result.frames, slaveCpu/(double)slavesReported/result.frames);
+	free(all);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc > 1)
+		numSlaves = atoi(argv[1]);
+	if(argc > 2)
+		seconds = atof(argv[2]);
+	if(numSlaves < 1 || numSlaves > MAX_SLAVES || seconds < 2)
+	{
+		printf("Usage: %s [slaves] [seconds] [path-to-dgr-relay]\n", argv[0]);
+		printf("There can be 1 to %d slaves. Each run must be at least 2 seconds.\n", MAX_SLAVES);
+		exit(EXIT_FAILURE);
+	}
+
+	/* dgr-relay is usually in the same directory as this program. */
+	char relay[1024];
+	if(argc > 3)
+		snprintf(relay, sizeof(relay), "%s", argv[3]);
+	else
+	{
+		snprintf(relay, sizeof(relay), "%s", argv[0]);
+		char *slash = strrchr(relay, '/');
+		snprintf(slash ? slash+1 : relay, sizeof(relay) - (slash ? slash+1-relay : 0), "dgr-relay");
+	}
+	int haveRelay = access(relay, X_OK) == 0;
+	if(!haveRelay)
+		printf("'%s' doesn't exist; only measuring without a relay.\n", relay);
+
+	/* Slaves that exit early shouldn't kill us when we read from them. */
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%d slaves, %.1f seconds per run, slaves check for frames every %d usec.\n", numSlaves, seconds, POLL_USEC);
+	printf("%-6s %5s %5s %5s %7s %8s %8s %7s %7s %7s %7s %7s %8s %8s\n",
+	       "path", "recs", "size", "rate", "fps", "MB/s", "pkts/s", "used",
+	       "p50 ms", "p90 ms", "p99 ms", "max ms", "cpu(m)", "cpu(s)");
+	for(unsigned int i=0; i<sizeof(configs)/sizeof(configs[0]); i++)
+	{
+		run(&configs[i], NULL);
+		if(haveRelay)
+			run(&configs[i], relay);
+	}
+	return 0;
+}
@@ -0,0 +1,212 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures the CPU time that a DGR master spends sending each
+ * frame. The current send path (dgr_update(), which serializes into a
+ * persistent buffer and sends batches of packets) is compared against
+ * the older approach where every frame was serialized into a new
+ * malloc()'d buffer with sprintf() and each packet was sent with its
+ * own system call. It also measures the same records when they are
+ * bound with dgr_bind() instead of copied with dgr_setget_handle().
+ *
+ * Usage: bench-dgr-send [records] [recordSize] [frames]
+ *
+ * Packets are sent to a socket on 127.0.0.1 that this program binds
+ * but never reads from (the OS drops the packets once the socket's
+ * buffer is full).
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "kuhl-util.h"
+#include "dgr.h"
+#include "dgr-packet.h"
+
+#define PORT 5690
+#define MTU 1500
+
+static int numRecords = 200;
+static int recordSize = 64;
+static int numFrames  = 20000;
+
+static char **names;
+static char **buffers;
+static char **legacyRecords;
+
+/** Fills in the records with values that change every frame so that
+ * they are always sent. */
+static void update_records(int frame)
+{
+	for(int i=0; i<numRecords; i++)
+		memset(buffers[i], (frame+i) & 0xff, recordSize);
+}
+
+
+/** The older send path. Copies each variable into a record (like
+ * dgr_setget() did), serializes every record into a new buffer using
+ * sprintf() and sends each fragment with sendmsg(). */
+static void legacy_send(int sock, struct sockaddr_in *dest, uint32_t frame)
+{
+	for(int i=0; i<numRecords; i++)
+		memcpy(legacyRecords[i], buffers[i], recordSize);
+
+	int spaceNeeded = 0;
+	for(int i=0; i<numRecords; i++)
+		spaceNeeded += strlen(names[i])+1+sizeof(int)+recordSize;
+
+	char *buf = malloc(spaceNeeded);
+	char *ptr = buf;
+	for(int i=0; i<numRecords; i++)
+	{
+		int bytesPrinted = sprintf(ptr, "%s", names[i]);
+		ptr += bytesPrinted+1;
+		memcpy(ptr, &recordSize, sizeof(int));
+		ptr += sizeof(int);
+		memcpy(ptr, legacyRecords[i], recordSize);
+		ptr += recordSize;
+	}
+
+	dgr_packet_header header;
+	int maxFragment = MTU - 28 - (int) sizeof(header);
+	int fragments = (spaceNeeded + maxFragment - 1) / maxFragment;
+	header.magic = DGR_PACKET_MAGIC;
+	header.frame = frame;
+	header.keyframe = frame;
+	header.flags = DGR_PACKET_KEYFRAME;
+	header.channel = 0;
+	header.size = spaceNeeded;
+	header.fragments = fragments;
+	for(int i=0; i<fragments; i++)
+	{
+		header.fragment = i;
+		header.offset = i*maxFragment;
+		int fragmentSize = spaceNeeded - (int) header.offset;
+		if(fragmentSize > maxFragment)
+			fragmentSize = maxFragment;
+
+		struct iovec iov[2];
+		iov[0].iov_base = &header;
+		iov[0].iov_len = sizeof(header);
+		iov[1].iov_base = buf + header.offset;
+		iov[1].iov_len = fragmentSize;
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = dest;
+		mh.msg_namelen = sizeof(*dest);
+		mh.msg_iov = iov;
+		mh.msg_iovlen = 2;
+		if(sendmsg(sock, &mh, 0) == -1)
+		{
+			perror("sendmsg");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(buf);
+}
+
+
+int main(int argc, char **argv)
+{
+	if(argc > 1)
+		numRecords = atoi(argv[1]);
+	if(argc > 2)
+		recordSize = atoi(argv[2]);
+	if(argc > 3)
+		numFrames = atoi(argv[3]);
+	if(numRecords < 1 || recordSize < 1 || numFrames < 1)
+	{
+		printf("Usage: %s [records] [recordSize] [frames]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* A socket that receives (and drops) the packets we send. */
+	int sink = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sink, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+	{
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+
+	char port[32];
+	snprintf(port, 32, "%d", PORT);
+	char mtu[32];
+	snprintf(mtu, 32, "%d", MTU);
+	kuhl_config_set("dgr.mode", "master");
+	kuhl_config_set("dgr.master.destip", "127.0.0.1");
+	kuhl_config_set("dgr.master.destport", port);
+	kuhl_config_set("dgr.mtu", mtu);
+	kuhl_config_set("dgr.keyframe.interval", "1"); // send every record, like the older path
+	dgr_init();
+
+	names = malloc(sizeof(char*)*numRecords);
+	buffers = malloc(sizeof(char*)*numRecords);
+	legacyRecords = malloc(sizeof(char*)*numRecords);
+	dgr_handle *handles = malloc(sizeof(dgr_handle)*numRecords);
+	for(int i=0; i<numRecords; i++)
+	{
+		names[i] = malloc(32);
+		snprintf(names[i], 32, "bench.record%d", i);
+		buffers[i] = malloc(recordSize);
+		legacyRecords[i] = malloc(recordSize);
+		handles[i] = dgr_register(names[i], recordSize);
+	}
+
+	printf("Sending %d frames of %d records (%d bytes each) with a %d byte MTU.\n", numFrames, numRecords, recordSize, MTU);
+
+	/* Current send path */
+	long start = kuhl_microseconds();
+	for(int f=0; f<numFrames; f++)
+	{
+		update_records(f);
+		for(int i=0; i<numRecords; i++)
+			dgr_setget_handle(handles[i], buffers[i], recordSize);
+		dgr_update(1,0);
+	}
+	long current = kuhl_microseconds() - start;
+
+	/* Older send path */
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	start = kuhl_microseconds();
+	for(int f=0; f<numFrames; f++)
+	{
+		update_records(f);
+		legacy_send(sock, &addr, f);
+	}
+	long legacy = kuhl_microseconds() - start;
+
+	/* Current send path with the records bound to our buffers */
+	for(int i=0; i<numRecords; i++)
+		dgr_bind(names[i], buffers[i], recordSize);
+	start = kuhl_microseconds();
+	for(int f=0; f<numFrames; f++)
+	{
+		update_records(f);
+		dgr_update(1,0);
+	}
+	long bound = kuhl_microseconds() - start;
+
+	printf("legacy  (malloc+sprintf, sendmsg per packet): %8.2f usec/frame\n", legacy/(double)numFrames);
+	printf("current (persistent buffer, batched send):     %8.2f usec/frame\n", current/(double)numFrames);
+	printf("bound   (dgr_bind(), no copy):                 %8.2f usec/frame\n", bound/(double)numFrames);
+	printf("speedup: %.2fx (bound: %.2fx)\n", legacy/(double)current, legacy/(double)bound);
+
+	close(sock);
+	close(sink);
+	return 0;
+}
@@ -0,0 +1,149 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures the CPU time that kuhl_geometry_draw() takes per
+ * draw with kuhl_errorcheck() turned on (every check calls
+ * glGetError() and OpenGL's debug output is synchronous) and turned
+ * off (see kuhl_errorcheck_enable()). The same geometry drawn with
+ * glBindVertexArray() and glDrawElements() alone is included for
+ * comparison.
+ *
+ * Usage: bench-kuhl-draw [draws per frame] [frames]
+ *
+ * Each geometry is a small textured quad drawn into a 1x1 viewport so
+ * that the GPU does very little work. If libkuhl was compiled with
+ * KUHL_UTIL_NO_ERRORCHECK (cmake -DKUHL_RELEASE=ON), kuhl_errorcheck()
+ * calls are removed at compile time and both kuhl_geometry_draw()
+ * rows should be about the same.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <GL/glew.h>
+#include "kuhl-util.h"
+#include "vecmat.h"
+
+static int numDraws = 1000;
+static int numFrames = 200;
+
+/** Creates a quad with a 1x1 texture on it. */
+static void make_quad(kuhl_geometry *geom, GLuint program, GLuint texture)
+{
+	kuhl_geometry_new(geom, program, 4, GL_TRIANGLES);
+	GLfloat pos[] = { -1, -1, 0,
+	                   1, -1, 0,
+	                   1,  1, 0,
+	                  -1,  1, 0 };
+	kuhl_geometry_attrib(geom, pos, 3, "in_Position", KG_WARN);
+	GLfloat texcoord[] = { 0, 0,
+	                       1, 0,
+	                       1, 1,
+	                       0, 1 };
+	kuhl_geometry_attrib(geom, texcoord, 2, "in_TexCoord", KG_WARN);
+	GLuint indices[] = { 0, 1, 2, 0, 2, 3 };
+	kuhl_geometry_indices(geom, indices, 6);
+	kuhl_geometry_texture(geom, texture, "tex", KG_WARN);
+}
+
+/** Draws every geometry once per frame with kuhl_geometry_draw().
+ * @return Microseconds per draw. */
+static double time_kuhl_draw(kuhl_geometry *geoms)
+{
+	glFinish();
+	long start = kuhl_microseconds();
+	for(int f=0; f<numFrames; f++)
+	{
+		for(int i=0; i<numDraws; i++)
+			kuhl_geometry_draw(&geoms[i]);
+		glFlush();
+	}
+	long elapsed = kuhl_microseconds() - start;
+	glFinish();
+	return elapsed / (double) (numFrames*numDraws);
+}
+
+/** Draws every geometry once per frame with only the OpenGL calls
+ * that are needed to draw it.
+ * @return Microseconds per draw. */
+static double time_raw_draw(kuhl_geometry *geoms)
+{
+	glFinish();
+	long start = kuhl_microseconds();
+	for(int f=0; f<numFrames; f++)
+	{
+		for(int i=0; i<numDraws; i++)
+		{
+			glBindVertexArray(geoms[i].vao);
+			glDrawElements(GL_TRIANGLES, geoms[i].indices_len, geoms[i].indices_type, NULL);
+		}
+		glFlush();
+	}
+	long elapsed = kuhl_microseconds() - start;
+	glFinish();
+	/* glBindVertexArray() was called directly. */
+	kuhl_gl_state_invalidate();
+	return elapsed / (double) (numFrames*numDraws);
+}
+
+int main(int argc, char **argv)
+{
+	kuhl_ogl_init(&argc, argv, 64, 64, 32, 0);
+	if(argc > 1)
+		numDraws = atoi(argv[1]);
+	if(argc > 2)
+		numFrames = atoi(argv[2]);
+	if(numDraws < 1 || numFrames < 1)
+	{
+		printf("Usage: %s [draws per frame] [frames]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	GLuint program = kuhl_create_program("texture.vert", "texture.frag");
+	kuhl_use_program(program);
+	float identity[16];
+	mat4f_identity(identity);
+	glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, identity);
+	glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+	glUniform1i(kuhl_get_uniform("tex"), 0);
+
+	unsigned char pixel[4] = { 255, 128, 0, 255 };
+	GLuint texture = kuhl_read_texture_rgba_array(pixel, 1, 1);
+
+	kuhl_geometry *geoms = malloc(sizeof(kuhl_geometry)*numDraws);
+	for(int i=0; i<numDraws; i++)
+		make_quad(&geoms[i], program, texture);
+
+	glViewport(0, 0, 1, 1);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+#ifdef KUHL_UTIL_NO_ERRORCHECK
+	printf("libkuhl compiled with KUHL_UTIL_NO_ERRORCHECK.\n");
+#endif
+	printf("%d frames of %d draws.\n", numFrames, numDraws);
+
+	/* Warm up the driver before measuring. */
+	kuhl_errorcheck_enable(1);
+	time_kuhl_draw(geoms);
+
+	double checked = time_kuhl_draw(geoms);
+	kuhl_errorcheck_enable(0);
+	double unchecked = time_kuhl_draw(geoms);
+	double raw = time_raw_draw(geoms);
+	kuhl_errorcheck_enable(1);
+
+	printf("kuhl_geometry_draw(), errorcheck on:  %8.3f usec/draw\n", checked);
+	printf("kuhl_geometry_draw(), errorcheck off: %8.3f usec/draw\n", unchecked);
+	printf("glBindVertexArray()+glDrawElements(): %8.3f usec/draw\n", raw);
+	printf("errorcheck on costs %.2fx as much CPU time per draw as errorcheck off.\n", checked/unchecked);
+
+	for(int i=0; i<numDraws; i++)
+		kuhl_geometry_delete(&geoms[i]);
+	free(geoms);
+	kuhl_delete_program(program);
+	return 0;
+}
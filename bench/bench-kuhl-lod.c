@@ -0,0 +1,205 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures how quickly kuhl_simplify() and
+ * kuhl_lod_generate() make levels of detail and how many triangles
+ * each level has. No GPU is needed.
+ *
+ * The mesh is a bumpy sphere made of a grid of quads, like a scanned
+ * model. It is tested twice: with its vertices shared by all of the
+ * triangles around them and with a seam (duplicated vertices, as a
+ * textured model would have) along each tenth row and column.
+ * kuhl_simplify() doesn't remove vertices on seams, so the second
+ * mesh can't be simplified as far.
+ *
+ * Usage: bench-kuhl-lod [grid size] [levels] [reduction]
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <GL/glew.h>
+#include "kuhl-util.h"
+
+static int gridSize = 400;
+static int levels = 6;
+static float reduction = 0.5f;
+
+/** Makes a bumpy sphere. Rows go from pole to pole and columns
+ * around the sphere. The poles are one vertex each.
+ *
+ * @param seamSpacing 0 to share every vertex between the triangles
+ * around it. Otherwise, the sphere is split into tiles of
+ * seamSpacing x seamSpacing quads and each tile gets its own copy of
+ * its vertices, like the charts of a texture atlas.
+ * @param positions Set to a newly allocated array of positions.
+ * @param vertexCount Set to the number of vertices.
+ * @param indexCount Set to the number of indices.
+ * @return A newly allocated array of indices.
+ */
+static GLuint* make_sphere(int seamSpacing, float **positions, GLuint *vertexCount, GLuint *indexCount)
+{
+	/* Rows 1 to gridSize-1 have gridSize vertices each; then the two
+	 * poles. */
+	GLuint sharedCount = (gridSize-1)*gridSize + 2;
+	GLuint northPole = sharedCount-2, southPole = sharedCount-1;
+	float *shared = malloc(sizeof(float)*3*sharedCount);
+	for(GLuint v=0; v<sharedCount; v++)
+	{
+		int r = v == northPole ? 0 : v == southPole ? gridSize : (int) (v / gridSize) + 1;
+		int c = v >= northPole ? 0 : (int) (v % gridSize);
+		float lat = M_PI * r / gridSize;
+		float lon = 2 * M_PI * c / gridSize;
+		float radius = 1 + 0.05f*sinf(9*lat)*sinf(7*lon) + 0.02f*sinf(31*lat)*cosf(23*lon);
+		shared[3*v+0] = radius * sinf(lat) * cosf(lon);
+		shared[3*v+1] = radius * cosf(lat);
+		shared[3*v+2] = radius * sinf(lat) * sinf(lon);
+	}
+
+	/* Two triangles per quad (one at the poles), tile by tile. */
+	int tile = seamSpacing > 0 ? seamSpacing : gridSize;
+	GLuint *indices = malloc(sizeof(GLuint)*6*gridSize*gridSize);
+	GLuint count = 0;
+	for(int tr=0; tr<gridSize; tr+=tile)
+	{
+		for(int tc=0; tc<gridSize; tc+=tile)
+		{
+			for(int r=tr; r<tr+tile && r<gridSize; r++)
+			{
+				for(int c=tc; c<tc+tile && c<gridSize; c++)
+				{
+					int c1 = (c+1) % gridSize;
+					GLuint v00 = r == 0 ? northPole : (GLuint) ((r-1)*gridSize + c);
+					GLuint v01 = r == 0 ? northPole : (GLuint) ((r-1)*gridSize + c1);
+					GLuint v10 = r+1 == gridSize ? southPole : (GLuint) (r*gridSize + c);
+					GLuint v11 = r+1 == gridSize ? southPole : (GLuint) (r*gridSize + c1);
+					if(r != 0)
+					{
+						GLuint tri[3] = { v00, v10, v01 };
+						memcpy(indices+count, tri, sizeof(tri));
+						count += 3;
+					}
+					if(r+1 != gridSize)
+					{
+						GLuint tri[3] = { v01, v10, v11 };
+						memcpy(indices+count, tri, sizeof(tri));
+						count += 3;
+					}
+				}
+			}
+		}
+	}
+
+	/* Give each tile its own copies of the vertices it uses. The
+	 * tiles are contiguous in the index list, so a vertex needs a new
+	 * copy whenever the tile using it changes. */
+	GLuint *copy = malloc(sizeof(GLuint)*sharedCount);
+	GLuint *copyTile = malloc(sizeof(GLuint)*sharedCount);
+	for(GLuint v=0; v<sharedCount; v++)
+		copyTile[v] = (GLuint) -1;
+	*positions = malloc(sizeof(float)*3*count);
+	GLuint n = 0;
+	GLuint currentTile = 0, i = 0;
+	for(int tr=0; tr<gridSize; tr+=tile)
+	{
+		for(int tc=0; tc<gridSize; tc+=tile)
+		{
+			/* Count the triangles in this tile (fewer at the poles
+			 * and at the edges of the grid). */
+			int rows = tr+tile < gridSize ? tile : gridSize-tr;
+			int cols = tc+tile < gridSize ? tile : gridSize-tc;
+			GLuint trianglesInTile = 2*rows*cols - (tr == 0 ? cols : 0) - (tr+rows == gridSize ? cols : 0);
+			for(GLuint end = i + 3*trianglesInTile; i<end; i++)
+			{
+				GLuint v = indices[i];
+				if(copyTile[v] != currentTile)
+				{
+					copyTile[v] = currentTile;
+					copy[v] = n;
+					memcpy(*positions + 3*n, shared + 3*v, sizeof(float)*3);
+					n++;
+				}
+				indices[i] = copy[v];
+			}
+			currentTile++;
+		}
+	}
+	free(copyTile);
+	free(copy);
+	free(shared);
+	*vertexCount = n;
+	*indexCount = count;
+	return indices;
+}
+
+/** Simplifies a mesh one level at a time and prints the size, error
+ * and time of each level, then times kuhl_lod_generate(). */
+static void run(const char *label, int seamSpacing)
+{
+	float *positions;
+	GLuint vertexCount, indexCount;
+	GLuint *indices = make_sphere(seamSpacing, &positions, &vertexCount, &indexCount);
+	printf("%s: %u triangles, %u vertices\n", label, indexCount/3, vertexCount);
+	printf("  %5s %10s %7s %10s %9s %12s\n", "level", "triangles", "kept", "error", "ms", "Mtri/s");
+
+	GLuint *prev = malloc(sizeof(GLuint)*indexCount);
+	GLuint *next = malloc(sizeof(GLuint)*indexCount);
+	memcpy(prev, indices, sizeof(GLuint)*indexCount);
+	GLuint prevCount = indexCount;
+	float error = 0;
+	printf("  %5d %10u %6.1f%% %10.5f\n", 0, indexCount/3, 100.0f, 0.0f);
+	for(int l=1; l<levels; l++)
+	{
+		GLuint target = (GLuint) (prevCount/3 * reduction) * 3;
+		float levelError;
+		long start = kuhl_microseconds();
+		GLuint count = kuhl_simplify(next, prev, prevCount, positions, vertexCount, target, &levelError);
+		long elapsed = kuhl_microseconds() - start;
+		error += levelError;
+		printf("  %5d %10u %6.1f%% %10.5f %9.2f %12.2f\n", l, count/3, 100.0f*count/indexCount, error,
+		       elapsed/1000.0, elapsed > 0 ? prevCount/3.0/elapsed : 0);
+		GLuint *swap = prev;
+		prev = next;
+		next = swap;
+		prevCount = count;
+	}
+
+	kuhl_lod lods[16];
+	GLuint *lodIndices;
+	long start = kuhl_microseconds();
+	int made = kuhl_lod_generate(&lodIndices, lods, levels, indices, indexCount, positions, vertexCount, reduction);
+	long elapsed = kuhl_microseconds() - start;
+	printf("  kuhl_lod_generate(): %d levels, %u indices in all levels, %.1f ms (%.2f usec/triangle)\n",
+	       made, lods[made-1].first + lods[made-1].count, elapsed/1000.0, elapsed / (indexCount/3.0));
+
+	free(lodIndices);
+	free(prev);
+	free(next);
+	free(indices);
+	free(positions);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc > 1)
+		gridSize = atoi(argv[1]);
+	if(argc > 2)
+		levels = atoi(argv[2]);
+	if(argc > 3)
+		reduction = atof(argv[3]);
+	if(gridSize < 3 || levels < 1 || levels > 16 || reduction <= 0 || reduction >= 1)
+	{
+		printf("Usage: %s [grid size] [levels (1-16)] [reduction (0-1)]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	run("Closed mesh", 0);
+	run("Seams every 10 rows and columns", 10);
+	return 0;
+}
@@ -0,0 +1,155 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Compares drawing geometry in an arbitrary order with
+ * kuhl_geometry_draw() against drawing the same geometry with a
+ * kuhl_renderqueue, which sorts it to reduce the number of program,
+ * texture and vertex array object changes.
+ *
+ * Usage: bench-kuhl-renderqueue [geometries] [programs] [textures] [frames]
+ *
+ * Each geometry is a small quad with a randomly chosen program and
+ * texture. The quads are drawn into a 1x1 viewport so that the GPU
+ * does very little work.
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <GL/glew.h>
+#include "kuhl-util.h"
+#include "vecmat.h"
+
+static int numGeoms = 2000;
+static int numPrograms = 4;
+static int numTextures = 16;
+static int numFrames = 100;
+
+/** Creates a quad that is drawn with the given program and texture. */
+static void make_quad(kuhl_geometry *geom, GLuint program, GLuint texture)
+{
+	kuhl_geometry_new(geom, program, 4, GL_TRIANGLES);
+	GLfloat pos[] = { -1, -1, 0,
+	                   1, -1, 0,
+	                   1,  1, 0,
+	                  -1,  1, 0 };
+	kuhl_geometry_attrib(geom, pos, 3, "in_Position", KG_WARN);
+	GLfloat texcoord[] = { 0, 0,
+	                       1, 0,
+	                       1, 1,
+	                       0, 1 };
+	kuhl_geometry_attrib(geom, texcoord, 2, "in_TexCoord", KG_WARN);
+	GLuint indices[] = { 0, 1, 2, 0, 2, 3 };
+	kuhl_geometry_indices(geom, indices, 6);
+	kuhl_geometry_texture(geom, texture, "tex", KG_WARN);
+}
+
+int main(int argc, char **argv)
+{
+	kuhl_ogl_init(&argc, argv, 64, 64, 32, 0);
+	if(argc > 1)
+		numGeoms = atoi(argv[1]);
+	if(argc > 2)
+		numPrograms = atoi(argv[2]);
+	if(argc > 3)
+		numTextures = atoi(argv[3]);
+	if(argc > 4)
+		numFrames = atoi(argv[4]);
+	if(numGeoms < 1 || numPrograms < 1 || numTextures < 1 || numFrames < 1)
+	{
+		printf("Usage: %s [geometries] [programs] [textures] [frames]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	float identity[16];
+	mat4f_identity(identity);
+
+	GLuint *programs = malloc(sizeof(GLuint)*numPrograms);
+	for(int i=0; i<numPrograms; i++)
+	{
+		programs[i] = kuhl_create_program("texture.vert", "texture.frag");
+		kuhl_use_program(programs[i]);
+		glUniformMatrix4fv(kuhl_get_uniform("Projection"), 1, 0, identity);
+	}
+	kuhl_use_program(0);
+
+	GLuint *textures = malloc(sizeof(GLuint)*numTextures);
+	for(int i=0; i<numTextures; i++)
+	{
+		unsigned char pixel[4] = { i*16, 128, 255-i*16, 255 };
+		textures[i] = kuhl_read_texture_rgba_array(pixel, 1, 1);
+	}
+
+	/* Each geometry gets a random program, texture and distance from
+	 * the camera. */
+	srand48(1);
+	kuhl_geometry *geoms = malloc(sizeof(kuhl_geometry)*numGeoms);
+	float (*modelview)[16] = malloc(sizeof(float)*16*numGeoms);
+	for(int i=0; i<numGeoms; i++)
+	{
+		make_quad(&geoms[i], programs[lrand48() % numPrograms], textures[lrand48() % numTextures]);
+		mat4f_translate_new(modelview[i], 0, 0, -drand48()*100);
+	}
+
+	glViewport(0, 0, 1, 1);
+	glEnable(GL_DEPTH_TEST);
+	printf("%d geometries, %d programs, %d textures, %d frames.\n", numGeoms, numPrograms, numTextures, numFrames);
+
+	/* Draw in submission order with kuhl_geometry_draw(). */
+	glFinish();
+	long start = kuhl_microseconds();
+	for(int f=0; f<numFrames; f++)
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		for(int i=0; i<numGeoms; i++)
+		{
+			kuhl_use_program(geoms[i].program);
+			glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, modelview[i]);
+			kuhl_geometry_draw(&geoms[i]);
+		}
+		glFlush();
+	}
+	long unsorted = kuhl_microseconds() - start;
+	glFinish();
+
+	/* Draw the same geometry with a render queue. */
+	kuhl_renderqueue queue;
+	kuhl_renderqueue_init(&queue);
+	long submit = 0;
+	start = kuhl_microseconds();
+	for(int f=0; f<numFrames; f++)
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		for(int i=0; i<numGeoms; i++)
+			kuhl_renderqueue_add(&queue, &geoms[i], modelview[i], KG_NONE);
+		kuhl_renderqueue_draw(&queue);
+		submit += queue.stats.submitTime;
+		glFlush();
+	}
+	long sorted = kuhl_microseconds() - start;
+	glFinish();
+
+	printf("kuhl_geometry_draw(), submission order: %8.1f usec/frame\n", unsorted / (double) numFrames);
+	printf("kuhl_renderqueue:                       %8.1f usec/frame (%.1f in kuhl_renderqueue_draw())\n",
+	       sorted / (double) numFrames, submit / (double) numFrames);
+	printf("renderqueue stats: %ld draws, %ld program changes, %ld texture changes, %ld VAO changes, %ld changes avoided\n",
+	       queue.stats.draws, queue.stats.programChanges, queue.stats.textureChanges,
+	       queue.stats.vaoChanges, queue.stats.changesAvoided);
+
+	kuhl_renderqueue_free(&queue);
+	for(int i=0; i<numGeoms; i++)
+		kuhl_geometry_delete(&geoms[i]);
+	free(geoms);
+	free(modelview);
+	for(int i=0; i<numTextures; i++)
+		glDeleteTextures(1, &textures[i]);
+	for(int i=0; i<numPrograms; i++)
+		kuhl_delete_program(programs[i]);
+	free(textures);
+	free(programs);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file Measures how kuhl_optimize_vertex_cache(),
+ * kuhl_optimize_overdraw() and kuhl_optimize_vertex_fetch() change
+ * the number of times vertices would be processed by the vertex
+ * program (see kuhl_vertex_cache_stats()) and how long they take. No
+ * GPU is needed; the cache is simulated.
+ *
+ * The mesh is a sphere made of a grid of quads, like a scanned model.
+ * It is tested in the order it is generated (row by row, which only
+ * reuses vertices from the previous row if a row fits in the cache)
+ * and with its triangles shuffled.
+ *
+ * Usage: bench-kuhl-vertexcache [grid size]
+ *
+ * @author Scott Kuhl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <GL/glew.h>
+#include "kuhl-util.h"
+
+static int gridSize = 300;
+
+/** Prints the cache statistics of a triangle order for a 16 and a
+ * 32 vertex cache. */
+static void print_stats(const char *label, const GLuint *indices, GLuint indexCount, GLuint vertexCount)
+{
+	float acmr16, atvr16, acmr32, atvr32;
+	kuhl_vertex_cache_stats(indices, indexCount, vertexCount, 16, &acmr16, &atvr16);
+	kuhl_vertex_cache_stats(indices, indexCount, vertexCount, 32, &acmr32, &atvr32);
+	printf("%-32s %7.3f %7.3f %7.3f %7.3f\n", label, acmr16, atvr16, acmr32, atvr32);
+}
+
+/** Optimizes a copy of the indices and prints the results.
+ * @return Microseconds that kuhl_optimize_vertex_cache() took. */
+static long optimize(const char *label, const GLuint *indices, GLuint indexCount,
+                     const float *positions, GLuint vertexCount, int overdraw)
+{
+	GLuint *copy = malloc(sizeof(GLuint)*indexCount);
+	memcpy(copy, indices, sizeof(GLuint)*indexCount);
+	long start = kuhl_microseconds();
+	kuhl_optimize_vertex_cache(copy, indexCount, vertexCount);
+	long elapsed = kuhl_microseconds() - start;
+	if(overdraw)
+		kuhl_optimize_overdraw(copy, indexCount, positions, vertexCount);
+	GLuint *remap = kuhl_optimize_vertex_fetch(copy, indexCount, vertexCount);
+	print_stats(label, copy, indexCount, vertexCount);
+	free(remap);
+	free(copy);
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	if(argc > 1)
+		gridSize = atoi(argv[1]);
+	if(gridSize < 2)
+	{
+		printf("Usage: %s [grid size]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Vertices of a sphere: gridSize+1 rows and columns (the seam
+	 * and the poles have duplicate vertices, as they would in a
+	 * textured model). */
+	GLuint rowLength = gridSize+1;
+	GLuint vertexCount = rowLength*rowLength;
+	float *positions = malloc(sizeof(float)*3*vertexCount);
+	for(GLuint r=0; r<rowLength; r++)
+	{
+		for(GLuint c=0; c<rowLength; c++)
+		{
+			float lat = M_PI * r / gridSize;
+			float lon = 2 * M_PI * c / gridSize;
+			float *p = positions + 3*(r*rowLength+c);
+			p[0] = sinf(lat) * cosf(lon);
+			p[1] = cosf(lat);
+			p[2] = sinf(lat) * sinf(lon);
+		}
+	}
+
+	/* Two triangles per quad, row by row. */
+	GLuint indexCount = gridSize*gridSize*6;
+	GLuint *indices = malloc(sizeof(GLuint)*indexCount);
+	GLuint n = 0;
+	for(GLuint r=0; r<(GLuint)gridSize; r++)
+	{
+		for(GLuint c=0; c<(GLuint)gridSize; c++)
+		{
+			GLuint v = r*rowLength+c;
+			indices[n++] = v;
+			indices[n++] = v+1;
+			indices[n++] = v+rowLength;
+			indices[n++] = v+1;
+			indices[n++] = v+rowLength+1;
+			indices[n++] = v+rowLength;
+		}
+	}
+	GLuint *shuffled = malloc(sizeof(GLuint)*indexCount);
+	memcpy(shuffled, indices, sizeof(GLuint)*indexCount);
+	srand(1);
+	kuhl_shuffle(shuffled, indexCount/3, sizeof(GLuint)*3);
+
+	printf("%u triangles, %u vertices.\n", indexCount/3, vertexCount);
+	printf("%-32s %15s %15s\n", "", "16 vertex cache", "32 vertex cache");
+	printf("%-32s %7s %7s %7s %7s\n", "", "ACMR", "ATVR", "ACMR", "ATVR");
+	print_stats("row order", indices, indexCount, vertexCount);
+	long rowTime = optimize("row order, optimized", indices, indexCount, positions, vertexCount, 0);
+	optimize("row order, optimized+overdraw", indices, indexCount, positions, vertexCount, 1);
+	print_stats("shuffled", shuffled, indexCount, vertexCount);
+	long shuffledTime = optimize("shuffled, optimized", shuffled, indexCount, positions, vertexCount, 0);
+	optimize("shuffled, optimized+overdraw", shuffled, indexCount, positions, vertexCount, 1);
+
+	printf("kuhl_optimize_vertex_cache(): %.1f ms (row order), %.1f ms (shuffled), %.2f usec/triangle\n",
+	       rowTime/1000.0, shuffledTime/1000.0, shuffledTime / (indexCount/3.0));
+
+	free(shuffled);
+	free(indices);
+	free(positions);
+	return 0;
+}
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+#
+# Runs a DGR master and two slaves on this machine. The master
+# multicasts its packets to the slaves over the loopback interface
+# (see config/multicast-test-common.ini) instead of using dgr-relay.
+
+PROGRAM="${1}"
+ARGS="${@:2}"
+
+# If we exit unexpectedly, kill all of the background processes.
+trap 'cleanup' ERR   # process exits with non-zero exit code
+trap 'cleanup' INT   # Ctrl+C
+cleanup() {
+	echo
+	echo "Exiting, killing all DGR processes..."
+	kill -TERM `jobs -p` &> /dev/null
+}
+
+
+if [[ ! -x "${PROGRAM}" ]]; then
+	echo "Executable is missing: ${PROGRAM}"
+	exit 1
+fi
+
+echo "Starting slave 1"
+"${PROGRAM}" --config config/multicast-test-slave1.ini ${ARGS} &
+echo "Starting slave 2"
+"${PROGRAM}" --config config/multicast-test-slave2.ini ${ARGS} &
+
+sleep .1
+
+echo "Starting master process"
+"${PROGRAM}" --config config/multicast-test-master.ini ${ARGS} &
+
+
+wait
@@ -7,20 +7,31 @@
 // Scott A. Kuhl  kuhl at mtu dot edu
 
 #ifndef __MINGW32__
-#include <math.h>
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
+#endif
+#endif
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <time.h>
-#include <math.h>
-#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 #include <string>
 #include <vector>
+#include "dgr-packet.h"
 
 
 /* On most networks, the MTU is set to 1500 bytes. With header
@@ -30,58 +41,223 @@
  * IPv4 fragmentation---which happens automatically. */
 #define BUFLEN 65536
 
-char *RELAY_IN_PORT = NULL; // the port we listen for UDP packets on
-char *RELAY_OUT_IP = NULL; // the address we send UDP packets to
+/* Maximum number of packets that we receive with one system call. The
+ * master sends large frames as bursts of packets. */
+#define BATCH 64
+
+/* Print statistics this often (seconds). */
+#define STATS_INTERVAL 5
 
-pthread_t receiverThread;
+char *RELAY_IN_PORT = NULL; // the port we listen for UDP packets on
 
 int s_R; // socket we will read packets from
-socklen_t slen_R;
+int s_S; // socket we send packets from
 
+std::vector<struct sockaddr_in> si_other_S; // list of addresses we send packets to
 
-struct sockaddr_in si_me_R;
+/* Packets that we have received but not forwarded yet. */
+static char buffers[BATCH][BUFLEN];
+static struct iovec recvIov[BATCH];
+static char control[BATCH][CMSG_SPACE(sizeof(struct timespec))];
+static struct timespec received[BATCH]; // time that the OS received each packet
+#ifdef __linux__
+static struct mmsghdr recvMsgs[BATCH];
+#define RECV_MSGHDR(i) (recvMsgs[i].msg_hdr)
+#else
+static struct msghdr recvMsgs[BATCH];
+#define RECV_MSGHDR(i) (recvMsgs[i])
+#endif
 
-std::vector<int> s_S; // list of sockets to send data to
-std::vector<struct sockaddr_in> si_other_S; // list of sockaddr objects for our sockets.
-socklen_t slen_S;
+/* One message for each packet and destination. */
+static std::vector<struct iovec> sendIov;
+#ifdef __linux__
+static std::vector<struct mmsghdr> sendMsgs;
+#define SEND_MSGHDR(i) (sendMsgs[i].msg_hdr)
+#else
+static std::vector<struct msghdr> sendMsgs;
+#define SEND_MSGHDR(i) (sendMsgs[i])
+#endif
 
-bool receivedPacket = false;
-int framesPassed = 0;
+/* Statistics since the last time they were printed. */
+static long statsPacketsIn = 0;
+static long statsPacketsOut = 0;
+static long statsBytesIn = 0;
+static double statsLatencyTotal = 0; // microseconds
+static double statsLatencyMax = 0;   // microseconds
 
-// This function receives incoming packets, repackages them, and then forwards them
-// on the network for consumption by the slaves. It does this in an infinite loop.
-void * receiver(void *) {
-	char buf[BUFLEN];
-	while (true) {
-		// Receive any frames
-		int bytesReceived;
-		bytesReceived = recvfrom(s_R, buf, BUFLEN, 0, NULL, 0);
-		if (bytesReceived == -1) {
-			perror("DGR Relay: ERROR recvfrom");
-			exit(EXIT_FAILURE);
+
+/** Returns the difference between two times in microseconds. */
+static double elapsed_usec(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec)*1000000.0 + (end->tv_nsec - start->tv_nsec)/1000.0;
+}
+
+/** Adds a destination to the list of addresses we send packets to. */
+static void add_destination(const char *ip, const char *port)
+{
+	printf("DGR Relay: Preparing to send data to %s on port %s\n", ip, port);
+
+	struct sockaddr_in addr;
+	memset((char *) &addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port));
+	if (inet_aton(ip, &addr.sin_addr) == 0) {
+		fprintf(stderr, "DGR Relay: inet_aton() failed for '%s'\n", ip);
+		exit(EXIT_FAILURE);
+	}
+	si_other_S.push_back(addr);
+}
+
+/** Returns true if the string contains only digits. */
+static bool is_port(const char *str)
+{
+	if(*str == '\0')
+		return false;
+	for(; *str != '\0'; str++)
+		if(!isdigit((unsigned char) *str))
+			return false;
+	return true;
+}
+
+/** Receives as many packets as are available (up to BATCH) without
+ * blocking.
+ *
+ * @return The number of packets received. */
+static int receive_batch(void)
+{
+	for(int i=0; i<BATCH; i++)
+	{
+		recvIov[i].iov_base = buffers[i];
+		recvIov[i].iov_len = BUFLEN;
+		struct msghdr *mh = &RECV_MSGHDR(i);
+		memset(mh, 0, sizeof(struct msghdr));
+		mh->msg_iov = &recvIov[i];
+		mh->msg_iovlen = 1;
+		mh->msg_control = control[i];
+		mh->msg_controllen = sizeof(control[i]);
+	}
+
+#ifdef __linux__
+	int count = recvmmsg(s_R, recvMsgs, BATCH, MSG_DONTWAIT, NULL);
+#else
+	int count = 0;
+	while(count < BATCH)
+	{
+		int bytes = recvmsg(s_R, &recvMsgs[count], MSG_DONTWAIT);
+		if(bytes == -1)
+			break;
+		recvIov[count].iov_len = bytes; // remember the size for send_batch()
+		count++;
+	}
+	if(count == 0)
+		count = -1;
+#endif
+	if(count == -1)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		perror("DGR Relay: ERROR recvmmsg");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Find the time that the OS received each packet so that we can
+	 * measure how long the packet spent in the relay. */
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	for(int i=0; i<count; i++)
+	{
+		received[i] = now;
+		struct msghdr *mh = &RECV_MSGHDR(i);
+		for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(mh); cmsg != NULL; cmsg = CMSG_NXTHDR(mh, cmsg))
+		{
+#ifdef SO_TIMESTAMPNS
+			if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+				memcpy(&received[i], CMSG_DATA(cmsg), sizeof(struct timespec));
+#endif
 		}
+	}
+	return count;
+}
 
-		receivedPacket = true;
-		framesPassed = 0;
+/** Sends each of the received packets to every destination.
+ *
+ * @param count The number of packets that receive_batch() received.
+ */
+static void send_batch(int count)
+{
+	unsigned int numMsgs = count * si_other_S.size();
+	if(sendMsgs.size() < numMsgs)
+	{
+		sendMsgs.resize(numMsgs);
+		sendIov.resize(numMsgs);
+	}
 
-		// When we have received a frame, send it out!
-		for(unsigned int i = 0; i < s_S.size(); i++){
-			if (sendto(s_S[i], buf, bytesReceived, 0, (struct sockaddr*)&si_other_S[i],
-					   slen_S) == -1) {
-				perror("DGR Relay: ERROR sendto");
-				exit(EXIT_FAILURE);
-			}
+	unsigned int m = 0;
+	for(int i=0; i<count; i++)
+	{
+#ifdef __linux__
+		size_t length = recvMsgs[i].msg_len;
+#else
+		size_t length = recvIov[i].iov_len;
+#endif
+		statsBytesIn += length;
+		for(unsigned int d=0; d<si_other_S.size(); d++)
+		{
+			sendIov[m].iov_base = buffers[i];
+			sendIov[m].iov_len = length;
+			struct msghdr *mh = &SEND_MSGHDR(m);
+			memset(mh, 0, sizeof(struct msghdr));
+			mh->msg_name = &si_other_S[d];
+			mh->msg_namelen = sizeof(struct sockaddr_in);
+			mh->msg_iov = &sendIov[m];
+			mh->msg_iovlen = 1;
+			m++;
 		}
+	}
 
-		/* Check if the frame that we just forwarded was informing
-		 * processes to exit. */
-		if(bytesReceived > (int) strlen("!!!dgr_died!!!") &&
-		   strcmp(buf, "!!!dgr_died!!!") == 0)
+	unsigned int sent = 0;
+	while(sent < numMsgs)
+	{
+#ifdef __linux__
+		int n = sendmmsg(s_S, &sendMsgs[sent], numMsgs-sent, 0);
+#else
+		int n = sendmsg(s_S, &sendMsgs[sent], 0) == -1 ? -1 : 1;
+#endif
+		if(n == -1)
 		{
-			printf("DGR Relay: Received message from master indicating that DGR communication is complete.\n");
-			exit(EXIT_SUCCESS);
+			if(errno == EINTR)
+				continue;
+			perror("DGR Relay: ERROR sendmmsg");
+			exit(EXIT_FAILURE);
 		}
+		sent += n;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	for(int i=0; i<count; i++)
+	{
+		double latency = elapsed_usec(&received[i], &now);
+		statsLatencyTotal += latency;
+		if(latency > statsLatencyMax)
+			statsLatencyMax = latency;
 	}
+	statsPacketsIn += count;
+	statsPacketsOut += numMsgs;
+}
+
+/** Prints and resets the statistics.
+ *
+ * @param seconds The number of seconds since the statistics were last printed.
+ */
+static void print_stats(double seconds)
+{
+	if(statsPacketsIn > 0)
+		printf("DGR Relay: %.0f packets/sec in, %.0f packets/sec out, %.2f MB/sec in, latency avg %.1f usec, max %.1f usec\n",
+		       statsPacketsIn/seconds, statsPacketsOut/seconds, statsBytesIn/seconds/1024/1024,
+		       statsLatencyTotal/statsPacketsIn, statsLatencyMax);
+	statsPacketsIn = statsPacketsOut = statsBytesIn = 0;
+	statsLatencyTotal = statsLatencyMax = 0;
 }
 #endif // __MINGW32__
 
@@ -89,40 +265,44 @@ void * receiver(void *) {
 int main(int argc, char **argv) {
 #ifndef __MINGW32__
 	if (argc < 4) {
-		printf("USAGE: %s port-in ipaddr-out port-out [ port2-out .. ]\n", argv[0]);
-		printf("This program will listen on a specific port for UDP packets. When one is received, it will be sent to the specified IP address. If more than one port is specified, it will send the packet to multiple ports at that IP address.\n");
+		printf("USAGE: %s port-in ipaddr-out port-out [ port2-out .. ] [ ipaddr2-out port-out .. ] [ ipaddr:port .. ]\n", argv[0]);
+		printf("This program will listen on a specific port for UDP packets. When one is received, it will be sent to each of the destinations. A port is sent to at the IP address that was listed most recently; ipaddr:port specifies both.\n");
 		exit(EXIT_FAILURE);
 	}
 	RELAY_IN_PORT=argv[1];
-	RELAY_OUT_IP=argv[2];
-
-	// for each of the output ports, create a socket:
-	for(int i = 3; i < argc; i++){
-		printf("DGR Relay: Preparing to send data to %s on port %s\n", RELAY_OUT_IP, argv[i]);
-		
-		struct sockaddr_in _si_other_S;
-		int _s_S;
-		slen_S=sizeof(_si_other_S);
-
-		if ((_s_S=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-			perror("DGR Relay: ERROR socket");
-			exit(EXIT_FAILURE);
+
+	// Parse the list of destinations.
+	const char *ip = NULL;
+	for(int i = 2; i < argc; i++){
+		const char *colon = strrchr(argv[i], ':');
+		if(colon != NULL) {
+			std::string destIp(argv[i], colon-argv[i]);
+			add_destination(destIp.c_str(), colon+1);
 		}
-		int so_broadcast = 1;
-		setsockopt(_s_S, SOL_SOCKET, SO_BROADCAST, &so_broadcast, sizeof(so_broadcast));
-
-		memset((char *) &_si_other_S, 0, sizeof(_si_other_S));
-		_si_other_S.sin_family = AF_INET;
-		_si_other_S.sin_port = htons(atoi(argv[i]));
-		if (inet_aton(RELAY_OUT_IP, &_si_other_S.sin_addr) == 0) {
-			fprintf(stderr, "DGR Relay: inet_aton() failed\n");
-			exit(1);
+		else if(is_port(argv[i])) {
+			if(ip == NULL) {
+				fprintf(stderr, "DGR Relay: Port %s was listed before an IP address.\n", argv[i]);
+				exit(EXIT_FAILURE);
+			}
+			add_destination(ip, argv[i]);
 		}
+		else
+			ip = argv[i];
+	}
+	if(si_other_S.empty()) {
+		fprintf(stderr, "DGR Relay: No destination ports were specified.\n");
+		exit(EXIT_FAILURE);
+	}
 
-		// add this socket to a list
-		s_S.push_back(_s_S);
-		si_other_S.push_back(_si_other_S);
-    }
+	// One socket can send to all of the destinations.
+	if ((s_S=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+		perror("DGR Relay: ERROR socket");
+		exit(EXIT_FAILURE);
+	}
+	int so_broadcast = 1;
+	setsockopt(s_S, SOL_SOCKET, SO_BROADCAST, &so_broadcast, sizeof(so_broadcast));
+	int sndbuf = 4*1024*1024;
+	setsockopt(s_S, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
 
 
 	printf("DGR Relay: Preparing to receive data on port %s\n", RELAY_IN_PORT);
@@ -131,6 +311,7 @@ int main(int argc, char **argv) {
 		perror("DGR Relay: ERROR socket");
 		exit(EXIT_FAILURE);
 	}
+	struct sockaddr_in si_me_R;
 	memset((char *) &si_me_R, 0, sizeof(si_me_R));
 	si_me_R.sin_family = AF_INET;
 	si_me_R.sin_port = htons(atoi(RELAY_IN_PORT));
@@ -140,32 +321,108 @@ int main(int argc, char **argv) {
 		perror("DGR Relay: ERROR bind");
 		exit(EXIT_FAILURE);
 	}
+	int rcvbuf = 4*1024*1024;
+	setsockopt(s_R, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef SO_TIMESTAMPNS
+	// Ask the OS for the time that each packet arrived.
+	int timestamp = 1;
+	setsockopt(s_R, SOL_SOCKET, SO_TIMESTAMPNS, &timestamp, sizeof(timestamp));
+#endif
 
-	// listen for updates
-	if (pthread_create(&receiverThread, NULL, &receiver, NULL) != 0) {
-		perror("DGR Relay: Exiting because pthread_create() failed.");
+#ifdef __linux__
+	int epfd = epoll_create1(0);
+	if(epfd == -1) {
+		perror("DGR Relay: ERROR epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = s_R;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, s_R, &ev) == -1) {
+		perror("DGR Relay: ERROR epoll_ctl");
 		exit(EXIT_FAILURE);
 	}
+#endif
 
 	printf("DGR Relay: Initialization complete, running...\n");
 
+	/* The relay automatically shuts itself off if it hasn't received
+	 * any packets within a certain time period if it has already
+	 * received a packet (>15 seconds if it hasn't received any
+	 * packets yet). */
+	const int timeoutReceivedPacket = 5;  // seconds to timeout (if we HAVE received previous packet)
+	const int timeoutFirstPacket    = 15; // seconds to timeout (if we have NOT received previous packet)
+	bool receivedPacket = false;
+	time_t lastPacket = time(NULL);
+	struct timespec lastStats;
+	clock_gettime(CLOCK_MONOTONIC, &lastStats);
+
 	while (true) {
-	        usleep(100000); // 1/10th a second
-
-		// The relay automatically shuts itself off if it hasn't received any packets
-		// within a certain time period if it has already received a packet,
-		// >15 seconds if it hasn't received any packets yet).
-		framesPassed++;
-
-		int timeoutReceivedPacket = 50; // tenths of a second to timeout (if we HAVE received previous packet)
-		int timeoutFirstPacket = 150; // tenths of a second to timeout (if we have NOT received previous packet)
-		
-		if(receivedPacket && framesPassed > timeoutReceivedPacket) {
-		printf("DGR Relay: Exiting because we haven't received a packet within %f seconds (and we have received packets previously).\n", timeoutReceivedPacket/10.0);
-				exit(EXIT_SUCCESS);
+		// Wait for up to 1/10th of a second for packets.
+#ifdef __linux__
+		struct epoll_event events[1];
+		int ready = epoll_wait(epfd, events, 1, 100);
+#else
+		struct pollfd fds;
+		fds.fd = s_R;
+		fds.events = POLLIN;
+		int ready = poll(&fds, 1, 100);
+#endif
+		if(ready == -1 && errno != EINTR) {
+			perror("DGR Relay: ERROR epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+
+		// Forward everything that has arrived. Stop after a partial
+		// batch so that the timeouts and statistics below still run
+		// when packets arrive continuously.
+		if(ready > 0) {
+			int count;
+			do {
+				count = receive_batch();
+				if(count == 0)
+					break;
+				send_batch(count);
+				receivedPacket = true;
+
+				/* Check if any packet that we just forwarded was
+				 * informing processes to exit. */
+				for(int i=0; i<count; i++) {
+					dgr_packet_header header;
+					memcpy(&header, buffers[i], sizeof(header));
+#ifdef __linux__
+					unsigned int bytesReceived = recvMsgs[i].msg_len;
+#else
+					unsigned int bytesReceived = recvIov[i].iov_len;
+#endif
+					if(bytesReceived >= sizeof(header) &&
+					   header.magic == DGR_PACKET_MAGIC &&
+					   (header.flags & DGR_PACKET_EXIT))
+					{
+						printf("DGR Relay: Received message from master indicating that DGR communication is complete.\n");
+						exit(EXIT_SUCCESS);
+					}
+				}
+			} while(count == BATCH);
+			lastPacket = time(NULL);
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double sinceStats = elapsed_usec(&lastStats, &now) / 1000000.0;
+		if(sinceStats >= STATS_INTERVAL) {
+			print_stats(sinceStats);
+			lastStats = now;
+		}
+
+		int idle = (int) (time(NULL) - lastPacket);
+		if(receivedPacket && idle >= timeoutReceivedPacket) {
+			printf("DGR Relay: Exiting because we haven't received a packet within %d seconds (and we have received packets previously).\n", timeoutReceivedPacket);
+			exit(EXIT_SUCCESS);
 		}
-		if(receivedPacket == 0 && framesPassed > timeoutFirstPacket) {
-		printf("DGR Relay: Exiting because we never received any packets within %f seconds.\n", timeoutFirstPacket/10.0);
+		if(!receivedPacket && idle >= timeoutFirstPacket) {
+			printf("DGR Relay: Exiting because we never received any packets within %d seconds.\n", timeoutFirstPacket);
 			exit(EXIT_SUCCESS);
 		}
 	}
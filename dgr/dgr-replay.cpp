@@ -0,0 +1,175 @@
+// This program sends the frames in a DGR capture file (see the
+// dgr.capture setting) to DGR slaves or to a dgr-relay. It lets slaves
+// be tested and benchmarked without running a master.
+
+// Authors:
+// Scott A. Kuhl  kuhl at mtu dot edu
+
+#ifndef __MINGW32__
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+#include "dgr-packet.h"
+
+/** Returns a time in microseconds that only increases. */
+static int64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Sends a frame to the slaves. The frame is split into fragments in
+ * the same way that the DGR master does it.
+ *
+ * @param sock The socket to send packets with.
+ * @param dest The address to send packets to.
+ * @param header The header stored in the capture file for the frame.
+ * @param frame The serialized records in the frame.
+ * @param mtu The largest IP packet to send.
+ * @return The number of packets sent.
+ */
+static int send_frame(int sock, struct sockaddr_in *dest, dgr_packet_header header, const char *frame, int mtu)
+{
+	int maxFragment = mtu - 28 - (int) sizeof(header);
+	int fragments = (header.size + maxFragment - 1) / maxFragment;
+	if(fragments == 0) // send a header even if the frame is empty.
+		fragments = 1;
+	if(fragments > UINT16_MAX)
+	{
+		fprintf(stderr, "DGR Replay: Frame %u requires too many fragments.\n", header.frame);
+		exit(EXIT_FAILURE);
+	}
+	header.fragments = fragments;
+
+	for(int i=0; i<fragments; i++)
+	{
+		header.fragment = i;
+		header.offset = i*maxFragment;
+		int fragmentSize = (int) header.size - (int) header.offset;
+		if(fragmentSize > maxFragment)
+			fragmentSize = maxFragment;
+
+		struct iovec iov[2];
+		iov[0].iov_base = &header;
+		iov[0].iov_len = sizeof(header);
+		iov[1].iov_base = (char*) frame + header.offset;
+		iov[1].iov_len = fragmentSize;
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_name = dest;
+		mh.msg_namelen = sizeof(*dest);
+		mh.msg_iov = iov;
+		mh.msg_iovlen = fragmentSize > 0 ? 2 : 1;
+		while(sendmsg(sock, &mh, 0) == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("DGR Replay: ERROR sendmsg");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return fragments;
+}
+#endif // __MINGW32__
+
+
+int main(int argc, char **argv) {
+#ifndef __MINGW32__
+	if (argc < 4) {
+		printf("USAGE: %s capture-file ipaddr-out port-out [ rate ] [ mtu ]\n", argv[0]);
+		printf("This program sends the frames in a DGR capture file to the specified IP address and port. A rate of 1 (the default) sends frames at the times they were originally sent, 2 sends them twice as fast and 0 sends them as fast as possible. The MTU defaults to 1500.\n");
+		exit(EXIT_FAILURE);
+	}
+	const char *filename = argv[1];
+	double rate = argc > 4 ? atof(argv[4]) : 1;
+	int mtu = argc > 5 ? atoi(argv[5]) : 1500;
+	if(mtu < 576)
+		mtu = 576;
+
+	FILE *f = fopen(filename, "rb");
+	char magic[DGR_CAPTURE_MAGIC_SIZE];
+	if(f == NULL || fread(magic, DGR_CAPTURE_MAGIC_SIZE, 1, f) != 1 ||
+	   memcmp(magic, DGR_CAPTURE_MAGIC, DGR_CAPTURE_MAGIC_SIZE) != 0) {
+		fprintf(stderr, "DGR Replay: '%s' is not a DGR capture file.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	int sock;
+	if ((sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+		perror("DGR Replay: ERROR socket");
+		exit(EXIT_FAILURE);
+	}
+	int so_broadcast = 1;
+	setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &so_broadcast, sizeof(so_broadcast));
+	struct sockaddr_in dest;
+	memset((char *) &dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(atoi(argv[3]));
+	if (inet_aton(argv[2], &dest.sin_addr) == 0) {
+		fprintf(stderr, "DGR Replay: inet_aton() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("DGR Replay: Sending '%s' to %s on port %s\n", filename, argv[2], argv[3]);
+
+	std::vector<char> frame;
+	int64_t timestamp, first = 0, start = 0;
+	dgr_packet_header header;
+	long frames = 0, packets = 0, bytes = 0;
+	bool exitSent = false;
+	while(fread(&timestamp, sizeof(timestamp), 1, f) == 1 &&
+	      fread(&header, sizeof(header), 1, f) == 1)
+	{
+		if(header.magic != DGR_PACKET_MAGIC) {
+			fprintf(stderr, "DGR Replay: The capture file is corrupt after %ld frames.\n", frames);
+			break;
+		}
+		frame.resize(header.size);
+		if(header.size > 0 && fread(&frame[0], header.size, 1, f) != 1)
+			break;
+
+		if(frames == 0) {
+			first = timestamp;
+			start = now_usec();
+		}
+
+		/* Wait until it is time to send the frame. */
+		if(rate > 0) {
+			int64_t due = start + (int64_t) ((timestamp - first) / rate);
+			int64_t wait = due - now_usec();
+			if(wait > 0)
+				usleep(wait);
+		}
+
+		packets += send_frame(sock, &dest, header, header.size > 0 ? &frame[0] : NULL, mtu);
+		bytes += header.size;
+		frames++;
+		if(header.flags & DGR_PACKET_EXIT)
+			exitSent = true;
+	}
+	fclose(f);
+
+	/* Tell the slaves to exit if the capture didn't end with the
+	 * master exiting. */
+	if(!exitSent) {
+		memset(&header, 0, sizeof(header));
+		header.magic = DGR_PACKET_MAGIC;
+		header.flags = DGR_PACKET_EXIT;
+		send_frame(sock, &dest, header, NULL, mtu);
+	}
+
+	double seconds = (now_usec() - start) / 1000000.0;
+	printf("DGR Replay: Sent %ld frames (%ld packets, %.2f MB) in %.2f seconds (%.1f frames/sec).\n",
+	       frames, packets, bytes/1024.0/1024.0, seconds, seconds > 0 ? frames/seconds : 0);
+	close(sock);
+#endif  // __MINGW32__
+}
@@ -10,6 +10,8 @@
 #include "dgr.h"
 
 static int viewmat_swapinterval = 0;
+static int bufferswap_framelock = 0;         /**< Synchronize swaps between DGR master and slaves? */
+static int bufferswap_framelock_timeout = 100; /**< Milliseconds to wait for other DGR processes */
 
 /** Call once per frame to update the 'fps' variable. */
 static float fps = 0;
@@ -300,6 +302,13 @@ static void bufferswap_init(void)
 	        occur.
 	*/
 	glfwSwapInterval(viewmat_swapinterval);
+
+	/* Frame lock makes DGR slaves swap buffers on the same frame as
+	 * the master. */
+	bufferswap_framelock = kuhl_config_boolean("bufferswap.framelock", 0, 0);
+	bufferswap_framelock_timeout = kuhl_config_int("bufferswap.framelock.timeout", 100, 100);
+	if(bufferswap_framelock && dgr_is_enabled())
+		msg(MSG_INFO, "Frame lock is turned on; waiting at most %d ms for other DGR processes each frame.\n", bufferswap_framelock_timeout);
 }
 
 /** Swaps the buffers using the appropriate settings based on the
@@ -317,6 +326,8 @@ void bufferswap(void)
 	}
 	
 	dgr_update(1,0); // DGR Master should send before blocking at swap.
+	if(bufferswap_framelock)
+		dgr_framelock(bufferswap_framelock_timeout); // wait until everyone is ready to swap
 
 	/* Swap the buffers */
 	if(viewmat_swapinterval == 0 ||
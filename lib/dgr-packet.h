@@ -0,0 +1,142 @@
+/* Copyright (c) 2014 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/**
+   @file
+
+    Describes the header at the start of every UDP packet that DGR
+    sends and the format of DGR capture files. This file is shared by
+    the DGR library and the programs (such as dgr-relay and
+    dgr-replay) that forward DGR packets.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Value stored in dgr_packet_header.magic ("DGR" followed by a
+ * protocol version number). Packets with any other value are
+ * ignored. */
+#define DGR_PACKET_MAGIC 0x44475204
+
+/** The frame contains every record (instead of only the records
+ * that changed since the previous keyframe). */
+#define DGR_PACKET_KEYFRAME 0x01
+/** The master is exiting; slaves (and relays) should exit too. */
+#define DGR_PACKET_EXIT     0x02
+/** The packet isn't part of a frame. Instead, it tells slaves that
+ * they may swap buffers for the frame in the 'frame' field (see
+ * dgr_framelock()). */
+#define DGR_PACKET_SWAP     0x04
+/** The frame (all of its fragments put together) is a uint32_t
+ * containing the size of the uncompressed frame followed by the frame
+ * compressed with lzcompress(). */
+#define DGR_PACKET_COMPRESSED 0x08
+/** The packet isn't part of a frame. Instead, it tells slaves that
+ * the newest frame on a reliable channel is 'frame'. Slaves that
+ * don't have that frame ask the master to send it again (see
+ * DGR_CONTROL_NACK). */
+#define DGR_PACKET_HEARTBEAT 0x10
+
+/** Every DGR packet begins with this header. A frame (the serialized
+ * records, see dgr_serialize()) is split into one or more fragments
+ * so that each UDP packet fits within the MTU. Each packet contains a
+ * header followed by one fragment. All fields are in host byte
+ * order. */
+typedef struct {
+	uint32_t magic;    /**< Always DGR_PACKET_MAGIC */
+	uint32_t frame;    /**< Sequence number of this frame; incremented each time the master sends. */
+	uint32_t keyframe; /**< Sequence number of the keyframe that this frame contains changes relative to. Equal to frame if this is a keyframe. */
+	uint32_t flags;    /**< Bitwise OR of DGR_PACKET_* flags */
+	uint32_t size;     /**< Total number of bytes in the frame (all fragments) */
+	uint32_t offset;   /**< Location of this fragment within the frame */
+	uint16_t fragment; /**< Index of this fragment */
+	uint16_t fragments; /**< Number of fragments in the frame */
+	uint32_t channel;  /**< Channel that the frame belongs to (see dgr_channel()). Each channel numbers its frames separately. Frames on channel 0 use delta encoding; frames on other channels contain every record on the channel. */
+} dgr_packet_header;
+
+/** Maximum size of a single DGR packet (header and fragment). */
+#define DGR_MAX_PACKET_SIZE 65507
+
+
+/** Value stored in dgr_control_header.magic. */
+#define DGR_CONTROL_MAGIC 0x44474301
+
+/** Slave is done rendering 'frame' and is ready to swap buffers. */
+#define DGR_CONTROL_READY 1
+/** The header is followed by a dgr_control_stats struct. */
+#define DGR_CONTROL_STATS 2
+/** Slave asks the master for the time. The header is followed by a
+ * dgr_control_clock struct with 'ping' set. 'frame' is 0 until the
+ * master has replied, which makes the master send every reliable
+ * channel again. */
+#define DGR_CONTROL_PING 3
+/** Master's reply to DGR_CONTROL_PING (sent back to the slave on the
+ * back channel) with every field of dgr_control_clock set and 'frame'
+ * set to the next frame that the master will send. */
+#define DGR_CONTROL_PONG 4
+/** Slave missed the newest frame on a reliable channel. The header
+ * (with 'frame' set to the newest frame the slave has on the channel,
+ * 0 if none) is followed by a dgr_control_nack struct. */
+#define DGR_CONTROL_NACK 5
+
+/** Slaves send packets directly to the master (bypassing any relay)
+ * on a separate "back channel". Each of these packets begins with
+ * this header. */
+typedef struct {
+	uint32_t magic; /**< Always DGR_CONTROL_MAGIC */
+	uint32_t type;  /**< One of the DGR_CONTROL_* values */
+	uint32_t frame; /**< The frame that the message refers to */
+	char name[32];  /**< Null terminated name of the slave that sent the packet */
+} dgr_control_header;
+
+/** Statistics that a slave periodically sends to the master (see
+ * dgr.stats.interval). Times are in milliseconds. */
+typedef struct {
+	float seconds;        /**< Length of the interval the statistics cover */
+	uint32_t frames;      /**< Frames used */
+	uint32_t packets;     /**< Packets received */
+	uint32_t bytes;       /**< Bytes received */
+	uint32_t superseded;  /**< Complete frames that were replaced by a newer frame before they were used */
+	uint32_t incomplete;  /**< Frames that were discarded before all of their packets arrived */
+	float unserialize;    /**< Average time to unserialize a frame */
+	float latency;        /**< Average time between receiving the last packet of a frame and using it */
+	float latencyMax;     /**< Longest latency */
+} dgr_control_stats;
+
+/** Times exchanged by DGR_CONTROL_PING and DGR_CONTROL_PONG so that
+ * slaves can estimate the difference between their clock and the
+ * master's clock (see dgr_time()). All times are in microseconds on
+ * the clock of the process that recorded them. */
+typedef struct {
+	int64_t ping;     /**< Slave: Time the ping was sent */
+	int64_t received; /**< Master: Time the ping arrived */
+	int64_t sent;     /**< Master: Time the pong was sent */
+	int64_t epoch;    /**< Master: Time that dgr_time() counts from */
+} dgr_control_clock;
+
+/** Identifies the channel in a DGR_CONTROL_NACK message. */
+typedef struct {
+	uint32_t channel; /**< The reliable channel that the slave wants the master to send again */
+} dgr_control_nack;
+
+
+/** A capture file (see dgr.capture) begins with these 8 bytes. The
+ * rest of the file is a sequence of frames. Each frame is stored as
+ * an int64_t timestamp (the master's dgr_time() when it sent the
+ * frame, in microseconds since it called dgr_init()), a
+ * dgr_packet_header (fragment 0 of 1) and header.size bytes of
+ * serialized records. Values are in host byte order. */
+#define DGR_CAPTURE_MAGIC "DGRCAP03"
+#define DGR_CAPTURE_MAGIC_SIZE 8
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -12,6 +12,9 @@
     @author Scott Kuhl
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // sendmmsg()
+#endif
 #include "windows-compat.h"
 
 #include <stdio.h>
@@ -28,20 +31,37 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <pthread.h>
 #endif // __MINGW32__
 
 #include <errno.h>
 #include <time.h>
 #include "msg.h"
 #include "kuhl-config.h"
+#include "kuhl-nodep.h"
 #include "dgr.h"
+#include "dgr-packet.h"
+#include "lzcompress.h"
 
 /** The dgr_record struct is used internally by DGR to hold a single
  * variable that DGR is keeping track of. */
 typedef struct {
-	char name[1024]; /**< The name of the variable */
-	int size;        /**< Number of bytes of data in this variable */
+	char *name;      /**< The name of the variable (allocated by DGR) */
+	int namelen;     /**< strlen(name) */
+	unsigned int hash; /**< Hash of the name, see dgr_hash() */
+	int size;        /**< Number of bytes of data in this variable, 0 if it has never been set. */
+	int capacity;    /**< Number of bytes allocated for buffer */
 	void *buffer;    /**< The bytes of data in this variable */
+	uint32_t changed; /**< Frame number when the contents of this record last changed. */
+	long count;      /**< Number of frames in the current statistics interval that contained this record */
+	long bytes;      /**< Bytes this record used in those frames */
+	long lastCount;  /**< count for the previous statistics interval */
+	long lastBytes;  /**< bytes for the previous statistics interval */
+	void *bound;     /**< Application memory bound with dgr_bind() (size bytes), NULL if not bound. The data is never copied into buffer. */
+	uint64_t boundHash; /**< Master: Hash of the bound memory when it last changed, see dgr_gather(). */
+	int channel;     /**< Master: Channel that the record is sent on, see dgr_channel(). */
 } dgr_record;
 
 
@@ -54,10 +74,262 @@ static dgr_record dgr_list[DGR_MAX_LIST_SIZE];
 /** Size of the DGR record list */
 static int dgr_list_size = 0;
 
+/** Number of slots in the hash table that maps names to an index in
+ * dgr_list. Must be a power of two and should be at least twice
+ * DGR_MAX_LIST_SIZE so that probe sequences stay short. */
+#define DGR_HASH_SIZE 2048
+/** Open addressing hash table (linear probing). Each slot stores an
+ * index into dgr_list plus one; zero indicates an empty slot. Records
+ * are never removed individually, so no tombstones are needed. */
+static int dgr_hashtable[DGR_HASH_SIZE];
+
 /* The socket that we are sending/receiving from */
 static int dgr_socket;
 static struct addrinfo *dgr_addrinfo;
-static time_t dgr_time_lastreceive; /**< time we received last packet, 0 if haven't received anything yet. */
+static time_t dgr_time_lastreceive; /**< time we received last packet, 0 if haven't received anything yet. Written by the receiver thread. */
+
+/* Delta encoding. The master sends a keyframe containing every record
+ * periodically. Other frames only contain the records that have
+ * changed since the most recent keyframe. Since the changes are
+ * relative to the keyframe (not to the previous frame), a slave that
+ * misses some frames can still apply any later frame as long as it
+ * has the keyframe. A slave that misses a keyframe ignores frames
+ * until the next keyframe arrives. */
+static uint32_t dgr_frame = 1;        /**< Master: Sequence number of the next frame to send. Slave: Sequence number of last frame we used. */
+static uint32_t dgr_keyframe = 0;     /**< Sequence number of the most recent keyframe sent (master) or used (slave). */
+static int dgr_have_keyframe = 0;     /**< Slave: Set to 1 once we have used a keyframe. */
+static int dgr_keyframe_interval = 30; /**< Master: Send a keyframe every this many frames. */
+static int dgr_exiting = 0;           /**< Master: Set to 1 when the next frame should tell slaves to exit. */
+
+/* Channels. Records can be put on channels other than the default
+ * channel (channel 0) so that they are sent at a different rate or
+ * reliably, see dgr_channel(). Each channel numbers its frames
+ * separately. A frame on a channel other than channel 0 contains every
+ * record on the channel, so slaves simply use the newest one they
+ * receive. Channels that aren't reliable ("latest wins", for example
+ * poses that change every frame) are sent first. Reliable channels are
+ * sent next: when nothing on them changed, the master sends a small
+ * heartbeat instead. Slaves that missed the newest frame on the
+ * channel ask the master to send it again on the back channel. */
+typedef struct {
+	char name[32];      /**< Name of the channel */
+	float rate;         /**< Master: Maximum frames per second, 0 to send with every dgr_update() */
+	int flags;          /**< Master: Bitwise OR of DGR_CHANNEL_* flags */
+	uint32_t frame;     /**< Master: Sequence number of the newest frame sent on this channel, 0 if none */
+	uint32_t sentFrame; /**< Master: Value of dgr_frame when this channel was last sent */
+	long lastTick;      /**< Master: Time that we last considered sending the channel */
+	int sinceSent;      /**< Master: Number of times we considered sending the channel since we last sent a frame on it */
+	int resend;         /**< Master: Set to 1 if a slave asked us to send the newest frame again */
+} dgr_channel_info;
+
+/** Maximum number of channels, including the default channel. */
+#define DGR_MAX_CHANNELS 8
+/** Maximum number of prefixes passed to dgr_channel_add(). */
+#define DGR_MAX_CHANNEL_PREFIXES 64
+static dgr_channel_info dgr_channels[DGR_MAX_CHANNELS]; /**< The channels, dgr_channels[0] is the default channel. */
+static int dgr_channels_size = 1;
+typedef struct {
+	char prefix[64]; /**< Records with names starting with this go on the channel */
+	int channel;
+} dgr_channel_prefix;
+static dgr_channel_prefix dgr_channel_prefixes[DGR_MAX_CHANNEL_PREFIXES];
+static int dgr_channel_prefixes_size = 0;
+static uint32_t dgr_channel_used[DGR_MAX_CHANNELS]; /**< Slave: Newest frame used on each channel (other than 0), 0 if none. */
+
+/* Fragmentation. Instead of relying on IPv4 fragmentation (where the
+ * loss of a single fragment causes the entire packet to be lost
+ * without any indication of which frame was lost), the master splits
+ * each frame into packets that fit within the MTU. Slaves reassemble
+ * the frames, discard incomplete frames once a newer frame is
+ * complete, and always use the newest complete frame. */
+static int dgr_mtu = 1500;            /**< Master: Largest IP packet we should send. */
+
+/* Compression. Large frames (for example, ones containing vertex
+ * arrays) are compressed with lzcompress() so that fewer packets are
+ * sent. Slaves decompress frames once they are reassembled. */
+static int dgr_compress = 0;            /**< Master: Set to 1 if dgr.compress is enabled. */
+static int dgr_compress_threshold = 1024; /**< Master: Only compress frames that are at least this many bytes. */
+static char *dgr_compressed = NULL;     /**< Buffer holding a compressed (master) or decompressed (slave) frame. */
+static int dgr_compressed_capacity = 0; /**< Number of bytes allocated for dgr_compressed. */
+
+/* Sending. The master serializes each frame into a buffer that is
+ * reused for every frame (it only grows when a frame is larger than
+ * any previous frame). The packets for a frame are then described
+ * with iovecs that point at a header and a slice of that buffer and
+ * are sent in batches. Nothing is allocated on the send path once the
+ * buffer has grown large enough. */
+static char *dgr_wire = NULL;    /**< Master: Buffer holding the serialized frame. */
+static int dgr_wire_capacity = 0; /**< Master: Number of bytes allocated for dgr_wire. */
+/** Maximum number of packets that are passed to the OS at once. */
+#define DGR_SEND_BATCH 64
+#ifdef __linux__
+static struct mmsghdr dgr_send_msgs[DGR_SEND_BATCH]; /**< Master: Packets passed to sendmmsg(). */
+#define DGR_SEND_MSGHDR(i) (dgr_send_msgs[i].msg_hdr)
+#else
+static struct msghdr dgr_send_msgs[DGR_SEND_BATCH];  /**< Master: Packets passed to sendmsg(). */
+#define DGR_SEND_MSGHDR(i) (dgr_send_msgs[i])
+#endif
+static struct iovec dgr_send_iov[DGR_SEND_BATCH][2];       /**< Master: Header and fragment for each packet. */
+static dgr_packet_header dgr_send_headers[DGR_SEND_BATCH]; /**< Master: Header for each packet. */
+
+/** Holds a frame that a slave is reassembling or has reassembled. */
+typedef struct {
+	int used;                 /**< 1 if this struct holds a frame. */
+	dgr_packet_header header; /**< The header of the first packet we received for this frame. */
+	int received;             /**< Number of fragments we have received. */
+	char *have;               /**< have[i] is set to 1 if we have received fragment i. */
+	int haveCapacity;         /**< Number of bytes allocated for 'have' */
+	char *buffer;             /**< The frame data */
+	int capacity;             /**< Number of bytes allocated for 'buffer' */
+	long completed;           /**< Time (kuhl_microseconds()) that the last packet arrived, 0 if unknown. */
+} dgr_frame_buffer;
+
+/** Maximum number of incomplete frames a slave holds on to. */
+#define DGR_REASSEMBLY_SLOTS 4
+/** Maximum size of a frame that a slave will accept. */
+#define DGR_MAX_FRAME_SIZE (64*1024*1024)
+static dgr_frame_buffer dgr_reassembly[DGR_REASSEMBLY_SLOTS]; /**< Slave: Frames that are being reassembled. */
+static dgr_frame_buffer dgr_complete;     /**< Slave: Newest complete frame that we haven't published yet. */
+static dgr_frame_buffer dgr_complete_key; /**< Slave: Newest complete keyframe. */
+static char *dgr_packet = NULL;           /**< Slave: Buffer that packets are received into. */
+static uint32_t dgr_received_frame = 0;   /**< Slave: Newest usable frame that we have completely received. */
+static int dgr_received_any = 0;          /**< Slave: Set to 1 once dgr_received_frame is valid. */
+
+/* Receiver thread. On a slave, a thread receives and reassembles
+ * packets so that bursts of packets don't stall rendering. Frames are
+ * handed to the rendering thread through a lock-free triple buffer:
+ * the receiver fills the "back" slot and then atomically exchanges it
+ * with the "middle" slot; dgr_update() atomically exchanges the
+ * "front" slot with the middle one if it holds something new. The
+ * variables in this section marked "Receiver" are only used by the
+ * receiver thread. The other dgr_* slave variables (dgr_frame,
+ * dgr_keyframe, etc) are only used by the rendering thread. */
+typedef struct {
+	dgr_frame_buffer key;   /**< A keyframe that the rendering thread doesn't have yet (key.used is 0 if none). */
+	dgr_frame_buffer delta; /**< The newest frame (delta.used is 0 if none). */
+	dgr_frame_buffer channel[DGR_MAX_CHANNELS]; /**< Newest frame on each of the other channels that the rendering thread doesn't have yet */
+} dgr_frame_pair;
+#define DGR_TRIPLE_FRESH 4    /**< Set in dgr_triple_middle if the middle slot hasn't been used. */
+static dgr_frame_pair dgr_triple[3];
+static int dgr_triple_back = 0;   /**< Receiver: Slot that is filled next. */
+static int dgr_triple_middle = 2; /**< Shared: Slot that was published most recently (and DGR_TRIPLE_FRESH) */
+static int dgr_triple_front = 1;  /**< Slot that the rendering thread used most recently. */
+static uint32_t dgr_applied_keyframe = 0; /**< Shared: Keyframe that the rendering thread has used (0 if none). */
+static uint32_t dgr_applied_channel[DGR_MAX_CHANNELS]; /**< Shared: Newest frame on each channel that the rendering thread has used (0 if none). */
+static dgr_frame_buffer dgr_channel_reassembly[DGR_MAX_CHANNELS]; /**< Receiver: Frame being reassembled on each channel other than 0. */
+static dgr_frame_buffer dgr_channel_complete[DGR_MAX_CHANNELS];   /**< Receiver: Newest complete frame on each channel other than 0. */
+static int dgr_exit_received = 0; /**< Shared: Set to 1 when the master tells slaves to exit. */
+static int dgr_receiver_started = 0;
+#if !defined __MINGW32__ && !defined _WIN32
+static pthread_t dgr_receiver_thread;
+/* The rendering thread waits on this condition variable when it
+ * needs a frame. It is never used to protect frames. */
+static pthread_mutex_t dgr_event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dgr_event_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int dgr_events = 0;      /**< Incremented by the receiver every time it publishes something. */
+static unsigned int dgr_events_seen = 0; /**< Value of dgr_events the last time the rendering thread waited. */
+static void* dgr_receiver(void *arg);
+#endif
+
+/* Multicast. Instead of sending packets to one slave (or to a relay
+ * which sends a copy to each slave), the master can send each packet
+ * once to a multicast group. Every slave that joins the group
+ * receives a copy. */
+static int dgr_multicast = 0; /**< Set to 1 if dgr.transport is 'multicast' */
+
+/* Frame lock. Slaves send packets directly to the master on a "back
+ * channel" to tell it that they are ready to swap buffers. The master
+ * waits for every slave before telling them to swap (see
+ * dgr_framelock()). */
+typedef struct {
+	long total;   /**< Total microseconds spent waiting */
+	long max;     /**< Longest wait in microseconds */
+	int count;    /**< Number of waits included in total */
+	int timeouts; /**< Number of times we gave up waiting */
+} dgr_wait_stats;
+
+typedef struct {
+	char name[32];       /**< Name that the slave sent us */
+	int active;          /**< 1 if the master waits for this slave */
+	uint32_t readyFrame; /**< Newest frame that the slave is ready to swap */
+	dgr_wait_stats wait; /**< Time the master spent waiting for the slave */
+} dgr_node;
+
+#define DGR_MAX_NODES 64
+static dgr_node dgr_nodes[DGR_MAX_NODES]; /**< Master: Slaves that have sent packets on the back channel. */
+static int dgr_nodes_size = 0;
+static int dgr_backchannel = -1;       /**< Master: Socket that receives packets from slaves. Slave: Socket connected to the master. -1 if there is no back channel. */
+static char dgr_slave_name[32];        /**< Slave: Name that we send to the master. */
+static uint32_t dgr_swap_frame = 0;    /**< Slave (shared): Newest frame that the master told us to swap. */
+static int dgr_framelock_active = 0;   /**< Set to 1 once dgr_framelock() has been called. */
+static dgr_wait_stats dgr_swap_wait;   /**< Slave: Time spent waiting for the master to tell us to swap. */
+static dgr_wait_stats dgr_frame_wait;  /**< Slave: Time spent waiting for the next frame after swapping. */
+static long dgr_framelock_stats_time = 0; /**< Time that frame lock statistics were last printed. */
+
+/* Capture and replay. A master can record every frame that it sends
+ * to a file (dgr.capture). When dgr.mode is 'replay', the frames are
+ * read from the file and used as if they were received from a
+ * master. */
+static FILE *dgr_capture = NULL;     /**< Master: File that frames are recorded in. */
+static FILE *dgr_replay = NULL;      /**< Replay: File that frames are read from. NULL if not replaying. */
+static float dgr_replay_rate = 1;    /**< Replay: Speed relative to the original session; 0 to use one frame per dgr_update(). */
+static long dgr_replay_start = 0;    /**< Replay: Time that the first frame was used. */
+static int64_t dgr_replay_first = 0; /**< Replay: Timestamp of the first frame in the file. */
+static int64_t dgr_replay_time = 0;  /**< Replay: Timestamp of the frame in dgr_replay_next. */
+static int64_t dgr_replay_clock = 0; /**< Replay: Timestamp of the frame that was used most recently. dgr_time() returns it. */
+static dgr_frame_buffer dgr_replay_next; /**< Replay: The next frame to use. */
+
+/* Statistics. Counters are collected for an interval (one second or
+ * dgr.stats.interval seconds) and then copied into dgr_stats_last
+ * where dgr_stats() can read them. Counters that the receiver thread
+ * updates are kept separately and are only accessed atomically. */
+typedef struct {
+	long frames, keyframes, packets, bytes, rawBytes;
+	long serializeTime, serializeMax, serializeCount; /**< Microseconds */
+	long compressTime, compressCount;                 /**< Microseconds */
+	long latencyTime, latencyMax, latencyCount;       /**< Microseconds */
+} dgr_counters;
+
+typedef struct {
+	long packets, bytes, superseded, incomplete;
+	long decompressTime, decompressCount; /**< Microseconds */
+} dgr_receiver_counters;
+
+static dgr_counters dgr_counters_current;          /**< Counters for the current interval. */
+static dgr_receiver_counters dgr_receiver_current; /**< Receiver (shared): Counters for the current interval. */
+static dgr_stats_info dgr_stats_last;              /**< Statistics for the previous interval. */
+static long dgr_stats_start = 0;    /**< Time that the current interval started. */
+static int dgr_stats_interval = 0;  /**< Seconds between writing statistics to the log, 0 to not write them. */
+
+/* Clock synchronization. Slaves periodically ping the master on the
+ * back channel. Each reply gives an estimate of the difference
+ * between the slave's clock and the master's clock (like NTP). The
+ * estimates with the shortest round trip times are combined into an
+ * offset and a skew (the rate the clocks drift apart) so that
+ * dgr_time() returns the same value on every process without sending
+ * the time in every frame. */
+typedef struct {
+	int64_t local;  /**< Local time in the middle of the round trip */
+	int64_t offset; /**< Master's clock minus our clock */
+	int64_t rtt;    /**< Round trip time, excluding the time the master held the ping */
+} dgr_clock_sample;
+
+#define DGR_CLOCK_SAMPLES 16
+static dgr_clock_sample dgr_clock_samples[DGR_CLOCK_SAMPLES]; /**< Slave: The most recent samples. */
+static int dgr_clock_count = 0;      /**< Slave: Number of samples in dgr_clock_samples. */
+static int dgr_clock_next = 0;       /**< Slave: Index the next sample is stored at. */
+static int dgr_clock_synced = 0;     /**< Slave: Set to 1 once we have received a pong. */
+static int64_t dgr_clock_epoch = 0;  /**< Time that dgr_time() counts from (on the master's clock once synchronized). */
+static int64_t dgr_clock_ref = 0;    /**< Slave: Local time that dgr_clock_offset was estimated for. */
+static double dgr_clock_offset = 0;  /**< Slave: Master's clock minus our clock at dgr_clock_ref (microseconds). */
+static double dgr_clock_skew = 0;    /**< Slave: Change in the offset per microsecond. */
+static int64_t dgr_clock_lastping = 0; /**< Slave: Time that we last sent a ping. */
+static int dgr_clock_interval = 1000;  /**< Slave: Milliseconds between pings. */
+static uint32_t dgr_clock_frame = 0;  /**< Slave: The next frame the master was going to send when it first replied to a ping. */
+static double dgr_time_last = 0;     /**< Value dgr_time() returned most recently. */
+#if !defined __MINGW32__ && !defined _WIN32
+static void dgr_clock_sync(void);
+#endif
 
 /* Other DGR variables. */
 static int dgr_mode     = 1; /**< Set to 1 if we are master, 0 otherwise */
@@ -68,11 +340,123 @@ static int dgr_disabled = 1; /**< Is DGR disabled? */
 static void dgr_free(void)
 {
 	for(int i=0; i<dgr_list_size; i++)
+	{
+		free(dgr_list[i].name);
 		free(dgr_list[i].buffer);
+	}
+	memset(dgr_list, 0, sizeof(dgr_record)*dgr_list_size);
+	memset(dgr_hashtable, 0, sizeof(dgr_hashtable));
 	dgr_list_size = 0;
 }
 
 
+#if !defined __MINGW32__ && !defined _WIN32
+/** Reads the dgr.transport setting and, if multicast is being used,
+ * the multicast group address.
+ *
+ * @param group Filled in with the multicast group if multicast is used.
+ *
+ * @return 1 if multicast is being used, 0 otherwise.
+ */
+static int dgr_init_transport(struct in_addr *group)
+{
+	const char *transport = kuhl_config_get("dgr.transport");
+	if(transport == NULL || strcmp(transport, "unicast") == 0)
+		return 0;
+	if(strcmp(transport, "multicast") != 0)
+	{
+		msg(MSG_FATAL, "dgr.transport must be 'unicast' or 'multicast' but you set it to '%s'", transport);
+		exit(EXIT_FAILURE);
+	}
+
+	const char *groupString = kuhl_config_get("dgr.multicast.group");
+	if(groupString == NULL || inet_pton(AF_INET, groupString, group) != 1 ||
+	   !IN_MULTICAST(ntohl(group->s_addr)))
+	{
+		msg(MSG_FATAL, "DGR: dgr.multicast.group must be set to an IPv4 multicast address (224.0.0.0 to 239.255.255.255) when dgr.transport is 'multicast'.");
+		exit(EXIT_FAILURE);
+	}
+	return 1;
+}
+
+/** Gets the IPv4 address of the network interface that multicast
+ * packets should be sent and received on. Uses the
+ * dgr.multicast.interface setting, or lets the OS choose if it is not
+ * set. Set it to 127.0.0.1 to test multicast on a single machine.
+ */
+static struct in_addr dgr_multicast_interface(void)
+{
+	struct in_addr iface;
+	iface.s_addr = htonl(INADDR_ANY);
+	const char *ifaceString = kuhl_config_get("dgr.multicast.interface");
+	if(ifaceString != NULL && inet_pton(AF_INET, ifaceString, &iface) != 1)
+	{
+		msg(MSG_ERROR, "DGR: dgr.multicast.interface must be the IPv4 address of a network interface, ignoring '%s'.", ifaceString);
+		iface.s_addr = htonl(INADDR_ANY);
+	}
+	return iface;
+}
+
+/** Creates the UDP socket used for the back channel between slaves
+ * and the master.
+ *
+ * @param ipAddr The address of the master (slave) or NULL to bind to
+ * port on all interfaces (master).
+ *
+ * @param port The port that the master receives packets on.
+ *
+ * @return The socket or -1 if the socket couldn't be created.
+ */
+static int dgr_open_backchannel(const char *ipAddr, const char *port)
+{
+	struct addrinfo hints, *servinfo, *p;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if(ipAddr == NULL)
+		hints.ai_flags = AI_PASSIVE;
+
+	int rv;
+	if((rv = getaddrinfo(ipAddr, port, &hints, &servinfo)) != 0)
+	{
+		msg(MSG_ERROR, "DGR: Back channel: getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+
+	int sock = -1;
+	for(p = servinfo; p != NULL; p = p->ai_next)
+	{
+		if((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+			continue;
+		/* The master receives on the port; a slave only sends to it. */
+		if((ipAddr == NULL && bind(sock, p->ai_addr, p->ai_addrlen) == -1) ||
+		   (ipAddr != NULL && connect(sock, p->ai_addr, p->ai_addrlen) == -1))
+		{
+			msg(MSG_ERROR, "DGR: Back channel: %s: %s", ipAddr == NULL ? "bind" : "connect", strerror(errno));
+			close(sock);
+			sock = -1;
+			continue;
+		}
+		break;
+	}
+	freeaddrinfo(servinfo);
+
+	if(sock != -1)
+	{
+		msg(MSG_INFO, "DGR: Using back channel %s port %s.\n", ipAddr == NULL ? "on" : ipAddr, port);
+#ifdef SO_TIMESTAMP
+		/* Ask the OS to record when packets arrive so that clock
+		 * synchronization isn't affected by how often we read from
+		 * the socket. */
+		int on = 1;
+		if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) == -1)
+			msg(MSG_DEBUG, "DGR: Back channel: setsockopt(SO_TIMESTAMP): %s", strerror(errno));
+#endif
+	}
+	return sock;
+}
+#endif // __MINGW32__
+
 /** Initializes a master DGR process that will send packets out on the network. */
 static void dgr_init_master()
 {
@@ -80,6 +464,12 @@ static void dgr_init_master()
 	const char *ipAddr = kuhl_config_get("dgr.master.destip");
 	const char *port = kuhl_config_get("dgr.master.destport");
 
+	/* When multicasting, send to the multicast group. */
+	struct in_addr group;
+	dgr_multicast = dgr_init_transport(&group);
+	if(dgr_multicast)
+		ipAddr = kuhl_config_get("dgr.multicast.group");
+
 	if(ipAddr == NULL || strcmp(ipAddr, "0.0.0.0") == 0)
 	{
 		dgr_disabled = 1;
@@ -95,10 +485,31 @@ static void dgr_init_master()
 	}
 
 	msg(MSG_INFO, "DGR Master: Preparing to send packets to %s port %s.\n", ipAddr, port);
+
+	dgr_keyframe_interval = kuhl_config_int("dgr.keyframe.interval", 30, 30);
+	if(dgr_keyframe_interval < 1)
+		dgr_keyframe_interval = 1;
+	/* The smallest MTU IPv4 allows is 576 bytes. */
+	dgr_mtu = kuhl_config_int("dgr.mtu", 1500, 1500);
+	if(dgr_mtu < 576)
+		dgr_mtu = 576;
+	dgr_compress = kuhl_config_boolean("dgr.compress", 0, 0);
+	dgr_compress_threshold = kuhl_config_int("dgr.compress.threshold", 1024, 1024);
+	if(dgr_compress)
+		msg(MSG_INFO, "DGR Master: Compressing frames that are %d bytes or larger.\n", dgr_compress_threshold);
+	dgr_frame = 1;
+	dgr_keyframe = 0;
+	dgr_exiting = 0;
+	dgr_nodes_size = 0;
+
+	/* Slaves send packets to this port when frame lock is used. */
+	const char *listenport = kuhl_config_get("dgr.master.listenport");
+	if(listenport != NULL)
+		dgr_backchannel = dgr_open_backchannel(NULL, listenport);
 	
 	struct addrinfo hints, *servinfo;
 	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_UNSPEC;
+	hints.ai_family = dgr_multicast ? AF_INET : AF_UNSPEC;
 	hints.ai_socktype = SOCK_DGRAM;
 
 	int rv;
@@ -124,6 +535,41 @@ static void dgr_init_master()
 	}
 
 	dgr_addrinfo = p;
+
+	if(dgr_multicast)
+	{
+		/* The TTL limits how many routers multicast packets can pass
+		 * through (1 keeps them on the local network). Loopback
+		 * determines if slaves on this machine receive the
+		 * packets. */
+		int ttl = kuhl_config_int("dgr.multicast.ttl", 1, 1);
+		int loopback = kuhl_config_boolean("dgr.multicast.loopback", 1, 1);
+		struct in_addr iface = dgr_multicast_interface();
+		msg(MSG_INFO, "DGR Master: Multicasting with TTL %d, loopback %s.\n", ttl, loopback ? "on" : "off");
+
+		if(setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1 ||
+		   setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loopback, sizeof(loopback)) == -1 ||
+		   (iface.s_addr != htonl(INADDR_ANY) &&
+		    setsockopt(dgr_socket, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) == -1))
+		{
+			msg(MSG_FATAL, "DGR Master: Failed to set up multicast: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Record every frame we send if requested. */
+	const char *captureFile = kuhl_config_get("dgr.capture");
+	if(captureFile != NULL && strlen(captureFile) > 0)
+	{
+		dgr_capture = fopen(captureFile, "wb");
+		if(dgr_capture == NULL ||
+		   fwrite(DGR_CAPTURE_MAGIC, DGR_CAPTURE_MAGIC_SIZE, 1, dgr_capture) != 1)
+		{
+			msg(MSG_FATAL, "DGR Master: Failed to create capture file '%s': %s", captureFile, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		msg(MSG_INFO, "DGR Master: Recording frames to '%s'.\n", captureFile);
+	}
 #endif // __MINGW32__
 }
 
@@ -139,12 +585,52 @@ static void dgr_init_slave()
 		exit(EXIT_FAILURE);
 	}
 	msg(MSG_INFO, "DGR Slave: Preparing to receive packets on port %s.\n", port);
+
+	struct in_addr group;
+	dgr_multicast = dgr_init_transport(&group);
 	
 	dgr_time_lastreceive = 0;
+	dgr_frame = 0;
+	dgr_keyframe = 0;
+	dgr_have_keyframe = 0;
+	if(dgr_packet == NULL)
+		dgr_packet = malloc(DGR_MAX_PACKET_SIZE);
+	for(int i=0; i<DGR_REASSEMBLY_SLOTS; i++)
+		dgr_reassembly[i].used = 0;
+	dgr_complete.used = 0;
+	dgr_complete_key.used = 0;
+	dgr_received_any = 0;
+	dgr_swap_frame = 0;
+	dgr_applied_keyframe = 0;
+	dgr_exit_received = 0;
+
+	/* Frame lock requires a back channel to the master. The relay
+	 * only forwards packets from the master, so slaves send packets
+	 * directly to the master. */
+	const char *masterip = kuhl_config_get("dgr.slave.masterip");
+	const char *masterport = kuhl_config_get("dgr.slave.masterport");
+	if(masterip != NULL && masterport != NULL)
+		dgr_backchannel = dgr_open_backchannel(masterip, masterport);
+
+	/* The master identifies slaves by name in its messages. */
+	const char *name = kuhl_config_get("dgr.slave.name");
+	if(name != NULL)
+		snprintf(dgr_slave_name, sizeof(dgr_slave_name), "%s", name);
+	else
+	{
+		char hostname[256];
+		if(gethostname(hostname, sizeof(hostname)) != 0)
+			strcpy(hostname, "slave");
+		hostname[sizeof(hostname)-1] = '\0';
+		snprintf(dgr_slave_name, sizeof(dgr_slave_name), "%.20s:%d", hostname, (int) getpid());
+	}
+
 	struct addrinfo hints, *servinfo, *p;
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC; // set to AF_INET forces IPv4; AF_INET6 forces IPv6; AF_UNSPEC allows any
+	if(dgr_multicast)
+		hints.ai_family = AF_INET; // only IPv4 multicast is supported
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_flags = AI_PASSIVE; // use my IP
 
@@ -161,6 +647,13 @@ static void dgr_init_slave()
 			perror("DGR Slave: socket");
 			continue;
 		}
+		/* Multiple slaves on the same machine can receive the same
+		 * multicast packets if they all allow the address to be
+		 * reused. */
+		int reuse = 1;
+		if(dgr_multicast &&
+		   setsockopt(dgr_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+			msg(MSG_ERROR, "DGR Slave: setsockopt(SO_REUSEADDR): %s", strerror(errno));
 		if (bind(dgr_socket, p->ai_addr, p->ai_addrlen) == -1) {
 			close(dgr_socket);
 			msg(MSG_ERROR, "DGR Slave: bind: %s", strerror(errno));
@@ -175,11 +668,75 @@ static void dgr_init_slave()
 		exit(EXIT_FAILURE);
 	}
 
+	/* A large frame arrives as a burst of packets. Ask for a receive
+	 * buffer that is large enough to hold several of them. The OS may
+	 * limit this value (see net.core.rmem_max on Linux). */
+	int rcvbuf = 4*1024*1024;
+	if(setsockopt(dgr_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1)
+		msg(MSG_DEBUG, "DGR Slave: setsockopt(SO_RCVBUF): %s", strerror(errno));
+
+	if(dgr_multicast)
+	{
+		struct ip_mreq mreq;
+		mreq.imr_multiaddr = group;
+		mreq.imr_interface = dgr_multicast_interface();
+		if(setsockopt(dgr_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+		{
+			msg(MSG_FATAL, "DGR Slave: Failed to join multicast group %s: %s", kuhl_config_get("dgr.multicast.group"), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		msg(MSG_INFO, "DGR Slave: Joined multicast group %s.\n", kuhl_config_get("dgr.multicast.group"));
+	}
+
 	freeaddrinfo(servinfo);
+
+	/* Receive packets on a separate thread. */
+	if(dgr_receiver_started == 0)
+	{
+		if(pthread_create(&dgr_receiver_thread, NULL, dgr_receiver, NULL) != 0)
+		{
+			msg(MSG_FATAL, "DGR Slave: Failed to create receiver thread.");
+			exit(EXIT_FAILURE);
+		}
+		dgr_receiver_started = 1;
+	}
 #endif // __MINGW32__
 }
 
 
+/** Initializes a DGR process that reads frames from a capture file
+ * instead of receiving them from a master. */
+static void dgr_init_replay()
+{
+	const char *filename = kuhl_config_get("dgr.replay.file");
+	if(filename == NULL)
+	{
+		msg(MSG_FATAL, "DGR Replay: dgr.replay.file must be set when dgr.mode is 'replay'.");
+		exit(EXIT_FAILURE);
+	}
+	dgr_replay = fopen(filename, "rb");
+	char magic[DGR_CAPTURE_MAGIC_SIZE];
+	if(dgr_replay == NULL ||
+	   fread(magic, DGR_CAPTURE_MAGIC_SIZE, 1, dgr_replay) != 1 ||
+	   memcmp(magic, DGR_CAPTURE_MAGIC, DGR_CAPTURE_MAGIC_SIZE) != 0)
+	{
+		msg(MSG_FATAL, "DGR Replay: '%s' is not a DGR capture file.", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	dgr_replay_rate = kuhl_config_float("dgr.replay.rate", 1, 1);
+	dgr_replay_start = 0;
+	dgr_replay_clock = 0;
+	dgr_frame = 0;
+	dgr_keyframe = 0;
+	dgr_have_keyframe = 0;
+	dgr_replay_next.used = 0;
+	if(dgr_replay_rate > 0)
+		msg(MSG_INFO, "DGR Replay: Replaying '%s' at %gx speed.\n", filename, dgr_replay_rate);
+	else
+		msg(MSG_INFO, "DGR Replay: Replaying '%s', one frame per dgr_update().\n", filename);
+}
+
 /** Indicates if this process is either a master process or a slave
     process as specified by the DGR environment variables.
 
@@ -205,19 +762,164 @@ int dgr_is_enabled(void)
 	return 1;
 }
 
+/** Computes a hash of a record name (32-bit FNV-1a). */
+static unsigned int dgr_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) name; *c != '\0'; c++)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** Computes a 64-bit hash of a block of memory. It reads 8 bytes at a
+ * time so that hashing a bound variable (see dgr_gather()) costs about
+ * as much as the memcmp() that dgr_set_index() uses. */
+static uint64_t dgr_content_hash(const void *data, int size)
+{
+	const unsigned char *p = (const unsigned char*) data;
+	uint64_t hash = 0x9E3779B97F4A7C15ull ^ (uint64_t) size;
+	int i = 0;
+	for(; i+8 <= size; i+=8)
+	{
+		uint64_t word;
+		memcpy(&word, p+i, 8);
+		hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 32;
+	}
+	for(; i<size; i++)
+	{
+		hash = (hash ^ p[i]) * 0x100000001B3ull;
+		hash ^= hash >> 32;
+	}
+	return hash;
+}
+
+/** Given a name, find the slot in the hash table where the name is
+ * stored, or the empty slot where it should be inserted.
+ *
+ * @param name The name of the record.
+ * @param hash The hash of the name, as computed by dgr_hash().
+ * @return An index into dgr_hashtable.
+ */
+static int dgr_findSlot(const char *name, unsigned int hash)
+{
+	int slot = hash & (DGR_HASH_SIZE-1);
+	while(dgr_hashtable[slot] != 0)
+	{
+		dgr_record *rec = &(dgr_list[dgr_hashtable[slot]-1]);
+		if(rec->hash == hash && strcmp(name, rec->name) == 0)
+			return slot;
+		slot = (slot+1) & (DGR_HASH_SIZE-1);
+	}
+	return slot;
+}
+
 /** Given a name, find the index of the name in our list. Returns -1 if
  * name is not found. */
 static int dgr_findIndex(const char *name)
 {
-	for(int i=0; i<dgr_list_size; i++)
+	int slot = dgr_findSlot(name, dgr_hash(name));
+	return dgr_hashtable[slot]-1;
+}
+
+/** Finds the channel that a record belongs to based on the prefixes
+ * passed to dgr_channel_add(). The most recently added matching
+ * prefix wins.
+ *
+ * @param name The name of the record.
+ * @return The channel, 0 if no prefix matches.
+ */
+static int dgr_channel_match(const char *name)
+{
+	for(int i=dgr_channel_prefixes_size-1; i>=0; i--)
+	{
+		const dgr_channel_prefix *p = &(dgr_channel_prefixes[i]);
+		if(strncmp(name, p->prefix, strlen(p->prefix)) == 0)
+			return p->channel;
+	}
+	return 0;
+}
+
+/** Given a name, find the index of the name in our list. If the name
+ * isn't in the list, an empty record (with a size of 0) is added to
+ * the list.
+ *
+ * @param name The name of the record.
+ * @return The index of the record in dgr_list.
+ */
+static int dgr_findOrAddIndex(const char *name)
+{
+	unsigned int hash = dgr_hash(name);
+	int slot = dgr_findSlot(name, hash);
+	if(dgr_hashtable[slot] != 0)
+		return dgr_hashtable[slot]-1;
+
+	// printf("DGR: The name '%s' is new to dgr, storing it at location %d\n", name, dgr_list_size);
+	if(dgr_list_size >= DGR_MAX_LIST_SIZE)
 	{
-		if(strcmp(name, dgr_list[i].name) == 0)
-			return i;
+		msg(MSG_FATAL, "DGR: You have exceeded the maximum list size for DGR.");
+		exit(EXIT_FAILURE);
 	}
-	return -1;
+
+	dgr_record *record = &(dgr_list[dgr_list_size]);
+	record->name = strdup(name);
+	record->namelen = strlen(name);
+	record->hash = hash;
+	record->size = 0;
+	record->capacity = 0;
+	record->buffer = NULL;
+	record->count = 0;
+	record->bytes = 0;
+	record->lastCount = 0;
+	record->lastBytes = 0;
+	record->bound = NULL;
+	record->channel = dgr_channel_match(name);
+	dgr_hashtable[slot] = dgr_list_size+1;
+	dgr_list_size++;
+	return dgr_list_size-1;
 }
 
 
+/** Stores data in a record. These records will be sent to slaves
+ * when dgr_update() is called.
+ *
+ * @param index The index of the record in dgr_list.
+ * @param buffer A pointer to the variable.
+ * @param size The number of bytes used by the variable.
+ */
+static void dgr_set_index(int index, const void *buffer, int size)
+{
+	dgr_record *record = &(dgr_list[index]);
+
+	/* The bound memory holds the data. dgr_gather() notices if it
+	 * changed. */
+	if(record->bound != NULL)
+	{
+		if(size == record->size && record->bound != buffer)
+			memcpy(record->bound, buffer, size);
+		return;
+	}
+
+	/* If nothing changed, there is nothing to do. Otherwise, remember
+	 * that this record needs to be included in the next frame. */
+	if(record->size == size && memcmp(record->buffer, buffer, size) == 0)
+		return;
+	record->changed = dgr_frame;
+
+	if(record->capacity < size)
+	{
+		// printf("DGR: The name %s used to have size %d but now has size %d.", record->name, record->size, size);
+		free(record->buffer);
+		record->buffer = malloc(size);
+		record->capacity = size;
+	}
+	record->size = size;
+	memcpy(record->buffer, buffer, size);
+}
+
 /** Adds a variable to DGRs list of variables. These variables will be
  * sent to slaves when dgr_update() is called.
  *
@@ -231,39 +933,7 @@ static void dgr_set(const char *name, const void *buffer, int size)
 		return;
 	
 	// printf("dgr_set(%s, %p, %d)\n", name, buffer, size);
-	int index = dgr_findIndex(name);
-	if(index == -1)
-	{
-		// printf("DGR Master: The name '%s' is new to dgr, storing it at location %d\n", name, dgr_list_size);
-
-		if(dgr_list_size > DGR_MAX_LIST_SIZE)
-		{
-			msg(MSG_FATAL, "DGR Master: You have exceeded the maximum list size for DGR.");
-			exit(EXIT_FAILURE);
-		}
-
-		dgr_record *record = &(dgr_list[dgr_list_size]);
-		sprintf(record->name, "%s",  name);
-		record->size = size;
-		record->buffer = malloc(size);
-		memcpy(record->buffer, buffer, size);
-
-		dgr_list_size++;
-	}
-	else
-	{
-		dgr_record *record = &(dgr_list[index]);
-		// printf("DGR Master: The name '%s' is already known to dgr (at index %d)\n", name, index);
-
-		if(record->size != size)
-		{
-//			printf("DGR Master: The name %s used to have size %d but now has size %d.", name, record->size, size);
-			free(record->buffer);
-			record->buffer = malloc(size);
-			record->size = size;
-		}
-		memcpy(record->buffer, buffer, size);
-	}
+	dgr_set_index(dgr_findOrAddIndex(name), buffer, size);
 }
 
 
@@ -276,10 +946,13 @@ static void dgr_exit(void)
 	if(dgr_is_enabled() && dgr_is_master())
 	{
 		msg(MSG_DEBUG, "dgr_exit() is informing slaves that the master is exiting.\n");
-		dgr_free(); // clear the list of records to send.
-		int died = 1;
-		dgr_set("!!!dgr_died!!!", &died, sizeof(int));
+		dgr_exiting = 1;
 		dgr_update(1,1);
+		if(dgr_capture != NULL)
+		{
+			fclose(dgr_capture);
+			dgr_capture = NULL;
+		}
 
 		// Don't let this get called repeatedly.
 		dgr_mode = 1;
@@ -302,7 +975,27 @@ void dgr_init(void)
 	// if there already is a list, free it.
 	if(dgr_list_size > 0)
 		dgr_free();
-	
+
+	memset(&dgr_counters_current, 0, sizeof(dgr_counters_current));
+	memset(&dgr_stats_last, 0, sizeof(dgr_stats_last));
+	dgr_stats_start = kuhl_microseconds();
+	dgr_stats_interval = kuhl_config_int("dgr.stats.interval", 0, 0);
+
+	dgr_clock_epoch = kuhl_microseconds();
+	dgr_clock_synced = 0;
+	dgr_clock_count = 0;
+	dgr_clock_next = 0;
+	dgr_clock_lastping = 0;
+	dgr_clock_frame = 0;
+	dgr_clock_interval = kuhl_config_int("dgr.time.interval", 1000, 1000);
+	dgr_time_last = 0;
+
+	memset(dgr_channels, 0, sizeof(dgr_channels));
+	strcpy(dgr_channels[0].name, "default");
+	dgr_channels_size = 1;
+	dgr_channel_prefixes_size = 0;
+	memset(dgr_channel_used, 0, sizeof(dgr_channel_used));
+
 	if(mode != NULL)
 	{
 		if(strcmp(mode, "master") == 0)
@@ -317,10 +1010,20 @@ void dgr_init(void)
 			dgr_disabled = 0;
 			dgr_init_slave();
 			dgr_update(0,1); // get anything that is already sent to us.
+#if !defined __MINGW32__ && !defined _WIN32
+			dgr_clock_sync(); // the master is running now
+#endif
+		}
+		else if(strcmp(mode, "replay") == 0)
+		{
+			dgr_mode = 0; // behave like a slave
+			dgr_disabled = 0;
+			dgr_init_replay();
+			dgr_update(0,1); // use the first frame.
 		}
 		else if(strlen(mode) > 0)
 		{
-			msg(MSG_ERROR, "dgr.mode must be 'slave' or 'master' but you set it to '%s'", mode);
+			msg(MSG_ERROR, "dgr.mode must be 'slave', 'master' or 'replay' but you set it to '%s'", mode);
 		}
 	}
 	
@@ -338,11 +1041,11 @@ void dgr_init(void)
 
 
 
-/** Given a label, a buffer to store data, and the size of that buffer,
+/** Given a record index, a buffer to store data, and the size of that buffer,
  * get data from DGR, store it in buffer and return the actual size of
  * the data we copied into the buffer.
  *
- * @param name The label or name to apply to the piece of data to be retrieved from DGR.
+ * @param index The index of the record in dgr_list.
  *
  * @param buffer A buffer for the retrieved data should be stored in.
  *
@@ -351,30 +1054,65 @@ void dgr_init(void)
  *
  * @return Returns the size of the data if success, and a negative
  * number upon error. Returns -1 if DGR didn't know about the
- * name. Returns -2 the buffer you provided was too small. Returns -3
+ * record (or has never received data for it). Returns -2 the buffer you provided was too small. Returns -3
  * if DGR is not enabled.
  */
-static int dgr_get(const char *name, void* buffer, int bufferSize)
+static int dgr_get_index(int index, void* buffer, int bufferSize)
 {
 	if(dgr_disabled)
 		return -3;
-	
-	int index = dgr_findIndex(name);
-	if(index == -1)
+
+	if(index < 0 || index >= dgr_list_size)
 		return -1;
 
 	/* If we found the record... */
 	dgr_record *rec = &(dgr_list[index]);
+	/* A record that has been registered but never received. */
+	if(rec->size == 0)
+		return -1;
+
 	/* Copy the data if there is enough room */
 	if(bufferSize >= rec->size)
 	{
-		memcpy(buffer, rec->buffer, rec->size);
+		const void *data = rec->bound != NULL ? rec->bound : rec->buffer;
+		if(data != buffer)
+			memcpy(buffer, data, rec->size);
 		return rec->size;
 	}
 	else /* 'buffer' wasn't large enough to store data. */
 		return -2;
 }
 
+/** Same as dgr_get_index() except that the record is looked up by
+ * name.
+ *
+ * @see dgr_get_index()
+ */
+static int dgr_get(const char *name, void* buffer, int bufferSize)
+{
+	if(dgr_disabled)
+		return -3;
+	
+	return dgr_get_index(dgr_findIndex(name), buffer, bufferSize);
+}
+
+
+/** Prints an error message if dgr_get() or dgr_get_index() failed.
+ *
+ * @param name The name of the record we tried to get.
+ * @param ret The value returned by dgr_get() or dgr_get_index().
+ * @param bufferSize The size of the buffer that was provided.
+ */
+static void dgr_get_check(const char *name, int ret, int bufferSize)
+{
+	if(ret == -1)
+		msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it\n", name);
+	else if(ret == -2)
+		msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
+	else if(ret != bufferSize)
+		msg(MSG_WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
+}
+
 
 /** Set a variable if we are a DGR master (so that we can send it to
  * slaves) and get a variable if we are a DGR slave. The variable is
@@ -403,89 +1141,409 @@ void dgr_setget(const char *name, void* buffer, int bufferSize)
 	if(dgr_mode)
 		dgr_set(name, buffer, bufferSize);
 	else
-	{
-		int ret = dgr_get(name, buffer, bufferSize);
-		if(ret == -1)
-			msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but DGR didn't have it\n", name);
-		else if(ret == -2)
-			msg(MSG_ERROR, "DGR Slave: Tried to get '%s' from DGR, but you didn't provide a large enough buffer.\n", name);
-
-		else if(ret != bufferSize)
-			msg(MSG_WARNING, "DGR Slave: Successfully retrieved '%s' from DGR but you provided a buffer that didn't match the size of the data you are retrieving. Your buffer is %d bytes but the '%s' record is %d bytes.\n", name, bufferSize, name, ret);
-	}
+		dgr_get_check(name, dgr_get(name, buffer, bufferSize), bufferSize);
 }
 
 
-/** Takes the list of DGR records and puts them into a compact byte
- * stream. The format is:
- *   
- * label character string<br>
- * Null terminator at end of string<br>
- * An integer indicating the size of the data that follows.<br>
- * A buffer of the data.<br>
+/** Registers a variable with DGR and returns a handle that can be
+ * used with dgr_setget_handle(). Looking up a variable by its handle
+ * avoids the name lookup that dgr_setget() performs every time it is
+ * called. A handle is valid until dgr_init() is called again. It is
+ * safe to register the same name multiple times (the same handle is
+ * returned) and to mix dgr_setget() and dgr_setget_handle() calls for
+ * the same variable.
  *
- * @param size The size of the data being serialized.
- * @return A serialized array of bytes (to be free()'d by the caller)
-*/
-char* dgr_serialize(int *size)
+ * @param name A string representing the name of the variable. Both
+ * the DGR master and DGR slaves must use the same string for the same
+ * variable.
+ *
+ * @param size The expected size of the variable in bytes. DGR uses
+ * this to allocate space for the variable ahead of time.
+ *
+ * @return A handle for the variable or -1 if DGR is disabled.
+ */
+dgr_handle dgr_register(const char *name, int size)
 {
-	int spaceNeeded = 0;
-	for(int i=0; i<dgr_list_size; i++)
-		spaceNeeded += strlen(dgr_list[i].name)+1+sizeof(int)+dgr_list[i].size;
-	*size = spaceNeeded;
+	if(dgr_disabled)
+		return -1;
 
-	if(spaceNeeded == 0)
-		return NULL;
-	
-	char *serialized = malloc(spaceNeeded);
-	char *ptr = serialized;
-	for(int i=0; i<dgr_list_size; i++)
+	int index = dgr_findOrAddIndex(name);
+	dgr_record *record = &(dgr_list[index]);
+	if(record->capacity < size)
 	{
-		int bytesPrinted = sprintf(ptr, "%s", dgr_list[i].name);
-		ptr += bytesPrinted+1; // extra byte for null terminated string.
-		memcpy(ptr, &(dgr_list[i].size), sizeof(int));
-		ptr += sizeof(int);
-		memcpy(ptr, dgr_list[i].buffer, dgr_list[i].size);
-		ptr += dgr_list[i].size;
+		void *buffer = realloc(record->buffer, size);
+		if(buffer == NULL)
+		{
+			msg(MSG_FATAL, "DGR: Failed to allocate %d bytes for '%s'.", size, name);
+			exit(EXIT_FAILURE);
+		}
+		record->buffer = buffer;
+		record->capacity = size;
 	}
-
-	return serialized;
+	return index;
 }
 
-
-/** Unserializes serialized data and stores it in our global dgr_list
- * variable. We do not blow away the list, instead we just update the
- * data that is already in the list.
+/** Same as dgr_setget() except the variable is identified with a
+ * handle returned by dgr_register() instead of by name.
  *
- * @param size Length of the serialized data.
- * @param serialized The serialized data as an array of bytes.
- **/
-static void dgr_unserialize(int size, const char *serialized)
+ * @param handle A handle returned by dgr_register().
+ * @param buffer A pointer to the data (an int, float, array, struct, etc.)
+ * @param bufferSize The size of the data in the buffer in bytes.
+ */
+void dgr_setget_handle(dgr_handle handle, void* buffer, int bufferSize)
 {
-	const char *ptr = serialized;
+	if(dgr_disabled || handle < 0)
+		return;
 
-	while(ptr < serialized + size)
+	if(handle >= dgr_list_size)
 	{
-		int c = 0;
-		char name[1024];
-		while(*ptr != 0)
-		{
-			name[c++] = *ptr;
-			ptr++;
-		}
-		name[c++] = '\0';
-		ptr++;
-		//msg(MSG_DEBUG, "DGR unserialized: %s\n", name);
-
-		int size = 0;
-		memcpy(&size, ptr, sizeof(int));
-		ptr += sizeof(int);
-
-		dgr_set(name, ptr, size);
-		ptr += size;
+		msg(MSG_ERROR, "DGR: Invalid handle %d. Was dgr_init() called after dgr_register()?\n", handle);
+		return;
 	}
-}
-
+
+	if(dgr_mode)
+		dgr_set_index(handle, buffer, bufferSize);
+	else
+		dgr_get_check(dgr_list[handle].name, dgr_get_index(handle, buffer, bufferSize), bufferSize);
+}
+
+/** Binds a variable in your program to a DGR record so that you
+ * don't need to call dgr_setget() for it. Each time dgr_update()
+ * sends a frame, the DGR master reads the variable directly from your
+ * memory; each time a DGR slave uses a frame, the new value is written
+ * directly into your variable. Neither one keeps a separate copy of
+ * the data.
+ *
+ * The memory must remain valid until the variable is unbound (by
+ * calling dgr_bind() again with a NULL pointer) or dgr_init() is
+ * called again. Do not change the variable on a slave---it will be
+ * overwritten when the master changes it. dgr_setget() and
+ * dgr_setget_handle() still work for bound variables but they
+ * simply copy to (master) or from (slave) the bound memory.
+ *
+ * @param name A string representing the name of the variable. Both
+ * the DGR master and DGR slaves must use the same string for the same
+ * variable.
+ *
+ * @param ptr A pointer to the variable, or NULL to unbind it. After
+ * a variable is unbound, DGR stores its value again.
+ *
+ * @param size The size of the variable in bytes. The master and the
+ * slaves must use the same size.
+ *
+ * @return A handle for the variable or -1 if DGR is disabled.
+ */
+dgr_handle dgr_bind(const char *name, void *ptr, int size)
+{
+	if(dgr_disabled)
+		return -1;
+
+	int index = dgr_findOrAddIndex(name);
+	dgr_record *record = &(dgr_list[index]);
+
+	if(ptr == NULL)
+	{
+		/* Keep the most recent value so that the variable doesn't
+		 * disappear from the frames the master sends. */
+		void *bound = record->bound;
+		int boundSize = record->size;
+		record->bound = NULL;
+		if(bound != NULL)
+		{
+			record->size = 0;
+			dgr_set_index(index, bound, boundSize);
+		}
+		return index;
+	}
+
+	if(size <= 0)
+	{
+		msg(MSG_ERROR, "DGR: Can't bind '%s' with a size of %d bytes.\n", name, size);
+		return index;
+	}
+
+	/* The bound memory holds the data from now on. A slave that
+	 * already received the variable starts with that value. On the
+	 * master, the variable becomes whatever is in the bound memory. */
+	if(dgr_mode == 0 && record->size == size)
+		memcpy(ptr, record->buffer, size);
+	record->bound = ptr;
+	record->size = size;
+	record->boundHash = dgr_content_hash(ptr, size);
+	record->changed = dgr_frame;
+	return index;
+}
+
+/** Checks the variables that are bound with dgr_bind() for changes.
+ * Called by the master before it serializes a frame. Instead of
+ * keeping a copy of each bound variable, we keep a hash of it. If a
+ * hash collision hides a change, the slaves still receive the new
+ * value with the next keyframe. */
+static void dgr_gather(void)
+{
+	for(int i=0; i<dgr_list_size; i++)
+	{
+		dgr_record *rec = &(dgr_list[i]);
+		if(rec->bound == NULL)
+			continue;
+		uint64_t hash = dgr_content_hash(rec->bound, rec->size);
+		if(hash != rec->boundHash)
+		{
+			rec->boundHash = hash;
+			rec->changed = dgr_frame;
+		}
+	}
+}
+
+/** Creates a channel that records can be sent on (see
+ * dgr_channel_add()). By default, every record is on channel 0 which
+ * is sent every time dgr_update() sends a frame and contains only the
+ * records that changed since the last keyframe.
+ *
+ * Records that change every frame and need to arrive with as little
+ * latency as possible (such as poses) should be put on a channel that
+ * isn't reliable. That channel is sent before the other channels and
+ * slaves always use the newest frame they receive on it.
+ *
+ * Records that rarely change (such as settings) can be put on a
+ * reliable channel with a low rate. When nothing on it changes, the
+ * master only sends a small heartbeat. Slaves that missed the newest
+ * frame on the channel ask the master to send it again (this requires
+ * the dgr.backchannel setting). Every channel is also sent again
+ * every dgr.keyframe.interval times it is considered for sending so
+ * that slaves that started late receive it.
+ *
+ * Only the master needs to set up channels, but it is harmless to
+ * call this function on slaves.
+ *
+ * @param name The name of the channel. If a channel with this name
+ * already exists, its settings are changed. The default channel is
+ * named "default" and its settings can't be changed.
+ *
+ * @param rate The maximum number of times per second that the channel
+ * is sent, or 0 to send it every time dgr_update() sends a frame. The
+ * rate can be overridden with the dgr.channel.NAME.rate setting.
+ *
+ * @param flags 0 or DGR_CHANNEL_RELIABLE.
+ *
+ * @return The channel number or -1 if DGR is disabled or there are
+ * too many channels.
+ */
+int dgr_channel(const char *name, float rate, int flags)
+{
+	if(dgr_disabled)
+		return -1;
+	if(strcmp(name, "default") == 0)
+		return 0;
+
+	int channel = 1;
+	while(channel < dgr_channels_size && strcmp(dgr_channels[channel].name, name) != 0)
+		channel++;
+	if(channel == dgr_channels_size)
+	{
+		if(channel == DGR_MAX_CHANNELS || strlen(name) >= sizeof(dgr_channels[0].name))
+		{
+			msg(MSG_ERROR, "DGR: Can't create channel '%s'. Channel names must be shorter than %d characters and there can be at most %d channels.\n",
+			    name, (int) sizeof(dgr_channels[0].name), DGR_MAX_CHANNELS);
+			return -1;
+		}
+		memset(&(dgr_channels[channel]), 0, sizeof(dgr_channel_info));
+		strcpy(dgr_channels[channel].name, name);
+		dgr_channels_size++;
+	}
+
+	char key[128];
+	snprintf(key, sizeof(key), "dgr.channel.%s.rate", name);
+	dgr_channels[channel].rate = kuhl_config_float(key, rate, rate);
+	dgr_channels[channel].flags = flags;
+	return channel;
+}
+
+/** Puts records on a channel created with dgr_channel(). Every record
+ * whose name starts with the prefix is sent on the channel, including
+ * records that are created later. If several prefixes match a record,
+ * the one that was added most recently is used. Only the master needs
+ * to call this function.
+ *
+ * @param channel A channel returned by dgr_channel() or 0 to move the
+ * records back to the default channel.
+ *
+ * @param prefix The beginning of the names of the records (or the
+ * full name of a single record).
+ */
+void dgr_channel_add(int channel, const char *prefix)
+{
+	if(dgr_disabled || channel < 0)
+		return;
+	if(channel >= dgr_channels_size)
+	{
+		msg(MSG_ERROR, "DGR: Can't put '%s' on channel %d because the channel doesn't exist.\n", prefix, channel);
+		return;
+	}
+
+	int i = 0;
+	while(i < dgr_channel_prefixes_size && strcmp(dgr_channel_prefixes[i].prefix, prefix) != 0)
+		i++;
+	if(i < dgr_channel_prefixes_size)
+	{
+		/* Move the prefix to the end so that it takes precedence. */
+		memmove(&(dgr_channel_prefixes[i]), &(dgr_channel_prefixes[i+1]),
+		        sizeof(dgr_channel_prefix)*(dgr_channel_prefixes_size-i-1));
+		dgr_channel_prefixes_size--;
+	}
+	if(dgr_channel_prefixes_size == DGR_MAX_CHANNEL_PREFIXES || strlen(prefix) >= sizeof(dgr_channel_prefixes[0].prefix))
+	{
+		msg(MSG_ERROR, "DGR: Can't put '%s' on channel %d. Prefixes must be shorter than %d characters and there can be at most %d of them.\n",
+		    prefix, channel, (int) sizeof(dgr_channel_prefixes[0].prefix), DGR_MAX_CHANNEL_PREFIXES);
+		return;
+	}
+	dgr_channel_prefix *p = &(dgr_channel_prefixes[dgr_channel_prefixes_size++]);
+	strcpy(p->prefix, prefix);
+	p->channel = channel;
+
+	/* Move existing records. They are sent on their new channel with
+	 * the next frame. */
+	for(int r=0; r<dgr_list_size; r++)
+	{
+		int c = dgr_channel_match(dgr_list[r].name);
+		if(c != dgr_list[r].channel)
+		{
+			dgr_list[r].channel = c;
+			dgr_list[r].changed = dgr_frame;
+		}
+	}
+}
+
+
+/** Takes the list of DGR records and puts them into a compact byte
+ * stream. The format is:
+ *   
+ * label character string<br>
+ * Null terminator at end of string<br>
+ * An integer indicating the size of the data that follows.<br>
+ * A buffer of the data.<br>
+ *
+ * @param size The size of the data being serialized.
+ *
+ * @param keyframe If 1, all records are serialized. If 0, only records
+ * which have changed since the most recent keyframe are serialized.
+ *
+ * @param channel Only records on this channel are serialized.
+ *
+ * @return A serialized array of bytes. The array belongs to DGR and is
+ * reused the next time dgr_serialize() is called.
+*/
+static const char* dgr_serialize(int *size, int keyframe, int channel)
+{
+	int spaceNeeded = 0;
+	for(int i=0; i<dgr_list_size; i++)
+	{
+		/* Skip records that were registered but never set and
+		 * records that haven't changed since the last keyframe. */
+		if(dgr_list[i].size == 0 || dgr_list[i].channel != channel ||
+		   (!keyframe && dgr_list[i].changed <= dgr_keyframe))
+			continue;
+		spaceNeeded += dgr_list[i].namelen+1+sizeof(int)+dgr_list[i].size;
+	}
+	*size = spaceNeeded;
+
+	if(spaceNeeded > dgr_wire_capacity)
+	{
+		/* Leave some room to grow so that a slowly growing frame
+		 * doesn't cause a realloc() every frame. */
+		int capacity = spaceNeeded + spaceNeeded/2;
+		char *wire = (char*) realloc(dgr_wire, capacity);
+		if(wire == NULL)
+		{
+			msg(MSG_FATAL, "DGR Master: Failed to allocate %d bytes for a frame.", capacity);
+			exit(EXIT_FAILURE);
+		}
+		dgr_wire = wire;
+		dgr_wire_capacity = capacity;
+	}
+
+	char *ptr = dgr_wire;
+	for(int i=0; i<dgr_list_size; i++)
+	{
+		dgr_record *rec = &(dgr_list[i]);
+		if(rec->size == 0 || rec->channel != channel ||
+		   (!keyframe && rec->changed <= dgr_keyframe))
+			continue;
+		memcpy(ptr, rec->name, rec->namelen+1); // include null terminator
+		ptr += rec->namelen+1;
+		memcpy(ptr, &(rec->size), sizeof(int));
+		ptr += sizeof(int);
+		memcpy(ptr, rec->bound != NULL ? rec->bound : rec->buffer, rec->size);
+		ptr += rec->size;
+		rec->count++;
+		rec->bytes += rec->namelen+1+sizeof(int)+rec->size;
+	}
+
+	return dgr_wire;
+}
+
+
+/** Unserializes serialized data and stores it in our global dgr_list
+ * variable. We do not blow away the list, instead we just update the
+ * data that is already in the list.
+ *
+ * @param size Length of the serialized data.
+ * @param serialized The serialized data as an array of bytes.
+ **/
+static void dgr_unserialize(int size, const char *serialized)
+{
+	const char *ptr = serialized;
+	const char *end = serialized + size;
+
+	while(ptr < end)
+	{
+		/* The name is null terminated inside of the serialized
+		 * data, so we can look it up without copying it. */
+		const char *name = ptr;
+		const char *nameEnd = memchr(ptr, '\0', end-ptr);
+		if(nameEnd == NULL)
+		{
+			msg(MSG_ERROR, "DGR Slave: Received a malformed packet (unterminated name).\n");
+			return;
+		}
+		ptr = nameEnd+1;
+		//msg(MSG_DEBUG, "DGR unserialized: %s\n", name);
+
+		int recordSize = 0;
+		if(end - ptr < (int) sizeof(int))
+		{
+			msg(MSG_ERROR, "DGR Slave: Received a malformed packet (truncated record '%s').\n", name);
+			return;
+		}
+		memcpy(&recordSize, ptr, sizeof(int));
+		ptr += sizeof(int);
+
+		if(recordSize < 0 || end - ptr < recordSize)
+		{
+			msg(MSG_ERROR, "DGR Slave: Received a malformed packet (bad size for record '%s').\n", name);
+			return;
+		}
+
+		int index = dgr_findOrAddIndex(name);
+		dgr_record *rec = &(dgr_list[index]);
+		if(rec->bound == NULL)
+			dgr_set_index(index, ptr, recordSize);
+		else if(recordSize == rec->size)
+			memcpy(rec->bound, ptr, recordSize); // straight into the application's variable
+		else
+		{
+			/* Only print one message per record. */
+			static int warned = -1;
+			if(warned != index)
+				msg(MSG_ERROR, "DGR Slave: Received %d bytes for '%s' but %d bytes are bound to it. Ignoring it.\n", recordSize, name, rec->size);
+			warned = index;
+		}
+		dgr_list[index].count++;
+		dgr_list[index].bytes += ptr+recordSize - name;
+		ptr += recordSize;
+	}
+}
+
 
 /** Prints a list of variables that DGR is aware of. */
 void dgr_print_list(void)
@@ -499,136 +1557,1836 @@ void dgr_print_list(void)
 	for(int i=0; i<dgr_list_size; i++)
 	{
 		dgr_record *r = &(dgr_list[i]);
-		msg(MSG_DEBUG, "%3d %5d %p %s\n", i, r->size, r->buffer, r->name);
+		msg(MSG_DEBUG, "%3d %5d %p %s%s\n", i, r->size, r->bound != NULL ? r->bound : r->buffer,
+		    r->name, r->bound != NULL ? " (bound)" : "");
 	}
 	if(dgr_list_size == 0)
 		msg(MSG_DEBUG, "[ the list is empty ]\n");
 }
 
-/** Serializes and sends DGR data out across a network. */
-static void dgr_send(void)
+/** Unserializes the records in a frame that a slave received and
+ * updates the statistics.
+ *
+ * @param frame The frame.
+ */
+static void dgr_apply_records(const dgr_frame_buffer *frame)
+{
+	long start = kuhl_microseconds();
+	dgr_unserialize(frame->header.size, frame->buffer);
+	long end = kuhl_microseconds();
+
+	dgr_counters *c = &dgr_counters_current;
+	c->serializeTime += end-start;
+	c->serializeCount++;
+	if(end-start > c->serializeMax)
+		c->serializeMax = end-start;
+	if(frame->completed != 0)
+	{
+		long latency = start - frame->completed;
+		c->latencyTime += latency;
+		c->latencyCount++;
+		if(latency > c->latencyMax)
+			c->latencyMax = latency;
+	}
+}
+
+/** Applies a frame that a slave received from the master. The frame
+ * is ignored if it is older than the frames we have already used or
+ * if it contains changes relative to a keyframe that we don't have.
+ *
+ * @param frame The frame (the header of one of its packets and the reassembled serialized records).
+ * @return 1 if the frame was used, 0 if it was ignored.
+ */
+static int dgr_apply_frame(const dgr_frame_buffer *frame)
+{
+	const dgr_packet_header *header = &(frame->header);
+
+	/* Packets may arrive out of order. Never go backwards. */
+	if(dgr_have_keyframe && (int32_t) (header->frame - dgr_frame) <= 0)
+		return 0;
+
+	if(header->flags & DGR_PACKET_KEYFRAME)
+	{
+		dgr_keyframe = header->frame;
+		dgr_have_keyframe = 1;
+	}
+	else if(dgr_have_keyframe == 0 || header->keyframe != dgr_keyframe)
+	{
+		/* Only print one message per missing keyframe. */
+		static uint32_t missingKeyframe = 0;
+		if(missingKeyframe != header->keyframe)
+			msg(MSG_DEBUG, "DGR Slave: Ignoring frame %u because we don't have keyframe %u. Waiting for the next keyframe.\n", header->frame, header->keyframe);
+		missingKeyframe = header->keyframe;
+		return 0;
+	}
+
+	dgr_frame = header->frame;
+	dgr_apply_records(frame);
+
+	dgr_counters *c = &dgr_counters_current;
+	c->frames++;
+	if(header->flags & DGR_PACKET_KEYFRAME)
+		c->keyframes++;
+	return 1;
+}
+
+/** Applies a frame that a slave received on a channel other than
+ * channel 0. Since these frames contain every record on the channel,
+ * the newest frame can always be used.
+ *
+ * @param frame The frame.
+ * @return 1 if the frame was used, 0 if it was older than the frame we already used.
+ */
+static int dgr_apply_channel(const dgr_frame_buffer *frame)
+{
+	uint32_t channel = frame->header.channel;
+	if(dgr_channel_used[channel] != 0 &&
+	   (int32_t) (frame->header.frame - dgr_channel_used[channel]) <= 0)
+		return 0;
+	dgr_channel_used[channel] = frame->header.frame;
+	dgr_apply_records(frame);
+	return 1;
+}
+
+/** Exchanges the contents of two dgr_frame_buffer structs. Swapping
+ * lets us move a frame without copying it.
+ */
+static void dgr_frame_swap(dgr_frame_buffer *a, dgr_frame_buffer *b)
+{
+	dgr_frame_buffer tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/** Decompresses a frame if it is compressed. The frame buffer is
+ * replaced with the uncompressed data.
+ *
+ * @param frame The frame to decompress.
+ * @return 1 if the frame can be used, 0 if it was malformed.
+ */
+static int dgr_frame_decompress(dgr_frame_buffer *frame)
+{
+	if((frame->header.flags & DGR_PACKET_COMPRESSED) == 0)
+		return 1;
+
+	uint32_t rawSize;
+	if(frame->header.size < sizeof(uint32_t))
+		return 0;
+	memcpy(&rawSize, frame->buffer, sizeof(uint32_t));
+	if(rawSize > DGR_MAX_FRAME_SIZE)
+		return 0;
+	if(dgr_compressed_capacity < (int) rawSize)
+	{
+		free(dgr_compressed);
+		dgr_compressed = malloc(rawSize);
+		dgr_compressed_capacity = rawSize;
+	}
+	long start = kuhl_microseconds();
+	int size = lzdecompress(frame->buffer + sizeof(uint32_t), frame->header.size - sizeof(uint32_t),
+	                        dgr_compressed, rawSize);
+	__atomic_fetch_add(&dgr_receiver_current.decompressTime, kuhl_microseconds()-start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dgr_receiver_current.decompressCount, 1, __ATOMIC_RELAXED);
+	if(size != (int) rawSize)
+	{
+		msg(MSG_ERROR, "DGR: Ignoring frame %u because it couldn't be decompressed.\n", frame->header.frame);
+		return 0;
+	}
+
+	/* Swap buffers so that the frame holds the uncompressed data. */
+	char *tmp = frame->buffer;
+	int tmpCapacity = frame->capacity;
+	frame->buffer = dgr_compressed;
+	frame->capacity = dgr_compressed_capacity;
+	dgr_compressed = tmp;
+	dgr_compressed_capacity = tmpCapacity;
+	frame->header.size = rawSize;
+	frame->header.flags &= ~DGR_PACKET_COMPRESSED;
+	return 1;
+}
+
+/** Receiver: Discards a frame that we never received all of the
+ * packets for.
+ *
+ * @param slot The reassembly slot holding the incomplete frame.
+ */
+static void dgr_frame_discard(dgr_frame_buffer *slot)
+{
+	msg(MSG_DEBUG, "DGR Slave: Discarding incomplete frame %u on channel %u (%d of %d fragments).\n",
+	    slot->header.frame, slot->header.channel, slot->received, slot->header.fragments);
+	slot->used = 0;
+	__atomic_fetch_add(&dgr_receiver_current.incomplete, 1, __ATOMIC_RELAXED);
+}
+
+/** Called when a frame has been completely reassembled. Moves the frame
+ * into dgr_complete or dgr_complete_key if it is newer than the frame
+ * already stored there. Incomplete frames older than this frame are
+ * discarded since we will never use them.
+ *
+ * @param slot The reassembly slot that holds the complete frame.
+ */
+static void dgr_frame_completed(dgr_frame_buffer *slot)
+{
+	if(dgr_frame_decompress(slot) == 0)
+	{
+		slot->used = 0;
+		return;
+	}
+	slot->completed = kuhl_microseconds();
+	dgr_packet_header header = slot->header; // slot changes below
+	uint32_t frame = header.frame;
+	for(int i=0; i<DGR_REASSEMBLY_SLOTS; i++)
+	{
+		if(dgr_reassembly[i].used && (int32_t) (dgr_reassembly[i].header.frame - frame) < 0)
+			dgr_frame_discard(&(dgr_reassembly[i]));
+	}
+
+	/* A newer frame replaces a frame that we haven't published yet. */
+	if(dgr_complete.used && (int32_t) (dgr_complete.header.frame - frame) < 0)
+		__atomic_fetch_add(&dgr_receiver_current.superseded, 1, __ATOMIC_RELAXED);
+
+	if(header.flags & DGR_PACKET_KEYFRAME)
+	{
+		/* A keyframe makes any older frame that we haven't used yet
+		 * unnecessary. */
+		if(dgr_complete.used && (int32_t) (dgr_complete.header.frame - frame) < 0)
+			dgr_complete.used = 0;
+		if(dgr_complete_key.used == 0 || (int32_t) (dgr_complete_key.header.frame - frame) < 0)
+			dgr_frame_swap(&dgr_complete_key, slot);
+	}
+	else if(dgr_complete.used == 0 || (int32_t) (dgr_complete.header.frame - frame) < 0)
+		dgr_frame_swap(&dgr_complete, slot);
+	slot->used = 0;
+
+	/* Once we have a frame that can be used (a keyframe, or changes
+	 * relative to the keyframe we have), we can ignore packets for
+	 * older frames. */
+	int usable = (header.flags & DGR_PACKET_KEYFRAME) ||
+		(dgr_complete_key.used && header.keyframe == dgr_complete_key.header.frame);
+	if(usable && (dgr_received_any == 0 || (int32_t) (frame - dgr_received_frame) > 0))
+	{
+		dgr_received_frame = frame;
+		dgr_received_any = 1;
+	}
+}
+
+/** Receiver: Prepares an empty reassembly slot for a new frame.
+ *
+ * @param slot The reassembly slot.
+ * @param header The header of the first packet we received for the frame.
+ */
+static void dgr_frame_start(dgr_frame_buffer *slot, const dgr_packet_header *header)
+{
+	slot->used = 1;
+	slot->header = *header;
+	slot->received = 0;
+	if(slot->haveCapacity < header->fragments)
+	{
+		free(slot->have);
+		slot->have = malloc(header->fragments);
+		slot->haveCapacity = header->fragments;
+	}
+	memset(slot->have, 0, header->fragments);
+	if(slot->capacity < (int) header->size)
+	{
+		free(slot->buffer);
+		slot->buffer = malloc(header->size);
+		slot->capacity = header->size;
+	}
+}
+
+/** Receiver: Copies a fragment into the frame that it belongs to.
+ *
+ * @param slot The reassembly slot holding the frame.
+ * @param header The header of the packet.
+ * @param fragment The data in the packet after the header.
+ * @param fragmentSize The number of bytes in fragment.
+ * @return 1 if the frame is now complete, 0 otherwise.
+ */
+static int dgr_frame_add(dgr_frame_buffer *slot, const dgr_packet_header *header, const char *fragment, int fragmentSize)
+{
+	if(slot->header.size != header->size || slot->header.fragments != header->fragments)
+	{
+		msg(MSG_ERROR, "DGR Slave: Ignoring a packet that is inconsistent with other packets in frame %u.\n", header->frame);
+		return 0;
+	}
+
+	if(slot->have[header->fragment]) // duplicate packet
+		return 0;
+	slot->have[header->fragment] = 1;
+	slot->received++;
+	if(fragmentSize > 0)
+		memcpy(slot->buffer + header->offset, fragment, fragmentSize);
+	return slot->received == slot->header.fragments;
+}
+
+/** Receiver: Asks the master to send the newest frame on a reliable
+ * channel again.
+ *
+ * @param channel The channel.
+ * @param have The newest frame we have on the channel, 0 if none.
+ */
+static void dgr_channel_nack(uint32_t channel, uint32_t have)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	if(dgr_backchannel == -1)
+		return;
+	dgr_control_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = DGR_CONTROL_MAGIC;
+	header.type = DGR_CONTROL_NACK;
+	header.frame = have;
+	strcpy(header.name, dgr_slave_name);
+	dgr_control_nack nack;
+	nack.channel = channel;
+
+	char packet[sizeof(header)+sizeof(nack)];
+	memcpy(packet, &header, sizeof(header));
+	memcpy(packet+sizeof(header), &nack, sizeof(nack));
+	if(send(dgr_backchannel, packet, sizeof(packet), 0) == -1)
+		msg(MSG_DEBUG, "DGR Slave: Back channel: send: %s", strerror(errno));
+#endif
+}
+
+/** Receiver: Adds a packet for a channel other than channel 0 to the
+ * frame that it belongs to. Only the newest frame on each channel is
+ * reassembled; a packet for a newer frame replaces an incomplete one.
+ *
+ * @param header The header of the packet.
+ * @param fragment The data in the packet after the header.
+ * @param fragmentSize The number of bytes in fragment.
+ */
+static void dgr_channel_reassemble(const dgr_packet_header *header, const char *fragment, int fragmentSize)
+{
+	uint32_t channel = header->channel;
+	dgr_frame_buffer *complete = &(dgr_channel_complete[channel]);
+	dgr_frame_buffer *slot = &(dgr_channel_reassembly[channel]);
+
+	/* Ignore frames that are not newer than one we already have. */
+	if(complete->used && (int32_t) (header->frame - complete->header.frame) <= 0)
+		return;
+
+	if(header->flags & DGR_PACKET_HEARTBEAT)
+	{
+		/* We missed the newest frame (or some of its packets). */
+		if(slot->used && slot->header.frame != header->frame)
+			dgr_frame_discard(slot);
+		dgr_channel_nack(channel, complete->used ? complete->header.frame : 0);
+		return;
+	}
+
+	if(slot->used && slot->header.frame != header->frame)
+	{
+		if((int32_t) (header->frame - slot->header.frame) < 0)
+			return; // older than the frame we are reassembling
+		dgr_frame_discard(slot);
+	}
+	if(slot->used == 0)
+		dgr_frame_start(slot, header);
+	if(dgr_frame_add(slot, header, fragment, fragmentSize) == 0)
+		return;
+
+	slot->used = 0;
+	if(dgr_frame_decompress(slot) == 0)
+		return;
+	slot->completed = kuhl_microseconds();
+	/* A newer frame replaces one that the rendering thread hasn't used. */
+	if(complete->used &&
+	   __atomic_load_n(&(dgr_applied_channel[channel]), __ATOMIC_ACQUIRE) != complete->header.frame)
+		__atomic_fetch_add(&dgr_receiver_current.superseded, 1, __ATOMIC_RELAXED);
+	dgr_frame_swap(complete, slot);
+	complete->used = 1;
+	slot->used = 0;
+}
+
+/** Adds a packet that a slave received to the frame that it belongs
+ * to.
+ *
+ * @param size The size of the packet.
+ * @param packet The packet (a dgr_packet_header followed by a fragment of a frame).
+ */
+static void dgr_reassemble(int size, const char *packet)
+{
+	dgr_packet_header header;
+	if(size < (int) sizeof(header))
+	{
+		msg(MSG_ERROR, "DGR Slave: Ignoring a packet that is too small (%d bytes).\n", size);
+		return;
+	}
+	memcpy(&header, packet, sizeof(header));
+	if(header.magic != DGR_PACKET_MAGIC)
+	{
+		msg(MSG_ERROR, "DGR Slave: Ignoring a packet that wasn't sent by a compatible DGR master.\n");
+		return;
+	}
+
+	/* If the packet we received indicates that dgr has died. The
+	 * rendering thread exits when it sees the flag. */
+	if(header.flags & DGR_PACKET_EXIT)
+	{
+		__atomic_store_n(&dgr_exit_received, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* The master is telling us that we may swap buffers. */
+	if(header.flags & DGR_PACKET_SWAP)
+	{
+		uint32_t swap = __atomic_load_n(&dgr_swap_frame, __ATOMIC_RELAXED);
+		if((int32_t) (header.frame - swap) > 0)
+			__atomic_store_n(&dgr_swap_frame, header.frame, __ATOMIC_RELEASE);
+		return;
+	}
+
+	int fragmentSize = size - (int) sizeof(header);
+	if(header.fragment >= header.fragments || header.size > DGR_MAX_FRAME_SIZE || header.channel >= DGR_MAX_CHANNELS ||
+	   header.offset > header.size || (uint32_t) fragmentSize > header.size - header.offset)
+	{
+		msg(MSG_ERROR, "DGR Slave: Ignoring a malformed packet (frame %u, fragment %u of %u).\n",
+		    header.frame, header.fragment, header.fragments);
+		return;
+	}
+
+	if(header.channel != 0)
+	{
+		dgr_channel_reassemble(&header, packet + sizeof(header), fragmentSize);
+		return;
+	}
+
+	/* Ignore packets for frames that are older than ones we have already received. */
+	if(dgr_received_any && (int32_t) (header.frame - dgr_received_frame) <= 0)
+		return;
+
+	/* Find the frame that this packet belongs to. If we aren't
+	 * reassembling it yet, use an empty slot or replace the oldest
+	 * incomplete frame. */
+	dgr_frame_buffer *slot = NULL;
+	dgr_frame_buffer *oldest = NULL;
+	for(int i=0; i<DGR_REASSEMBLY_SLOTS; i++)
+	{
+		dgr_frame_buffer *f = &(dgr_reassembly[i]);
+		if(f->used && f->header.frame == header.frame)
+		{
+			slot = f;
+			break;
+		}
+		if(oldest == NULL || f->used == 0 ||
+		   (oldest->used && (int32_t) (f->header.frame - oldest->header.frame) < 0))
+			oldest = f;
+	}
+	if(slot == NULL)
+	{
+		slot = oldest;
+		if(slot->used)
+			dgr_frame_discard(slot);
+		dgr_frame_start(slot, &header);
+	}
+
+	if(dgr_frame_add(slot, &header, packet + sizeof(header), fragmentSize))
+		dgr_frame_completed(slot);
+}
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Sends packets that have been placed in dgr_send_msgs. On Linux, all
+ * of the packets are passed to the OS with a single system call.
+ *
+ * @param count The number of packets in dgr_send_msgs.
+ */
+static void dgr_send_batch(int count)
+{
+	int sent = 0;
+	while(sent < count)
+	{
+#ifdef __linux__
+		int numsent = sendmmsg(dgr_socket, dgr_send_msgs+sent, count-sent, 0);
+#else
+		int numsent = sendmsg(dgr_socket, dgr_send_msgs+sent, 0) == -1 ? -1 : 1;
+#endif
+		if(numsent == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			msg(MSG_FATAL, "DGR Master: sendmsg: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+#ifdef __linux__
+		// double check that everything got sent
+		for(int i=sent; i<sent+numsent; i++)
+		{
+			const struct msghdr *mh = &DGR_SEND_MSGHDR(i);
+			unsigned int expected = 0;
+			for(unsigned int j=0; j<mh->msg_iovlen; j++)
+				expected += mh->msg_iov[j].iov_len;
+			if(dgr_send_msgs[i].msg_len != expected)
+			{
+				msg(MSG_FATAL, "DGR Master: Error sending all of the bytes in the message.");
+				exit(EXIT_FAILURE);
+			}
+		}
+#endif
+		sent += numsent;
+	}
+}
+#endif // __MINGW32__
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Master: Compresses a serialized frame (if it is large and
+ * compression is enabled), records it in the capture file, splits it
+ * into packets and sends them.
+ *
+ * @param header The header for the frame with magic, frame, keyframe,
+ * flags and channel filled in. The remaining fields are filled in by
+ * this function.
+ * @param buf The serialized frame.
+ * @param bufSize The number of bytes in buf.
+ */
+static void dgr_send_frame(dgr_packet_header *header, const char *buf, int bufSize)
+{
+	dgr_counters *c = &dgr_counters_current;
+	c->rawBytes += bufSize;
+
+	/* Compress large frames. Send the uncompressed frame if
+	 * compression doesn't make it smaller. */
+	if(dgr_compress && bufSize >= dgr_compress_threshold)
+	{
+		long start = kuhl_microseconds();
+		int needed = (int) sizeof(uint32_t) + lzcompress_bound(bufSize);
+		if(dgr_compressed_capacity < needed)
+		{
+			free(dgr_compressed);
+			dgr_compressed = malloc(needed);
+			dgr_compressed_capacity = needed;
+		}
+		uint32_t rawSize = bufSize;
+		memcpy(dgr_compressed, &rawSize, sizeof(uint32_t));
+		int csize = lzcompress(buf, bufSize, dgr_compressed + sizeof(uint32_t), bufSize - (int) sizeof(uint32_t));
+		c->compressTime += kuhl_microseconds()-start;
+		c->compressCount++;
+		if(csize > 0)
+		{
+			buf = dgr_compressed;
+			bufSize = csize + (int) sizeof(uint32_t);
+			header->flags |= DGR_PACKET_COMPRESSED;
+		}
+	}
+
+	/* Split the frame into fragments so that each packet (including
+	 * the IPv4 and UDP headers, 28 bytes) fits within the MTU. */
+	int maxFragment = dgr_mtu - 28 - (int) sizeof(dgr_packet_header);
+	int fragments = (bufSize + maxFragment - 1) / maxFragment;
+	if(fragments == 0) // send a header even if the frame is empty.
+		fragments = 1;
+	if(fragments > UINT16_MAX)
+	{
+		msg(MSG_FATAL, "DGR Master: A frame of %d bytes requires too many fragments.", bufSize);
+		exit(EXIT_FAILURE);
+	}
+	header->size = bufSize;
+	header->fragments = fragments;
+
+	c->packets += fragments;
+	c->bytes += bufSize + fragments*(long)sizeof(dgr_packet_header);
+
+	if(dgr_capture != NULL)
+	{
+		/* Store the whole frame so that it can be fragmented again
+		 * (possibly with a different MTU) when it is replayed. The
+		 * timestamp is the master's dgr_time() in microseconds, so a
+		 * replay can reproduce dgr_time(). */
+		int64_t now = kuhl_microseconds() - dgr_clock_epoch;
+		dgr_packet_header captureHeader = *header;
+		captureHeader.fragment = 0;
+		captureHeader.fragments = 1;
+		captureHeader.offset = 0;
+		if(fwrite(&now, sizeof(now), 1, dgr_capture) != 1 ||
+		   fwrite(&captureHeader, sizeof(captureHeader), 1, dgr_capture) != 1 ||
+		   (bufSize > 0 && fwrite(buf, bufSize, 1, dgr_capture) != 1))
+		{
+			msg(MSG_ERROR, "DGR Master: Failed to write to capture file. Stopping the capture.");
+			fclose(dgr_capture);
+			dgr_capture = NULL;
+		}
+	}
+
+	int batch = 0;
+	for(int i=0; i<fragments; i++)
+	{
+		dgr_packet_header *h = &(dgr_send_headers[batch]);
+		*h = *header;
+		h->fragment = i;
+		h->offset = i*maxFragment;
+		int fragmentSize = bufSize - (int) h->offset;
+		if(fragmentSize > maxFragment)
+			fragmentSize = maxFragment;
+
+		/* Send the header and the fragment without copying them into
+		 * a single buffer. */
+		dgr_send_iov[batch][0].iov_base = h;
+		dgr_send_iov[batch][0].iov_len = sizeof(dgr_packet_header);
+		dgr_send_iov[batch][1].iov_base = (char*) buf + h->offset;
+		dgr_send_iov[batch][1].iov_len = fragmentSize;
+
+		struct msghdr *mh = &DGR_SEND_MSGHDR(batch);
+		memset(mh, 0, sizeof(struct msghdr));
+		mh->msg_name = dgr_addrinfo->ai_addr;
+		mh->msg_namelen = dgr_addrinfo->ai_addrlen;
+		mh->msg_iov = dgr_send_iov[batch];
+		mh->msg_iovlen = fragmentSize > 0 ? 2 : 1;
+		batch++;
+
+		if(batch == DGR_SEND_BATCH || i == fragments-1)
+		{
+			dgr_send_batch(batch);
+			batch = 0;
+		}
+	}
+}
+
+/** Master: Sends a frame on a channel other than channel 0 if it is
+ * time to. A new frame is sent when a record on the channel changed.
+ * Otherwise, the newest frame is sent again if a slave asked for it
+ * (or periodically for slaves that started late) and reliable
+ * channels send a heartbeat.
+ *
+ * @param channel The channel.
+ * @param now The current time (kuhl_microseconds()).
+ */
+static void dgr_send_channel(int channel, long now)
+{
+	dgr_channel_info *ch = &(dgr_channels[channel]);
+	int due = ch->rate <= 0 || ch->lastTick == 0 || now - ch->lastTick >= (long) (1000000 / ch->rate);
+	if(due == 0 && ch->resend == 0)
+		return;
+
+	int records = 0, changed = 0;
+	for(int i=0; i<dgr_list_size; i++)
+	{
+		const dgr_record *rec = &(dgr_list[i]);
+		if(rec->channel != channel || rec->size == 0)
+			continue;
+		records++;
+		if((int32_t) (rec->changed - ch->sentFrame) > 0)
+			changed = 1;
+	}
+	if(due)
+	{
+		ch->lastTick = now;
+		ch->sinceSent++;
+	}
+	int resend = ch->resend;
+	ch->resend = 0;
+	if(records == 0)
+		return;
+
+	dgr_packet_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = DGR_PACKET_MAGIC;
+	header.channel = channel;
+	if(changed || resend || ch->sinceSent >= dgr_keyframe_interval)
+	{
+		/* Sending the same frame again is safe: it contains the same
+		 * data since nothing changed and slaves ignore frames they
+		 * already have. */
+		if(changed)
+			ch->frame++;
+		ch->sentFrame = dgr_frame;
+		ch->sinceSent = 0;
+		header.frame = ch->frame;
+		header.keyframe = ch->frame;
+		header.flags = DGR_PACKET_KEYFRAME;
+		int bufSize = 0;
+		const char *buf = dgr_serialize(&bufSize, 1, channel);
+		dgr_send_frame(&header, buf, bufSize);
+	}
+	else if(ch->flags & DGR_CHANNEL_RELIABLE)
+	{
+		header.frame = ch->frame;
+		header.keyframe = ch->frame;
+		header.flags = DGR_PACKET_HEARTBEAT;
+		header.fragments = 1;
+		if(sendto(dgr_socket, &header, sizeof(header), 0, dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen) == -1)
+			msg(MSG_ERROR, "DGR Master: sendto: %s", strerror(errno));
+		dgr_counters_current.packets++;
+		dgr_counters_current.bytes += sizeof(header);
+	}
+}
+#endif // __MINGW32__
+
+/** Serializes and sends DGR data out across a network. Channels that
+ * aren't reliable are sent first, then reliable channels and then the
+ * default channel (see dgr_channel()). */
+static void dgr_send(void)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	if(dgr_disabled)
+		return;
+
+	// no need to send anything if there are no records (unless the
+	// slaves are waiting for a frame because of frame lock).
+	if(dgr_list_size == 0 && dgr_exiting == 0 && dgr_framelock_active == 0)
+		return;
+
+	long start = kuhl_microseconds();
+	dgr_gather();
+	long gatherTime = kuhl_microseconds() - start;
+
+	for(int i=1; i<dgr_channels_size; i++)
+		if((dgr_channels[i].flags & DGR_CHANNEL_RELIABLE) == 0)
+			dgr_send_channel(i, start);
+	for(int i=1; i<dgr_channels_size; i++)
+		if(dgr_channels[i].flags & DGR_CHANNEL_RELIABLE)
+			dgr_send_channel(i, start);
+
+	/* Send a keyframe periodically. Other frames contain only the
+	 * records that changed since the last keyframe---or only a header
+	 * if nothing changed. */
+	int keyframe = 0;
+	if(dgr_keyframe == 0 || dgr_frame - dgr_keyframe >= (uint32_t) dgr_keyframe_interval)
+	{
+		keyframe = 1;
+		dgr_keyframe = dgr_frame;
+	}
+
+	int  bufSize = 0;
+	start = kuhl_microseconds();
+	const char *buf = dgr_serialize(&bufSize, keyframe, 0);
+	long end = kuhl_microseconds();
+	dgr_counters *c = &dgr_counters_current;
+	c->serializeTime += end-start + gatherTime;
+	c->serializeCount++;
+	if(end-start + gatherTime > c->serializeMax)
+		c->serializeMax = end-start + gatherTime;
+
+	dgr_packet_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = DGR_PACKET_MAGIC;
+	header.frame = dgr_frame;
+	header.keyframe = dgr_keyframe;
+	header.flags = 0;
+	if(keyframe)
+		header.flags |= DGR_PACKET_KEYFRAME;
+	if(dgr_exiting)
+		header.flags |= DGR_PACKET_EXIT;
+	header.channel = 0;
+
+	c->frames++;
+	if(keyframe)
+		c->keyframes++;
+	dgr_send_frame(&header, buf, bufSize);
+	dgr_frame++;
+#endif // __MINGW32__
+}
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Waits until a socket has data for us to read.
+ *
+ * @param sock The socket.
+ * @param timeout Maximum number of milliseconds to wait.
+ * @return 1 if there is data to read, 0 if we timed out.
+ */
+static int dgr_wait_readable(int sock, int timeout)
+{
+	struct pollfd fds;
+	fds.fd = sock;
+	fds.events = POLLIN;
+	int retval;
+	while((retval = poll(&fds, 1, timeout)) == -1 && errno == EINTR)
+		;
+	if(retval == -1)
+	{
+		msg(MSG_FATAL, "poll(): %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	return retval > 0;
+}
+
+/** Receiver: Reads packets until there are no more to read and adds
+ * them to the frames that are being reassembled.
+ */
+static void dgr_receive_packets(void)
+{
+	/* Reading every packet ensures that we are always using the
+	 * newest frame. For example, 5 frames might arrive while the
+	 * slave is rendering a scene. We want to make sure that we use
+	 * the newest one. */
+	while(1)
+	{
+		int numbytes = recvfrom(dgr_socket, dgr_packet, DGR_MAX_PACKET_SIZE, MSG_DONTWAIT, NULL, NULL);
+		if(numbytes == -1)
+		{
+			// if there is nothing to read anymore from the socket, break out of loop.
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			msg(MSG_FATAL, "recvfrom: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		dgr_reassemble(numbytes, dgr_packet);
+		__atomic_fetch_add(&dgr_receiver_current.packets, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dgr_receiver_current.bytes, numbytes, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&dgr_time_lastreceive, time(NULL), __ATOMIC_RELEASE);
+}
+
+/** Receiver: Copies a frame into another dgr_frame_buffer.
+ *
+ * @param dest The buffer to copy into.
+ * @param src The frame to copy.
+ */
+static void dgr_frame_copy(dgr_frame_buffer *dest, const dgr_frame_buffer *src)
+{
+	if(dest->capacity < (int) src->header.size)
+	{
+		free(dest->buffer);
+		dest->buffer = malloc(src->header.size);
+		dest->capacity = src->header.size;
+	}
+	dest->header = src->header;
+	dest->completed = src->completed;
+	memcpy(dest->buffer, src->buffer, src->header.size);
+	dest->used = 1;
+}
+
+/** Receiver: Wakes up the rendering thread if it is waiting for
+ * something from the receiver. */
+static void dgr_notify(void)
+{
+	pthread_mutex_lock(&dgr_event_mutex);
+	dgr_events++;
+	pthread_cond_broadcast(&dgr_event_cond);
+	pthread_mutex_unlock(&dgr_event_mutex);
+}
+
+/** Receiver: Gives the newest complete frame (and the keyframe it
+ * depends on, if the rendering thread doesn't have it) and the newest
+ * frame on each of the other channels to the rendering thread.
+ *
+ * @return 1 if something was published, 0 otherwise.
+ */
+static int dgr_publish(void)
+{
+	dgr_frame_pair *pair = &dgr_triple[dgr_triple_back];
+	pair->key.used = 0;
+	pair->delta.used = 0;
+
+	/* The receiver keeps the newest keyframe. The rendering thread
+	 * gets a copy of it until it has used it. */
+	if(dgr_complete_key.used &&
+	   __atomic_load_n(&dgr_applied_keyframe, __ATOMIC_ACQUIRE) != dgr_complete_key.header.frame)
+		dgr_frame_copy(&(pair->key), &dgr_complete_key);
+	if(dgr_complete.used)
+	{
+		dgr_frame_swap(&(pair->delta), &dgr_complete);
+		dgr_complete.used = 0;
+	}
+	int published = pair->key.used || pair->delta.used;
+
+	/* Like keyframes, the newest frame on each of the other channels
+	 * is copied until the rendering thread has used it. */
+	for(int i=1; i<DGR_MAX_CHANNELS; i++)
+	{
+		pair->channel[i].used = 0;
+		const dgr_frame_buffer *complete = &(dgr_channel_complete[i]);
+		if(complete->used &&
+		   __atomic_load_n(&(dgr_applied_channel[i]), __ATOMIC_ACQUIRE) != complete->header.frame)
+		{
+			dgr_frame_copy(&(pair->channel[i]), complete);
+			published = 1;
+		}
+	}
+	if(published == 0)
+		return 0;
+
+	int old = __atomic_exchange_n(&dgr_triple_middle, dgr_triple_back | DGR_TRIPLE_FRESH, __ATOMIC_ACQ_REL);
+	dgr_triple_back = old & ~DGR_TRIPLE_FRESH;
+
+	/* If the rendering thread didn't use what we published
+	 * previously, the frame in it was superseded. */
+	if((old & DGR_TRIPLE_FRESH) && dgr_triple[dgr_triple_back].delta.used)
+		__atomic_fetch_add(&dgr_receiver_current.superseded, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/** Receiver: Receives packets until the process exits. */
+static void* dgr_receiver(void *arg)
+{
+	(void) arg;
+	while(1)
+	{
+		if(dgr_wait_readable(dgr_socket, 1000) == 0)
+			continue;
+		uint32_t swap = __atomic_load_n(&dgr_swap_frame, __ATOMIC_RELAXED);
+		dgr_receive_packets();
+		int published = dgr_publish();
+
+		/* Only wake up the rendering thread if something changed. */
+		if(published || swap != __atomic_load_n(&dgr_swap_frame, __ATOMIC_RELAXED) ||
+		   __atomic_load_n(&dgr_exit_received, __ATOMIC_RELAXED))
+			dgr_notify();
+	}
+	return NULL;
+}
+
+/** Waits until the receiver thread publishes something or until a
+ * timeout occurs.
+ *
+ * @param timeout Maximum number of milliseconds to wait.
+ * @return 1 if the receiver published something, 0 if we timed out.
+ */
+static int dgr_wait_receiver(int timeout)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	int ret = 0;
+	pthread_mutex_lock(&dgr_event_mutex);
+	while(dgr_events == dgr_events_seen && ret == 0)
+		ret = pthread_cond_timedwait(&dgr_event_cond, &dgr_event_mutex, &deadline);
+	int published = dgr_events != dgr_events_seen;
+	dgr_events_seen = dgr_events;
+	pthread_mutex_unlock(&dgr_event_mutex);
+	return published;
+}
+#endif // __MINGW32__
+
+/** Exits if the master told us to exit or if we haven't received any
+ * packets for a while (after receiving packets successfully in the
+ * past). */
+static void dgr_check_master(void)
+{
+	if(__atomic_load_n(&dgr_exit_received, __ATOMIC_ACQUIRE))
+	{
+		msg(MSG_DEBUG, "The master told slaves to exit. Exiting...\n");
+		exit(EXIT_SUCCESS);
+	}
+
+	/* If too much time has elapsed since the last packet that we received, exit. */
+	time_t lastreceive = __atomic_load_n(&dgr_time_lastreceive, __ATOMIC_ACQUIRE);
+	if(lastreceive != 0) // if we have received a packet previously
+	{
+		int seconds = 15;
+		if(time(NULL) - lastreceive >= seconds)
+		{
+			msg(MSG_FATAL, "DGR Slave: dgr_receive() hasn't received packets within %d seconds. We did receive one or more packets earlier. Did the master or relay die? Exiting...\n", seconds);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/** Uses the newest frame that the receiver thread has published (if
+ * there is one that we haven't used yet).
+ *
+ * @return 1 if there was a new frame, 0 otherwise.
+ */
+static int dgr_use_published(void)
+{
+	if((__atomic_load_n(&dgr_triple_middle, __ATOMIC_ACQUIRE) & DGR_TRIPLE_FRESH) == 0)
+		return 0;
+	int old = __atomic_exchange_n(&dgr_triple_middle, dgr_triple_front, __ATOMIC_ACQ_REL);
+	dgr_triple_front = old & ~DGR_TRIPLE_FRESH;
+
+	/* Use the newest keyframe (if we received one) and then the
+	 * newest frame that contains changes relative to it. */
+	dgr_frame_pair *pair = &dgr_triple[dgr_triple_front];
+	if(pair->key.used)
+		dgr_apply_frame(&(pair->key));
+	if(pair->delta.used)
+		dgr_apply_frame(&(pair->delta));
+	if(dgr_have_keyframe)
+		__atomic_store_n(&dgr_applied_keyframe, dgr_keyframe, __ATOMIC_RELEASE);
+	for(int i=1; i<DGR_MAX_CHANNELS; i++)
+	{
+		if(pair->channel[i].used == 0)
+			continue;
+		dgr_apply_channel(&(pair->channel[i]));
+		__atomic_store_n(&(dgr_applied_channel[i]), dgr_channel_used[i], __ATOMIC_RELEASE);
+	}
+	return 1;
+}
+
+/** Uses the newest DGR data that the receiver thread received from
+ * the network.
+ *
+ * @param timeout If timeout > 0, dgr_receive() will block for at most
+ * 'timeout' milliseconds until new data arrives. If a timeout occurs,
+ * DGR will exit. If timeout==0, dgr_receive() not block and will use
+ * whatever information is available. If timeout==0, we still might
+ * exit if we haven't received information for a while (and we have
+ * received information successfully in the past). */
+static void dgr_receive(int timeout)
 {
 #if !defined __MINGW32__ && !defined _WIN32
 	if(dgr_disabled)
 		return;
 
-	int  bufSize = 0;
-	char *buf = dgr_serialize(&bufSize);
-	
-	// no need to send an empty packet.
-	if(bufSize == 0 || dgr_list_size == 0)
+	dgr_check_master();
+	if(dgr_use_published())
 		return;
-	
-	/* If the message is too large to send, sendto() will not send the
-	 * message, and will set errno to EMSGSIZE. The MTU may limit the
-	 * amount of data that we can send. With an MTU of 1500, we can
-	 * only expect to send 1472 bytes. Even with the small MTU, the
-	 * system may still allow us to send larger UDP packets due to
-	 * IPv4 fragmentation. */
-	int numbytes;
-	if((numbytes = sendto(dgr_socket, buf, bufSize, 0,
-	                      dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen)) == -1) {
-		msg(MSG_FATAL, "DGR Master: sendto: %s", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	free(buf);
-	if(numbytes != bufSize) // double check that everything got sent
+	if(timeout == 0)
+		return;
+
+	/* Wait for up to timeout milliseconds. */
+	long start = kuhl_microseconds();
+	while(dgr_use_published() == 0)
 	{
-		msg(MSG_FATAL, "DGR Master: Error sending all of the bytes in the message.");
-		exit(EXIT_FAILURE);
+		long remaining = timeout - (kuhl_microseconds()-start)/1000;
+		if(remaining <= 0 || dgr_wait_receiver((int) remaining) == 0)
+		{
+			/* If a non-zero timeout value was specified and we timed out, exit() */
+			msg(MSG_FATAL, "DGR Slave: dgr_receive() never received anything and timed out (%f second timeout). Exiting...\n", timeout/1000.0);
+			exit(EXIT_FAILURE);
+		}
+		dgr_check_master();
 	}
 #endif // __MINGW32__
 }
 
-/** Receives DGR data from the network.
+/** Adds a wait to a set of statistics.
  *
- * @param timeout If timeout > 0, dgr_receive() will block for at most
- * 'timeout' milliseconds. If a timeout occurs, DGR will exit. If
- * timeout==0, dgr_receive() not block and will read whatever
- * information is available to read. If timeout==0, we still might
- * exit if we haven't received information for a while (and we have
- * received information successfully in the past). */
-static void dgr_receive(int timeout)
+ * @param stats The statistics to update.
+ * @param usec The number of microseconds that we waited.
+ */
+static void dgr_wait_stats_add(dgr_wait_stats *stats, long usec)
 {
-#if !defined __MINGW32__ && !defined _WIN32
-	if(dgr_disabled)
+	stats->total += usec;
+	stats->count++;
+	if(usec > stats->max)
+		stats->max = usec;
+}
+
+/** Writes a set of wait statistics to the log file and resets them.
+ *
+ * @param label Describes what we were waiting for.
+ * @param name The slave we were waiting for (or an empty string).
+ * @param stats The statistics.
+ */
+static void dgr_wait_stats_print(const char *label, const char *name, dgr_wait_stats *stats)
+{
+	if(stats->count == 0 && stats->timeouts == 0)
 		return;
+	msg(MSG_DEBUG, "DGR Frame lock: %s%s: avg %.2f ms, max %.2f ms over %d frames, %d timeouts.\n", label, name,
+	    stats->count > 0 ? stats->total/1000.0/stats->count : 0.0,
+	    stats->max/1000.0, stats->count, stats->timeouts);
+	memset(stats, 0, sizeof(dgr_wait_stats));
+}
 
-	/* If too much time has elapsed since the last packet that we received, exit. */
-	if(dgr_time_lastreceive != 0) // if we have received a packet previously
+/** Writes frame lock statistics to the log file every 10 seconds. */
+static void dgr_framelock_stats(void)
+{
+	long now = kuhl_microseconds();
+	if(dgr_framelock_stats_time == 0)
+		dgr_framelock_stats_time = now;
+	if(now - dgr_framelock_stats_time < 10000000)
+		return;
+	dgr_framelock_stats_time = now;
+
+	if(dgr_is_master())
 	{
-		int seconds = 15;
-		if(time(NULL) - dgr_time_lastreceive >= seconds)
+		for(int i=0; i<dgr_nodes_size; i++)
+			dgr_wait_stats_print(dgr_nodes[i].active ? "master waiting for " : "master waiting for (inactive) ",
+			                     dgr_nodes[i].name, &(dgr_nodes[i].wait));
+	}
+	else
+	{
+		dgr_wait_stats_print("waiting for swap", "", &dgr_swap_wait);
+		dgr_wait_stats_print("waiting for next frame", "", &dgr_frame_wait);
+	}
+}
+
+#if !defined __MINGW32__ && !defined _WIN32
+/** Receives a packet from the back channel without blocking.
+ *
+ * @param buf Where the packet should be stored.
+ * @param size The size of buf.
+ * @param from Filled in with the address of the sender (may be NULL).
+ * @param fromlen Filled in with the size of the address (may be NULL).
+ * @param arrived Filled in with the time (see kuhl_microseconds()) that the packet arrived.
+ * @return The size of the packet or -1 if there was an error (see errno).
+ */
+static int dgr_backchannel_recv(void *buf, int size, struct sockaddr_storage *from, socklen_t *fromlen, int64_t *arrived)
+{
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	char control[256];
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = from;
+	mh.msg_namelen = from != NULL ? sizeof(struct sockaddr_storage) : 0;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	int numbytes = recvmsg(dgr_backchannel, &mh, MSG_DONTWAIT);
+	if(numbytes == -1)
+		return -1;
+	if(fromlen != NULL)
+		*fromlen = mh.msg_namelen;
+
+	*arrived = kuhl_microseconds();
+#ifdef SO_TIMESTAMP
+	/* Use the time the OS received the packet if it recorded it. */
+	for(struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c))
+	{
+		if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMP)
 		{
-			msg(MSG_FATAL, "DGR Slave: dgr_receive() hasn't received packets within %d seconds. We did receive one or more packets earlier. Did the master or relay die? Exiting...\n", seconds);
-			exit(EXIT_FAILURE);
+			struct timeval tv;
+			memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+			*arrived = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
 		}
 	}
+#endif
+	return numbytes;
+}
 
-	/* Use poll to wait for up to timeout seconds. */
-	struct pollfd fds;
-	fds.fd = dgr_socket;
-	fds.events = POLLIN;
-	int retval = poll(&fds, 1, timeout);
-	if(retval == -1)
+/** Slave: Estimates the offset and skew between our clock and the
+ * master's clock from the samples we have. */
+static void dgr_clock_estimate(void)
+{
+	/* Samples with short round trip times were delayed the least by
+	 * the network (and by the master), so they are the most
+	 * accurate. Ignore samples that took much longer than the
+	 * fastest one. */
+	int64_t minRtt = dgr_clock_samples[0].rtt;
+	for(int i=1; i<dgr_clock_count; i++)
+		if(dgr_clock_samples[i].rtt < minRtt)
+			minRtt = dgr_clock_samples[i].rtt;
+	int64_t limit = minRtt + minRtt/2 + 100;
+
+	/* Times are relative to the first sample to keep the numbers small. */
+	int64_t base = dgr_clock_samples[0].local;
+	int64_t first = 0, last = 0;
+	double n = 0, meanLocal = 0, meanOffset = 0;
+	for(int i=0; i<dgr_clock_count; i++)
 	{
-		msg(MSG_FATAL, "poll(): %s", strerror(errno));
-		exit(EXIT_FAILURE);
+		const dgr_clock_sample *sample = &(dgr_clock_samples[i]);
+		if(sample->rtt > limit)
+			continue;
+		int64_t local = sample->local - base;
+		if(n == 0 || local < first)
+			first = local;
+		if(n == 0 || local > last)
+			last = local;
+		meanLocal += local;
+		meanOffset += sample->offset;
+		n++;
 	}
-	else if(retval == 0) // nothing to read within timeout value
+	meanLocal /= n;
+	meanOffset /= n;
+
+	/* Fit a line (offset = meanOffset + skew*(local-meanLocal)) to
+	 * the samples once they cover enough time for the slope to be
+	 * meaningful. Clocks rarely drift more than 500 ppm. */
+	double skew = 0;
+	if(n >= 3 && last - first >= 5000000)
 	{
-		/* If a non-zero timeout value was specified and we timed out, exit() */
-		if(timeout > 0)
+		double cov = 0, var = 0;
+		for(int i=0; i<dgr_clock_count; i++)
 		{
-			msg(MSG_FATAL, "DGR Slave: dgr_receive() never received anything and timed out (%f second timeout). Exiting...\n", timeout/1000.0);
-			exit(EXIT_FAILURE);
+			const dgr_clock_sample *sample = &(dgr_clock_samples[i]);
+			if(sample->rtt > limit)
+				continue;
+			double dx = sample->local - base - meanLocal;
+			cov += dx * (sample->offset - meanOffset);
+			var += dx * dx;
+		}
+		skew = cov / var;
+		if(skew > 0.0005)
+			skew = 0.0005;
+		if(skew < -0.0005)
+			skew = -0.0005;
+	}
+	dgr_clock_ref = base + (int64_t) meanLocal;
+	dgr_clock_offset = meanOffset;
+	dgr_clock_skew = skew;
+}
+
+/** Slave: Asks the master for the time. Until the master has replied
+ * to one of our pings, the frame in the ping is 0, which tells the
+ * master that we just started and need the newest frame on every
+ * reliable channel. */
+static void dgr_clock_ping(void)
+{
+	dgr_control_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = DGR_CONTROL_MAGIC;
+	header.type = DGR_CONTROL_PING;
+	header.frame = dgr_clock_count == 0 ? 0 : dgr_frame;
+	strcpy(header.name, dgr_slave_name);
+	dgr_control_clock clock;
+	memset(&clock, 0, sizeof(clock));
+	clock.ping = kuhl_microseconds();
+
+	char packet[sizeof(header)+sizeof(clock)];
+	memcpy(packet, &header, sizeof(header));
+	memcpy(packet+sizeof(header), &clock, sizeof(clock));
+	if(send(dgr_backchannel, packet, sizeof(packet), 0) == -1)
+		msg(MSG_DEBUG, "DGR Slave: Back channel: send: %s", strerror(errno));
+	dgr_clock_lastping = clock.ping;
+}
+
+/** Slave: Reads the master's replies to our pings and updates the
+ * clock estimate.
+ *
+ * @return The number of replies that were received.
+ */
+static int dgr_clock_receive(void)
+{
+	char packet[sizeof(dgr_control_header)+sizeof(dgr_control_clock)];
+	dgr_control_header header;
+	dgr_control_clock clock;
+	int64_t arrived;
+	int received = 0;
+	while(1)
+	{
+		int numbytes = dgr_backchannel_recv(packet, sizeof(packet), NULL, NULL, &arrived);
+		if(numbytes == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			break; // no more packets (or the master isn't running)
+		}
+		memcpy(&header, packet, sizeof(header));
+		if(numbytes != (int) sizeof(packet) || header.magic != DGR_CONTROL_MAGIC ||
+		   header.type != DGR_CONTROL_PONG)
+			continue;
+		memcpy(&clock, packet+sizeof(header), sizeof(clock));
+
+		/* Like NTP: The master's clock minus our clock is the average
+		 * of the differences measured in each direction. */
+		dgr_clock_sample *sample = &(dgr_clock_samples[dgr_clock_next]);
+		sample->local = (clock.ping + arrived) / 2;
+		sample->offset = ((clock.received - clock.ping) + (clock.sent - arrived)) / 2;
+		sample->rtt = (arrived - clock.ping) - (clock.sent - clock.received);
+		dgr_clock_next = (dgr_clock_next+1) % DGR_CLOCK_SAMPLES;
+		if(dgr_clock_count < DGR_CLOCK_SAMPLES)
+			dgr_clock_count++;
+		dgr_clock_epoch = clock.epoch;
+		if(dgr_clock_frame == 0)
+			dgr_clock_frame = header.frame;
+		received++;
+	}
+	if(received == 0)
+		return 0;
+
+	dgr_clock_estimate();
+	if(dgr_clock_synced == 0)
+	{
+		/* Our time was relative to when we started. Let it jump to
+		 * the master's time. */
+		dgr_clock_synced = 1;
+		dgr_time_last = 0;
+	}
+	return received;
+}
+
+/** Slave: Collects several clock samples so that dgr_time() matches
+ * the master right away. Called once the master is running. */
+static void dgr_clock_sync(void)
+{
+	if(dgr_backchannel == -1)
+		return;
+	for(int i=0; i<8; i++)
+	{
+		dgr_clock_ping();
+		/* The master replies the next time it calls dgr_update(). */
+		long start = kuhl_microseconds();
+		int received = 0;
+		while(received == 0)
+		{
+			long remaining = 200000 - (kuhl_microseconds()-start);
+			if(remaining <= 0 || dgr_wait_readable(dgr_backchannel, (int) ((remaining+999)/1000)) == 0)
+				break;
+			received = dgr_clock_receive();
 		}
+	}
+	if(dgr_clock_synced == 0)
+	{
+		msg(MSG_WARNING, "DGR Slave: The master didn't reply to clock synchronization requests. Will keep trying.\n");
 		return;
 	}
-	
-	struct sockaddr_storage their_addr;
-	socklen_t addr_len = sizeof their_addr;
-
-	char serialized[1024*1024];
-	int numbytes;
-	/* Read packets until there are no more to read. This ensures that
-	 * we are always using the newest packet. For example, 5 packets
-	 * might arrive while the slave is rendering a scene. We want to
-	 * make sure that we use the newest packet. */
+	msg(MSG_INFO, "DGR Slave: Synchronized clock with the master (offset %.3f ms).\n", dgr_clock_offset/1000.0);
+
+	/* The master sends the reliable channels again before the frame
+	 * in its first reply (see dgr_backchannel_receive()). Wait for
+	 * that frame so that every record is available. */
+	long start = kuhl_microseconds();
+	dgr_receive(0);
+	while(dgr_frame < dgr_clock_frame)
+	{
+		long remaining = 1000000 - (kuhl_microseconds()-start);
+		if(remaining <= 0)
+		{
+			msg(MSG_WARNING, "DGR Slave: Didn't receive frame %u from the master. Some records might be missing.\n", dgr_clock_frame);
+			break;
+		}
+		dgr_wait_receiver((int) ((remaining+999)/1000));
+		dgr_receive(0);
+	}
+}
+
+/** Slave: Reads replies to pings and periodically sends a new ping.
+ * Called every dgr_update(). */
+static void dgr_clock_update(void)
+{
+	if(dgr_backchannel == -1)
+		return;
+	dgr_clock_receive();
+	if(kuhl_microseconds() - dgr_clock_lastping >= dgr_clock_interval*1000L)
+		dgr_clock_ping();
+}
+
+/** Master: Reads packets that slaves sent on the back channel.
+ *
+ * @param frame The frame that the master is waiting for slaves to finish.
+ * @param start The time that the master started waiting.
+ */
+static void dgr_backchannel_receive(uint32_t frame, long start)
+{
+	dgr_control_header header;
+	char packet[sizeof(dgr_control_header)+sizeof(dgr_control_stats)+sizeof(dgr_control_clock)+sizeof(dgr_control_nack)];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	int64_t arrived;
 	while(1)
 	{
-		if ((numbytes = recvfrom(dgr_socket, serialized, 1024*1024, 0,
-		                         (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-			msg(MSG_FATAL, "recvfrom: %s", strerror(errno));
+		int numbytes = dgr_backchannel_recv(packet, sizeof(packet), &from, &fromlen, &arrived);
+		if(numbytes == -1)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			msg(MSG_ERROR, "DGR Master: Back channel: recvfrom: %s", strerror(errno));
+			break;
+		}
+		if(numbytes >= (int) sizeof(header))
+			memcpy(&header, packet, sizeof(header));
+		if(numbytes < (int) sizeof(header) || header.magic != DGR_CONTROL_MAGIC)
+		{
+			msg(MSG_ERROR, "DGR Master: Ignoring an invalid packet on the back channel.\n");
+			continue;
+		}
+		header.name[sizeof(header.name)-1] = '\0';
+		if(header.type == DGR_CONTROL_PING &&
+		   numbytes == (int) (sizeof(header)+sizeof(dgr_control_clock)))
+		{
+			/* A slave that just started only receives the records
+			 * on reliable channels when they change, when it misses
+			 * a heartbeat or when the channel is sent periodically.
+			 * Send them again in our next frame. The slave waits
+			 * for that frame (see dgr_clock_sync()). */
+			if(header.frame == 0)
+			{
+				for(int i=1; i<dgr_channels_size; i++)
+					if(dgr_channels[i].flags & DGR_CHANNEL_RELIABLE)
+						dgr_channels[i].resend = 1;
+				msg(MSG_DEBUG, "DGR Master: Slave '%s' started. Sending the reliable channels again.\n", header.name);
+			}
+
+			/* Reply with our time right away. */
+			dgr_control_clock clock;
+			memcpy(&clock, packet+sizeof(header), sizeof(clock));
+			header.type = DGR_CONTROL_PONG;
+			header.frame = dgr_frame;
+			clock.received = arrived;
+			clock.epoch = dgr_clock_epoch;
+			clock.sent = kuhl_microseconds();
+			memcpy(packet, &header, sizeof(header));
+			memcpy(packet+sizeof(header), &clock, sizeof(clock));
+			if(sendto(dgr_backchannel, packet, numbytes, 0, (struct sockaddr*) &from, fromlen) == -1)
+				msg(MSG_DEBUG, "DGR Master: Back channel: sendto: %s", strerror(errno));
+			continue;
+		}
+		if(header.type == DGR_CONTROL_STATS &&
+		   numbytes == (int) (sizeof(header)+sizeof(dgr_control_stats)))
+		{
+			dgr_control_stats stats;
+			memcpy(&stats, packet+sizeof(header), sizeof(stats));
+			msg(MSG_INFO, "DGR Stats: Slave '%s': %.1f s: %u frames used, %u packets, %.1f KB/s; %u frames superseded, %u incomplete; unserialize avg %.3f ms; latency avg %.3f ms, max %.3f ms.\n",
+			    header.name, stats.seconds, stats.frames, stats.packets,
+			    stats.seconds > 0 ? stats.bytes/1024.0/stats.seconds : 0.0,
+			    stats.superseded, stats.incomplete, stats.unserialize, stats.latency, stats.latencyMax);
+			continue;
+		}
+		if(header.type == DGR_CONTROL_NACK &&
+		   numbytes == (int) (sizeof(header)+sizeof(dgr_control_nack)))
+		{
+			/* dgr_send() sends the newest frame on the channel
+			 * again, no matter how many slaves asked for it. */
+			dgr_control_nack nack;
+			memcpy(&nack, packet+sizeof(header), sizeof(nack));
+			if(nack.channel > 0 && nack.channel < (uint32_t) dgr_channels_size &&
+			   header.frame != dgr_channels[nack.channel].frame)
+			{
+				msg(MSG_DEBUG, "DGR Master: Slave '%s' asked for frame %u on channel '%s' again.\n",
+				    header.name, dgr_channels[nack.channel].frame, dgr_channels[nack.channel].name);
+				dgr_channels[nack.channel].resend = 1;
+			}
+			continue;
+		}
+		if(header.type != DGR_CONTROL_READY)
+			continue;
+
+		dgr_node *node = NULL;
+		for(int i=0; i<dgr_nodes_size; i++)
+			if(strcmp(dgr_nodes[i].name, header.name) == 0)
+				node = &(dgr_nodes[i]);
+		if(node == NULL)
+		{
+			if(dgr_nodes_size >= DGR_MAX_NODES)
+			{
+				msg(MSG_ERROR, "DGR Master: Frame lock supports at most %d slaves. Ignoring '%s'.\n", DGR_MAX_NODES, header.name);
+				continue;
+			}
+			node = &(dgr_nodes[dgr_nodes_size++]);
+			memset(node, 0, sizeof(dgr_node));
+			strcpy(node->name, header.name);
+			msg(MSG_INFO, "DGR Master: Slave '%s' joined the frame lock.\n", node->name);
+		}
+
+		/* A slave that we aren't waiting for (re)joins once it is
+		 * at most one frame behind the master. */
+		int32_t behind = (int32_t) (frame - header.frame);
+		if(node->active == 0 && behind >= 0 && behind <= 1)
+		{
+			if(node->wait.timeouts > 0)
+				msg(MSG_INFO, "DGR Master: Slave '%s' caught up; waiting for it again.\n", node->name);
+			node->active = 1;
+		}
+		node->readyFrame = header.frame;
+		if(node->active && header.frame == frame)
+			dgr_wait_stats_add(&(node->wait), kuhl_microseconds()-start);
+	}
+}
+
+/** Master: Waits for slaves to be ready to swap the frame that we just
+ * sent and then tells them to swap.
+ *
+ * @param timeout Maximum number of milliseconds to wait for slaves.
+ */
+static void dgr_framelock_master(int timeout)
+{
+	uint32_t frame = dgr_frame-1; // the frame we just sent
+	long start = kuhl_microseconds();
+	while(1)
+	{
+		dgr_backchannel_receive(frame, start);
+
+		int waiting = 0;
+		for(int i=0; i<dgr_nodes_size; i++)
+			if(dgr_nodes[i].active && dgr_nodes[i].readyFrame != frame)
+				waiting = 1;
+		if(waiting == 0)
+			break;
+
+		long remaining = timeout*1000L - (kuhl_microseconds()-start);
+		if(remaining <= 0 ||
+		   dgr_wait_readable(dgr_backchannel, (int) ((remaining+999)/1000)) == 0)
+		{
+			/* Don't let one slow slave freeze everyone else. Stop
+			 * waiting for it until it catches up. */
+			for(int i=0; i<dgr_nodes_size; i++)
+			{
+				if(dgr_nodes[i].active && dgr_nodes[i].readyFrame != frame)
+				{
+					msg(MSG_WARNING, "DGR Master: Slave '%s' wasn't ready to swap frame %u within %d ms. Not waiting for it until it catches up.\n", dgr_nodes[i].name, frame, timeout);
+					dgr_nodes[i].active = 0;
+					dgr_nodes[i].wait.timeouts++;
+				}
+			}
+			break;
+		}
+	}
+
+	/* Tell slaves to swap. This packet travels the same path as the
+	 * frames so it works with a relay or multicast. */
+	dgr_packet_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = DGR_PACKET_MAGIC;
+	header.frame = frame;
+	header.keyframe = dgr_keyframe;
+	header.flags = DGR_PACKET_SWAP;
+	header.fragments = 1;
+	if(sendto(dgr_socket, &header, sizeof(header), 0, dgr_addrinfo->ai_addr, dgr_addrinfo->ai_addrlen) == -1)
+		msg(MSG_ERROR, "DGR Master: sendto: %s", strerror(errno));
+}
+
+/** Slave: Tells the master that we are ready to swap the frame that
+ * we rendered and waits for the master to tell us to swap.
+ *
+ * @param timeout Maximum number of milliseconds to wait for the master.
+ */
+static void dgr_framelock_slave(int timeout)
+{
+	dgr_control_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = DGR_CONTROL_MAGIC;
+	header.type = DGR_CONTROL_READY;
+	header.frame = dgr_frame;
+	strcpy(header.name, dgr_slave_name);
+	if(send(dgr_backchannel, &header, sizeof(header), 0) == -1)
+		msg(MSG_DEBUG, "DGR Slave: Back channel: send: %s", strerror(errno));
+
+	long start = kuhl_microseconds();
+	while((int32_t) (__atomic_load_n(&dgr_swap_frame, __ATOMIC_ACQUIRE) - dgr_frame) < 0)
+	{
+		dgr_check_master();
+		long remaining = timeout*1000L - (kuhl_microseconds()-start);
+		if(remaining <= 0)
+		{
+			msg(MSG_DEBUG, "DGR Slave: The master didn't tell us to swap frame %u within %d ms.\n", dgr_frame, timeout);
+			dgr_swap_wait.timeouts++;
+			return;
+		}
+		dgr_wait_receiver((int) ((remaining+999)/1000));
+	}
+	dgr_wait_stats_add(&dgr_swap_wait, kuhl_microseconds()-start);
+}
+#endif // __MINGW32__
+
+/** Synchronizes buffer swaps between the master and slaves ("frame
+ * lock"). Call after rendering a frame and calling dgr_update(1,0) but
+ * before swapping buffers. The master waits until every slave has
+ * rendered the same frame and then tells the slaves to swap
+ * buffers. Slaves wait until the master tells them to swap. Once
+ * frame lock is used, dgr_update() on a slave waits for the master's
+ * next frame instead of reusing the previous one.
+ *
+ * Frame lock requires a back channel from the slaves to the master:
+ * set dgr.master.listenport on the master and dgr.slave.masterip and
+ * dgr.slave.masterport on each slave. If a slave doesn't respond
+ * within the timeout, the master stops waiting for it until it
+ * catches up. Wait times are written to the log file.
+ *
+ * @param timeout Maximum number of milliseconds to wait each frame.
+ */
+void dgr_framelock(int timeout)
+{
+#if !defined __MINGW32__ && !defined _WIN32
+	if(dgr_disabled || dgr_replay != NULL)
+		return;
+	if(dgr_backchannel == -1)
+	{
+		static int warned = 0;
+		if(warned == 0)
+			msg(MSG_WARNING, "DGR: Frame lock requires dgr.master.listenport (master) or dgr.slave.masterip and dgr.slave.masterport (slaves) to be set.\n");
+		warned = 1;
+		return;
+	}
+	dgr_framelock_active = 1;
+
+	if(dgr_is_master())
+		dgr_framelock_master(timeout);
+	else
+		dgr_framelock_slave(timeout);
+	dgr_framelock_stats();
+#endif // __MINGW32__
+}
+
+/** Returns the number of seconds since the DGR master called
+ * dgr_init(). Every DGR process returns (nearly) the same value at
+ * the same moment, so animations that only depend on time can be
+ * computed by each process instead of being sent with dgr_setget()
+ * every frame.
+ *
+ * Slaves estimate the master's clock by exchanging packets with it on
+ * the back channel (set dgr.slave.masterip and dgr.slave.masterport
+ * on slaves and dgr.master.listenport on the master). A slave sends
+ * one packet every dgr.time.interval milliseconds (default 1000).
+ * Without a back channel, or if DGR is disabled, the time is relative
+ * to when this process called dgr_init(). When a capture is replayed,
+ * the time is the master's time when it sent the frame that was used
+ * most recently, so the captured animation is reproduced. The time
+ * never decreases (except once, when a slave first synchronizes with
+ * the master).
+ *
+ * @return Time in seconds.
+ */
+double dgr_time(void)
+{
+	int64_t now = kuhl_microseconds();
+	if(dgr_clock_epoch == 0) // dgr_init() hasn't been called
+		dgr_clock_epoch = now;
+
+	double master = (double) now;
+	if(dgr_replay != NULL)
+		master = (double) (dgr_clock_epoch + dgr_replay_clock);
+	else if(dgr_is_master() == 0 && dgr_clock_synced)
+		master = now + dgr_clock_offset + dgr_clock_skew * (now - dgr_clock_ref);
+	else if(dgr_is_master() == 0 && dgr_backchannel == -1)
+	{
+		static int warned = 0;
+		if(warned == 0)
+			msg(MSG_WARNING, "DGR Slave: dgr_time() won't match the master unless dgr.slave.masterip and dgr.slave.masterport are set.\n");
+		warned = 1;
+	}
+
+	double t = (master - dgr_clock_epoch) / 1000000.0;
+	if(t < dgr_time_last)
+		t = dgr_time_last;
+	dgr_time_last = t;
+	return t;
+}
+
+/** Reads the next frame in the capture file into dgr_replay_next.
+ *
+ * @return 1 if a frame was read, 0 if we reached the end of the file.
+ */
+static int dgr_replay_read(void)
+{
+	dgr_frame_buffer *f = &dgr_replay_next;
+	f->used = 0;
+	if(fread(&dgr_replay_time, sizeof(int64_t), 1, dgr_replay) != 1 ||
+	   fread(&(f->header), sizeof(dgr_packet_header), 1, dgr_replay) != 1)
+		return 0;
+	if(f->header.magic != DGR_PACKET_MAGIC || f->header.size > DGR_MAX_FRAME_SIZE ||
+	   f->header.channel >= DGR_MAX_CHANNELS)
+	{
+		msg(MSG_ERROR, "DGR Replay: The capture file is corrupt after frame %u.\n", dgr_frame);
+		return 0;
+	}
+	if(f->capacity < (int) f->header.size)
+	{
+		free(f->buffer);
+		f->buffer = malloc(f->header.size);
+		f->capacity = f->header.size;
+	}
+	if(f->header.size > 0 && fread(f->buffer, f->header.size, 1, dgr_replay) != 1)
+		return 0;
+	if(dgr_frame_decompress(f) == 0)
+		return dgr_replay_read(); // skip the frame
+	f->used = 1;
+	return 1;
+}
+
+/** Uses the frames in the capture file that are due. When replaying
+ * at the original rate, frames are used at the same times (relative
+ * to the first frame) that the master sent them. Exits at the end of
+ * the file or when the master exited in the captured session. */
+static void dgr_replay_update(void)
+{
+	if(dgr_replay_start == 0)
+	{
+		if(dgr_replay_read() == 0)
+		{
+			msg(MSG_FATAL, "DGR Replay: The capture file doesn't contain any frames.");
 			exit(EXIT_FAILURE);
 		}
+		dgr_replay_start = kuhl_microseconds();
+		dgr_replay_first = dgr_replay_time;
+	}
+
+	int64_t due = dgr_replay_time; // with rate 0, use the next frame
+	if(dgr_replay_rate > 0)
+		due = dgr_replay_first + (int64_t) ((kuhl_microseconds()-dgr_replay_start) * (double) dgr_replay_rate);
+
+	/* Frames may contain changes relative to earlier frames, so we use
+	 * each frame in order. */
+	while(dgr_replay_next.used && dgr_replay_time <= due)
+	{
+		uint32_t channel = dgr_replay_next.header.channel;
+		if(channel == 0)
+			dgr_apply_frame(&dgr_replay_next);
+		else
+			dgr_apply_channel(&dgr_replay_next);
+		dgr_replay_clock = dgr_replay_time;
+		if(dgr_replay_next.header.flags & DGR_PACKET_EXIT)
+		{
+			msg(MSG_DEBUG, "DGR Replay: The master exited at this point in the capture. Exiting...\n");
+			exit(EXIT_SUCCESS);
+		}
+		if(dgr_replay_read() == 0)
+		{
+			msg(MSG_INFO, "DGR Replay: Reached the end of the capture file after frame %u. Exiting...\n", dgr_frame);
+			exit(EXIT_SUCCESS);
+		}
+
+		/* With rate 0, frames on other channels don't count: keep
+		 * going until we use a frame on channel 0. */
+		if(dgr_replay_rate <= 0 && channel != 0)
+			due = dgr_replay_time;
+	}
+}
+
+/** Writes the statistics for the interval that just finished to the
+ * log file, including the records that used the most bandwidth.
+ *
+ * @param s The statistics.
+ */
+static void dgr_stats_print(const dgr_stats_info *s)
+{
+	if(dgr_is_master())
+		msg(MSG_INFO, "DGR Stats: %.1f s: %ld frames (%ld keyframes), %ld packets (%.0f/s), %.1f KB/s (%.1f KB/s before compression); serialize avg %.3f ms, max %.3f ms; compress avg %.3f ms.\n",
+		    s->seconds, s->frames, s->keyframes, s->packets, s->packetsPerSecond,
+		    s->bytesPerSecond/1024.0, s->rawBytes/1024.0/s->seconds,
+		    s->serialize, s->serializeMax, s->compress);
+	else
+		msg(MSG_INFO, "DGR Stats: %.1f s: %ld frames used (%ld keyframes), %ld packets (%.0f/s), %.1f KB/s; %ld frames superseded, %ld incomplete; unserialize avg %.3f ms, max %.3f ms; decompress avg %.3f ms; latency avg %.3f ms, max %.3f ms.\n",
+		    s->seconds, s->frames, s->keyframes, s->packets, s->packetsPerSecond,
+		    s->bytesPerSecond/1024.0, s->superseded, s->incomplete,
+		    s->serialize, s->serializeMax, s->compress, s->latency, s->latencyMax);
 
-		// if there is nothing to read anymore from the socket, break out of loop.
-		struct pollfd fds;
-		fds.fd = dgr_socket;
-		fds.events = POLLIN;
-		int retval = poll(&fds, 1, 0);
-		if(retval == 0)
+	/* Find the records that used the most bytes. */
+	long total = 0;
+	for(int i=0; i<dgr_list_size; i++)
+		total += dgr_list[i].lastBytes;
+	int shown[5];
+	int numShown = 0;
+	while(numShown < 5)
+	{
+		int largest = -1;
+		for(int i=0; i<dgr_list_size; i++)
+		{
+			int skip = 0;
+			for(int j=0; j<numShown; j++)
+				if(shown[j] == i)
+					skip = 1;
+			if(!skip && dgr_list[i].lastBytes > 0 &&
+			   (largest == -1 || dgr_list[i].lastBytes > dgr_list[largest].lastBytes))
+				largest = i;
+		}
+		if(largest == -1)
 			break;
+		shown[numShown++] = largest;
+		const dgr_record *r = &(dgr_list[largest]);
+		msg(MSG_INFO, "DGR Stats:   %5.1f%% %9.1f KB/s in %5ld frames: %s\n",
+		    100.0*r->lastBytes/total, r->lastBytes/1024.0/s->seconds, r->lastCount, r->name);
 	}
-	dgr_time_lastreceive = time(NULL);
-	
-	dgr_unserialize(numbytes, serialized);
-	
-	/* If the packet we received indicates that dgr has died. */
-	int died = 0;
-	if(dgr_get("!!!dgr_died!!!", &died, sizeof(int)) >= 0 &&
-	   died == 1)
+}
+
+/** Finishes the current statistics interval once it is over. The
+ * interval is dgr.stats.interval seconds long (one second if it isn't
+ * set). The statistics are stored so that dgr_stats() can return
+ * them, written to the log file if dgr.stats.interval is set and, if
+ * this is a slave with a back channel, sent to the master. */
+static void dgr_stats_update(void)
+{
+	long now = kuhl_microseconds();
+	long length = (dgr_stats_interval > 0 ? dgr_stats_interval : 1) * 1000000L;
+	if(now - dgr_stats_start < length)
+		return;
+
+	/* Collect the counters from the receiver thread. */
+	dgr_counters c = dgr_counters_current;
+	memset(&dgr_counters_current, 0, sizeof(dgr_counters));
+	dgr_receiver_counters *r = &dgr_receiver_current;
+	c.packets += __atomic_exchange_n(&(r->packets), 0, __ATOMIC_RELAXED);
+	c.bytes   += __atomic_exchange_n(&(r->bytes), 0, __ATOMIC_RELAXED);
+	c.compressTime  += __atomic_exchange_n(&(r->decompressTime), 0, __ATOMIC_RELAXED);
+	c.compressCount += __atomic_exchange_n(&(r->decompressCount), 0, __ATOMIC_RELAXED);
+	long superseded = __atomic_exchange_n(&(r->superseded), 0, __ATOMIC_RELAXED);
+	long incomplete = __atomic_exchange_n(&(r->incomplete), 0, __ATOMIC_RELAXED);
+
+	dgr_stats_info *s = &dgr_stats_last;
+	s->seconds = (now - dgr_stats_start) / 1000000.0;
+	s->frames = c.frames;
+	s->keyframes = c.keyframes;
+	s->packets = c.packets;
+	s->bytes = c.bytes;
+	s->rawBytes = c.rawBytes;
+	s->packetsPerSecond = c.packets / s->seconds;
+	s->bytesPerSecond = c.bytes / s->seconds;
+	s->superseded = superseded;
+	s->incomplete = incomplete;
+	s->serialize = c.serializeCount > 0 ? c.serializeTime/1000.0/c.serializeCount : 0;
+	s->serializeMax = c.serializeMax/1000.0;
+	s->compress = c.compressCount > 0 ? c.compressTime/1000.0/c.compressCount : 0;
+	s->latency = c.latencyCount > 0 ? c.latencyTime/1000.0/c.latencyCount : 0;
+	s->latencyMax = c.latencyMax/1000.0;
+	s->records = dgr_list_size;
+	for(int i=0; i<dgr_list_size; i++)
 	{
-		msg(MSG_DEBUG, "The master told slaves to exit. Exiting...\n");
-		exit(EXIT_SUCCESS);
+		dgr_record *rec = &(dgr_list[i]);
+		rec->lastCount = rec->count;
+		rec->lastBytes = rec->bytes;
+		rec->count = 0;
+		rec->bytes = 0;
+	}
+	dgr_stats_start = now;
+
+	if(dgr_stats_interval <= 0)
+		return;
+	dgr_stats_print(s);
+
+#if !defined __MINGW32__ && !defined _WIN32
+	/* Let the master know how this slave is doing. */
+	if(dgr_is_master() == 0 && dgr_backchannel != -1)
+	{
+		char packet[sizeof(dgr_control_header)+sizeof(dgr_control_stats)];
+		dgr_control_header header;
+		memset(&header, 0, sizeof(header));
+		header.magic = DGR_CONTROL_MAGIC;
+		header.type = DGR_CONTROL_STATS;
+		header.frame = dgr_frame;
+		strcpy(header.name, dgr_slave_name);
+		dgr_control_stats stats;
+		stats.seconds = (float) s->seconds;
+		stats.frames = s->frames;
+		stats.packets = s->packets;
+		stats.bytes = s->bytes;
+		stats.superseded = s->superseded;
+		stats.incomplete = s->incomplete;
+		stats.unserialize = (float) s->serialize;
+		stats.latency = (float) s->latency;
+		stats.latencyMax = (float) s->latencyMax;
+		memcpy(packet, &header, sizeof(header));
+		memcpy(packet+sizeof(header), &stats, sizeof(stats));
+		if(send(dgr_backchannel, packet, sizeof(packet), 0) == -1)
+			msg(MSG_DEBUG, "DGR Slave: Back channel: send: %s", strerror(errno));
 	}
 #endif // __MINGW32__
 }
 
+/** Gets statistics about the frames that DGR sent (master) or received
+ * (slave) during the most recent statistics interval. The interval is
+ * dgr.stats.interval seconds long (one second if it isn't set). If
+ * dgr.stats.interval is set, the statistics are also written to the
+ * log file at the end of each interval and slaves with a back channel
+ * (see dgr_framelock()) send their statistics to the master, which
+ * writes them to its log file.
+ *
+ * @param stats Filled in with the statistics. All values are 0 until
+ * the first interval has finished.
+ */
+void dgr_stats(dgr_stats_info *stats)
+{
+	*stats = dgr_stats_last;
+}
+
+/** Gets statistics about one record during the most recent statistics
+ * interval. Use this to find which records use the most bandwidth.
+ *
+ * @param handle A handle returned by dgr_register() or a number
+ * between 0 and the 'records' value returned by dgr_stats() minus 1.
+ *
+ * @param stats Filled in with the statistics.
+ *
+ * @return 1 if the handle was valid, 0 otherwise.
+ */
+int dgr_stats_record(dgr_handle handle, dgr_record_stats_info *stats)
+{
+	if(dgr_disabled || handle < 0 || handle >= dgr_list_size)
+		return 0;
+	const dgr_record *rec = &(dgr_list[handle]);
+	stats->name = rec->name;
+	stats->size = rec->size;
+	stats->count = rec->lastCount;
+	stats->bytes = rec->lastBytes;
+	return 1;
+}
+
 /** Send or receive data depending on DGR configuration. If we are a
  * DGR master, dgr_update() will send data to the network. if we are
- * DGR slave, dgr_update() will receive data from the network. In an
+ * DGR slave, dgr_update() will receive data from the network (or
+ * read it from a capture file if dgr.mode is 'replay'). In an
  * OpenGL DGR program, you would typically call this method every time
  * you render a frame. This function may call exit() if we are a slave
  * which has received a special packet indicating that we should
@@ -654,20 +3412,60 @@ void dgr_update(int send, int receive)
 		return;
 	
 	if(dgr_is_master() && send == 1)
+	{
 		dgr_send();
+#if !defined __MINGW32__ && !defined _WIN32
+		/* Read statistics that slaves sent us (dgr_framelock() reads
+		 * the back channel itself). */
+		if(dgr_backchannel != -1 && dgr_framelock_active == 0)
+			dgr_backchannel_receive(dgr_frame-1, kuhl_microseconds());
+#endif
+	}
 	
-	if(dgr_is_master() == 0 && receive == 1)
+	if(dgr_is_master() == 0 && receive == 1 && dgr_replay != NULL)
+		dgr_replay_update();
+	else if(dgr_is_master() == 0 && receive == 1)
 	{
 		// if it is our first time receiving, allow for a delay.
-		if(dgr_time_lastreceive == 0)
+		if(dgr_have_keyframe == 0)
 		{
 			/* Give plenty of time for us to receive the first
 			 * packet. It might arrive very slowly if the master
 			 * process is starting up slowly because it is loading a
 			 * large image or model file. */
 			dgr_receive(300000);  // 300000 milliseconds = 30 seconds
+
+			/* The first packets we receive may contain changes
+			 * relative to a keyframe that we missed. Wait until we
+			 * have a keyframe so that all of the records are
+			 * available. */
+			while(dgr_have_keyframe == 0)
+				dgr_receive(300000);
+		}
+#if !defined __MINGW32__ && !defined _WIN32
+		else if(dgr_framelock_active)
+		{
+			/* The master sends its next frame after it tells us to
+			 * swap. Wait for it so that we render the same frame
+			 * as the master. dgr_receive() exits if the master
+			 * dies. */
+			uint32_t previous = dgr_frame;
+			long start = kuhl_microseconds();
+			dgr_receive(0);
+			while(dgr_frame == previous)
+			{
+				dgr_wait_receiver(100);
+				dgr_receive(0);
+			}
+			dgr_wait_stats_add(&dgr_frame_wait, kuhl_microseconds()-start);
 		}
+#endif // __MINGW32__
 		else
 			dgr_receive(0);
+#if !defined __MINGW32__ && !defined _WIN32
+		dgr_clock_update();
+#endif
 	}
+
+	dgr_stats_update();
 }
@@ -16,10 +16,57 @@
 extern "C" {
 #endif
 
+/** A handle to a DGR variable, returned by dgr_register(). */
+typedef int dgr_handle;
+
+/** Flag for dgr_channel(): Slaves that miss a frame on the channel ask
+ * the master to send it again. */
+#define DGR_CHANNEL_RELIABLE 1
+
+/** Statistics about the frames that DGR sent (master) or received
+ * (slave) during the most recent statistics interval, see
+ * dgr_stats(). Times are in milliseconds. */
+typedef struct {
+	double seconds;          /**< Length of the interval (0 if an interval hasn't finished yet) */
+	long frames;             /**< Frames sent (master) or used (slave) */
+	long keyframes;          /**< Keyframes sent or used */
+	long packets;            /**< Packets sent or received */
+	long bytes;              /**< Bytes sent or received (including packet headers) */
+	long rawBytes;           /**< Master: Bytes in the frames before they were compressed */
+	double packetsPerSecond; /**< packets / seconds */
+	double bytesPerSecond;   /**< bytes / seconds */
+	long superseded;         /**< Slave: Complete frames that were replaced by a newer frame before they were used */
+	long incomplete;         /**< Slave: Frames that were discarded before all of their packets arrived */
+	double serialize;        /**< Average time to serialize (master) or unserialize (slave) a frame */
+	double serializeMax;     /**< Longest time to serialize or unserialize a frame */
+	double compress;         /**< Average time to compress (master) or decompress (slave) a frame that was compressed */
+	double latency;          /**< Slave: Average time between receiving the last packet of a frame and using it */
+	double latencyMax;       /**< Slave: Longest latency */
+	int records;             /**< Number of records; valid handles for dgr_stats_record() are 0 to records-1 */
+} dgr_stats_info;
+
+/** Statistics about a single record during the most recent statistics
+ * interval, see dgr_stats_record(). */
+typedef struct {
+	const char *name; /**< Name of the record (belongs to DGR) */
+	int size;         /**< Current size of the record's data */
+	long count;       /**< Number of frames that contained the record */
+	long bytes;       /**< Bytes that the record used in those frames (including its name) */
+} dgr_record_stats_info;
+
 void dgr_init(void);
 void dgr_update(int send, int receive);
+void dgr_framelock(int timeout);
+double dgr_time(void);
 void dgr_setget(const char *name, void* buffer, int bufferSize);
+dgr_handle dgr_register(const char *name, int size);
+void dgr_setget_handle(dgr_handle handle, void* buffer, int bufferSize);
+dgr_handle dgr_bind(const char *name, void *ptr, int size);
+int dgr_channel(const char *name, float rate, int flags);
+void dgr_channel_add(int channel, const char *prefix);
 void dgr_print_list(void);
+void dgr_stats(dgr_stats_info *stats);
+int dgr_stats_record(dgr_handle handle, dgr_record_stats_info *stats);
 int dgr_is_master(void);
 int dgr_is_enabled(void);
 	
@@ -109,6 +109,19 @@ const char* kuhl_config_get(const char *key)
 	return value;
 }
 
+/** Sets a key to a value, overriding any value for that key that is in
+    the config file. This is useful for programs (such as benchmarks)
+    that need specific settings regardless of the config file.
+
+    @param key The key to set.
+    @param value The value to store for the key.
+*/
+void kuhl_config_set(const char *key, const char *value)
+{
+	kuhl_config_get(key); // ensures that the config file is loaded.
+	cfg_set(cfg, key, value);
+}
+
 /** Checks if a key is set to a value in the config file.
 
     @return Returns 1 if the key is present and set to a non-empty
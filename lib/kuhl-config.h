@@ -20,6 +20,7 @@ extern "C" {
 
 void kuhl_config_filename(const char *filename);
 const char* kuhl_config_get(const char *key);
+void kuhl_config_set(const char *key, const char *value);
 int kuhl_config_isset(const char *key);
 int kuhl_config_boolean(const char *key, int returnWhenMissing, int returnInvalidValue);
 float kuhl_config_float(const char *key, float returnWhenMissing, float returnInvalidValue);
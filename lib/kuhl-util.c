@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <float.h> // for FLT_MAX
+#include <errno.h>
 #ifndef _WIN32
 #include <libgen.h> // for dirname()
 #include <sys/time.h> // gettimeofday()
@@ -72,9 +73,16 @@ void mat4f_from_aiMatrix4x4(float  dest[16], struct aiMatrix4x4 src)
 #endif
 
 
+/** 1 if kuhl_errorcheck() calls glGetError(), see kuhl_errorcheck_enable(). */
+static int kuhl_errorcheck_active = 1;
+/** 1 if kuhl_gl_debug_init() installed kuhl_gl_debug_callback(). */
+static int kuhl_gl_debug_installed = 0;
+
 /** Don't call this function, call kuhl_errorcheck() instead. */
 int kuhl_errorcheckFileLine(const char *file, int line, const char *func)
 {
+	if(!kuhl_errorcheck_active)
+		return 0;
 	GLenum errCode = glGetError();
 	if(errCode != GL_NO_ERROR)
 	{
@@ -85,6 +93,79 @@ int kuhl_errorcheckFileLine(const char *file, int line, const char *func)
 	return 0;
 }
 
+/** Turns kuhl_errorcheck() on or off. When it is off,
+ * kuhl_errorcheck() returns 0 without calling glGetError() (which
+ * can make the CPU wait for the graphics driver). kuhl_ogl_init()
+ * sets this from the gl.errorcheck config option, which is true
+ * unless libkuhl was compiled with KUHL_UTIL_NO_ERRORCHECK.
+ *
+ * If OpenGL supports debug output, errors are also reported by a
+ * callback. While error checking is on, the callback is synchronous
+ * (it is called before the OpenGL function that caused the error
+ * returns, so a debugger can show where the error happened). While
+ * it is off, OpenGL may call it later to avoid slowing down the
+ * driver.
+ *
+ * @param enable 1 to call glGetError() in kuhl_errorcheck(), 0 to
+ * skip it.
+ */
+void kuhl_errorcheck_enable(int enable)
+{
+	kuhl_errorcheck_active = enable;
+	if(kuhl_gl_debug_installed)
+	{
+		if(enable)
+			glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+		else
+			glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+	}
+}
+
+/** Receives messages from OpenGL's debug output and writes them to
+ * the log. Errors and high severity messages are printed as errors,
+ * medium severity messages as warnings and everything else only goes
+ * to the log file. */
+static void APIENTRY kuhl_gl_debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                            GLsizei length, const GLchar *message, const void *userParam)
+{
+	msg_type level = MSG_DEBUG;
+	if(type == GL_DEBUG_TYPE_ERROR || severity == GL_DEBUG_SEVERITY_HIGH)
+		level = MSG_ERROR;
+	else if(severity == GL_DEBUG_SEVERITY_MEDIUM)
+		level = MSG_WARNING;
+
+	/* Don't flood the console if something goes wrong every frame. */
+	static int shownCount = 0;
+	if(level != MSG_DEBUG)
+	{
+		if(shownCount == 50)
+			return;
+		shownCount++;
+		if(shownCount == 50)
+		{
+			msg_details(level, "OpenGL", 0, "debug output", "%s", message);
+			msg(MSG_WARNING, "Hiding any additional errors and warnings from OpenGL's debug output.");
+			return;
+		}
+	}
+	msg_details(level, "OpenGL", 0, "debug output", "%s", message);
+}
+
+/** Asks OpenGL to report errors and warnings to
+ * kuhl_gl_debug_callback(). Requires OpenGL 4.3 or the KHR_debug
+ * extension. */
+static void kuhl_gl_debug_init(void)
+{
+	if(!GLEW_VERSION_4_3 && !GLEW_KHR_debug)
+	{
+		msg(MSG_DEBUG, "OpenGL debug output (KHR_debug) is not available.");
+		return;
+	}
+	glDebugMessageCallback((GLDEBUGPROC) kuhl_gl_debug_callback, NULL);
+	glEnable(GL_DEBUG_OUTPUT);
+	kuhl_gl_debug_installed = 1;
+}
+
 /** An error callback function to be used with GLFW. */
 void kuhl_glfw_error(int error, const char* description)
 {
@@ -352,6 +433,17 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 	if(msaaSamples > 1)
 		glfwWindowHint(GLFW_SAMPLES, msaaSamples);
 
+	/* Use kuhl_errorcheck() and a debug context (which may be slower
+	 * but reports more problems) unless error checking is turned
+	 * off. */
+#ifdef KUHL_UTIL_NO_ERRORCHECK
+	int errorcheck = kuhl_config_boolean("gl.errorcheck", 0, 0);
+#else
+	int errorcheck = kuhl_config_boolean("gl.errorcheck", 1, 1);
+#endif
+	if(errorcheck)
+		glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+
 	/* Create a GLFW window */
 	
 	GLFWwindow *window = kuhl_glfw_create_window(width, height, argv[0]);
@@ -379,6 +471,9 @@ void kuhl_ogl_init(int *argcp, char **argv, int width, int height, int oglProfil
 	 * http://www.opengl.org/wiki/OpenGL_Loading_Library */
 	glGetError();
 
+	kuhl_gl_debug_init();
+	kuhl_errorcheck_enable(errorcheck);
+
 
 	kuhl_diagnostics(); /* print additional information in log file */
 
@@ -543,6 +638,7 @@ void kuhl_delete_program(GLuint program)
 		glDeleteShader(shaders[i]);
 	}
 	glDeleteProgram(program);
+	kuhl_uniform_cache_invalidate(program);
 }
 
 /** Creates an OpenGL program from pair of files containing a vertex
@@ -588,6 +684,8 @@ GLuint kuhl_create_program(const char *vertexFilename, const char *fragFilename)
 	/* Try to link the program. */
 	glLinkProgram(program);
 	kuhl_errorcheck();
+	/* A program we deleted earlier may have had the same name. */
+	kuhl_uniform_cache_invalidate(program);
 
 	/* Check if glLinkProgram was successful. */
 	GLint linked;
@@ -626,13 +724,389 @@ void kuhl_print_program_log(GLuint program)
 
 
 
+/** A uniform location stored in a kuhl_uniform_cache. */
+typedef struct {
+	char *name;        /**< Name of the uniform variable */
+	unsigned int hash; /**< kuhl_uniform_hash(name) */
+	GLint location;    /**< Location of the variable, -1 if it is missing or inactive */
+} kuhl_uniform_location;
+
+/** Uniform locations for one GLSL program. The locations are looked
+ * up once (when the cache is built or the first time an unknown name
+ * is requested) so that kuhl_geometry_draw() and kuhl_get_uniform()
+ * don't need to ask OpenGL for them every time they are used. */
+typedef struct {
+	int valid;                   /**< 1 if the cache has been built for the program */
+	kuhl_uniform_location *list; /**< Locations that have been looked up */
+	int count;                   /**< Number of items in list */
+	int capacity;                /**< Number of items allocated for list */
+	GLint hasTex;        /**< Location of "HasTex" */
+	GLint boneMat;       /**< Location of "BoneMat" */
+	GLint numBones;      /**< Location of "NumBones" */
+	GLint geomTransform; /**< Location of "GeomTransform" */
+	GLint modelView;     /**< Location of "ModelView" */
+	GLint instanceMat;    /**< Location of "InstanceMat" */
+	GLint useInstanceMat; /**< Location of "UseInstanceMat" */
+	int instanceUnitSet;  /**< 1 once InstanceMat has been pointed at KUHL_INSTANCE_TEXTURE_UNIT */
+} kuhl_uniform_cache;
+
+/** Uniform location caches indexed by GLSL program name. */
+static kuhl_uniform_cache *kuhl_uniform_caches = NULL;
+static GLuint kuhl_uniform_caches_size = 0;
+
+/** Computes a hash of a uniform variable name (32-bit FNV-1a). */
+static unsigned int kuhl_uniform_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	for(const unsigned char *c = (const unsigned char*) name; *c != '\0'; c++)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** Adds a location to a uniform location cache. */
+static void kuhl_uniform_cache_add(kuhl_uniform_cache *cache, const char *name, unsigned int hash, GLint location)
+{
+	if(cache->count == cache->capacity)
+	{
+		int capacity = cache->capacity == 0 ? 16 : cache->capacity*2;
+		kuhl_uniform_location *list = (kuhl_uniform_location*) realloc(cache->list, sizeof(kuhl_uniform_location)*capacity);
+		if(list == NULL)
+		{
+			msg(MSG_FATAL, "Failed to grow a uniform location cache to %d items.\n", capacity);
+			exit(EXIT_FAILURE);
+		}
+		cache->list = list;
+		cache->capacity = capacity;
+	}
+	kuhl_uniform_location *u = &(cache->list[cache->count++]);
+	u->name = strdup(name);
+	u->hash = hash;
+	u->location = location;
+}
+
+/** Looks up the location of a uniform variable in a cache. If the
+ * name isn't in the cache yet, OpenGL is asked for the location and
+ * the answer (even if the variable is missing) is added to the cache.
+ *
+ * @param program The program that the cache belongs to.
+ * @param cache The cache for the program.
+ * @param name The name of the uniform variable.
+ * @param hash kuhl_uniform_hash(name)
+ * @return The location of the variable or -1 if it is missing or inactive.
+ */
+static GLint kuhl_uniform_cache_lookup(GLuint program, kuhl_uniform_cache *cache, const char *name, unsigned int hash)
+{
+	for(int i=0; i<cache->count; i++)
+	{
+		const kuhl_uniform_location *u = &(cache->list[i]);
+		if(u->hash == hash && strcmp(u->name, name) == 0)
+			return u->location;
+	}
+	GLint location = glGetUniformLocation(program, name);
+	kuhl_uniform_cache_add(cache, name, hash, location);
+	return location;
+}
+
+/** Gets the uniform location cache for a program, building it if
+ * necessary. Building the cache records the location of every active
+ * uniform in the program and the locations of the variables that
+ * kuhl_geometry_draw() sets.
+ *
+ * @param program A linked GLSL program.
+ * @return The cache for the program.
+ */
+static kuhl_uniform_cache* kuhl_uniform_cache_get(GLuint program)
+{
+	if(program >= kuhl_uniform_caches_size)
+	{
+		GLuint newSize = program+1 > kuhl_uniform_caches_size*2 ? program+1 : kuhl_uniform_caches_size*2;
+		kuhl_uniform_cache *caches = (kuhl_uniform_cache*) realloc(kuhl_uniform_caches, sizeof(kuhl_uniform_cache)*newSize);
+		if(caches == NULL)
+		{
+			msg(MSG_FATAL, "Failed to allocate uniform location caches for %u programs.\n", newSize);
+			exit(EXIT_FAILURE);
+		}
+		kuhl_uniform_caches = caches;
+		memset(kuhl_uniform_caches+kuhl_uniform_caches_size, 0, sizeof(kuhl_uniform_cache)*(newSize-kuhl_uniform_caches_size));
+		kuhl_uniform_caches_size = newSize;
+	}
+	kuhl_uniform_cache *cache = &(kuhl_uniform_caches[program]);
+	if(cache->valid)
+		return cache;
+
+	cache->valid = 1;
+	cache->count = 0;
+	cache->instanceUnitSet = 0;
+	GLint numUniforms = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &numUniforms);
+	for(int i=0; i<numUniforms; i++)
+	{
+		char name[1024];
+		GLint arraySize = 0;
+		GLenum type = 0;
+		GLsizei length = 0;
+		glGetActiveUniform(program, i, sizeof(name), &length, &arraySize, &type, name);
+		GLint location = glGetUniformLocation(program, name);
+		kuhl_uniform_cache_add(cache, name, kuhl_uniform_hash(name), location);
+
+		/* Arrays are listed as "name[0]" but are usually referred to
+		 * as "name". */
+		if(length > 3 && strcmp(name+length-3, "[0]") == 0)
+		{
+			name[length-3] = '\0';
+			kuhl_uniform_cache_add(cache, name, kuhl_uniform_hash(name), location);
+		}
+	}
+	kuhl_errorcheck();
+
+	cache->hasTex        = kuhl_uniform_cache_lookup(program, cache, "HasTex",        kuhl_uniform_hash("HasTex"));
+	cache->boneMat       = kuhl_uniform_cache_lookup(program, cache, "BoneMat",       kuhl_uniform_hash("BoneMat"));
+	cache->numBones      = kuhl_uniform_cache_lookup(program, cache, "NumBones",      kuhl_uniform_hash("NumBones"));
+	cache->geomTransform = kuhl_uniform_cache_lookup(program, cache, "GeomTransform", kuhl_uniform_hash("GeomTransform"));
+	cache->modelView     = kuhl_uniform_cache_lookup(program, cache, "ModelView",     kuhl_uniform_hash("ModelView"));
+	cache->instanceMat    = kuhl_uniform_cache_lookup(program, cache, "InstanceMat",    kuhl_uniform_hash("InstanceMat"));
+	cache->useInstanceMat = kuhl_uniform_cache_lookup(program, cache, "UseInstanceMat", kuhl_uniform_hash("UseInstanceMat"));
+	return cache;
+}
+
+/** Discards the cached uniform locations for a program. kuhl-util
+ * calls this when it links or deletes a program. If you link a
+ * program yourself (for example, to relink it after changing its
+ * shaders), call this function afterwards so that
+ * kuhl_get_uniform() and kuhl_geometry_draw() don't use stale
+ * locations.
+ *
+ * @param program The GLSL program.
+ */
+void kuhl_uniform_cache_invalidate(GLuint program)
+{
+	if(program >= kuhl_uniform_caches_size)
+		return;
+	kuhl_uniform_cache *cache = &(kuhl_uniform_caches[program]);
+	for(int i=0; i<cache->count; i++)
+		free(cache->list[i].name);
+	cache->count = 0;
+	cache->valid = 0;
+}
+
+
+/** Number of texture units whose GL_TEXTURE_2D binding is tracked by
+ * kuhl_bind_texture(). */
+#define KUHL_GL_STATE_TEXTURE_UNITS 32
+/** Value stored in kuhl_gl_state for a binding that we don't know. */
+#define KUHL_GL_STATE_UNKNOWN 0xFFFFFFFFu
+
+/** A copy of the OpenGL bindings that kuhl-util changes. Keeping our
+ * own copy lets kuhl_geometry_draw() skip binds that wouldn't change
+ * anything without asking OpenGL what is bound (glGet*() calls can
+ * force the driver to wait for the GPU). All zeros matches the state
+ * of a newly created OpenGL context. */
+typedef struct {
+	GLuint program;     /**< Current GLSL program */
+	GLuint vao;         /**< Bound vertex array object */
+	GLuint arrayBuffer; /**< Buffer bound to GL_ARRAY_BUFFER */
+	GLuint activeUnit;  /**< Active texture unit (0 for GL_TEXTURE0) */
+	GLuint texture[KUHL_GL_STATE_TEXTURE_UNITS]; /**< Texture bound to GL_TEXTURE_2D in each texture unit */
+} kuhl_gl_state;
+
+static kuhl_gl_state kuhl_gl_shadow;
+
+/** Returns 1 if the gl.validate config option is set. When it is,
+ * kuhl-util checks objects with glIsProgram(), glIsTexture(),
+ * etc. before it draws them and checks that kuhl_gl_shadow matches
+ * OpenGL. These checks ask OpenGL for information every time
+ * something is drawn, so they are off by default. */
+static int kuhl_gl_validate(void)
+{
+	static int validate = -1;
+	if(validate < 0)
+		validate = kuhl_config_boolean("gl.validate", 0, 0);
+	return validate;
+}
+
+/** Forgets the OpenGL bindings that kuhl-util has recorded. The next
+ * bind of each kind is always sent to OpenGL, and
+ * kuhl_current_program() asks OpenGL which program is in use.
+ *
+ * kuhl-util assumes that programs, vertex array objects,
+ * GL_ARRAY_BUFFER buffers and 2D textures are only bound with
+ * kuhl_use_program(), kuhl_bind_vertex_array(), kuhl_bind_buffer()
+ * and kuhl_bind_texture(). If you call glUseProgram(),
+ * glBindVertexArray(), glBindBuffer(), glActiveTexture() or
+ * glBindTexture() directly, or delete an object that might be bound,
+ * call this function before you use kuhl_geometry_draw() or
+ * kuhl_get_uniform() again. Set gl.validate in the config file to
+ * find places where this is needed.
+ */
+void kuhl_gl_state_invalidate(void)
+{
+	kuhl_gl_shadow.program = KUHL_GL_STATE_UNKNOWN;
+	kuhl_gl_shadow.vao = KUHL_GL_STATE_UNKNOWN;
+	kuhl_gl_shadow.arrayBuffer = KUHL_GL_STATE_UNKNOWN;
+	kuhl_gl_shadow.activeUnit = KUHL_GL_STATE_UNKNOWN;
+	for(int i=0; i<KUHL_GL_STATE_TEXTURE_UNITS; i++)
+		kuhl_gl_shadow.texture[i] = KUHL_GL_STATE_UNKNOWN;
+}
+
+/** Compares kuhl_gl_shadow with the bindings that OpenGL reports
+ * and prints a warning for each difference. OpenGL's values replace
+ * the ones that were wrong. Only used when gl.validate is set. */
+static void kuhl_gl_state_check(void)
+{
+	GLint program = 0, vao = 0, arrayBuffer = 0, activeTexture = 0, texture = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vao);
+	glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &arrayBuffer);
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &texture);
+	GLuint activeUnit = activeTexture - GL_TEXTURE0;
+
+	const char *advice = "Use kuhl_use_program(), kuhl_bind_vertex_array(), kuhl_bind_buffer() and kuhl_bind_texture() instead of calling OpenGL directly, or call kuhl_gl_state_invalidate() after you do.";
+	if(kuhl_gl_shadow.program != KUHL_GL_STATE_UNKNOWN && kuhl_gl_shadow.program != (GLuint) program)
+		msg(MSG_WARNING, "Program %d is in use but kuhl-util expected program %u. %s", program, kuhl_gl_shadow.program, advice);
+	if(kuhl_gl_shadow.vao != KUHL_GL_STATE_UNKNOWN && kuhl_gl_shadow.vao != (GLuint) vao)
+		msg(MSG_WARNING, "Vertex array object %d is bound but kuhl-util expected %u. %s", vao, kuhl_gl_shadow.vao, advice);
+	if(kuhl_gl_shadow.arrayBuffer != KUHL_GL_STATE_UNKNOWN && kuhl_gl_shadow.arrayBuffer != (GLuint) arrayBuffer)
+		msg(MSG_WARNING, "Buffer %d is bound to GL_ARRAY_BUFFER but kuhl-util expected %u. %s", arrayBuffer, kuhl_gl_shadow.arrayBuffer, advice);
+	if(kuhl_gl_shadow.activeUnit != KUHL_GL_STATE_UNKNOWN && kuhl_gl_shadow.activeUnit != activeUnit)
+		msg(MSG_WARNING, "Texture unit %u is active but kuhl-util expected %u. %s", activeUnit, kuhl_gl_shadow.activeUnit, advice);
+	if(activeUnit < KUHL_GL_STATE_TEXTURE_UNITS &&
+	   kuhl_gl_shadow.texture[activeUnit] != KUHL_GL_STATE_UNKNOWN &&
+	   kuhl_gl_shadow.texture[activeUnit] != (GLuint) texture)
+		msg(MSG_WARNING, "Texture %d is bound to texture unit %u but kuhl-util expected %u. %s", texture, activeUnit, kuhl_gl_shadow.texture[activeUnit], advice);
+
+	kuhl_gl_shadow.program = program;
+	kuhl_gl_shadow.vao = vao;
+	kuhl_gl_shadow.arrayBuffer = arrayBuffer;
+	kuhl_gl_shadow.activeUnit = activeUnit;
+	if(activeUnit < KUHL_GL_STATE_TEXTURE_UNITS)
+		kuhl_gl_shadow.texture[activeUnit] = texture;
+}
+
+/** Removes a texture name from kuhl_gl_shadow. Call this when a
+ * texture is deleted or a new texture name is generated: OpenGL
+ * unbinds textures when they are deleted and may reuse their names,
+ * so a texture unit that we think has the name bound might not. */
+static void kuhl_gl_state_forget_texture(GLuint texture)
+{
+	for(int i=0; i<KUHL_GL_STATE_TEXTURE_UNITS; i++)
+	{
+		if(kuhl_gl_shadow.texture[i] == texture)
+			kuhl_gl_shadow.texture[i] = KUHL_GL_STATE_UNKNOWN;
+	}
+}
+
+/** Same as glUseProgram() except that nothing is sent to OpenGL if
+ * the program is already in use. See kuhl_gl_state_invalidate().
+ *
+ * @param program The GLSL program to use (0 for none).
+ */
+void kuhl_use_program(GLuint program)
+{
+	if(kuhl_gl_shadow.program == program)
+		return;
+	glUseProgram(program);
+	kuhl_gl_shadow.program = program;
+}
+
+/** Returns the GLSL program that is in use without asking OpenGL
+ * (unless kuhl_gl_state_invalidate() was called since the program
+ * was last changed).
+ *
+ * @return The current GLSL program or 0 if none is in use.
+ */
+GLuint kuhl_current_program(void)
+{
+	if(kuhl_gl_shadow.program == KUHL_GL_STATE_UNKNOWN)
+	{
+		GLint program = 0;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+		kuhl_gl_shadow.program = program;
+	}
+	return kuhl_gl_shadow.program;
+}
+
+/** Same as glBindVertexArray() except that nothing is sent to OpenGL
+ * if the vertex array object is already bound. See
+ * kuhl_gl_state_invalidate().
+ *
+ * @param vao The vertex array object to bind (0 for none).
+ */
+void kuhl_bind_vertex_array(GLuint vao)
+{
+	if(kuhl_gl_shadow.vao == vao)
+		return;
+	glBindVertexArray(vao);
+	kuhl_gl_shadow.vao = vao;
+}
+
+/** Same as glBindBuffer() except that nothing is sent to OpenGL if
+ * the buffer is already bound to GL_ARRAY_BUFFER. Other targets are
+ * always passed to OpenGL (the GL_ELEMENT_ARRAY_BUFFER binding, for
+ * example, is part of the bound vertex array object). See
+ * kuhl_gl_state_invalidate().
+ *
+ * @param target The target to bind the buffer to.
+ * @param buffer The buffer to bind (0 for none).
+ */
+void kuhl_bind_buffer(GLenum target, GLuint buffer)
+{
+	if(target != GL_ARRAY_BUFFER)
+	{
+		glBindBuffer(target, buffer);
+		return;
+	}
+	if(kuhl_gl_shadow.arrayBuffer == buffer)
+		return;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	kuhl_gl_shadow.arrayBuffer = buffer;
+}
+
+/** Makes a texture unit active if it isn't already. */
+static void kuhl_active_texture(GLuint unit)
+{
+	if(kuhl_gl_shadow.activeUnit == unit)
+		return;
+	glActiveTexture(GL_TEXTURE0+unit);
+	kuhl_gl_shadow.activeUnit = unit;
+}
+
+/** Binds a 2D texture to a texture unit. Nothing is sent to OpenGL
+ * if the texture is already bound to the unit. The active texture
+ * unit may change. See kuhl_gl_state_invalidate().
+ *
+ * @param unit The texture unit (0 for GL_TEXTURE0).
+ * @param texture The texture to bind (0 for none).
+ */
+void kuhl_bind_texture(GLuint unit, GLuint texture)
+{
+	if(unit < KUHL_GL_STATE_TEXTURE_UNITS && kuhl_gl_shadow.texture[unit] == texture)
+		return;
+	kuhl_active_texture(unit);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	if(unit < KUHL_GL_STATE_TEXTURE_UNITS)
+		kuhl_gl_shadow.texture[unit] = texture;
+}
+
+/** Binds a 2D texture to the active texture unit so that its
+ * parameters and image can be changed. */
+static void kuhl_bind_texture_active(GLuint texture)
+{
+	if(kuhl_gl_shadow.activeUnit == KUHL_GL_STATE_UNKNOWN)
+		kuhl_active_texture(0);
+	kuhl_bind_texture(kuhl_gl_shadow.activeUnit, texture);
+}
+
 /** Provides functionality similar to glGetUniformLocation() with
  * error checking. However, unlike glGetUniformLocation(), this
  * function gets the location of the variable from the active OpenGL
- * program instead of a specified one. If a problem occurs, an
- * appropriate error message is printed to the standard error. This
- * function may exit or return -1 if the uniform location is not
- * found.
+ * program (set with kuhl_use_program()) instead of a specified
+ * one. If a problem occurs, an appropriate error message is printed
+ * to the standard error. This function may exit or return -1 if the
+ * uniform location is not found.
  *
  * @param uniformName The name of the uniform variable.
  *
@@ -647,23 +1121,31 @@ GLint kuhl_get_uniform(const char *uniformName)
 		return -1;
 	}
 
-	GLint currentProgram = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &currentProgram);
+	GLuint currentProgram = kuhl_current_program();
+	if(currentProgram == 0)
+	{
+		/* Before we complain, check if the program was set with
+		 * glUseProgram() instead of kuhl_use_program(). */
+		kuhl_gl_state_invalidate();
+		currentProgram = kuhl_current_program();
+		if(currentProgram != 0)
+			msg(MSG_WARNING, "GLSL program %u was set with glUseProgram(). Use kuhl_use_program() instead so that kuhl-util knows which program is in use.\n", currentProgram);
+	}
 	if(currentProgram == 0)
 	{
 		msg(MSG_ERROR, "Can't get the uniform location of %s because no GLSL program is currently being used.\n", uniformName);
 		return -1;
 	}
-	
-	if(!glIsProgram(currentProgram))
+
+	if(kuhl_gl_validate() && !glIsProgram(currentProgram))
 	{
 		msg(MSG_ERROR, "The current active program (%d) is not a valid GLSL program.\n", currentProgram);
 		return -1;
 	}
 
 	static int missingUniformCount = 0;
-	GLint loc = glGetUniformLocation(currentProgram, uniformName);
-	kuhl_errorcheck();
+	kuhl_uniform_cache *cache = kuhl_uniform_cache_get(currentProgram);
+	GLint loc = kuhl_uniform_cache_lookup(currentProgram, cache, uniformName, kuhl_uniform_hash(uniformName));
 	if(loc == -1 && missingUniformCount < 50)
 	{
 		msg(MSG_ERROR, "Uniform variable '%s' is missing or inactive in your GLSL program.\n", uniformName);
@@ -967,7 +1449,8 @@ void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name
 	}
 	
 	/* Find the uniform variable location inside of the GLSL program. */
-	GLint samplerLocation = glGetUniformLocation(geom->program, name);
+	unsigned int hash = kuhl_uniform_hash(name);
+	GLint samplerLocation = kuhl_uniform_cache_lookup(geom->program, kuhl_uniform_cache_get(geom->program), name, hash);
 	if(samplerLocation == -1)
 	{
 		if(kg_options & KG_WARN)
@@ -1002,6 +1485,7 @@ void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name
 	}
 
 	geom->textures[destIndex].name = strdup(name);
+	geom->textures[destIndex].name_hash = hash;
 	geom->textures[destIndex].textureId = texture;
 }
 
@@ -1030,146 +1514,611 @@ int kuhl_geometry_attrib_index(kuhl_geometry *geom, const char *name)
 	return -1;
 }
 
-/** Retrieves vertex attribute information stored in an OpenGL array
- * buffer.
- *
- * @param geom The geometry object containing the attribute that you
- * want to retrieve.
- *
- * @param name The GLSL variable name of the attribute that you are
- * interested in.
- *
- * @param size A pointer to an integer that will be filled in with the
- * length of the data retrieved.
- *
- * @return A pointer to a array of floats which contains all of
- * per-vertex data for this attribute. Any changes you make to the
- * array will automatically be propagated back to OpenGL before the
- * next time the geometry is drawn. The array should NOT be
- * free()'d. It also should NOT be accessed after the geometry is
- * drawn. If you want to continue to access the data, you should call
- * kuhl_geometry_attrib_get() every frame. If you aren't changing the
- * data but still want access to it, it is best to make a copy of the
- * array that kuhl_geometry_attrib_get() returns instead of calling it
- * every single frame to retrieve the same data repeatedly.
- */
-GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size)
+/** Returns 1 if another attribute in the geometry is stored in the
+ * same buffer as geom->attribs[index]. */
+static int kuhl_attrib_buffer_shared(const kuhl_geometry *geom, unsigned int index)
 {
-	if(size != NULL)
-		*size = 0;
-
-	if(geom == NULL || name == NULL || size == NULL)
-		return NULL;
-
-	int index = kuhl_geometry_attrib_index(geom, name);
-	if(index < 0)
-		return NULL;
-
-	/* Bind the VAO and the buffer we are interested in */
-	kuhl_attrib *attrib = &(geom->attribs[index]);
-	if(!glIsBuffer(attrib->bufferobject) || !glIsVertexArray(geom->vao))
-		return NULL;
-	glBindVertexArray(geom->vao);
-	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
-	kuhl_errorcheck();
-
-	/* Get the size of the buffer */
-	GLint bufferSize = 0;
-	glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
-	GLint bufferNumFloats = bufferSize / sizeof(GLfloat);
-
-	/* Get a pointer to the memory-mapped array (but first check if
-	 * the buffer is already mapped. */
-	GLfloat *ret;
-	glGetBufferPointerv(GL_ARRAY_BUFFER, GL_BUFFER_MAP_POINTER, (void**) &ret);
-	if(ret == NULL) /* If buffer is not already mapped */
-		ret = (GLfloat*) glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
-
-	/* NOTE: We will unmap any buffer that needs unmapping in
-	 * kuhl_geometry_draw() before we draw. */
-	kuhl_errorcheck();
-	if(ret == NULL)
-		return NULL;
-	*size = bufferNumFloats;
-
-	// unbind
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
-	kuhl_errorcheck();
-
-	return ret;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		if(i != index && geom->attribs[i].bufferobject == geom->attribs[index].bufferobject)
+			return 1;
+	}
+	return 0;
 }
 
-/** Changes the GLSL program that is used by a kuhl_geometry object.
- *
- * @param geom A geometry that you want to change the GLSL program for.
- *
- * @param program The new GLSL program you wish to use with the geometry.
- *
- * @param kg_options Set this to KG_FULL_LIST to apply the new program
- * to all geometries in the kuhl_geometry linked list. Otherwise, set
- * to 0.
- */
-void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
+/** Converts a float into a 16-bit half float, rounding to the
+ * nearest representable value. */
+static GLushort kuhl_float_to_half(float f)
 {
-	if(geom == NULL)
-		return;
-
-	if(kg_options & KG_FULL_LIST)
-		kuhl_geometry_program(geom->next, program, kg_options);
-
-	// If the caller deleted their old program and created a new one,
-	// the new program ID might match the old program ID. Therefore,
-	// we can't rely on the program IDs to verify that the user
-	// changed the program.
-
-	if(!glIsProgram(program))
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	unsigned int sign = (bits >> 16) & 0x8000;
+	int exponent = (int) ((bits >> 23) & 0xff);
+	unsigned int mantissa = bits & 0x7fffff;
+
+	if(exponent == 0xff) // infinity or NaN
+		return (GLushort) (sign | 0x7c00 | (mantissa ? 0x200 : 0));
+	exponent = exponent - 127 + 15;
+	if(exponent >= 31) // too large, use infinity
+		return (GLushort) (sign | 0x7c00);
+
+	unsigned int half, remainder, halfway;
+	if(exponent <= 0)
 	{
-		msg(MSG_WARNING, "GLSL program %d is not a valid program.\n",program);
+		/* Too small for a normalized half float. */
+		if(exponent < -10)
+			return (GLushort) sign;
+		mantissa |= 0x800000;
+		unsigned int shift = (unsigned int) (14 - exponent);
+		half = mantissa >> shift;
+		remainder = mantissa & ((1u << shift) - 1);
+		halfway = 1u << (shift - 1);
 	}
-	
-	geom->program = program;
-
-	/* Iterate through the vertex attributes in this kuhl_geometry
-	 * object and determine where these attributes should go in the
-	 * newly specified program. */
-	glBindVertexArray(geom->vao);
-	for(unsigned int i=0; i<geom->attrib_count; i++)
+	else
 	{
-		kuhl_attrib *attrib = &(geom->attribs[i]);
-		glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
-		kuhl_errorcheck();
-
-		// Find attribute location in the new program; enable that location
-		GLint attribLocation = kuhl_get_attribute(geom->program, attrib->name);
-		glEnableVertexAttribArray(attribLocation);
-
-		/* Get the size of the buffer */
-		GLint bufferSize = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
-		GLint bufferNumFloats = bufferSize/sizeof(GLfloat);
-		GLint components = bufferNumFloats / geom->vertex_count;
-
-		/* Connect this vertex attribute with the (possibly different)
-		 * attribute location. */
-		glVertexAttribPointer(
-			attribLocation, // attribute location in glsl program
-			components, // number of elements (x,y,z)
-			GL_FLOAT, // type of each element
-			GL_FALSE, // should OpenGL normalize values?
-			0,        // no extra data between each position
-			0 );      // offset of first element
-		kuhl_errorcheck();
+		half = ((unsigned int) exponent << 10) | (mantissa >> 13);
+		remainder = mantissa & 0x1fff;
+		halfway = 0x1000;
 	}
+	/* Round to nearest, ties to even. A carry out of the mantissa
+	 * correctly increments the exponent. */
+	if(remainder > halfway || (remainder == halfway && (half & 1)))
+		half++;
+	return (GLushort) (sign | half);
+}
 
-	/* NOTE: We do not have to update the uniform locations because
-	 * they are determined in kuhl_geometry_draw() */
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+/** Converts a 16-bit half float into a float. */
+static float kuhl_half_to_float(GLushort h)
+{
+	unsigned int sign = (unsigned int) (h & 0x8000) << 16;
+	unsigned int exponent = (h >> 10) & 0x1f;
+	unsigned int mantissa = h & 0x3ff;
+	if(exponent == 0) // zero or subnormal
+	{
+		float f = ldexpf((float) mantissa, -24);
+		return sign ? -f : f;
+	}
+	unsigned int bits;
+	if(exponent == 31) // infinity or NaN
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	else
+		bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
 }
 
+/** Clamps a value to a range and scales it to an integer range for
+ * a normalized attribute. */
+static long kuhl_attrib_quantize(float value, float min, float max, float scale)
+{
+	if(!(value >= min)) // also catches NaN
+		value = min;
+	if(value > max)
+		value = max;
+	return lroundf(value * scale);
+}
 
-/** Adds a vertex attribute (such as vertex position, normal, color,
+/** Returns the number of bytes an attribute uses in each vertex of
+ * an interleaved buffer. It is rounded up to a multiple of 4 so that
+ * every attribute starts on a 4-byte boundary. */
+static GLuint kuhl_attrib_bytes(const kuhl_attrib *attrib)
+{
+	GLuint size;
+	switch(attrib->type)
+	{
+		case GL_INT_2_10_10_10_REV:
+			size = 4;
+			break;
+		case GL_HALF_FLOAT:
+		case GL_SHORT:
+		case GL_UNSIGNED_SHORT:
+			size = 2*attrib->components;
+			break;
+		case GL_UNSIGNED_BYTE:
+			size = attrib->components;
+			break;
+		default:
+			size = sizeof(GLfloat)*attrib->components;
+	}
+	return (size + 3) & ~3u;
+}
+
+/** Stores one vertex of an attribute in the attribute's format.
+ *
+ * @param attrib The attribute.
+ * @param src attrib->components floats.
+ * @param dest Where the vertex is in the interleaved buffer.
+ */
+static void kuhl_attrib_encode(const kuhl_attrib *attrib, const GLfloat *src, unsigned char *dest)
+{
+	GLuint n = attrib->components;
+	switch(attrib->type)
+	{
+		case GL_HALF_FLOAT:
+		{
+			GLushort half[4];
+			for(GLuint c=0; c<n; c++)
+				half[c] = kuhl_float_to_half(src[c]);
+			memcpy(dest, half, sizeof(GLushort)*n);
+			break;
+		}
+		case GL_INT_2_10_10_10_REV:
+		{
+			/* x, y, z are signed 10-bit values; w is 0. */
+			GLuint packed = 0;
+			for(GLuint c=0; c<3; c++)
+				packed |= ((GLuint) kuhl_attrib_quantize(src[c], -1, 1, 511) & 0x3ff) << (10*c);
+			memcpy(dest, &packed, sizeof(packed));
+			break;
+		}
+		case GL_SHORT:
+		{
+			GLshort value[4];
+			for(GLuint c=0; c<n; c++)
+				value[c] = (GLshort) kuhl_attrib_quantize(src[c], -1, 1, 32767);
+			memcpy(dest, value, sizeof(GLshort)*n);
+			break;
+		}
+		case GL_UNSIGNED_SHORT:
+		{
+			GLushort value[4];
+			for(GLuint c=0; c<n; c++)
+				value[c] = (GLushort) kuhl_attrib_quantize(src[c], 0, 1, 65535);
+			memcpy(dest, value, sizeof(GLushort)*n);
+			break;
+		}
+		case GL_UNSIGNED_BYTE:
+		{
+			long sum = 0, largest = 0;
+			float total = 0;
+			for(GLuint c=0; c<n; c++)
+			{
+				if(attrib->normalized)
+					dest[c] = (unsigned char) kuhl_attrib_quantize(src[c], 0, 1, 255);
+				else
+					dest[c] = (unsigned char) kuhl_attrib_quantize(src[c], 0, 255, 1);
+				sum += dest[c];
+				total += src[c];
+				if(dest[c] > dest[largest])
+					largest = c;
+			}
+			/* Bone weights add up to 1. Rounding each one separately
+			 * can make them add up to slightly more or less, which
+			 * scales the vertex, so put the difference in the largest
+			 * weight. */
+			if(attrib->normalized && strcmp(attrib->name, "in_BoneWeight") == 0)
+			{
+				long fixed = dest[largest] + lroundf(total*255) - sum;
+				if(fixed >= 0 && fixed <= 255)
+					dest[largest] = (unsigned char) fixed;
+			}
+			break;
+		}
+		default:
+			memcpy(dest, src, sizeof(GLfloat)*n);
+	}
+}
+
+/** Reads one vertex of an attribute from its format. This is the
+ * inverse of kuhl_attrib_encode().
+ *
+ * @param attrib The attribute.
+ * @param src Where the vertex is in the interleaved buffer.
+ * @param dest attrib->components floats.
+ */
+static void kuhl_attrib_decode(const kuhl_attrib *attrib, const unsigned char *src, GLfloat *dest)
+{
+	GLuint n = attrib->components;
+	switch(attrib->type)
+	{
+		case GL_HALF_FLOAT:
+		{
+			GLushort half[4];
+			memcpy(half, src, sizeof(GLushort)*n);
+			for(GLuint c=0; c<n; c++)
+				dest[c] = kuhl_half_to_float(half[c]);
+			break;
+		}
+		case GL_INT_2_10_10_10_REV:
+		{
+			GLuint packed;
+			memcpy(&packed, src, sizeof(packed));
+			for(GLuint c=0; c<n && c<3; c++)
+			{
+				int value = (int) ((packed >> (10*c)) & 0x3ff);
+				if(value & 0x200) // sign extend
+					value -= 0x400;
+				dest[c] = value < -511 ? -1.0f : value / 511.0f;
+			}
+			break;
+		}
+		case GL_SHORT:
+		{
+			GLshort value[4];
+			memcpy(value, src, sizeof(GLshort)*n);
+			for(GLuint c=0; c<n; c++)
+				dest[c] = value[c] < -32767 ? -1.0f : value[c] / 32767.0f;
+			break;
+		}
+		case GL_UNSIGNED_SHORT:
+		{
+			GLushort value[4];
+			memcpy(value, src, sizeof(GLushort)*n);
+			for(GLuint c=0; c<n; c++)
+				dest[c] = value[c] / 65535.0f;
+			break;
+		}
+		case GL_UNSIGNED_BYTE:
+			for(GLuint c=0; c<n; c++)
+				dest[c] = attrib->normalized ? src[c] / 255.0f : src[c];
+			break;
+		default:
+			memcpy(dest, src, sizeof(GLfloat)*n);
+	}
+}
+
+/** Picks a format for an attribute that is smaller than 32-bit
+ * floats if the data can be stored in it without a visible
+ * difference. The format is chosen by the attribute's name (the
+ * names used by kuhl_load_model()) and the range of the data:
+ *
+ * - in_Position: half floats, if the rounding error is small compared
+ *   to the size of the geometry.
+ * - in_Normal: signed 10-bit integers (GL_INT_2_10_10_10_REV) or, if
+ *   OpenGL 3.3 isn't available, signed 16-bit integers.
+ * - in_TexCoord: unsigned 16-bit integers, if they are within [0,1].
+ * - in_Color and in_BoneWeight: unsigned bytes, if they are within [0,1].
+ * - in_BoneIndex: unsigned bytes.
+ *
+ * Integer formats are normalized (except for bone indices) so that
+ * the vertex program still receives floats.
+ *
+ * @param attrib The attribute. Its type is left as GL_FLOAT if no
+ * compact format fits.
+ * @param data The first component of the attribute in the first vertex.
+ * @param floatStride The number of floats between vertices in data.
+ * @param vertexCount The number of vertices.
+ */
+static void kuhl_attrib_compact(kuhl_attrib *attrib, const GLfloat *data, GLuint floatStride, GLuint vertexCount)
+{
+	GLuint n = attrib->components;
+	if(n > 4 || vertexCount == 0)
+		return;
+
+	float min[4], max[4];
+	int integral = 1;
+	for(GLuint c=0; c<n; c++)
+	{
+		min[c] = FLT_MAX;
+		max[c] = -FLT_MAX;
+	}
+	for(GLuint v=0; v<vertexCount; v++)
+	{
+		for(GLuint c=0; c<n; c++)
+		{
+			float value = data[v*floatStride+c];
+			if(value < min[c])
+				min[c] = value;
+			if(value > max[c])
+				max[c] = value;
+			if(value != floorf(value))
+				integral = 0;
+		}
+	}
+	float low = min[0], high = max[0];
+	for(GLuint c=1; c<n; c++)
+	{
+		low = fminf(low, min[c]);
+		high = fmaxf(high, max[c]);
+	}
+	/* NaN or infinity */
+	if(!(low >= -FLT_MAX && high <= FLT_MAX))
+		return;
+
+	const char *name = attrib->name;
+	if(strcmp(name, "in_Position") == 0 && n >= 3)
+	{
+		/* Half floats have 11 bits of precision. Allow an error of
+		 * 1/2048 of the bounding box diagonal, which they meet for
+		 * geometry that is near the origin. */
+		float diagonal = 0;
+		for(GLuint c=0; c<n; c++)
+			diagonal += (max[c]-min[c])*(max[c]-min[c]);
+		float tolerance = sqrtf(diagonal) / 2048;
+		if(tolerance == 0 || low < -65504 || high > 65504)
+			return;
+		for(GLuint v=0; v<vertexCount; v++)
+		{
+			for(GLuint c=0; c<n; c++)
+			{
+				float value = data[v*floatStride+c];
+				if(fabsf(kuhl_half_to_float(kuhl_float_to_half(value)) - value) > tolerance)
+					return;
+			}
+		}
+		attrib->type = GL_HALF_FLOAT;
+		attrib->normalized = GL_FALSE;
+	}
+	else if(strcmp(name, "in_Normal") == 0 && n == 3 && low >= -1.001f && high <= 1.001f)
+	{
+		if(GLEW_VERSION_3_3 || GLEW_ARB_vertex_type_2_10_10_10_rev)
+			attrib->type = GL_INT_2_10_10_10_REV;
+		else
+			attrib->type = GL_SHORT;
+		attrib->normalized = GL_TRUE;
+	}
+	else if(strcmp(name, "in_TexCoord") == 0 && low >= 0 && high <= 1)
+	{
+		attrib->type = GL_UNSIGNED_SHORT;
+		attrib->normalized = GL_TRUE;
+	}
+	else if((strcmp(name, "in_Color") == 0 || strcmp(name, "in_BoneWeight") == 0) &&
+	        low >= 0 && high <= 1)
+	{
+		attrib->type = GL_UNSIGNED_BYTE;
+		attrib->normalized = GL_TRUE;
+	}
+	else if(strcmp(name, "in_BoneIndex") == 0 && integral && low >= 0 && high <= 255)
+	{
+		attrib->type = GL_UNSIGNED_BYTE;
+		attrib->normalized = GL_FALSE;
+	}
+}
+
+/** Tells OpenGL where an attribute is in its buffer. The buffer
+ * must be bound to GL_ARRAY_BUFFER and the geometry's vertex array
+ * object must be bound. */
+static void kuhl_attrib_pointer(GLint attribLocation, const kuhl_attrib *attrib)
+{
+	glVertexAttribPointer(
+		attribLocation, // attribute location in glsl program
+		// number of elements (x,y,z); packed 10-bit values always have 4
+		attrib->type == GL_INT_2_10_10_10_REV ? 4 : attrib->components,
+		attrib->type, // type of each element
+		attrib->normalized, // should OpenGL normalize values?
+		attrib->stride, // distance between vertices in bytes (0 if tightly packed)
+		(const GLvoid*) (GLintptr) attrib->offset ); // offset of first element
+	kuhl_errorcheck();
+}
+
+/** Copies an attribute out of its OpenGL buffer, converting it to
+ * floats if it is stored in a compact format. The buffer must not be
+ * mapped.
+ *
+ * @return A newly allocated array of geom->vertex_count *
+ * attrib->components floats that the caller should free().
+ */
+static GLfloat* kuhl_attrib_read(kuhl_geometry *geom, const kuhl_attrib *attrib)
+{
+	GLuint numFloats = geom->vertex_count*attrib->components;
+	GLfloat *data = (GLfloat*) kuhl_malloc(sizeof(GLfloat)*numFloats);
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	if(attrib->stride == 0)
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*numFloats, data);
+	else
+	{
+		unsigned char *all = (unsigned char*) kuhl_malloc(geom->vertex_count*attrib->stride);
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, geom->vertex_count*attrib->stride, all);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			kuhl_attrib_decode(attrib, all + v*attrib->stride + attrib->offset,
+			                   data + v*attrib->components);
+		free(all);
+	}
+	kuhl_errorcheck();
+	return data;
+}
+
+/** Copies geom->vertex_count * attrib->components floats into an
+ * attribute's OpenGL buffer, converting them to the attribute's
+ * format. Other attributes in an interleaved buffer are not
+ * changed. */
+static void kuhl_attrib_write(kuhl_geometry *geom, const kuhl_attrib *attrib, const GLfloat *data)
+{
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	if(attrib->stride == 0)
+		glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat)*geom->vertex_count*attrib->components, data);
+	else
+	{
+		/* The other attributes in the buffer are left as they are;
+		 * mapping it write-only doesn't discard them. */
+		unsigned char *all = (unsigned char*) glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+		if(all == NULL)
+		{
+			msg(MSG_ERROR, "Unable to map the buffer for attribute '%s'.\n", attrib->name);
+			kuhl_errorcheck();
+			return;
+		}
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			kuhl_attrib_encode(attrib, data + v*attrib->components,
+			                   all + v*attrib->stride + attrib->offset);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+	}
+	kuhl_errorcheck();
+}
+
+/** Unmaps any buffers mapped by kuhl_geometry_attrib_get() and
+ * copies changes that the caller may have made to interleaved
+ * attributes back into their buffer. Called before a geometry is
+ * drawn.
+ *
+ * The copies of interleaved attributes are kept so that programs
+ * which change an attribute every frame (e.g., explode.c) don't read
+ * the buffer back from OpenGL every frame. */
+static void kuhl_geometry_unmap(kuhl_geometry *geom)
+{
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		if(attrib->mapped == NULL)
+			continue;
+		if(attrib->stride == 0)
+		{
+			kuhl_bind_buffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			attrib->mapped = NULL;
+		}
+		else if(attrib->dirty)
+		{
+			kuhl_attrib_write(geom, attrib, attrib->mapped);
+			attrib->dirty = GL_FALSE;
+		}
+		kuhl_errorcheck();
+	}
+}
+
+/** Retrieves vertex attribute information stored in an OpenGL array
+ * buffer.
+ *
+ * @param geom The geometry object containing the attribute that you
+ * want to retrieve.
+ *
+ * @param name The GLSL variable name of the attribute that you are
+ * interested in.
+ *
+ * @param size A pointer to an integer that will be filled in with the
+ * length of the data retrieved.
+ *
+ * @return A pointer to a array of floats which contains all of
+ * per-vertex data for this attribute. Any changes you make to the
+ * array will automatically be propagated back to OpenGL before the
+ * next time the geometry is drawn. The array should NOT be
+ * free()'d. It also should NOT be accessed after the geometry is
+ * drawn. If you want to continue to access the data, you should call
+ * kuhl_geometry_attrib_get() every frame. If you aren't changing the
+ * data but still want access to it, it is best to make a copy of the
+ * array that kuhl_geometry_attrib_get() returns instead of calling it
+ * every single frame to retrieve the same data repeatedly.
+ *
+ * If the attribute is interleaved with others (see
+ * kuhl_geometry_interleave()), the array is a copy of the attribute
+ * which is copied back into the interleaved buffer before the
+ * geometry is drawn. The copy is read from OpenGL the first time
+ * and reused by later calls, and it is only copied back if
+ * kuhl_geometry_attrib_get() was called since the last draw. If the
+ * attribute is stored in a compact format
+ * (KG_COMPACT), the copy is converted to floats and converted back
+ * (rounded, and clamped to the range of the format) when it is
+ * copied back.
+ */
+GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size)
+{
+	if(size != NULL)
+		*size = 0;
+
+	if(geom == NULL || name == NULL || size == NULL)
+		return NULL;
+
+	int index = kuhl_geometry_attrib_index(geom, name);
+	if(index < 0)
+		return NULL;
+
+	/* Bind the VAO and the buffer we are interested in */
+	kuhl_attrib *attrib = &(geom->attribs[index]);
+	if(!glIsBuffer(attrib->bufferobject) || !glIsVertexArray(geom->vao))
+		return NULL;
+
+	/* Interleaved attributes aren't contiguous in their buffer, so
+	 * give the caller a copy. */
+	if(attrib->stride > 0)
+	{
+		if(attrib->mapped == NULL)
+			attrib->mapped = kuhl_attrib_read(geom, attrib);
+		attrib->dirty = GL_TRUE;
+		kuhl_bind_buffer(GL_ARRAY_BUFFER, 0);
+		*size = geom->vertex_count*attrib->components;
+		return attrib->mapped;
+	}
+
+	kuhl_bind_vertex_array(geom->vao);
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	kuhl_errorcheck();
+
+	/* Get the size of the buffer */
+	GLint bufferSize = 0;
+	glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &bufferSize);
+	GLint bufferNumFloats = bufferSize / sizeof(GLfloat);
+
+	/* Get a pointer to the memory-mapped array (but first check if
+	 * the buffer is already mapped. */
+	if(attrib->mapped == NULL) /* If buffer is not already mapped */
+		attrib->mapped = (GLfloat*) glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
+
+	/* NOTE: We will unmap any buffer that needs unmapping in
+	 * kuhl_geometry_draw() before we draw. */
+	kuhl_errorcheck();
+	if(attrib->mapped == NULL)
+		return NULL;
+	*size = bufferNumFloats;
+
+	// unbind
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, 0);
+	kuhl_bind_vertex_array(0);
+	kuhl_errorcheck();
+
+	return attrib->mapped;
+}
+
+/** Changes the GLSL program that is used by a kuhl_geometry object.
+ *
+ * @param geom A geometry that you want to change the GLSL program for.
+ *
+ * @param program The new GLSL program you wish to use with the geometry.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to apply the new program
+ * to all geometries in the kuhl_geometry linked list. Otherwise, set
+ * to 0.
+ */
+void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options)
+{
+	if(geom == NULL)
+		return;
+
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_program(geom->next, program, kg_options);
+
+	// If the caller deleted their old program and created a new one,
+	// the new program ID might match the old program ID. Therefore,
+	// we can't rely on the program IDs to verify that the user
+	// changed the program.
+
+	if(!glIsProgram(program))
+	{
+		msg(MSG_WARNING, "GLSL program %d is not a valid program.\n",program);
+	}
+	else
+		kuhl_uniform_cache_get(program);
+	
+	geom->program = program;
+
+	/* Iterate through the vertex attributes in this kuhl_geometry
+	 * object and determine where these attributes should go in the
+	 * newly specified program. */
+	kuhl_bind_vertex_array(geom->vao);
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		kuhl_bind_buffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+		kuhl_errorcheck();
+
+		// Find attribute location in the new program; enable that location
+		GLint attribLocation = kuhl_get_attribute(geom->program, attrib->name);
+		glEnableVertexAttribArray(attribLocation);
+
+		/* Connect this vertex attribute with the (possibly different)
+		 * attribute location. */
+		kuhl_attrib_pointer(attribLocation, attrib);
+	}
+
+	/* NOTE: We do not have to update the uniform locations because
+	 * kuhl_geometry_draw() gets them from the program's uniform
+	 * location cache. */
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, 0);
+	kuhl_bind_vertex_array(0);
+}
+
+
+/** Adds a vertex attribute (such as vertex position, normal, color,
  * texture coordinate, etc) to the geometry object.
  *
  * @param geom The geometry to add the attribute to.
@@ -1244,10 +2193,40 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	}
 	else
 	{
-		/* If overwriting, free resources from old attribute. */
-		free(geom->attribs[destIndex].name);
-		if(glIsBuffer(geom->attribs[destIndex].bufferobject))
-			glDeleteBuffers(1, &(geom->attribs[destIndex].bufferobject));
+		kuhl_attrib *old = &(geom->attribs[destIndex]);
+		if(old->stride > 0)
+		{
+			/* Discard the copy from kuhl_geometry_attrib_get(); it is
+			 * being replaced. */
+			free(old->mapped);
+			old->mapped = NULL;
+			old->dirty = GL_FALSE;
+
+			/* If the attribute is interleaved, the size isn't changing
+			 * and the new data fits in the attribute's format, replace
+			 * the data in the interleaved buffer. */
+			kuhl_attrib format = *old;
+			format.type = GL_FLOAT;
+			format.normalized = GL_FALSE;
+			if(old->type != GL_FLOAT && old->components == components)
+				kuhl_attrib_compact(&format, data, components, geom->vertex_count);
+			if(old->components == components && format.type == old->type)
+			{
+				kuhl_attrib_write(geom, old, data);
+				kuhl_bind_buffer(GL_ARRAY_BUFFER, 0);
+				return;
+			}
+		}
+
+		/* If overwriting, free resources from old attribute (unless
+		 * other attributes are interleaved in the same buffer). */
+		free(old->name);
+		if(!kuhl_attrib_buffer_shared(geom, destIndex) && glIsBuffer(old->bufferobject))
+		{
+			if(kuhl_gl_shadow.arrayBuffer == old->bufferobject)
+				kuhl_gl_shadow.arrayBuffer = 0;
+			glDeleteBuffers(1, &(old->bufferobject));
+		}
 	}
 	msg(MSG_DEBUG, "Storing attribute %s at index %d in kuhl_geometry; connected to location %d in program %d", name, destIndex, attribLocation, geom->program);
 	
@@ -1261,44 +2240,1495 @@ void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint compo
 	/* Set up this attribute. */
 	kuhl_attrib *attrib = &(geom->attribs[destIndex]);
 	attrib->name = strdup(name);
+	attrib->components = components;
+	attrib->type = GL_FLOAT;
+	attrib->normalized = GL_FALSE;
+	attrib->stride = 0;
+	attrib->offset = 0;
+	attrib->mapped = NULL;
+	attrib->dirty = GL_FALSE;
 
 	/* Switch to our vertex array object. */
-	glBindVertexArray(geom->vao);
+	kuhl_bind_vertex_array(geom->vao);
 
 	/* Enable this attribute location for this vertex array object. */
 	glEnableVertexAttribArray(attribLocation);
 	
 	/* Ask OpenGL for one new buffer "name" (or ID number). */
 	glGenBuffers(1, &(attrib->bufferobject));
+	if(kuhl_gl_shadow.arrayBuffer == attrib->bufferobject)
+		kuhl_gl_shadow.arrayBuffer = KUHL_GL_STATE_UNKNOWN;
 	/* Tell OpenGL that we are going to use this buffer until we
 	 * say otherwise. GL_ARRAY_BUFFER basically means that the
 	 * data stored in this buffer will be an array containing
 	 * vertex information. */
-	glBindBuffer(GL_ARRAY_BUFFER, attrib->bufferobject);
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, attrib->bufferobject);
 	kuhl_errorcheck();
 
-	/* Copy our data into the buffer object that is currently bound. */
-	glBufferData(GL_ARRAY_BUFFER,
-	             sizeof(GLfloat)*geom->vertex_count*components,
-	             data, GL_STATIC_DRAW);
-	kuhl_errorcheck();
+	/* Copy our data into the buffer object that is currently bound. */
+	glBufferData(GL_ARRAY_BUFFER,
+	             sizeof(GLfloat)*geom->vertex_count*components,
+	             data, GL_STATIC_DRAW);
+	kuhl_errorcheck();
+
+	/* Tell OpenGL some information about the data that is in the
+	 * buffer. Among other things, we need to tell OpenGL which
+	 * attribute number (i.e., variable) the data should correspond to
+	 * in the vertex program. */
+	kuhl_attrib_pointer(attribLocation, attrib);
+
+	// unbind
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, 0);
+	kuhl_bind_vertex_array(0);
+}
+
+/** Copies interleaved vertices into a new buffer and points all of
+ * a geometry's attributes at it. The names and components of the
+ * attributes in geom->attribs[] must already be set; their format,
+ * stride and offsets are filled in. Old buffers are not deleted.
+ *
+ * @param geom The geometry.
+ * @param vertices geom->vertex_count vertices, each containing every
+ * attribute (as floats) in the order they appear in geom->attribs[].
+ * @param compact If nonzero, store attributes in a smaller format
+ * when they fit in one (see kuhl_attrib_compact()). Otherwise, store
+ * them as floats.
+ * @return The new buffer.
+ */
+static GLuint kuhl_geometry_upload_interleaved(kuhl_geometry *geom, const GLfloat *vertices, int compact)
+{
+	GLuint floatStride = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		floatStride += geom->attribs[i].components;
+
+	/* Choose the format of each attribute and where it goes in each
+	 * vertex. */
+	GLuint stride = 0, floatOffset = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		attrib->type = GL_FLOAT;
+		attrib->normalized = GL_FALSE;
+		if(compact)
+			kuhl_attrib_compact(attrib, vertices+floatOffset, floatStride, geom->vertex_count);
+		attrib->offset = stride;
+		stride += kuhl_attrib_bytes(attrib);
+		floatOffset += attrib->components;
+	}
+
+	/* If everything is still a float, the vertices are already in
+	 * the right layout. */
+	unsigned char *packed = NULL;
+	if(stride != sizeof(GLfloat)*floatStride)
+	{
+		packed = (unsigned char*) kuhl_malloc(geom->vertex_count*stride);
+		memset(packed, 0, geom->vertex_count*stride);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+		{
+			floatOffset = 0;
+			for(unsigned int i=0; i<geom->attrib_count; i++)
+			{
+				kuhl_attrib *attrib = &(geom->attribs[i]);
+				kuhl_attrib_encode(attrib, vertices + v*floatStride + floatOffset,
+				                   packed + v*stride + attrib->offset);
+				floatOffset += attrib->components;
+			}
+		}
+	}
+
+	GLuint buffer = 0;
+	glGenBuffers(1, &buffer);
+	if(kuhl_gl_shadow.arrayBuffer == buffer)
+		kuhl_gl_shadow.arrayBuffer = KUHL_GL_STATE_UNKNOWN;
+	kuhl_bind_vertex_array(geom->vao);
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, geom->vertex_count*stride,
+	             packed ? (const GLvoid*) packed : (const GLvoid*) vertices, GL_STATIC_DRAW);
+	kuhl_errorcheck();
+	free(packed);
+
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		attrib->bufferobject = buffer;
+		attrib->stride = stride;
+
+		GLint attribLocation = glGetAttribLocation(geom->program, attrib->name);
+		if(attribLocation != -1)
+		{
+			glEnableVertexAttribArray(attribLocation);
+			kuhl_attrib_pointer(attribLocation, attrib);
+		}
+	}
+	return buffer;
+}
+
+/** Packs all of the vertex attributes in a geometry into a single
+ * interleaved buffer (position, normal, texture coordinate, etc. of
+ * the first vertex, followed by the attributes of the second vertex,
+ * and so on). Each vertex is then fetched from one place in memory
+ * instead of one place per attribute, and the geometry uses one
+ * buffer object instead of one for each attribute.
+ *
+ * kuhl_geometry_attrib() and kuhl_geometry_attrib_get() continue to
+ * work after a geometry is interleaved. Replacing an attribute with
+ * one that has the same number of components updates the
+ * interleaved buffer. Adding an attribute (or changing the number of
+ * components) puts that attribute in its own buffer; call this
+ * function again to interleave it too.
+ *
+ * With KG_COMPACT, attributes that fit in a smaller format than
+ * 32-bit floats are stored in it: half float positions, 10-bit
+ * normals, 16-bit texture coordinates and 8-bit colors, bone indices
+ * and bone weights (see kuhl_attrib_compact() for when each is
+ * used). OpenGL converts them back to floats when the vertices are
+ * read, so GLSL programs don't change as long as they declare these
+ * inputs as floats (vec2, vec3, vec4). This roughly halves the size
+ * of a typical vertex. Without KG_COMPACT, the attributes are stored
+ * as floats.
+ *
+ * The attributes are read back from OpenGL, so this should be done
+ * once after the attributes are set up rather than every frame.
+ * kuhl_load_model() interleaves models unless model.interleave is
+ * set to 0 in the config file and compacts them if model.compact is
+ * set to 1.
+ *
+ * @param geom The geometry to interleave.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to interleave all
+ * geometries in the kuhl_geometry linked list and add KG_COMPACT to
+ * use compact formats. Otherwise, set to 0.
+ */
+void kuhl_geometry_interleave(kuhl_geometry *geom, int kg_options)
+{
+	if(geom == NULL)
+		return;
+	if(kg_options & KG_FULL_LIST)
+		kuhl_geometry_interleave(geom->next, kg_options);
+	int compact = kg_options & KG_COMPACT;
+	if(geom->attrib_count == 0 || (geom->attrib_count < 2 && !compact))
+		return;
+
+	/* Don't do anything if the attributes are already in one
+	 * interleaved buffer (unless their formats may change). */
+	int interleaved = 1;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		if(geom->attribs[i].stride == 0 ||
+		   geom->attribs[i].bufferobject != geom->attribs[0].bufferobject)
+			interleaved = 0;
+	}
+	if(interleaved && !compact)
+		return;
+
+	/* The copies of interleaved attributes would no longer match the
+	 * new buffer if its formats change. */
+	kuhl_geometry_unmap(geom);
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		if(geom->attribs[i].stride > 0)
+		{
+			free(geom->attribs[i].mapped);
+			geom->attribs[i].mapped = NULL;
+		}
+	}
+
+	GLuint stride = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		stride += geom->attribs[i].components;
+
+	/* Copy each attribute into its place in the interleaved array. */
+	GLfloat *vertices = (GLfloat*) kuhl_malloc(sizeof(GLfloat)*geom->vertex_count*stride);
+	GLuint offset = 0;
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		kuhl_attrib *attrib = &(geom->attribs[i]);
+		GLfloat *data = kuhl_attrib_read(geom, attrib);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			for(GLuint c=0; c<attrib->components; c++)
+				vertices[v*stride+offset+c] = data[v*attrib->components+c];
+		free(data);
+		offset += attrib->components;
+	}
+
+	GLuint oldBuffers[MAX_ATTRIBUTES];
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+		oldBuffers[i] = geom->attribs[i].bufferobject;
+
+	GLuint buffer = kuhl_geometry_upload_interleaved(geom, vertices, compact);
+	free(vertices);
+
+	/* Delete the old buffers now that the vertex array object no
+	 * longer uses them. Some of them may have been shared. */
+	for(unsigned int i=0; i<geom->attrib_count; i++)
+	{
+		int deleted = 0;
+		for(unsigned int j=0; j<i; j++)
+			if(oldBuffers[j] == oldBuffers[i])
+				deleted = 1;
+		if(deleted || oldBuffers[i] == buffer)
+			continue;
+		if(kuhl_gl_shadow.arrayBuffer == oldBuffers[i])
+			kuhl_gl_shadow.arrayBuffer = 0;
+		glDeleteBuffers(1, &(oldBuffers[i]));
+	}
+
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, 0);
+	kuhl_bind_vertex_array(0);
+	kuhl_errorcheck();
+	msg(MSG_DEBUG, "Interleaved %u attributes (%u bytes per vertex instead of %u) into buffer %u",
+	    geom->attrib_count, geom->attribs[0].stride, (GLuint) sizeof(GLfloat)*stride, buffer);
+}
+
+/** Returns 1 if kuhl_geometry_merge() can put a geometry into a
+ * shared buffer. Geometry with bones is animated in the vertex
+ * program and is left alone, as is geometry with more than one
+ * texture or with levels of detail (which are drawn from its own
+ * index buffer). */
+static int kuhl_geometry_can_merge(const kuhl_geometry *geom)
+{
+#if KUHL_UTIL_USE_ASSIMP
+	if(geom->bones != NULL)
+		return 0;
+#endif
+	return geom->multidraw == NULL && geom->lod_count < 2 && geom->attrib_count > 0 &&
+		geom->vertex_count > 0 && geom->texture_count <= 1;
+}
+
+/** Returns 1 if two geometries have the same vertex format (the same
+ * attributes in the same order), program and primitive type. */
+static int kuhl_geometry_same_format(const kuhl_geometry *a, const kuhl_geometry *b)
+{
+	if(a->program != b->program || a->primitive_type != b->primitive_type ||
+	   a->attrib_count != b->attrib_count)
+		return 0;
+	for(unsigned int i=0; i<a->attrib_count; i++)
+	{
+		if(a->attribs[i].components != b->attribs[i].components ||
+		   strcmp(a->attribs[i].name, b->attribs[i].name) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/** qsort() comparison function that orders geometries by texture. */
+static int kuhl_geometry_compare_texture(const void *a, const void *b)
+{
+	const kuhl_geometry *ga = *(kuhl_geometry* const*) a;
+	const kuhl_geometry *gb = *(kuhl_geometry* const*) b;
+	GLuint ta = ga->texture_count > 0 ? ga->textures[0].textureId : 0;
+	GLuint tb = gb->texture_count > 0 ? gb->textures[0].textureId : 0;
+	if(ta != tb)
+		return ta < tb ? -1 : 1;
+	return 0;
+}
+
+/** Returns the size in bytes of each index in a geometry's index
+ * buffer. */
+static GLuint kuhl_geometry_index_size(const kuhl_geometry *geom)
+{
+	return geom->indices_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+}
+
+/** Copies the indices of a geometry out of OpenGL. If the geometry
+ * has no indices, the vertices are numbered in order.
+ *
+ * @param geom The geometry.
+ * @param count Set to the number of indices.
+ * @return A newly allocated array of indices that the caller should free().
+ */
+static GLuint* kuhl_geometry_read_indices(kuhl_geometry *geom, GLuint *count)
+{
+	if(geom->indices_len > 0 && geom->indices_bufferobject != 0)
+	{
+		*count = geom->indices_len;
+		GLuint *indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*geom->indices_len);
+		/* The index buffer binding is part of the vertex array object. */
+		kuhl_bind_vertex_array(geom->vao);
+		if(geom->indices_type == GL_UNSIGNED_SHORT)
+		{
+			GLushort *shorts = (GLushort*) kuhl_malloc(sizeof(GLushort)*geom->indices_len);
+			glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(GLushort)*geom->indices_len, shorts);
+			for(GLuint i=0; i<geom->indices_len; i++)
+				indices[i] = shorts[i];
+			free(shorts);
+		}
+		else
+			glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(GLuint)*geom->indices_len, indices);
+		kuhl_errorcheck();
+		return indices;
+	}
+	*count = geom->vertex_count;
+	GLuint *indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*geom->vertex_count);
+	for(GLuint i=0; i<geom->vertex_count; i++)
+		indices[i] = i;
+	return indices;
+}
+
+/** Combines geometries that have the same vertex format into one
+ * geometry with one vertex buffer, one index buffer and one draw
+ * command per original geometry. Called by kuhl_geometry_merge().
+ *
+ * @param members The geometries to merge (reordered by texture).
+ * @param count The number of geometries.
+ * @return A new geometry (allocated with malloc()).
+ */
+static kuhl_geometry* kuhl_geometry_merge_group(kuhl_geometry **members, int count)
+{
+	/* Meshes that use the same texture are drawn with one call, so
+	 * put them next to each other. */
+	qsort(members, count, sizeof(kuhl_geometry*), kuhl_geometry_compare_texture);
+
+	const kuhl_geometry *first = members[0];
+	GLuint vertexCount = 0;
+	GLuint totalIndexCount = 0;
+	for(int m=0; m<count; m++)
+	{
+		const kuhl_geometry *g = members[m];
+		vertexCount += g->vertex_count;
+		/* kuhl_geometry_read_indices() makes one index per vertex for
+		 * geometries without an index buffer. */
+		if(g->indices_len > 0 && g->indices_bufferobject != 0)
+			totalIndexCount += g->indices_len;
+		else
+			totalIndexCount += g->vertex_count;
+	}
+	GLuint stride = 0;
+	for(unsigned int a=0; a<first->attrib_count; a++)
+		stride += first->attribs[a].components;
+
+	kuhl_geometry *merged = (kuhl_geometry*) kuhl_malloc(sizeof(kuhl_geometry));
+	kuhl_geometry_new(merged, first->program, vertexCount, first->primitive_type);
+	merged->attrib_count = first->attrib_count;
+	for(unsigned int a=0; a<first->attrib_count; a++)
+	{
+		kuhl_attrib *attrib = &(merged->attribs[a]);
+		attrib->name = strdup(first->attribs[a].name);
+		attrib->components = first->attribs[a].components;
+		attrib->mapped = NULL;
+		attrib->dirty = GL_FALSE;
+	}
+
+	kuhl_multidraw *md = (kuhl_multidraw*) kuhl_malloc(sizeof(kuhl_multidraw));
+	md->command_count = count;
+	md->commands = (kuhl_draw_command*) kuhl_malloc(sizeof(kuhl_draw_command)*count);
+	md->textures = (kuhl_texture*) kuhl_malloc(sizeof(kuhl_texture)*count);
+	md->group_start = (int*) kuhl_malloc(sizeof(int)*(count+1));
+	md->group_count = 0;
+	md->counts = (GLsizei*) kuhl_malloc(sizeof(GLsizei)*count);
+	md->offsets = (GLvoid**) kuhl_malloc(sizeof(GLvoid*)*count);
+	md->base_vertices = (GLint*) kuhl_malloc(sizeof(GLint)*count);
+	md->indirect_bufferobject = 0;
+
+	GLfloat *vertices = (GLfloat*) kuhl_malloc(sizeof(GLfloat)*vertexCount*stride);
+	GLuint *indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*totalIndexCount);
+	GLuint indexCount = 0;
+	GLuint baseVertex = 0;
+	for(int m=0; m<count; m++)
+	{
+		kuhl_geometry *g = members[m];
+
+		/* The meshes will be drawn without their own GeomTransform,
+		 * so apply it to the positions and normals now. */
+		float normalMat[9];
+		mat3f_from_mat4f(normalMat, g->matrix);
+		mat3f_invert(normalMat);
+		mat3f_transpose(normalMat);
+
+		GLuint offset = 0;
+		for(unsigned int a=0; a<g->attrib_count; a++)
+		{
+			kuhl_attrib *attrib = &(g->attribs[a]);
+			GLuint comps = attrib->components;
+			GLfloat *data = kuhl_attrib_read(g, attrib);
+			for(GLuint v=0; v<g->vertex_count; v++)
+			{
+				GLfloat *src = data + v*comps;
+				GLfloat *dest = vertices + (baseVertex+v)*stride + offset;
+				if(strcmp(attrib->name, "in_Position") == 0 && comps >= 3)
+				{
+					float p[4] = { src[0], src[1], src[2], comps == 4 ? src[3] : 1 };
+					float result[4];
+					mat4f_mult_vec4f_new(result, g->matrix, p);
+					memcpy(dest, result, sizeof(GLfloat)*comps);
+				}
+				else if(strcmp(attrib->name, "in_Normal") == 0 && comps == 3)
+					mat3f_mult_vec3f_new(dest, normalMat, src);
+				else
+					memcpy(dest, src, sizeof(GLfloat)*comps);
+			}
+			free(data);
+			offset += comps;
+		}
+
+		/* Append this mesh's indices. They stay relative to the mesh's
+		 * first vertex; the draw command's baseVertex is added to
+		 * them. */
+		GLuint meshIndexCount = 0;
+		GLuint *meshIndices = kuhl_geometry_read_indices(g, &meshIndexCount);
+		memcpy(indices+indexCount, meshIndices, sizeof(GLuint)*meshIndexCount);
+		free(meshIndices);
+
+		kuhl_draw_command *cmd = &(md->commands[m]);
+		cmd->count = meshIndexCount;
+		cmd->instanceCount = 1;
+		cmd->firstIndex = indexCount;
+		cmd->baseVertex = baseVertex;
+		cmd->baseInstance = 0;
+		md->counts[m] = cmd->count;
+		md->base_vertices[m] = cmd->baseVertex;
+
+		/* Start a new group when the texture changes. */
+		GLuint textureId = g->texture_count > 0 ? g->textures[0].textureId : 0;
+		if(m == 0 || textureId != md->textures[md->group_count-1].textureId)
+		{
+			kuhl_texture *tex = &(md->textures[md->group_count]);
+			tex->name = strdup(g->texture_count > 0 ? g->textures[0].name : "tex");
+			tex->name_hash = kuhl_uniform_hash(tex->name);
+			tex->textureId = textureId;
+			md->group_start[md->group_count] = m;
+			md->group_count++;
+		}
+
+		indexCount += meshIndexCount;
+		baseVertex += g->vertex_count;
+	}
+	md->group_start[md->group_count] = count;
+
+	/* Vertices that are moved by the matrices of the merged meshes
+	 * are now relative to the model rather than to each mesh. Keep
+	 * the attributes in compact formats if the meshes used them. */
+	int compact = 0;
+	for(unsigned int a=0; a<first->attrib_count; a++)
+		if(first->attribs[a].type != GL_FLOAT)
+			compact = 1;
+	kuhl_geometry_upload_interleaved(merged, vertices, compact);
+	free(vertices);
+
+	/* kuhl_geometry_indices() checks indices against the vertex
+	 * count; these are smaller because they are relative to each
+	 * mesh. That also lets them be 16-bit even if there are more
+	 * than 65536 vertices in total. */
+	kuhl_geometry_indices(merged, indices, indexCount);
+	free(indices);
+	for(int m=0; m<count; m++)
+		md->offsets[m] = (GLvoid*) (GLintptr) (kuhl_geometry_index_size(merged)*md->commands[m].firstIndex);
+
+	if(GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect)
+	{
+		glGenBuffers(1, &(md->indirect_bufferobject));
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, md->indirect_bufferobject);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(kuhl_draw_command)*count, md->commands, GL_STATIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		kuhl_errorcheck();
+	}
+
+	merged->multidraw = md;
+	kuhl_bind_buffer(GL_ARRAY_BUFFER, 0);
+	kuhl_bind_vertex_array(0);
+	return merged;
+}
+
+/** Merges static meshes so that they can be drawn with a few draw
+ * calls instead of one draw call each. Geometries in the list that
+ * use the same GLSL program, primitive type and vertex attributes are
+ * combined into one kuhl_geometry with a shared (interleaved) vertex
+ * buffer and a shared index buffer. It contains one draw command for
+ * each original geometry, and the commands that use the same texture
+ * are issued with one glMultiDrawElementsIndirect() call (OpenGL 4.3
+ * or ARB_multi_draw_indirect) or glMultiDrawElementsBaseVertex() call
+ * (OpenGL 3.2).
+ *
+ * The matrix of each geometry (GeomTransform) is applied to its
+ * positions and normals while merging, so the merged geometry can't
+ * be moved piece by piece afterwards (e.g., by node animations in
+ * kuhl_update_model()). Geometry with bones or more than one texture
+ * isn't merged.
+ *
+ * @param geom A list of geometries that were allocated with malloc()
+ * (such as a list from kuhl_load_model()). The geometries that are
+ * merged are deleted and free()'d; the others are moved into the
+ * returned list.
+ *
+ * @return The new list of geometries.
+ */
+kuhl_geometry* kuhl_geometry_merge(kuhl_geometry *geom)
+{
+	unsigned int count = kuhl_geometry_count(geom);
+	if(count < 2)
+		return geom;
+
+	kuhl_geometry **list = (kuhl_geometry**) kuhl_malloc(sizeof(kuhl_geometry*)*count);
+	kuhl_geometry **members = (kuhl_geometry**) kuhl_malloc(sizeof(kuhl_geometry*)*count);
+	unsigned int n = 0;
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+		list[n++] = g;
+	for(unsigned int i=0; i<count; i++)
+		list[i]->next = NULL;
+
+	kuhl_geometry *result = NULL, *last = NULL;
+	unsigned int merged = 0, drawCalls = 0;
+	for(unsigned int i=0; i<count; i++)
+	{
+		if(list[i] == NULL)
+			continue;
+
+		/* Find everything that can be merged with this geometry. */
+		int memberCount = 0;
+		if(kuhl_geometry_can_merge(list[i]))
+		{
+			for(unsigned int j=i; j<count; j++)
+			{
+				if(list[j] != NULL && kuhl_geometry_can_merge(list[j]) &&
+				   kuhl_geometry_same_format(list[i], list[j]))
+					members[memberCount++] = list[j];
+			}
+		}
+
+		kuhl_geometry *g = list[i];
+		if(memberCount >= 2)
+		{
+			g = kuhl_geometry_merge_group(members, memberCount);
+			for(unsigned int j=i; j<count; j++)
+			{
+				for(int m=0; m<memberCount; m++)
+				{
+					if(list[j] == members[m])
+					{
+						kuhl_geometry_delete(list[j]);
+						free(list[j]);
+						list[j] = NULL;
+						break;
+					}
+				}
+			}
+			merged += memberCount;
+			drawCalls += g->multidraw->group_count;
+		}
+		else
+		{
+			list[i] = NULL;
+			drawCalls++;
+		}
+
+		if(last == NULL)
+			result = g;
+		else
+			last->next = g;
+		last = g;
+	}
+	free(list);
+	free(members);
+
+	msg(MSG_INFO, "Merged %u of %u geometries; drawing them takes %u draw calls instead of %u.",
+	    merged, count, drawCalls, count);
+	return result;
+}
+
+/** Size of the LRU cache of transformed vertices that
+ * kuhl_optimize_vertex_cache() optimizes for. */
+#define KUHL_VERTEX_CACHE_SIZE 32
+
+/** Scores a vertex for kuhl_optimize_vertex_cache(). Vertices that
+ * were used recently (and are likely still in the cache) and
+ * vertices with only a few triangles left score higher.
+ *
+ * @param cachePosition Position of the vertex in the modeled LRU
+ * cache, -1 if it isn't in the cache.
+ * @param remaining Number of triangles that use the vertex and
+ * haven't been emitted yet.
+ */
+static float kuhl_vertex_cache_score(int cachePosition, GLuint remaining)
+{
+	if(remaining == 0)
+		return -1;
+
+	float score = 0;
+	if(cachePosition >= 0)
+	{
+		/* The vertices of the triangle that was just emitted get a
+		 * fixed, lower score so that the next triangle doesn't
+		 * always share an edge with it (which produces long, thin
+		 * strips that leave the cache). */
+		if(cachePosition < 3)
+			score = 0.75f;
+		else
+			score = powf(1.0f - (cachePosition-3) / (float) (KUHL_VERTEX_CACHE_SIZE-3), 1.5f);
+	}
+	/* Finish off vertices that have few triangles left so they
+	 * don't have to be loaded into the cache again later. */
+	score += 2.0f / sqrtf((float) remaining);
+	return score;
+}
+
+/** Reorders the triangles in an index array so that vertices are
+ * reused while they are still in the GPU's post-transform vertex
+ * cache, reducing the number of times each vertex is processed by
+ * the vertex program. This is Tom Forsyth's "Linear-Speed Vertex
+ * Cache Optimisation" algorithm: triangles are emitted greedily,
+ * always picking the triangle whose vertices score highest according
+ * to kuhl_vertex_cache_score(). It works well for a wide range of
+ * cache sizes, so the size of the GPU's cache doesn't need to be
+ * known.
+ *
+ * Use kuhl_vertex_cache_stats() to measure the result and
+ * kuhl_optimize_vertex_fetch() afterwards to put the vertices in the
+ * order that they are used.
+ *
+ * @param indices The indices of a triangle list. They are reordered
+ * in place; the triangles and their winding don't change.
+ * @param indexCount Number of indices (three per triangle).
+ * @param vertexCount Number of vertices that the indices refer to.
+ */
+void kuhl_optimize_vertex_cache(GLuint *indices, GLuint indexCount, GLuint vertexCount)
+{
+	GLuint triCount = indexCount / 3;
+	if(indices == NULL || triCount < 2 || vertexCount == 0)
+		return;
+	for(GLuint i=0; i<triCount*3; i++)
+	{
+		if(indices[i] >= vertexCount)
+		{
+			msg(MSG_WARNING, "Not optimizing for the vertex cache because index %u refers to vertex %u and there are only %u vertices.",
+			    i, indices[i], vertexCount);
+			return;
+		}
+	}
+
+	/* Make a list of the triangles that use each vertex. The first
+	 * remaining[v] entries in the list for vertex v are the
+	 * triangles that haven't been emitted yet. */
+	GLuint *remaining = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	memset(remaining, 0, sizeof(GLuint)*vertexCount);
+	for(GLuint i=0; i<triCount*3; i++)
+		remaining[indices[i]]++;
+	GLuint *adjStart = (GLuint*) kuhl_malloc(sizeof(GLuint)*(vertexCount+1));
+	adjStart[0] = 0;
+	for(GLuint v=0; v<vertexCount; v++)
+		adjStart[v+1] = adjStart[v] + remaining[v];
+	GLuint *adj = (GLuint*) kuhl_malloc(sizeof(GLuint)*triCount*3);
+	GLuint *fill = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	memcpy(fill, adjStart, sizeof(GLuint)*vertexCount);
+	for(GLuint i=0; i<triCount*3; i++)
+		adj[fill[indices[i]]++] = i/3;
+	free(fill);
+
+	int *cachePosition = (int*) kuhl_malloc(sizeof(int)*vertexCount);
+	float *vertexScore = (float*) kuhl_malloc(sizeof(float)*vertexCount);
+	for(GLuint v=0; v<vertexCount; v++)
+	{
+		cachePosition[v] = -1;
+		vertexScore[v] = kuhl_vertex_cache_score(-1, remaining[v]);
+	}
+	float *triScore = (float*) kuhl_malloc(sizeof(float)*triCount);
+	char *emitted = (char*) kuhl_malloc(triCount);
+	memset(emitted, 0, triCount);
+	GLuint best = 0;
+	for(GLuint t=0; t<triCount; t++)
+	{
+		triScore[t] = vertexScore[indices[t*3]] + vertexScore[indices[t*3+1]] + vertexScore[indices[t*3+2]];
+		if(triScore[t] > triScore[best])
+			best = t;
+	}
+
+	GLuint *output = (GLuint*) kuhl_malloc(sizeof(GLuint)*triCount*3);
+	GLuint cache[KUHL_VERTEX_CACHE_SIZE+3];
+	int cacheCount = 0;
+	GLuint nextUnemitted = 0;
+	for(GLuint n=0; n<triCount; n++)
+	{
+		/* If none of the triangles that use the vertices in the cache
+		 * are left, start again with the next unused triangle. */
+		if(best == (GLuint) -1)
+		{
+			while(emitted[nextUnemitted])
+				nextUnemitted++;
+			best = nextUnemitted;
+		}
+
+		const GLuint *tri = indices + best*3;
+		memcpy(output + n*3, tri, sizeof(GLuint)*3);
+		emitted[best] = 1;
+
+		/* Remove the triangle from the lists of its vertices. */
+		for(int k=0; k<3; k++)
+		{
+			GLuint v = tri[k];
+			GLuint *list = adj + adjStart[v];
+			for(GLuint j=0; j<remaining[v]; j++)
+			{
+				if(list[j] == best)
+				{
+					list[j] = list[remaining[v]-1];
+					list[remaining[v]-1] = best;
+					remaining[v]--;
+					break;
+				}
+			}
+		}
+
+		/* The triangle's vertices move to the front of the LRU
+		 * cache; up to three vertices fall off the end. */
+		GLuint newCache[KUHL_VERTEX_CACHE_SIZE+3];
+		int newCount = 0;
+		for(int k=0; k<3; k++)
+		{
+			if(k == 0 || (tri[k] != tri[0] && (k == 1 || tri[k] != tri[1])))
+				newCache[newCount++] = tri[k];
+		}
+		for(int i=0; i<cacheCount; i++)
+		{
+			if(cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2])
+				newCache[newCount++] = cache[i];
+		}
+
+		/* Update the scores of the vertices that were in the cache
+		 * and of the triangles that use them. */
+		for(int i=0; i<newCount; i++)
+		{
+			GLuint v = newCache[i];
+			cachePosition[v] = i < KUHL_VERTEX_CACHE_SIZE ? i : -1;
+			float score = kuhl_vertex_cache_score(cachePosition[v], remaining[v]);
+			float delta = score - vertexScore[v];
+			vertexScore[v] = score;
+			for(GLuint j=0; j<remaining[v]; j++)
+				triScore[adj[adjStart[v]+j]] += delta;
+		}
+		cacheCount = newCount < KUHL_VERTEX_CACHE_SIZE ? newCount : KUHL_VERTEX_CACHE_SIZE;
+		memcpy(cache, newCache, sizeof(GLuint)*cacheCount);
+
+		/* The next triangle is the best one that uses a vertex in
+		 * the cache. */
+		best = (GLuint) -1;
+		float bestScore = -FLT_MAX;
+		for(int i=0; i<cacheCount; i++)
+		{
+			GLuint v = cache[i];
+			for(GLuint j=0; j<remaining[v]; j++)
+			{
+				GLuint t = adj[adjStart[v]+j];
+				if(triScore[t] > bestScore)
+				{
+					bestScore = triScore[t];
+					best = t;
+				}
+			}
+		}
+	}
+
+	memcpy(indices, output, sizeof(GLuint)*triCount*3);
+	free(output);
+	free(emitted);
+	free(triScore);
+	free(vertexScore);
+	free(cachePosition);
+	free(adj);
+	free(adjStart);
+	free(remaining);
+}
+
+/** Measures how well a triangle list uses a FIFO post-transform
+ * vertex cache by counting how many vertices would be processed by
+ * the vertex program (cache misses).
+ *
+ * @param indices The indices of a triangle list.
+ * @param indexCount Number of indices.
+ * @param vertexCount Number of vertices that the indices refer to.
+ * @param cacheSize Number of vertices in the cache (GPUs have
+ * roughly 16 to 32).
+ * @param acmr Set to the average cache miss ratio: vertices
+ * processed per triangle. It is 3 without any reuse and approaches
+ * 0.5 for a large regular grid.
+ * @param atvr Set to the average transformed vertex ratio: vertices
+ * processed divided by the number of vertices that are used. 1 is
+ * ideal.
+ */
+void kuhl_vertex_cache_stats(const GLuint *indices, GLuint indexCount, GLuint vertexCount,
+                             int cacheSize, float *acmr, float *atvr)
+{
+	*acmr = 0;
+	*atvr = 0;
+	GLuint triCount = indexCount / 3;
+	if(indices == NULL || triCount == 0 || vertexCount == 0 || cacheSize < 1)
+		return;
+
+	/* A vertex is in the FIFO cache if fewer than cacheSize vertices
+	 * were added after it. Time starts at cacheSize so that added[v]
+	 * == 0 means the vertex has never been processed. */
+	GLuint *added = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	memset(added, 0, sizeof(GLuint)*vertexCount);
+	GLuint time = (GLuint) cacheSize;
+	GLuint misses = 0, used = 0;
+	for(GLuint i=0; i<triCount*3; i++)
+	{
+		GLuint v = indices[i];
+		if(v >= vertexCount)
+			continue;
+		if(time - added[v] >= (GLuint) cacheSize)
+		{
+			if(added[v] == 0)
+				used++;
+			added[v] = time++;
+			misses++;
+		}
+	}
+	free(added);
+	*acmr = misses / (float) triCount;
+	*atvr = used > 0 ? misses / (float) used : 0;
+}
+
+/** One group of triangles for kuhl_optimize_overdraw(). */
+typedef struct
+{
+	GLuint start;  /**< First triangle in the cluster */
+	GLuint count;  /**< Number of triangles */
+	float key;     /**< How far the cluster faces out from the center of the mesh */
+} kuhl_overdraw_cluster;
+
+/** qsort() comparison function that puts clusters that face out
+ * first, keeping the original order for equal keys. */
+static int kuhl_overdraw_cluster_compare(const void *a, const void *b)
+{
+	const kuhl_overdraw_cluster *ca = (const kuhl_overdraw_cluster*) a;
+	const kuhl_overdraw_cluster *cb = (const kuhl_overdraw_cluster*) b;
+	if(ca->key != cb->key)
+		return ca->key > cb->key ? -1 : 1;
+	return ca->start < cb->start ? -1 : (ca->start > cb->start);
+}
+
+/** Reorders groups of triangles so that surfaces which are likely to
+ * be in front of the rest of the mesh are drawn first. The depth
+ * test can then reject more of the fragments behind them before
+ * they are shaded.
+ *
+ * This should be called after kuhl_optimize_vertex_cache(). Its
+ * output is split into clusters of consecutive triangles. Each
+ * cluster ends as soon as its own cache miss ratio (starting with an
+ * empty cache) is within 5% of the ratio of the whole mesh, so the
+ * clusters can be drawn in any order while making the vertex cache
+ * at most 5% less effective.
+ * Clusters are then sorted by how far they face away from the center
+ * of the mesh (the dot product of the cluster's average normal with
+ * the direction from the mesh's center to the cluster's center),
+ * which approximates how often each cluster occludes the rest of
+ * the mesh without knowing where the camera is.
+ *
+ * @param indices The indices of a triangle list. They are reordered
+ * in place.
+ * @param indexCount Number of indices.
+ * @param positions Three floats (x, y, z) per vertex.
+ * @param vertexCount Number of vertices.
+ */
+void kuhl_optimize_overdraw(GLuint *indices, GLuint indexCount, const GLfloat *positions, GLuint vertexCount)
+{
+	GLuint triCount = indexCount / 3;
+	if(indices == NULL || positions == NULL || triCount < 2)
+		return;
+	for(GLuint i=0; i<triCount*3; i++)
+		if(indices[i] >= vertexCount)
+			return;
+
+	/* Split the triangles into clusters, simulating a 16 vertex
+	 * FIFO cache that is emptied at the start of each cluster. */
+	const GLuint cacheSize = 16;
+	float acmr, atvr;
+	kuhl_vertex_cache_stats(indices, indexCount, vertexCount, cacheSize, &acmr, &atvr);
+	const float maxAcmr = acmr * 1.05f;
+	kuhl_overdraw_cluster *clusters = (kuhl_overdraw_cluster*) kuhl_malloc(sizeof(kuhl_overdraw_cluster)*triCount);
+	GLuint clusterCount = 0;
+	GLuint *added = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	memset(added, 0, sizeof(GLuint)*vertexCount);
+	GLuint time = cacheSize;
+	GLuint clusterMisses = 0;
+	for(GLuint t=0; t<triCount; t++)
+	{
+		if(t == 0 || clusterMisses <= maxAcmr * clusters[clusterCount-1].count)
+		{
+			clusters[clusterCount].start = t;
+			clusters[clusterCount].count = 0;
+			clusterCount++;
+			clusterMisses = 0;
+			time += cacheSize; // empty the cache
+		}
+		for(int k=0; k<3; k++)
+		{
+			GLuint v = indices[t*3+k];
+			if(time - added[v] >= cacheSize)
+			{
+				added[v] = time++;
+				clusterMisses++;
+			}
+		}
+		clusters[clusterCount-1].count++;
+	}
+	free(added);
+	if(clusterCount < 2)
+	{
+		free(clusters);
+		return;
+	}
+
+	/* Find the area-weighted center and normal of each cluster and
+	 * the center of the whole mesh. */
+	float (*centers)[3] = kuhl_malloc(sizeof(float)*3*clusterCount);
+	float (*normals)[3] = kuhl_malloc(sizeof(float)*3*clusterCount);
+	float meshCenter[3] = { 0, 0, 0 };
+	float meshArea = 0;
+	for(GLuint c=0; c<clusterCount; c++)
+	{
+		float area = 0;
+		vec3f_set(centers[c], 0, 0, 0);
+		vec3f_set(normals[c], 0, 0, 0);
+		for(GLuint t=clusters[c].start; t<clusters[c].start+clusters[c].count; t++)
+		{
+			const float *p0 = positions + 3*indices[t*3];
+			const float *p1 = positions + 3*indices[t*3+1];
+			const float *p2 = positions + 3*indices[t*3+2];
+			float e1[3], e2[3], n[3];
+			vec3f_sub_new(e1, p1, p0);
+			vec3f_sub_new(e2, p2, p0);
+			vec3f_cross_new(n, e1, e2);
+			float triArea = vec3f_norm(n); // twice the area; only ratios matter
+			for(int k=0; k<3; k++)
+				centers[c][k] += triArea * (p0[k]+p1[k]+p2[k]) / 3;
+			vec3f_add_new(normals[c], normals[c], n);
+			area += triArea;
+		}
+		vec3f_add_new(meshCenter, meshCenter, centers[c]);
+		meshArea += area;
+		if(area > 0)
+			vec3f_scalarDiv(centers[c], area);
+	}
+	if(meshArea > 0)
+		vec3f_scalarDiv(meshCenter, meshArea);
+
+	for(GLuint c=0; c<clusterCount; c++)
+	{
+		float toCluster[3];
+		vec3f_sub_new(toCluster, centers[c], meshCenter);
+		float length = vec3f_norm(normals[c]);
+		clusters[c].key = length > 0 ? vec3f_dot(toCluster, normals[c]) / length : 0;
+	}
+	free(centers);
+	free(normals);
+
+	qsort(clusters, clusterCount, sizeof(kuhl_overdraw_cluster), kuhl_overdraw_cluster_compare);
+	GLuint *output = (GLuint*) kuhl_malloc(sizeof(GLuint)*triCount*3);
+	GLuint n = 0;
+	for(GLuint c=0; c<clusterCount; c++)
+	{
+		memcpy(output + n*3, indices + clusters[c].start*3, sizeof(GLuint)*3*clusters[c].count);
+		n += clusters[c].count;
+	}
+	memcpy(indices, output, sizeof(GLuint)*triCount*3);
+	free(output);
+	free(clusters);
+}
+
+/** Renumbers vertices in the order that an index array first uses
+ * them, so that vertices that are drawn together are next to each
+ * other in memory. Vertices that aren't used are moved to the end.
+ * Do this after the triangles are reordered (e.g., with
+ * kuhl_optimize_vertex_cache()).
+ *
+ * @param indices The indices to renumber (in place).
+ * @param indexCount Number of indices.
+ * @param vertexCount Number of vertices.
+ *
+ * @return A newly allocated array of vertexCount entries that the
+ * caller should free(). Entry i is the new position of the vertex
+ * that used to be at position i; move the vertex attributes
+ * accordingly. NULL if an index is out of range.
+ */
+GLuint* kuhl_optimize_vertex_fetch(GLuint *indices, GLuint indexCount, GLuint vertexCount)
+{
+	if(indices == NULL || vertexCount == 0)
+		return NULL;
+	for(GLuint i=0; i<indexCount; i++)
+		if(indices[i] >= vertexCount)
+			return NULL;
+
+	GLuint *remap = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	for(GLuint v=0; v<vertexCount; v++)
+		remap[v] = (GLuint) -1;
+	GLuint next = 0;
+	for(GLuint i=0; i<indexCount; i++)
+	{
+		if(remap[indices[i]] == (GLuint) -1)
+			remap[indices[i]] = next++;
+		indices[i] = remap[indices[i]];
+	}
+	for(GLuint v=0; v<vertexCount; v++)
+		if(remap[v] == (GLuint) -1)
+			remap[v] = next++;
+	return remap;
+}
+
+/** A quadric error metric (Garland and Heckbert, "Surface
+ * Simplification Using Quadric Error Metrics", 1997) used by
+ * kuhl_simplify(). It is the sum of the squared distances from a
+ * point to a set of planes, stored as the upper triangle of a
+ * symmetric 4x4 matrix. Each plane is weighted by the area of the
+ * triangle it came from. */
+typedef struct
+{
+	double m[10];  /**< a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d for planes ax+by+cz+d=0 */
+	double weight; /**< Total area of the triangles */
+} kuhl_quadric;
+
+/** Sets a quadric to the plane of a triangle. Triangles with no
+ * area have an empty quadric. */
+static void kuhl_quadric_from_triangle(kuhl_quadric *q, const GLfloat p0[3], const GLfloat p1[3], const GLfloat p2[3])
+{
+	memset(q, 0, sizeof(kuhl_quadric));
+	float e1[3], e2[3], n[3];
+	vec3f_sub_new(e1, p1, p0);
+	vec3f_sub_new(e2, p2, p0);
+	vec3f_cross_new(n, e1, e2);
+	float length = vec3f_norm(n);
+	if(length == 0)
+		return;
+	double a = n[0]/length, b = n[1]/length, c = n[2]/length;
+	double d = -(a*p0[0] + b*p0[1] + c*p0[2]);
+	double area = length/2;
+	double plane[10] = { a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d };
+	for(int i=0; i<10; i++)
+		q->m[i] = area*plane[i];
+	q->weight = area;
+}
+
+/** Adds quadric r to quadric q. */
+static void kuhl_quadric_add(kuhl_quadric *q, const kuhl_quadric *r)
+{
+	for(int i=0; i<10; i++)
+		q->m[i] += r->m[i];
+	q->weight += r->weight;
+}
+
+/** Returns the mean squared distance from a point to the planes in
+ * the sum of two quadrics (weighted by area). */
+static double kuhl_quadric_error(const kuhl_quadric *q, const kuhl_quadric *r, const GLfloat p[3])
+{
+	double m[10];
+	for(int i=0; i<10; i++)
+		m[i] = q->m[i] + r->m[i];
+	double weight = q->weight + r->weight;
+	double x = p[0], y = p[1], z = p[2];
+	double error = m[0]*x*x + 2*m[1]*x*y + 2*m[2]*x*z + 2*m[3]*x
+	             + m[4]*y*y + 2*m[5]*y*z + 2*m[6]*y
+	             + m[7]*z*z + 2*m[8]*z
+	             + m[9];
+	return weight > 0 ? fabs(error)/weight : 0;
+}
+
+/** An edge collapse that kuhl_simplify() may perform: vertex "from"
+ * is replaced by vertex "to". */
+typedef struct
+{
+	float cost;  /**< Error that the collapse introduces (see kuhl_quadric_error()) */
+	GLuint from; /**< Vertex that is removed */
+	GLuint to;   /**< Vertex that replaces it */
+} kuhl_simplify_collapse;
+
+/** Sorts collapses from the cheapest to the most expensive with a
+ * radix sort (two passes of 16 bits each), which is much faster than
+ * qsort() for the number of edges in a large mesh. The costs are
+ * never negative, so their bits sort in the same order as their
+ * values. The sort is stable, so the order of collapses with the same
+ * cost doesn't depend on the platform.
+ *
+ * @param collapses The collapses to sort.
+ * @param scratch Room for count collapses.
+ * @param count Number of collapses.
+ */
+static void kuhl_simplify_sort(kuhl_simplify_collapse *collapses, kuhl_simplify_collapse *scratch, GLuint count)
+{
+	GLuint *buckets = (GLuint*) kuhl_malloc(sizeof(GLuint)*65536);
+	kuhl_simplify_collapse *src = collapses, *dst = scratch;
+	for(int shift=0; shift<32; shift+=16)
+	{
+		memset(buckets, 0, sizeof(GLuint)*65536);
+		for(GLuint i=0; i<count; i++)
+		{
+			unsigned int bits;
+			memcpy(&bits, &(src[i].cost), sizeof(bits));
+			buckets[(bits >> shift) & 0xffff]++;
+		}
+		GLuint sum = 0;
+		for(int b=0; b<65536; b++)
+		{
+			GLuint n = buckets[b];
+			buckets[b] = sum;
+			sum += n;
+		}
+		for(GLuint i=0; i<count; i++)
+		{
+			unsigned int bits;
+			memcpy(&bits, &(src[i].cost), sizeof(bits));
+			dst[buckets[(bits >> shift) & 0xffff]++] = src[i];
+		}
+		kuhl_simplify_collapse *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	/* After an even number of passes, the result is back in collapses. */
+	free(buckets);
+}
+
+/** Makes a list of the triangles that use each vertex for
+ * kuhl_simplify(): the triangles that use vertex v are
+ * adjacent[adjStart[v]] to adjacent[adjStart[v+1]-1].
+ *
+ * @param adjFill Room for vertexCount entries (used as scratch space).
+ */
+static void kuhl_simplify_adjacency(const GLuint *tris, GLuint triCount, GLuint vertexCount,
+                                    GLuint *adjStart, GLuint *adjFill, GLuint *adjacent)
+{
+	memset(adjStart, 0, sizeof(GLuint)*(vertexCount+1));
+	for(GLuint i=0; i<triCount*3; i++)
+		adjStart[tris[i]+1]++;
+	for(GLuint v=0; v<vertexCount; v++)
+	{
+		adjStart[v+1] += adjStart[v];
+		adjFill[v] = adjStart[v];
+	}
+	for(GLuint i=0; i<triCount*3; i++)
+		adjacent[adjFill[tris[i]]++] = i/3;
+}
+
+/** Computes the (unnormalized) normal of a triangle. */
+static void kuhl_simplify_normal(float normal[3], const GLfloat *p0, const GLfloat *p1, const GLfloat *p2)
+{
+	float e1[3], e2[3];
+	vec3f_sub_new(e1, p1, p0);
+	vec3f_sub_new(e2, p2, p0);
+	vec3f_cross_new(normal, e1, e2);
+}
+
+/** Reduces the number of triangles in a triangle mesh by collapsing
+ * edges: one vertex of the edge is moved onto the other, which
+ * removes the two triangles that share the edge. The collapses that
+ * change the surface the least are done first, measured with
+ * quadric error metrics (Garland and Heckbert, 1997).
+ *
+ * Vertices are never moved or created; the simplified mesh uses a
+ * subset of the original vertices. Therefore, it can be drawn with
+ * the same vertex attributes as the original---several simplified
+ * versions of a mesh can share one vertex buffer (see
+ * kuhl_lod_generate()).
+ *
+ * Vertices on edges that aren't shared by exactly two triangles are
+ * never removed. This keeps holes in the mesh from growing and keeps
+ * seams (where vertices are duplicated because their normals or
+ * texture coordinates differ) closed. Collapses that would flip a
+ * triangle over or make the mesh non-manifold are skipped.
+ *
+ * @param destination Set to the indices of the simplified
+ * mesh. Must have room for indexCount indices. May be the same as
+ * indices.
+ * @param indices The indices of a triangle list.
+ * @param indexCount Number of indices (three per triangle).
+ * @param positions Three floats (x, y, z) per vertex.
+ * @param vertexCount Number of vertices.
+ * @param targetIndexCount The number of indices to stop at. The
+ * result may have more indices if the mesh can't be simplified
+ * further.
+ * @param error If not NULL, set to the largest error of the
+ * collapses that were made. It is the root mean square distance
+ * between the moved vertex and the planes of the original triangles
+ * around the edge (in the same units as the positions).
+ *
+ * @return The number of indices in destination.
+ */
+GLuint kuhl_simplify(GLuint *destination, const GLuint *indices, GLuint indexCount,
+                     const GLfloat *positions, GLuint vertexCount,
+                     GLuint targetIndexCount, float *error)
+{
+	if(error != NULL)
+		*error = 0;
+	GLuint triCount = indexCount / 3;
+	if(destination == NULL || indices == NULL)
+		return 0;
+	if(destination != indices)
+		memmove(destination, indices, sizeof(GLuint)*triCount*3);
+	if(positions == NULL || triCount == 0 || targetIndexCount >= triCount*3)
+		return triCount*3;
+	for(GLuint i=0; i<triCount*3; i++)
+	{
+		if(destination[i] >= vertexCount)
+		{
+			msg(MSG_WARNING, "Not simplifying because index %u refers to vertex %u and there are only %u vertices.",
+			    i, destination[i], vertexCount);
+			return triCount*3;
+		}
+	}
+	GLuint *tris = destination;
+	GLuint targetTris = targetIndexCount / 3;
+
+	/* The quadric of each vertex measures the distance to the planes
+	 * of the triangles around it. When an edge is collapsed, the
+	 * quadric of the removed vertex is added to the remaining one. */
+	kuhl_quadric *quadrics = (kuhl_quadric*) kuhl_malloc(sizeof(kuhl_quadric)*vertexCount);
+	memset(quadrics, 0, sizeof(kuhl_quadric)*vertexCount);
+	for(GLuint t=0; t<triCount; t++)
+	{
+		kuhl_quadric q;
+		kuhl_quadric_from_triangle(&q, positions+3*tris[3*t], positions+3*tris[3*t+1], positions+3*tris[3*t+2]);
+		for(int k=0; k<3; k++)
+			kuhl_quadric_add(&quadrics[tris[3*t+k]], &q);
+	}
+
+	GLuint *adjStart = (GLuint*) kuhl_malloc(sizeof(GLuint)*(vertexCount+1));
+	GLuint *adjFill = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	GLuint *adjacent = (GLuint*) kuhl_malloc(sizeof(GLuint)*triCount*3);
+	kuhl_simplify_adjacency(tris, triCount, vertexCount, adjStart, adjFill, adjacent);
+
+	/* Lock the vertices on edges that don't have exactly two
+	 * triangles: mesh borders, seams and non-manifold edges. */
+	unsigned char *locked = (unsigned char*) kuhl_malloc(vertexCount);
+	memset(locked, 0, vertexCount);
+	for(GLuint i=0; i<triCount*3; i++)
+	{
+		GLuint a = tris[i], b = tris[i - i%3 + (i+1)%3];
+		int edgeTris = 0;
+		for(GLuint j=adjStart[a]; j<adjStart[a+1]; j++)
+		{
+			const GLuint *t = tris + 3*adjacent[j];
+			if(t[0] == b || t[1] == b || t[2] == b)
+				edgeTris++;
+		}
+		if(edgeTris != 2)
+		{
+			locked[a] = 1;
+			locked[b] = 1;
+		}
+	}
+	GLuint *touched = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	GLuint *stamps = (GLuint*) kuhl_malloc(sizeof(GLuint)*vertexCount);
+	memset(touched, 0, sizeof(GLuint)*vertexCount);
+	memset(stamps, 0, sizeof(GLuint)*vertexCount);
+	kuhl_simplify_collapse *collapses = (kuhl_simplify_collapse*) kuhl_malloc(sizeof(kuhl_simplify_collapse)*triCount*3);
+	kuhl_simplify_collapse *scratch = (kuhl_simplify_collapse*) kuhl_malloc(sizeof(kuhl_simplify_collapse)*triCount*3);
+	double maxError = 0;
+	GLuint pass = 0, stamp = 0;
+
+	/* Each pass makes the cheapest collapses that don't touch the
+	 * triangles changed by another collapse in the same pass. The
+	 * costs are then recalculated for the next pass. */
+	while(triCount > targetTris)
+	{
+		pass++;
+		if(pass > 1)
+			kuhl_simplify_adjacency(tris, triCount, vertexCount, adjStart, adjFill, adjacent);
+
+		/* Each edge between two triangles appears once in each
+		 * direction; consider it once. Collapse in the direction
+		 * with the smaller error. */
+		GLuint collapseCount = 0;
+		for(GLuint i=0; i<triCount*3; i++)
+		{
+			GLuint a = tris[i], b = tris[i - i%3 + (i+1)%3];
+			if(a >= b || (locked[a] && locked[b]))
+				continue;
+			double costA = locked[a] ? DBL_MAX : kuhl_quadric_error(&quadrics[a], &quadrics[b], positions+3*b);
+			double costB = locked[b] ? DBL_MAX : kuhl_quadric_error(&quadrics[a], &quadrics[b], positions+3*a);
+			kuhl_simplify_collapse *c = &(collapses[collapseCount++]);
+			c->from = costA <= costB ? a : b;
+			c->to   = costA <= costB ? b : a;
+			c->cost = (float) (costA <= costB ? costA : costB);
+		}
+		kuhl_simplify_sort(collapses, scratch, collapseCount);
+
+		GLuint removed = 0, collapsed = 0;
+		for(GLuint c=0; c<collapseCount && triCount-removed > targetTris; c++)
+		{
+			GLuint from = collapses[c].from, to = collapses[c].to;
+			if(touched[from] == pass || touched[to] == pass)
+				continue;
+
+			/* The edge must be shared by exactly two triangles, and
+			 * the two vertices must have no other neighbors in
+			 * common; otherwise the collapse would pinch the mesh. */
+			stamp++;
+			for(GLuint i=adjStart[from]; i<adjStart[from+1]; i++)
+				for(int k=0; k<3; k++)
+					stamps[tris[3*adjacent[i]+k]] = stamp;
+			int shared = 0;
+			for(GLuint i=adjStart[to]; i<adjStart[to+1]; i++)
+			{
+				for(int k=0; k<3; k++)
+				{
+					GLuint v = tris[3*adjacent[i]+k];
+					if(v != to && v != from && stamps[v] == stamp)
+					{
+						shared++;
+						stamps[v] = 0;
+					}
+				}
+			}
+			if(shared != 2)
+				continue;
+
+			/* Don't flip a triangle over or make it degenerate. */
+			int flips = 0;
+			for(GLuint i=adjStart[from]; i<adjStart[from+1] && !flips; i++)
+			{
+				const GLuint *t = tris + 3*adjacent[i];
+				if(t[0] == to || t[1] == to || t[2] == to)
+					continue; // this triangle is removed
+				const GLfloat *p[3], *q[3];
+				for(int k=0; k<3; k++)
+				{
+					p[k] = positions + 3*t[k];
+					q[k] = t[k] == from ? positions + 3*to : p[k];
+				}
+				float before[3], after[3];
+				kuhl_simplify_normal(before, p[0], p[1], p[2]);
+				kuhl_simplify_normal(after, q[0], q[1], q[2]);
+				float lengthBefore = vec3f_norm(before);
+				/* Allow the normal to rotate by up to about 80 degrees. */
+				if(lengthBefore > 0 && vec3f_dot(before, after) <= 0.2f*lengthBefore*vec3f_norm(after))
+					flips = 1;
+			}
+			if(flips)
+				continue;
+
+			for(GLuint i=adjStart[from]; i<adjStart[from+1]; i++)
+			{
+				GLuint *t = tris + 3*adjacent[i];
+				if(t[0] == to || t[1] == to || t[2] == to)
+					removed++;
+				for(int k=0; k<3; k++)
+				{
+					if(t[k] == from)
+						t[k] = to;
+					touched[t[k]] = pass;
+				}
+			}
+			touched[from] = pass;
+			kuhl_quadric_add(&quadrics[to], &quadrics[from]);
+			if(collapses[c].cost > maxError)
+				maxError = collapses[c].cost;
+			collapsed++;
+		}
+		if(collapsed == 0)
+			break;
+
+		/* Remove the triangles that lost a vertex. */
+		GLuint n = 0;
+		for(GLuint t=0; t<triCount; t++)
+		{
+			GLuint a = tris[3*t], b = tris[3*t+1], c = tris[3*t+2];
+			if(a == b || b == c || a == c)
+				continue;
+			tris[3*n] = a;
+			tris[3*n+1] = b;
+			tris[3*n+2] = c;
+			n++;
+		}
+		triCount = n;
+	}
 
-	/* Tell OpenGL some information about the data that is in the
-	 * buffer. Among other things, we need to tell OpenGL which
-	 * attribute number (i.e., variable) the data should correspond to
-	 * in the vertex program. */
-	glVertexAttribPointer(
-		attribLocation, // attribute location in glsl program
-		components, // number of elements (x,y,z)
-		GL_FLOAT, // type of each element
-		GL_FALSE, // should OpenGL normalize values?
-		0,        // no extra data between each position
-		0 );      // offset of first element
-	kuhl_errorcheck();
+	free(scratch);
+	free(collapses);
+	free(stamps);
+	free(touched);
+	free(adjacent);
+	free(adjFill);
+	free(adjStart);
+	free(locked);
+	free(quadrics);
+	if(error != NULL)
+		*error = (float) sqrt(maxError);
+	return triCount*3;
+}
 
-	// unbind
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+/** Makes several levels of detail of a triangle mesh with
+ * kuhl_simplify(). Each level has about "reduction" times as many
+ * triangles as the previous one and is made by simplifying the
+ * previous level. The triangles of each level are reordered with
+ * kuhl_optimize_vertex_cache(). Fewer than maxLevels levels are made
+ * if the mesh can't be simplified any further.
+ *
+ * The result can be given to kuhl_geometry_lod().
+ *
+ * @param lodIndices Set to a newly allocated array (which the caller
+ * should free()) containing the indices of every level, one after
+ * the other.
+ * @param lods An array of maxLevels structs. lods[i] is set to the
+ * location of level i in lodIndices and its approximate error (the
+ * sum of the errors reported by kuhl_simplify() while making it).
+ * lods[0] is a copy of the original indices.
+ * @param maxLevels The most levels to make (including the original).
+ * @param indices The indices of a triangle list.
+ * @param indexCount Number of indices.
+ * @param positions Three floats (x, y, z) per vertex.
+ * @param vertexCount Number of vertices.
+ * @param reduction Fraction of the triangles to keep in each level
+ * (between 0 and 1).
+ *
+ * @return The number of levels made (at least 1), or 0 if there are
+ * no indices.
+ */
+int kuhl_lod_generate(GLuint **lodIndices, kuhl_lod *lods, int maxLevels,
+                      const GLuint *indices, GLuint indexCount,
+                      const GLfloat *positions, GLuint vertexCount, float reduction)
+{
+	*lodIndices = NULL;
+	indexCount -= indexCount % 3;
+	if(maxLevels < 1 || indices == NULL || indexCount == 0)
+		return 0;
+	if(reduction <= 0 || reduction >= 1)
+	{
+		msg(MSG_WARNING, "The reduction in each level of detail must be between 0 and 1 (it was %f). Using 0.5.", reduction);
+		reduction = 0.5f;
+	}
+
+	/* With a reduction of 0.5, all of the levels fit in twice the
+	 * space of the original. */
+	size_t capacity = (size_t) indexCount*2;
+	GLuint *all = (GLuint*) kuhl_malloc(sizeof(GLuint)*capacity);
+	memcpy(all, indices, sizeof(GLuint)*indexCount);
+	lods[0].first = 0;
+	lods[0].count = indexCount;
+	lods[0].error = 0;
+
+	int levels = 1;
+	while(levels < maxLevels)
+	{
+		const kuhl_lod *prev = &(lods[levels-1]);
+		GLuint used = prev->first + prev->count;
+		size_t needed = (size_t) used + prev->count;
+		if(capacity < needed)
+		{
+			GLuint *bigger = (GLuint*) realloc(all, sizeof(GLuint)*needed);
+			if(bigger == NULL)
+			{
+				/* Keep the levels that have already been made. */
+				msg(MSG_WARNING, "Ran out of memory after making %d levels of detail.", levels);
+				break;
+			}
+			all = bigger;
+			capacity = needed;
+		}
+
+		GLuint target = (GLuint) (prev->count/3 * reduction) * 3;
+		float error;
+		GLuint count = kuhl_simplify(all+used, all+prev->first, prev->count,
+		                             positions, vertexCount, target, &error);
+		/* Stop if the mesh couldn't be simplified much (e.g.,
+		 * because most of its vertices are on seams). */
+		if(count == 0 || count > prev->count - prev->count/10)
+			break;
+		kuhl_optimize_vertex_cache(all+used, count, vertexCount);
+
+		lods[levels].first = used;
+		lods[levels].count = count;
+		lods[levels].error = prev->error + error;
+		levels++;
+	}
+	*lodIndices = all;
+	return levels;
 }
 
 /** Calculates the number of objects in the kuhl_geometry linked list.
@@ -1343,9 +3773,12 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 	 * integer that you can think of as an ID number) that we can use
 	 * for a new VAO (vertex array object) */
 	glGenVertexArrays(1, &(geom->vao));
+	/* The name may belong to a deleted VAO that we think is bound. */
+	if(kuhl_gl_shadow.vao == geom->vao)
+		kuhl_gl_shadow.vao = KUHL_GL_STATE_UNKNOWN;
 	/* Bind to the VAO to finish creating it */
-	glBindVertexArray(geom->vao);
-	glBindVertexArray(0); // unbind
+	kuhl_bind_vertex_array(geom->vao);
+	kuhl_bind_vertex_array(0); // unbind
 
 	/* Check if the program is valid (we don't need to enable it here). */
 	if(!glIsProgram(program))
@@ -1360,6 +3793,7 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 	}
 
 	geom->program = program;
+	kuhl_uniform_cache_get(program);
 	geom->vertex_count = vertexCount;
 	geom->primitive_type = primitive_type;
 
@@ -1368,9 +3802,16 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 
 	geom->indices_len = 0;
 	geom->indices_bufferobject = 0;
+	geom->indices_type = GL_UNSIGNED_INT;
 
 	mat4f_identity(geom->matrix);
 	geom->has_been_drawn = 0;
+	geom->multidraw = NULL;
+	geom->lods = NULL;
+	geom->lod_count = 0;
+	geom->lod_current = 0;
+	for(int i=0; i<6; i++)
+		geom->lod_bbox[i] = 0;
 	
 #if KUHL_UTIL_USE_ASSIMP
 	geom->assimp_node  = NULL;
@@ -1384,6 +3825,11 @@ void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexC
 /** Applies a set of indices to the geometry so that vertices can be
  * re-used by multiple triangles or lines.
  *
+ * The indices are stored as 16-bit integers (GL_UNSIGNED_SHORT) if
+ * they are all smaller than 65536---which is always the case if the
+ * geometry has fewer than 65536 vertices. This halves the size of
+ * the index buffer. Otherwise, they are stored as 32-bit integers.
+ *
  * @param geom The geometry that the indices should be used with.
  *
  * @param indices A list of indices. Each index refers to a specific vertex.
@@ -1416,15 +3862,19 @@ void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCou
 	/* Verify that the indices the user passed in are
 	 * appropriate. If there are only 10 vertices, then a user
 	 * can't draw a vertex at index 10, 11, 13, etc. */
+	GLuint maxIndex = 0;
 	for(GLuint i=0; i<geom->indices_len; i++)
 	{
 		if(indices[i] >= geom->vertex_count)
 			msg(MSG_ERROR, "kuhl_geometry has %d vertices but indices[%d] is asking for vertex at index %d to be drawn.\n",
 			    geom->vertex_count, i, indices[i]);
+		if(indices[i] > maxIndex)
+			maxIndex = indices[i];
 	}
+	geom->indices_type = maxIndex < 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
 
 	/* Enable VAO */
-	glBindVertexArray(geom->vao);
+	kuhl_bind_vertex_array(geom->vao);
 		
 	/* Set up a buffer object (BO) which is a place to store the
 	 * *indices* on the graphics card. */
@@ -1433,13 +3883,163 @@ void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCou
 	kuhl_errorcheck();
 
 	/* Copy the indices data into the currently bound buffer. */
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*geom->indices_len,
-	             indices, GL_STATIC_DRAW);
+	if(geom->indices_type == GL_UNSIGNED_SHORT)
+	{
+		GLushort *shorts = (GLushort*) kuhl_malloc(sizeof(GLushort)*geom->indices_len);
+		for(GLuint i=0; i<geom->indices_len; i++)
+			shorts[i] = (GLushort) indices[i];
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort)*geom->indices_len,
+		             shorts, GL_STATIC_DRAW);
+		free(shorts);
+	}
+	else
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*geom->indices_len,
+		             indices, GL_STATIC_DRAW);
 	kuhl_errorcheck();
 	// Don't unbind GL_ELEMENT_ARRAY_BUFFER since the VAO keeps track of this for us.
 
 	// unbind vao
-	glBindVertexArray(0);
+	kuhl_bind_vertex_array(0);
+}
+
+/** Applies several levels of detail (e.g., from kuhl_lod_generate())
+ * to a geometry instead of calling kuhl_geometry_indices(). All of
+ * the levels are stored in the geometry's index buffer;
+ * kuhl_geometry_lod_select() chooses which one kuhl_geometry_draw()
+ * draws. Until it is called, the full-detail level is drawn.
+ *
+ * @param geom The geometry that the indices should be used with.
+ *
+ * @param lodIndices The indices of all of the levels.
+ *
+ * @param lods The location of each level in lodIndices, from the
+ * most detailed to the least detailed. lods[0] is the full-detail
+ * level and must be at the start of lodIndices. The error of each
+ * level is used by kuhl_geometry_lod_select().
+ *
+ * @param lodCount The number of levels.
+ *
+ * @param positions The positions of the geometry's vertices (three
+ * floats per vertex), used to calculate the bounding box that
+ * kuhl_geometry_lod_select() projects onto the screen.
+ */
+void kuhl_geometry_lod(kuhl_geometry *geom, GLuint *lodIndices, const kuhl_lod *lods, int lodCount,
+                       const GLfloat *positions)
+{
+	if(lodIndices == NULL || lods == NULL || lodCount < 1 || lods[0].first != 0)
+	{
+		msg(MSG_WARNING, "No levels of detail were provided or the first one isn't at the start of the indices.\n");
+		return;
+	}
+
+	if(geom->indices_bufferobject != 0)
+		glDeleteBuffers(1, &(geom->indices_bufferobject));
+	const kuhl_lod *last = &(lods[lodCount-1]);
+	kuhl_geometry_indices(geom, lodIndices, last->first + last->count);
+	geom->indices_len = lods[0].count;
+
+	free(geom->lods);
+	geom->lods = NULL;
+	geom->lod_count = 0;
+	geom->lod_current = 0;
+	if(lodCount > 1)
+	{
+		geom->lods = (kuhl_lod*) kuhl_malloc(sizeof(kuhl_lod)*lodCount);
+		memcpy(geom->lods, lods, sizeof(kuhl_lod)*lodCount);
+		geom->lod_count = lodCount;
+	}
+
+	for(int i=0; i<3; i++)
+	{
+		geom->lod_bbox[i*2]   = FLT_MAX;
+		geom->lod_bbox[i*2+1] = -FLT_MAX;
+	}
+	for(GLuint v=0; v<geom->vertex_count; v++)
+	{
+		for(int i=0; i<3; i++)
+		{
+			geom->lod_bbox[i*2]   = fminf(geom->lod_bbox[i*2],   positions[v*3+i]);
+			geom->lod_bbox[i*2+1] = fmaxf(geom->lod_bbox[i*2+1], positions[v*3+i]);
+		}
+	}
+}
+
+/** Chooses the level of detail that kuhl_geometry_draw() draws for
+ * each geometry that has levels of detail (see kuhl_geometry_lod()).
+ * The bounding box of the geometry is projected onto the screen, and
+ * the least detailed level whose error would cover at most
+ * maxPixelError pixels is chosen. The error of a level is measured
+ * relative to the size of the bounding box, so a geometry that covers
+ * a few pixels is drawn with its least detailed level.
+ *
+ * Call this once per viewport before drawing, with the same matrices
+ * that the geometry is drawn with (for example, the view matrix from
+ * viewmat_get() multiplied by the model matrix, and the projection
+ * matrix from viewmat_get()). The level is stored in the geometry,
+ * so drawing the same geometry in several places in one frame uses
+ * the level chosen last.
+ *
+ * @param geom The geometry. If it is part of a linked list, a level
+ * is chosen for every geometry in the list.
+ * @param modelview The modelview matrix the geometry is drawn with
+ * (without the geometry's own matrix, which is included
+ * automatically).
+ * @param projection The projection matrix.
+ * @param viewport The viewport (x, y, width, height) from
+ * viewmat_get_viewport().
+ * @param maxPixelError The largest error (in pixels) to allow. 1 is
+ * a reasonable value.
+ */
+void kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16], const float projection[16],
+                              const int viewport[4], float maxPixelError)
+{
+	float viewProj[16];
+	mat4f_mult_mat4f_new(viewProj, projection, modelview);
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+	{
+		g->lod_current = 0;
+		if(g->lod_count < 2)
+			continue;
+
+		float m[16];
+		mat4f_mult_mat4f_new(m, viewProj, g->matrix);
+		const float *bbox = g->lod_bbox;
+		float min[2] = { FLT_MAX, FLT_MAX };
+		float max[2] = { -FLT_MAX, -FLT_MAX };
+		int behind = 0;
+		for(int c=0; c<8 && !behind; c++)
+		{
+			float corner[4] = { bbox[(c&1) ? 1 : 0], bbox[(c&2) ? 3 : 2], bbox[(c&4) ? 5 : 4], 1 };
+			float clip[4];
+			mat4f_mult_vec4f_new(clip, m, corner);
+			/* Part of the box is behind the viewer, so the geometry
+			 * may be very close. Draw it in full detail. */
+			if(clip[3] <= 0)
+				behind = 1;
+			for(int i=0; i<2 && !behind; i++)
+			{
+				min[i] = fminf(min[i], clip[i]/clip[3]);
+				max[i] = fmaxf(max[i], clip[i]/clip[3]);
+			}
+		}
+		if(behind)
+			continue;
+
+		/* Normalized device coordinates are 2 units wide. */
+		float pixels = fmaxf((max[0]-min[0])*viewport[2], (max[1]-min[1])*viewport[3]) / 2;
+		float diagonal[3] = { bbox[1]-bbox[0], bbox[3]-bbox[2], bbox[5]-bbox[4] };
+		float size = vec3f_norm(diagonal);
+		if(size <= 0)
+			continue;
+		for(int l=g->lod_count-1; l>0; l--)
+		{
+			if(g->lods[l].error / size * pixels <= maxPixelError)
+			{
+				g->lod_current = l;
+				break;
+			}
+		}
+	}
 }
 
 
@@ -1475,47 +4075,210 @@ void kuhl_geometry_init(kuhl_geometry *geom)
 }
 #endif
 
-/** Draws a kuhl_geometry struct to the screen. The struct passed into
- * this function should have been set up with kuhl_geometry_new() and
- * at least one position attribute with kuhl_geometry_attrib() before
- * calling this function.
+/** Texture unit that kuhl_geometry_draw_instanced() binds the
+ * instance matrices to. Textures in a kuhl_geometry use units 0 to
+ * MAX_TEXTURES-1. */
+#define KUHL_INSTANCE_TEXTURE_UNIT MAX_TEXTURES
 
- @param geom The geometry to draw to the screen. If the kuhl_geometry
- object is a part of a linked list, this function will draw each of
- the objects in order. */
-void kuhl_geometry_draw(kuhl_geometry *geom)
+/** Buffer and buffer texture that hold the matrices for
+ * kuhl_geometry_draw_instanced(). */
+static GLuint kuhl_instance_buffer = 0;
+static GLuint kuhl_instance_texture = 0;
+
+/** Returns 1 if a program can read instance matrices (i.e., it has
+ * the "InstanceMat" and "UseInstanceMat" uniform variables that
+ * assimp.vert uses). */
+static int kuhl_program_supports_instancing(GLuint program)
 {
-	if(geom == NULL)
-		return;
-	
+	kuhl_uniform_cache *uniforms = kuhl_uniform_cache_get(program);
+	return uniforms->instanceMat != -1 && uniforms->useInstanceMat != -1;
+}
+
+/** Copies instance matrices into kuhl_instance_buffer and binds
+ * the buffer texture that reads from it to
+ * KUHL_INSTANCE_TEXTURE_UNIT.
+ *
+ * @param matrices count column-major 4x4 matrices.
+ * @param count The number of matrices.
+ */
+static void kuhl_instance_upload(const float *matrices, int count)
+{
+	if(kuhl_instance_buffer == 0)
+	{
+		glGenBuffers(1, &kuhl_instance_buffer);
+		glGenTextures(1, &kuhl_instance_texture);
+		kuhl_gl_state_forget_texture(kuhl_instance_texture);
+		kuhl_active_texture(KUHL_INSTANCE_TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_BUFFER, kuhl_instance_texture);
+		glBindBuffer(GL_TEXTURE_BUFFER, kuhl_instance_buffer);
+		/* Each texel is one column of a matrix. */
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, kuhl_instance_buffer);
+		kuhl_errorcheck();
+	}
+
+	/* Give OpenGL a new data store each time so that it doesn't need
+	 * to wait for earlier draws that use the old matrices. */
+	glBindBuffer(GL_TEXTURE_BUFFER, kuhl_instance_buffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(float)*16*count, matrices, GL_STREAM_DRAW);
+	kuhl_active_texture(KUHL_INSTANCE_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, kuhl_instance_texture);
 	kuhl_errorcheck();
-	
-	/* Record the OpenGL state so that we can restore it when we have
-	 * finished drawing. */
-	GLint previouslyUsedProgram = 0;
-	glGetIntegerv(GL_CURRENT_PROGRAM, &previouslyUsedProgram);
-	GLint previouslyBoundTexture = 0;
-	glGetIntegerv(GL_TEXTURE_BINDING_2D, &previouslyBoundTexture);
-	GLint previouslyActiveTexture = 0;
-	glGetIntegerv(GL_ACTIVE_TEXTURE, &previouslyActiveTexture);
-	GLint previousVAO=0;
-	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVAO);
-
-	/* Check that there is a valid program and VAO object for us to use. */
-	if(glIsProgram(geom->program) == 0)
-	{
-		msg(MSG_ERROR, "Program (%d) is invalid.\n", geom->program);
+}
+
+/** Draws the meshes in a geometry created by kuhl_geometry_merge():
+ * one multi-draw call for each texture. Called by
+ * kuhl_geometry_draw_call().
+ *
+ * @param geom The merged geometry. Its program and vertex array
+ * object must be in use.
+ * @param instanceCount The number of instances to draw, 0 if the
+ * geometry isn't instanced.
+ */
+static void kuhl_multidraw_draw(kuhl_geometry *geom, int instanceCount)
+{
+	kuhl_multidraw *md = geom->multidraw;
+	kuhl_uniform_cache *uniforms = kuhl_uniform_cache_get(geom->program);
+	if(md->indirect_bufferobject != 0 && instanceCount == 0)
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, md->indirect_bufferobject);
+
+	for(int g=0; g<md->group_count; g++)
+	{
+		/* Bind the texture for this group of meshes. */
+		int hasTex = 0;
+		kuhl_texture *tex = &(md->textures[g]);
+		if(tex->textureId != 0)
+		{
+			GLint loc = kuhl_uniform_cache_lookup(geom->program, uniforms, tex->name, tex->name_hash);
+			if(loc != -1)
+			{
+				glUniform1i(loc, 0);
+				kuhl_bind_texture(0, tex->textureId);
+				hasTex = strcmp(tex->name, "tex") == 0;
+			}
+		}
+		if(uniforms->hasTex != -1)
+			glUniform1i(uniforms->hasTex, hasTex);
+
+		int first = md->group_start[g];
+		int count = md->group_start[g+1] - first;
+		if(instanceCount > 0)
+		{
+			for(int i=first; i<first+count; i++)
+				glDrawElementsInstancedBaseVertex(geom->primitive_type, md->counts[i], geom->indices_type,
+				                                  md->offsets[i], instanceCount, md->base_vertices[i]);
+		}
+		else if(md->indirect_bufferobject != 0)
+			glMultiDrawElementsIndirect(geom->primitive_type, geom->indices_type,
+			                            (const GLvoid*) (sizeof(kuhl_draw_command)*first), count, 0);
+		else
+			glMultiDrawElementsBaseVertex(geom->primitive_type, md->counts+first, geom->indices_type,
+			                              (const GLvoid* const*) (md->offsets+first), count, md->base_vertices+first);
 		kuhl_errorcheck();
+	}
+
+	/* Unbind the indirect buffer so that indirect draws in the
+	 * application still read their commands from client memory. */
+	if(md->indirect_bufferobject != 0 && instanceCount == 0)
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+/** Issues the draw call for a geometry whose program, textures,
+ * uniforms and vertex array object are already set up.
+ *
+ * @param geom The geometry to draw.
+ * @param instanceCount The number of instances to draw, 0 to use
+ * glDrawElements()/glDrawArrays() instead of their instanced
+ * versions.
+ */
+static void kuhl_geometry_draw_call(kuhl_geometry *geom, int instanceCount)
+{
+	if(geom->multidraw != NULL)
+	{
+		kuhl_multidraw_draw(geom, instanceCount);
 		return;
 	}
-	else if (glIsVertexArray(geom->vao) == 0)
+
+	/* If the user provided us with indices, use glDrawElements() to
+	 * draw the geometry. */
+	if(geom->indices_len > 0 && geom->indices_bufferobject != 0)
 	{
-		msg(MSG_ERROR, "Vertex array object (%d) is invalid.\n", geom->vao);
+		/* Draw the level of detail chosen by
+		 * kuhl_geometry_lod_select(). Each level is a range of the
+		 * index buffer. */
+		GLuint count = geom->indices_len;
+		const GLvoid *offset = NULL;
+		if(geom->lod_current > 0 && geom->lod_current < geom->lod_count)
+		{
+			const kuhl_lod *lod = &(geom->lods[geom->lod_current]);
+			count = lod->count;
+			offset = (const GLvoid*) ((size_t) lod->first * kuhl_geometry_index_size(geom));
+		}
+		if(instanceCount > 0)
+			glDrawElementsInstanced(geom->primitive_type,
+			                        count,
+			                        geom->indices_type,
+			                        offset, instanceCount);
+		else
+			glDrawElements(geom->primitive_type,
+			               count,
+			               geom->indices_type,
+			               offset);
 		kuhl_errorcheck();
-		return;
 	}
-	glUseProgram(geom->program);
+	else
+	{
+		/* If the user didn't provide us with indices, just draw the
+		 * vertices in order. */
+		if(instanceCount > 0)
+			glDrawArraysInstanced(geom->primitive_type, 0, geom->vertex_count, instanceCount);
+		else
+			glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
+		kuhl_errorcheck();
+	}
+}
+
+/** Draws one kuhl_geometry object (but not the rest of the list that
+ * it may be a part of). Called by kuhl_geometry_draw() and
+ * kuhl_geometry_draw_instanced().
+ *
+ * @param geom The geometry to draw.
+ * @param instances NULL to draw the geometry once. Otherwise, the
+ * geometry is drawn once for each of these column-major matrices. If
+ * the program can read instance matrices, kuhl_instance_upload() must
+ * have been called with the same matrices.
+ * @param instanceCount The number of matrices in instances.
+ */
+static void kuhl_geometry_draw_one(kuhl_geometry *geom, const float *instances, int instanceCount)
+{
+	/* Check that there is a valid program and VAO object for us to
+	 * use. Asking OpenGL is slow, so only do it when validating. */
+	if(kuhl_gl_validate())
+	{
+		if(glIsProgram(geom->program) == 0)
+		{
+			msg(MSG_ERROR, "Program (%d) is invalid.\n", geom->program);
+			kuhl_errorcheck();
+			return;
+		}
+		else if (glIsVertexArray(geom->vao) == 0)
+		{
+			msg(MSG_ERROR, "Vertex array object (%d) is invalid.\n", geom->vao);
+			kuhl_errorcheck();
+			return;
+		}
+	}
+	kuhl_use_program(geom->program);
 	kuhl_errorcheck();
+	kuhl_uniform_cache *uniforms = kuhl_uniform_cache_get(geom->program);
+
+	/* Samplers of different types can't use the same texture unit,
+	 * so InstanceMat (which is 0 by default) must not share a unit
+	 * with the geometry's textures even when it isn't used. */
+	if(uniforms->instanceMat != -1 && !uniforms->instanceUnitSet)
+	{
+		glUniform1i(uniforms->instanceMat, KUHL_INSTANCE_TEXTURE_UNIT);
+		uniforms->instanceUnitSet = 1;
+	}
 
 	/* Bind all of the textures used in this geometry to texture
 	 * units. */
@@ -1523,12 +4286,17 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 	for(unsigned int i=0; i<geom->texture_count; i++)
 	{
 		kuhl_texture *tex = &(geom->textures[i]);
-		if(!glIsTexture(tex->textureId))
+		if(tex->textureId == 0)
+			continue;
+		if(kuhl_gl_validate() && !glIsTexture(tex->textureId))
+		{
+			msg(MSG_ERROR, "Texture '%s' (%d) is invalid.\n", tex->name, tex->textureId);
 			continue;
+		}
 
 		/* Check if the sampler variable is available in the GLSL
 		 * program. If not, don't send the texture. */
-		GLint loc = glGetUniformLocation(geom->program, tex->name);
+		GLint loc = kuhl_uniform_cache_lookup(geom->program, uniforms, tex->name, tex->name_hash);
 		if(loc == -1)
 			continue;
 
@@ -1540,133 +4308,442 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 		 */
 		glUniform1i(loc, i);
 		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Bind the texture that we want to use while the correct
-		 * texture unit is enabled. */
-		glBindTexture(GL_TEXTURE_2D, tex->textureId);
+		/* Bind the texture to texture unit 'i' (if it isn't
+		 * already bound there). */
+		kuhl_bind_texture(i, tex->textureId);
 		kuhl_errorcheck();
 	}
 
 	/* Set the HasTex variable if it exists in the GLSL program. */
-	GLint loc;
-	loc = glGetUniformLocation(geom->program, "HasTex");
+	GLint loc = uniforms->hasTex;
 	if(loc != -1)
 	    glUniform1i(loc, hasTex);
 
-	/* Try to set uniform variables if they are active in the current
-	 * GLSL program. If they are not active, don't print any warning
-	 * messages. */
-	int numBones = 0;
-#ifdef KUHL_UTIL_USE_ASSIMP
-	loc = glGetUniformLocation(geom->program, "BoneMat");
-	if(loc != -1 && geom->bones)
+	/* Try to set uniform variables if they are active in the current
+	 * GLSL program. If they are not active, don't print any warning
+	 * messages. */
+	int numBones = 0;
+#ifdef KUHL_UTIL_USE_ASSIMP
+	loc = uniforms->boneMat;
+	if(loc != -1 && geom->bones)
+	{
+		glUniformMatrix4fv(loc, MAX_BONES, 0, geom->bones->matrices[0]);
+		numBones = geom->bones->count;
+	}
+#endif
+	loc = uniforms->numBones;
+	if(loc != -1)
+	    glUniform1i(loc, numBones);
+
+	loc = uniforms->geomTransform;
+	if(loc != -1)
+		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
+	else
+	{ /* If the geom->matrix was not the identity and if it is not in
+	   * the GLSL shader program, print a helpful warning message. */
+		float identity[16];
+		mat4f_identity(identity);
+		float sum = 0;
+		for(int i=0; i<16; i++)
+			sum += fabsf(identity[i] - (geom->matrix)[i]);
+		if(sum > 0.00001 && geom->has_been_drawn == 0)
+		{
+			printf("\n\n");
+			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", geom->program);
+			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
+			printf("\n");
+			printf("We would set the GeomTransform to:\n");
+			mat4f_print(geom->matrix);
+			printf("This program will resume running in 2 seconds...\n");
+			sleep(2);
+			printf("...continuing despite the missing variable.\n");
+		}
+	}
+
+	/* Use the vertex array object for this geometry */
+	kuhl_bind_vertex_array(geom->vao);
+	kuhl_errorcheck();
+
+	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
+	 * be mapped. If any of them are, we unmap them before we draw the
+	 * geometry. */
+	kuhl_geometry_unmap(geom);
+	
+	if(instances == NULL)
+		kuhl_geometry_draw_call(geom, 0);
+	else if(uniforms->instanceMat != -1 && uniforms->useInstanceMat != -1)
+	{
+		/* Draw every instance with one call. The vertex program reads
+		 * the matrices from the buffer texture. UseInstanceMat is set
+		 * back to 0 so that the program works normally when it is
+		 * used for other draws. */
+		glUniform1i(uniforms->useInstanceMat, 1);
+		kuhl_geometry_draw_call(geom, instanceCount);
+		glUniform1i(uniforms->useInstanceMat, 0);
+		kuhl_errorcheck();
+	}
+	else if(uniforms->geomTransform != -1)
+	{
+		/* The program can't read instance matrices; draw each
+		 * instance separately with the instance matrix combined
+		 * with GeomTransform. */
+		for(int i=0; i<instanceCount; i++)
+		{
+			float m[16];
+			mat4f_mult_mat4f_new(m, instances+16*i, geom->matrix);
+			glUniformMatrix4fv(uniforms->geomTransform, 1, 0, m);
+			kuhl_geometry_draw_call(geom, 0);
+		}
+	}
+	else
+	{
+		if(geom->has_been_drawn == 0)
+			msg(MSG_ERROR, "GLSL program %d has neither 'InstanceMat' and 'UseInstanceMat' nor 'GeomTransform' uniform variables. Instances will be drawn on top of each other.\n", geom->program);
+		kuhl_geometry_draw_call(geom, instanceCount);
+	}
+
+	/* Indicate in the struct that we have successfully drawn this
+	 * geom once. */
+	geom->has_been_drawn = 1;
+}
+
+/** Draws a kuhl_geometry struct to the screen. The struct passed into
+ * this function should have been set up with kuhl_geometry_new() and
+ * at least one position attribute with kuhl_geometry_attrib() before
+ * calling this function.
+ *
+ * The GLSL program and active texture unit that were in use before
+ * this function was called are restored afterwards. The geometry's
+ * vertex array object and textures are left bound so that drawing
+ * the same geometry (or geometry that shares textures) again doesn't
+ * need to bind them again. This function doesn't ask OpenGL what is
+ * bound; see kuhl_gl_state_invalidate() if you bind things with
+ * OpenGL directly.
+
+ @param geom The geometry to draw to the screen. If the kuhl_geometry
+ object is a part of a linked list, this function will draw each of
+ the objects in order. */
+void kuhl_geometry_draw(kuhl_geometry *geom)
+{
+	if(geom == NULL)
+		return;
+	
+	kuhl_errorcheck();
+	if(kuhl_gl_validate())
+		kuhl_gl_state_check();
+
+	/* Record the program and texture unit that the caller was using
+	 * so that we can restore them when we have finished drawing. */
+	GLuint previousProgram = kuhl_current_program();
+	GLuint previousUnit = kuhl_gl_shadow.activeUnit;
+
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+		kuhl_geometry_draw_one(g, NULL, 0);
+
+	if(previousUnit != KUHL_GL_STATE_UNKNOWN)
+		kuhl_active_texture(previousUnit);
+	kuhl_use_program(previousProgram);
+	kuhl_errorcheck();
+}
+
+/** Draws many copies (instances) of a kuhl_geometry with as few
+ * draw calls as possible. Each instance has its own model matrix,
+ * which is applied after the geometry's own matrix (i.e., the vertex
+ * program computes ModelView * instance matrix * GeomTransform *
+ * vertex).
+ *
+ * If the geometry's GLSL program has "uniform samplerBuffer
+ * InstanceMat" and "uniform int UseInstanceMat" variables (see
+ * assimp.vert), the matrices are copied to a buffer texture once and
+ * each kuhl_geometry in the list is drawn with a single
+ * glDrawElementsInstanced() or glDrawArraysInstanced() call. The
+ * vertex program should use the matrix in the texture when
+ * UseInstanceMat is nonzero:
+ *
+ * mat4 m = mat4(texelFetch(InstanceMat, gl_InstanceID*4), ..., texelFetch(InstanceMat, gl_InstanceID*4+3));
+ *
+ * Other programs still work: each instance is drawn separately with
+ * the instance matrix multiplied into GeomTransform.
+ *
+ * Like kuhl_geometry_draw(), the GLSL program and active texture unit
+ * that were in use before this function was called are restored
+ * afterwards. Requires OpenGL 3.1 if the program reads the instance
+ * matrices.
+ *
+ * @param geom The geometry to draw. If the kuhl_geometry object is a
+ * part of a linked list, each object in the list is drawn.
+ *
+ * @param matrices count column-major 4x4 matrices (16*count floats).
+ *
+ * @param count The number of instances to draw.
+ */
+void kuhl_geometry_draw_instanced(kuhl_geometry *geom, const float *matrices, int count)
+{
+	if(geom == NULL || matrices == NULL || count < 1)
+		return;
+
+	kuhl_errorcheck();
+	if(kuhl_gl_validate())
+		kuhl_gl_state_check();
+
+	GLuint previousProgram = kuhl_current_program();
+	GLuint previousUnit = kuhl_gl_shadow.activeUnit;
+
+	/* Only create and fill the buffer texture if a program in the
+	 * list will read it. */
+	int supported = 0;
+	for(kuhl_geometry *g = geom; g != NULL && !supported; g = g->next)
+		supported = kuhl_program_supports_instancing(g->program);
+
+	/* A buffer texture may be too small to hold every matrix. If so,
+	 * draw the instances in batches. */
+	int batchSize = count;
+	if(supported)
 	{
-		glUniformMatrix4fv(loc, MAX_BONES, 0, geom->bones->matrices[0]);
-		numBones = geom->bones->count;
+		static GLint maxTexels = 0;
+		if(maxTexels == 0)
+			glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+		if(maxTexels/4 > 0 && batchSize > maxTexels/4)
+			batchSize = maxTexels/4;
 	}
-#endif
-	loc = glGetUniformLocation(geom->program, "NumBones");
-	if(loc != -1)
-	    glUniform1i(loc, numBones);
 
-	loc = glGetUniformLocation(geom->program, "GeomTransform");
-	if(loc != -1)
-		glUniformMatrix4fv(loc, 1, 0, geom->matrix);
-	else
-	{ /* If the geom->matrix was not the identity and if it is not in
-	   * the GLSL shader program, print a helpful warning message. */
-		float identity[16];
-		mat4f_identity(identity);
-		float sum = 0;
-		for(int i=0; i<16; i++)
-			sum += fabsf(identity[i] - (geom->matrix)[i]);
-		if(sum > 0.00001 && geom->has_been_drawn == 0)
-		{
-			printf("\n\n");
-			printf("ERROR: You must include a 'uniform mat4 GeomTransform' variable in your GLSL shader (program %d) when you load/display a model with kuhl-util. This matrix should be applied to the vertices in your model before you multiply by your modelview matrix in the vertex program. For example:\n\ngl_Position = Projection * ModelView * GeomTransform * in_Position\n\n", geom->program);
-			printf("This matrix is required to correctly translate/rotate/scale your geometry and is also used by some models to implement animation. This matrix is stored inside of a variable called 'matrix' in kuhl_geometry and is set to the identity matrix by default. This message only gets printed if you are using something that actually sets the matrix to something other than the identity. Earlier versions of this software simply transformed the vertices as the file was being loaded instead of doing it in the vertex program.\n");
-			printf("\n");
-			printf("We would set the GeomTransform to:\n");
-			mat4f_print(geom->matrix);
-			printf("This program will resume running in 2 seconds...\n");
-			sleep(2);
-			printf("...continuing despite the missing variable.\n");
-		}
+	for(int first = 0; first < count; first += batchSize)
+	{
+		int n = count-first < batchSize ? count-first : batchSize;
+		if(supported)
+			kuhl_instance_upload(matrices+16*first, n);
+		for(kuhl_geometry *g = geom; g != NULL; g = g->next)
+			kuhl_geometry_draw_one(g, matrices+16*first, n);
 	}
 
-	/* Use the vertex array object for this geometry */
-	glBindVertexArray(geom->vao);
+	if(previousUnit != KUHL_GL_STATE_UNKNOWN)
+		kuhl_active_texture(previousUnit);
+	kuhl_use_program(previousProgram);
 	kuhl_errorcheck();
+}
 
-	/* kuhl_geometry_attrib_get() allows vertex attribute buffers to
-	 * be mapped. Here, we check if the buffers are mapped. If they
-	 * are, we unmap them before we draw the geometry. */
-	for(unsigned int i=0; i<geom->attrib_count; i++)
+/** Initializes an empty render queue. A render queue collects the
+ * geometry that is drawn during a frame (kuhl_renderqueue_add()) and
+ * then draws it all at once (kuhl_renderqueue_draw()). The queue
+ * sorts the geometry by GLSL program, then by the textures it uses,
+ * then by vertex array object, and finally from front to back, so
+ * that the fewest possible bindings change between draws and the
+ * depth test can discard hidden fragments early. Sorting changes the
+ * order that geometry is drawn in, so only opaque geometry should be
+ * put in a queue; draw transparent geometry afterwards.
+ *
+ * Counters about the last kuhl_renderqueue_draw() are in
+ * queue->stats.
+ *
+ * @param queue The queue to initialize.
+ */
+void kuhl_renderqueue_init(kuhl_renderqueue *queue)
+{
+	queue->items = NULL;
+	queue->count = 0;
+	queue->capacity = 0;
+	memset(&(queue->stats), 0, sizeof(kuhl_renderqueue_stats));
+}
+
+/** Returns 1 if two geometries use different textures. */
+static int kuhl_geometry_textures_differ(const kuhl_geometry *a, const kuhl_geometry *b)
+{
+	if(a->texture_count != b->texture_count)
+		return 1;
+	for(unsigned int i=0; i<a->texture_count; i++)
 	{
-		glBindBuffer(GL_ARRAY_BUFFER, geom->attribs[i].bufferobject);
-		GLint bufferIsMapped = 0;
-		glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_MAPPED, &bufferIsMapped);
-		kuhl_errorcheck();
-		if(bufferIsMapped)
-			glUnmapBuffer(GL_ARRAY_BUFFER);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		kuhl_errorcheck();
+		if(a->textures[i].textureId != b->textures[i].textureId)
+			return 1;
 	}
-	
-	/* If the user provided us with indices, use glDrawElements() to
-	 * draw the geometry. */
-	if(geom->indices_len > 0 && glIsBuffer(geom->indices_bufferobject))
+	return 0;
+}
+
+/** Counts the program, texture set and vertex array object changes
+ * that drawing the items in the queue in their current order
+ * requires.
+ *
+ * @return The total number of changes. */
+static long kuhl_renderqueue_count_changes(const kuhl_renderqueue *queue, long *programChanges, long *textureChanges, long *vaoChanges)
+{
+	long p = 0, t = 0, v = 0;
+	const kuhl_geometry *prev = NULL;
+	for(int i=0; i<queue->count; i++)
 	{
-		glDrawElements(geom->primitive_type,
-		               geom->indices_len,
-		               GL_UNSIGNED_INT,
-		               NULL);
-		kuhl_errorcheck();
+		const kuhl_geometry *g = queue->items[i].geom;
+		if(prev == NULL || g->program != prev->program)
+			p++;
+		if(prev == NULL || kuhl_geometry_textures_differ(g, prev))
+			t++;
+		if(prev == NULL || g->vao != prev->vao)
+			v++;
+		prev = g;
 	}
-	else
+	if(programChanges) *programChanges = p;
+	if(textureChanges) *textureChanges = t;
+	if(vaoChanges)     *vaoChanges = v;
+	return p+t+v;
+}
+
+/** Computes the key that kuhl_renderqueue_draw() sorts an item
+ * by. From most to least significant, 16 bits each: program, a hash
+ * of the textures, vertex array object and a depth bucket. Names
+ * larger than 16 bits are truncated; that only affects how well the
+ * queue is sorted, not what is drawn. */
+static unsigned long long kuhl_renderqueue_key(const kuhl_renderqueue_item *item)
+{
+	const kuhl_geometry *g = item->geom;
+
+	unsigned int textureHash = 2166136261u;
+	for(unsigned int i=0; i<g->texture_count; i++)
 	{
-		/* If the user didn't provide us with indices, just draw the
-		 * vertices in order. */
-		glDrawArrays(geom->primitive_type, 0, geom->vertex_count);
-		kuhl_errorcheck();
+		textureHash ^= g->textures[i].textureId;
+		textureHash *= 16777619u;
+	}
+	textureHash = (textureHash >> 16) ^ (textureHash & 0xFFFF);
+	if(g->texture_count == 0)
+		textureHash = 0;
+
+	/* Distance in front of the camera to the geometry's origin. The
+	 * buckets are logarithmic so nearby geometry is sorted more
+	 * finely than distant geometry. */
+	unsigned long long depth = 0;
+	if(item->hasModelview)
+	{
+		float m[16];
+		mat4f_mult_mat4f_new(m, item->modelview, g->matrix);
+		float distance = -m[14];
+		if(distance > 0)
+		{
+			double bucket = log2(1.0+distance)*4096;
+			depth = bucket > 0xFFFF ? 0xFFFF : (unsigned long long) bucket;
+		}
 	}
 
+	return ((unsigned long long) (g->program & 0xFFFF) << 48) |
+		((unsigned long long) textureHash << 32) |
+		((unsigned long long) (g->vao & 0xFFFF) << 16) |
+		depth;
+}
 
-	/* For each texture unit that we bound a texture to, unbind the
-	 * texture since we have finished drawing the geometry */
-	for(unsigned int i=0; i<geom->texture_count; i++)
+/** Adds geometry to a render queue. It is drawn the next time that
+ * kuhl_renderqueue_draw() is called.
+ *
+ * @param queue The queue to add the geometry to.
+ *
+ * @param geom The geometry to draw. The geometry must not be changed
+ * or deleted until the queue is drawn.
+ *
+ * @param modelview The matrix to set the "ModelView" uniform variable
+ * to when the geometry is drawn (copied). If NULL, ModelView is not
+ * changed and the geometry is sorted as if it were at the camera.
+ *
+ * @param kg_options Set this to KG_FULL_LIST to add all geometries in
+ * the kuhl_geometry linked list (each one is sorted
+ * separately). Otherwise, set to 0.
+ */
+void kuhl_renderqueue_add(kuhl_renderqueue *queue, kuhl_geometry *geom, const float modelview[16], int kg_options)
+{
+	for(kuhl_geometry *g = geom; g != NULL; g = g->next)
 	{
-		kuhl_errorcheck();
-		/* Turn on appropriate texture unit */
-		glActiveTexture(GL_TEXTURE0+i);
-		kuhl_errorcheck();
-		/* Unbind the texture */
-		glBindTexture(GL_TEXTURE_2D, 0);
-		kuhl_errorcheck();
+		if(queue->count == queue->capacity)
+		{
+			int capacity = queue->capacity == 0 ? 64 : queue->capacity*2;
+			kuhl_renderqueue_item *items = (kuhl_renderqueue_item*) realloc(queue->items, sizeof(kuhl_renderqueue_item)*capacity);
+			if(items == NULL)
+			{
+				msg(MSG_FATAL, "Failed to grow the render queue to %d items.\n", capacity);
+				exit(EXIT_FAILURE);
+			}
+			queue->items = items;
+			queue->capacity = capacity;
+		}
+		kuhl_renderqueue_item *item = &(queue->items[queue->count]);
+		item->geom = g;
+		item->hasModelview = modelview != NULL;
+		if(modelview != NULL)
+			mat4f_copy(item->modelview, modelview);
+		item->order = queue->count;
+		item->key = kuhl_renderqueue_key(item);
+		queue->count++;
+
+		if(!(kg_options & KG_FULL_LIST))
+			break;
 	}
-	
-	/* Indicate in the struct that we have successfully drawn this
-	 * geom once. */
-	geom->has_been_drawn = 1;
+}
 
-	/* Restore previously active texture */
-	glActiveTexture(previouslyActiveTexture);
-	
-	/* Unbind texture */
-	glBindTexture(GL_TEXTURE_2D, previouslyBoundTexture);
+/** qsort() comparison function for kuhl_renderqueue_item. Items with
+ * the same key stay in the order they were submitted. */
+static int kuhl_renderqueue_compare(const void *a, const void *b)
+{
+	const kuhl_renderqueue_item *ia = (const kuhl_renderqueue_item*) a;
+	const kuhl_renderqueue_item *ib = (const kuhl_renderqueue_item*) b;
+	if(ia->key != ib->key)
+		return ia->key < ib->key ? -1 : 1;
+	return ia->order - ib->order;
+}
 
-	/* Restore the GLSL program that was used before this function was
-	 * called. */
-	glUseProgram(previouslyUsedProgram);
-	
-	/* Unbind the VAO */
-	glBindVertexArray(previousVAO);
+/** Sorts and draws everything in a render queue (see
+ * kuhl_renderqueue_init()) and then empties the queue. queue->stats
+ * is updated with the number of draws, the state changes between
+ * them and the CPU time that was spent.
+ *
+ * Like kuhl_geometry_draw(), the GLSL program and active texture
+ * unit that were in use before this function was called are restored
+ * afterwards. If the ModelView uniform variable was changed, it is
+ * left set to the value used by the last geometry that was drawn
+ * with each program.
+ *
+ * @param queue The queue to draw.
+ */
+void kuhl_renderqueue_draw(kuhl_renderqueue *queue)
+{
+	long start = kuhl_microseconds();
+	kuhl_errorcheck();
+	if(kuhl_gl_validate())
+		kuhl_gl_state_check();
+
+	long unsortedChanges = kuhl_renderqueue_count_changes(queue, NULL, NULL, NULL);
+	qsort(queue->items, queue->count, sizeof(kuhl_renderqueue_item), kuhl_renderqueue_compare);
+
+	GLuint previousProgram = kuhl_current_program();
+	GLuint previousUnit = kuhl_gl_shadow.activeUnit;
+
+	for(int i=0; i<queue->count; i++)
+	{
+		kuhl_renderqueue_item *item = &(queue->items[i]);
+		if(item->hasModelview)
+		{
+			kuhl_use_program(item->geom->program);
+			kuhl_uniform_cache *uniforms = kuhl_uniform_cache_get(item->geom->program);
+			if(uniforms->modelView != -1)
+				glUniformMatrix4fv(uniforms->modelView, 1, 0, item->modelview);
+		}
+		kuhl_geometry_draw_one(item->geom, NULL, 0);
+	}
+
+	if(previousUnit != KUHL_GL_STATE_UNKNOWN)
+		kuhl_active_texture(previousUnit);
+	kuhl_use_program(previousProgram);
 	kuhl_errorcheck();
 
-	/* Draw the next nodes in the list. */
-	kuhl_geometry_draw(geom->next);
+	kuhl_renderqueue_stats *stats = &(queue->stats);
+	stats->draws = queue->count;
+	long sortedChanges = kuhl_renderqueue_count_changes(queue, &(stats->programChanges),
+	                                                    &(stats->textureChanges), &(stats->vaoChanges));
+	stats->changesAvoided = unsortedChanges - sortedChanges;
+	queue->count = 0;
+	stats->submitTime = kuhl_microseconds() - start;
+}
+
+/** Frees the memory used by a render queue. The geometry in it is
+ * not deleted.
+ *
+ * @param queue The queue to free.
+ */
+void kuhl_renderqueue_free(kuhl_renderqueue *queue)
+{
+	free(queue->items);
+	kuhl_renderqueue_init(queue);
 }
 
 /** Deletes kuhl_geometry struct by freeing the OpenGL buffers that
@@ -1683,7 +4760,7 @@ void kuhl_geometry_draw(kuhl_geometry *geom)
 */
 void kuhl_geometry_delete(kuhl_geometry *geom)
 {
-	while(geom->next != NULL)
+	if(geom->next != NULL)
 		kuhl_geometry_delete(geom->next);
 	
 	for(unsigned int i=0; i<geom->attrib_count; i++)
@@ -1692,9 +4769,20 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 		if(attrib->name)
 			free(attrib->name);
 		attrib->name = NULL;
+		/* Free the copy of an interleaved attribute that
+		 * kuhl_geometry_attrib_get() made. Mapped buffers are
+		 * unmapped when they are deleted. Interleaved attributes
+		 * share a buffer, so it is only deleted once. */
+		if(attrib->stride > 0)
+			free(attrib->mapped);
 		if(glIsBuffer(attrib->bufferobject))
 			glDeleteBuffers(1, &(attrib->bufferobject));
+		/* OpenGL unbinds buffers and vertex array objects when they
+		 * are deleted. */
+		if(kuhl_gl_shadow.arrayBuffer == attrib->bufferobject)
+			kuhl_gl_shadow.arrayBuffer = 0;
 		attrib->bufferobject = 0;
+		attrib->mapped = NULL;
 	}
 	geom->attrib_count = 0;
 
@@ -1703,8 +4791,32 @@ void kuhl_geometry_delete(kuhl_geometry *geom)
 	geom->indices_bufferobject = 0;
 	geom->indices_len = 0;
 	
+	if(geom->multidraw != NULL)
+	{
+		kuhl_multidraw *md = geom->multidraw;
+		if(md->indirect_bufferobject != 0)
+			glDeleteBuffers(1, &(md->indirect_bufferobject));
+		for(int i=0; i<md->group_count; i++)
+			free(md->textures[i].name);
+		free(md->commands);
+		free(md->textures);
+		free(md->group_start);
+		free(md->counts);
+		free(md->offsets);
+		free(md->base_vertices);
+		free(md);
+		geom->multidraw = NULL;
+	}
+
+	free(geom->lods);
+	geom->lods = NULL;
+	geom->lod_count = 0;
+	geom->lod_current = 0;
+
 	if(glIsVertexArray(geom->vao))
 		glDeleteVertexArrays(1, &(geom->vao));
+	if(kuhl_gl_shadow.vao == geom->vao)
+		kuhl_gl_shadow.vao = 0;
 	geom->vao = 0;
 	geom->has_been_drawn = 0;
 }
@@ -1748,7 +4860,8 @@ GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height
 	}
 	kuhl_errorcheck();
 	glGenTextures(1, &texName);
-	glBindTexture(GL_TEXTURE_2D, texName);
+	kuhl_gl_state_forget_texture(texName);
+	kuhl_bind_texture_active(texName);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapS);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -1804,7 +4917,7 @@ GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height
 		// computers support 8k or larger. Most computers on MTU's
 		// campus supports 16k.
 
-		glBindTexture(GL_TEXTURE_2D, 0);
+		kuhl_bind_texture_active(0);
 		return 0;
 	}
 
@@ -1843,7 +4956,7 @@ GLuint kuhl_read_texture_array(const unsigned char* array, int width, int height
 
 	// Unbind the texture, make the caller bind it when they want to use it. More details:
 	// http://stackoverflow.com/questions/15273674
-	glBindTexture(GL_TEXTURE_2D, 0);
+	kuhl_bind_texture_active(0);
 	return texName;
 }
 
@@ -1979,7 +5092,10 @@ kuhl_geometry* kuhl_label_geom(kuhl_geometry *geom, GLuint program, float *width
 	for(unsigned int i=0; i<geom->texture_count; i++)
 	{
 		if(strcmp(geom->textures[i].name, "tex"))
+		{
+			kuhl_gl_state_forget_texture(geom->textures[i].textureId);
 			glDeleteTextures(1, &(geom->textures[i].textureId));
+		}
 	}
 
 	/* Create a new texture to use. */
@@ -3025,6 +6141,314 @@ kuhl_geometry* kuhl_geometry_append(kuhl_geometry *a, kuhl_geometry *b)
 
 
 
+/** Vertex cache statistics for the model that kuhl_load_model() is
+ * loading (see kuhl_private_optimize_mesh()). */
+typedef struct
+{
+	GLuint meshes;       /**< Number of meshes that were optimized */
+	GLuint triangles;    /**< Triangles in those meshes */
+	GLuint vertices;     /**< Vertices in those meshes */
+	GLuint missesBefore; /**< Vertex cache misses in the order from ASSIMP */
+	GLuint missesAfter;  /**< Vertex cache misses after optimizing */
+} kuhl_private_optimize_stats;
+static kuhl_private_optimize_stats optimizeStats;
+
+/** Cache size used to measure vertex cache misses for the report
+ * that kuhl_load_model() prints. */
+#define KUHL_VERTEX_CACHE_REPORT_SIZE 16
+
+/** Reorders the triangles of a mesh for the vertex cache (and,
+ * optionally, for less overdraw) and then reorders its vertices in
+ * the order that the triangles use them. Called by
+ * kuhl_private_load_model() before the mesh is uploaded if
+ * model.optimize is set in the config file. Adds the results to
+ * optimizeStats.
+ *
+ * @param indices The indices of a triangle mesh, reordered in place.
+ * @param numIndices Number of indices.
+ * @param mesh The mesh the indices belong to.
+ * @return The remapping from kuhl_optimize_vertex_fetch() that the
+ * vertex attributes need, or NULL if nothing changed.
+ */
+static GLuint* kuhl_private_optimize_mesh(GLuint *indices, GLuint numIndices, const struct aiMesh *mesh)
+{
+	GLuint vertexCount = mesh->mNumVertices;
+	float acmr, atvr;
+	kuhl_vertex_cache_stats(indices, numIndices, vertexCount, KUHL_VERTEX_CACHE_REPORT_SIZE, &acmr, &atvr);
+	GLuint missesBefore = (GLuint) lroundf(acmr * (numIndices/3));
+
+	kuhl_optimize_vertex_cache(indices, numIndices, vertexCount);
+	if(kuhl_config_boolean("model.optimize.overdraw", 0, 0))
+	{
+		float *positions = kuhl_malloc(sizeof(float)*vertexCount*3);
+		for(unsigned int i=0; i<vertexCount; i++)
+		{
+			positions[i*3+0] = (mesh->mVertices)[i].x;
+			positions[i*3+1] = (mesh->mVertices)[i].y;
+			positions[i*3+2] = (mesh->mVertices)[i].z;
+		}
+		kuhl_optimize_overdraw(indices, numIndices, positions, vertexCount);
+		free(positions);
+	}
+	GLuint *remap = kuhl_optimize_vertex_fetch(indices, numIndices, vertexCount);
+
+	kuhl_vertex_cache_stats(indices, numIndices, vertexCount, KUHL_VERTEX_CACHE_REPORT_SIZE, &acmr, &atvr);
+	optimizeStats.meshes++;
+	optimizeStats.triangles += numIndices/3;
+	optimizeStats.vertices += vertexCount;
+	optimizeStats.missesBefore += missesBefore;
+	optimizeStats.missesAfter += (GLuint) lroundf(acmr * (numIndices/3));
+	return remap;
+}
+
+/** Adds an attribute to a geometry with kuhl_geometry_attrib() after
+ * moving each vertex i in data to position remap[i] (see
+ * kuhl_optimize_vertex_fetch()).
+ *
+ * @param data The attribute; it is modified.
+ * @param remap The new position of each vertex. If NULL, the data is
+ * used as is.
+ */
+static void kuhl_private_geometry_attrib(kuhl_geometry *geom, GLfloat *data, GLuint components,
+                                         const char *name, int warnIfAttribMissing, const GLuint *remap)
+{
+	if(remap != NULL)
+	{
+		GLuint count = geom->vertex_count*components;
+		GLfloat *copy = kuhl_malloc(sizeof(GLfloat)*count);
+		memcpy(copy, data, sizeof(GLfloat)*count);
+		for(GLuint v=0; v<geom->vertex_count; v++)
+			memcpy(data + remap[v]*components, copy + v*components, sizeof(GLfloat)*components);
+		free(copy);
+	}
+	kuhl_geometry_attrib(geom, data, components, name, warnIfAttribMissing);
+}
+
+/** Most levels of detail that kuhl_load_model() makes for a mesh. */
+#define KUHL_MAX_LODS 8
+
+/** Levels of detail of one mesh in the model that kuhl_load_model()
+ * is loading. */
+typedef struct
+{
+	GLuint vertexCount; /**< Vertices in the mesh */
+	GLuint indexCount;  /**< Indices in the full-detail mesh */
+	unsigned int hash;  /**< kuhl_private_lod_hash() of the mesh */
+	int lodCount;       /**< Number of levels, 0 if there are none yet */
+	kuhl_lod lods[KUHL_MAX_LODS]; /**< Location of each level in indices */
+	GLuint *indices;    /**< Indices of every level (see kuhl_lod_generate()) */
+} kuhl_private_lod_entry;
+
+/** Levels of detail for the model that kuhl_load_model() is loading
+ * (see kuhl_private_lod_mesh()). */
+typedef struct
+{
+	kuhl_private_lod_entry *entries; /**< One entry per mesh in the aiScene; NULL if levels of detail aren't being made */
+	unsigned int count; /**< Number of entries */
+	int levels;         /**< Levels to make (model.lod.levels) */
+	float reduction;    /**< Fraction of the triangles kept in each level (model.lod.reduction) */
+	int changed;        /**< 1 if an entry was made or replaced, so the cache file is out of date */
+	unsigned int meshes;  /**< Meshes that were given levels of detail */
+	unsigned int cached;  /**< Meshes whose levels of detail were already known */
+	long time;            /**< Microseconds spent making levels of detail */
+	unsigned long triangles[KUHL_MAX_LODS]; /**< Triangles in each level, summed over all meshes */
+} kuhl_private_lod_state;
+static kuhl_private_lod_state lodState;
+
+/** The first bytes of a level of detail cache file. Change the
+ * number if the format changes. */
+#define KUHL_LOD_CACHE_MAGIC "KUHLLOD1"
+#define KUHL_LOD_CACHE_MAGIC_SIZE 8
+
+/** Computes a hash (32-bit FNV-1a) of the indices and vertex
+ * positions of a mesh so that levels of detail in the cache file are
+ * only reused if the mesh hasn't changed. */
+static unsigned int kuhl_private_lod_hash(const GLuint *indices, GLuint indexCount,
+                                          const GLfloat *positions, GLuint vertexCount)
+{
+	unsigned int hash = 2166136261u;
+	const unsigned char *bytes = (const unsigned char*) indices;
+	for(size_t i=0; i<sizeof(GLuint)*indexCount; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	bytes = (const unsigned char*) positions;
+	for(size_t i=0; i<sizeof(GLfloat)*3*vertexCount; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** Frees the levels of detail in lodState. */
+static void kuhl_private_lod_free(void)
+{
+	for(unsigned int i=0; i<lodState.count; i++)
+		free(lodState.entries[i].indices);
+	free(lodState.entries);
+	memset(&lodState, 0, sizeof(lodState));
+}
+
+/** Reads the levels of detail saved by kuhl_private_lod_cache_write()
+ * into lodState. The file is ignored if it was made with different
+ * settings or for a model with a different number of meshes.
+ *
+ * @param filename The cache file.
+ */
+static void kuhl_private_lod_cache_read(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if(f == NULL)
+	{
+		msg(MSG_DEBUG, "No level of detail cache file '%s'", filename);
+		return;
+	}
+
+	char magic[KUHL_LOD_CACHE_MAGIC_SIZE];
+	int levels;
+	float reduction;
+	unsigned int count;
+	if(fread(magic, KUHL_LOD_CACHE_MAGIC_SIZE, 1, f) != 1 ||
+	   memcmp(magic, KUHL_LOD_CACHE_MAGIC, KUHL_LOD_CACHE_MAGIC_SIZE) != 0 ||
+	   fread(&levels, sizeof(int), 1, f) != 1 ||
+	   fread(&reduction, sizeof(float), 1, f) != 1 ||
+	   fread(&count, sizeof(unsigned int), 1, f) != 1 ||
+	   levels != lodState.levels || reduction != lodState.reduction || count != lodState.count)
+	{
+		msg(MSG_INFO, "Ignoring level of detail cache file '%s'; it was made with different settings or for a different model.", filename);
+		fclose(f);
+		return;
+	}
+
+	for(unsigned int i=0; i<count; i++)
+	{
+		kuhl_private_lod_entry *e = &(lodState.entries[i]);
+		int ok = fread(&(e->vertexCount), sizeof(GLuint), 1, f) == 1 &&
+			fread(&(e->indexCount), sizeof(GLuint), 1, f) == 1 &&
+			fread(&(e->hash), sizeof(unsigned int), 1, f) == 1 &&
+			fread(&(e->lodCount), sizeof(int), 1, f) == 1 &&
+			e->lodCount >= 0 && e->lodCount <= KUHL_MAX_LODS;
+		if(ok && e->lodCount > 0)
+		{
+			ok = fread(e->lods, sizeof(kuhl_lod), e->lodCount, f) == (size_t) e->lodCount &&
+				e->lods[0].first == 0 && e->lods[0].count == e->indexCount;
+			for(int l=1; l<e->lodCount && ok; l++)
+				ok = e->lods[l].first == e->lods[l-1].first + e->lods[l-1].count;
+			if(ok)
+			{
+				GLuint total = e->lods[e->lodCount-1].first + e->lods[e->lodCount-1].count;
+				e->indices = (GLuint*) kuhl_malloc(sizeof(GLuint)*total);
+				ok = fread(e->indices, sizeof(GLuint), total, f) == total;
+			}
+		}
+		if(!ok)
+		{
+			msg(MSG_WARNING, "Level of detail cache file '%s' is damaged; ignoring it.", filename);
+			for(unsigned int j=0; j<=i; j++)
+			{
+				free(lodState.entries[j].indices);
+				memset(&(lodState.entries[j]), 0, sizeof(kuhl_private_lod_entry));
+			}
+			break;
+		}
+	}
+	fclose(f);
+}
+
+/** Saves the levels of detail in lodState so that the next
+ * kuhl_load_model() of the same model doesn't have to make them
+ * again.
+ *
+ * @param filename The cache file.
+ */
+static void kuhl_private_lod_cache_write(const char *filename)
+{
+	FILE *f = fopen(filename, "wb");
+	if(f == NULL)
+	{
+		msg(MSG_WARNING, "Unable to write level of detail cache file '%s': %s", filename, strerror(errno));
+		return;
+	}
+
+	int ok = fwrite(KUHL_LOD_CACHE_MAGIC, KUHL_LOD_CACHE_MAGIC_SIZE, 1, f) == 1 &&
+		fwrite(&(lodState.levels), sizeof(int), 1, f) == 1 &&
+		fwrite(&(lodState.reduction), sizeof(float), 1, f) == 1 &&
+		fwrite(&(lodState.count), sizeof(unsigned int), 1, f) == 1;
+	for(unsigned int i=0; i<lodState.count && ok; i++)
+	{
+		const kuhl_private_lod_entry *e = &(lodState.entries[i]);
+		ok = fwrite(&(e->vertexCount), sizeof(GLuint), 1, f) == 1 &&
+			fwrite(&(e->indexCount), sizeof(GLuint), 1, f) == 1 &&
+			fwrite(&(e->hash), sizeof(unsigned int), 1, f) == 1 &&
+			fwrite(&(e->lodCount), sizeof(int), 1, f) == 1;
+		if(ok && e->lodCount > 0)
+		{
+			GLuint total = e->lods[e->lodCount-1].first + e->lods[e->lodCount-1].count;
+			ok = fwrite(e->lods, sizeof(kuhl_lod), e->lodCount, f) == (size_t) e->lodCount &&
+				fwrite(e->indices, sizeof(GLuint), total, f) == total;
+		}
+	}
+	if(fclose(f) != 0)
+		ok = 0;
+	if(!ok)
+	{
+		msg(MSG_WARNING, "Unable to write level of detail cache file '%s'.", filename);
+		remove(filename);
+	}
+	else
+		msg(MSG_DEBUG, "Wrote level of detail cache file '%s'", filename);
+}
+
+/** Gives a triangle mesh levels of detail with kuhl_geometry_lod()
+ * instead of calling kuhl_geometry_indices(). The levels are made
+ * with kuhl_lod_generate() unless the same mesh already has levels
+ * in lodState (from the cache file or from another node that uses
+ * the mesh).
+ *
+ * @param geom The geometry for the mesh.
+ * @param indices The indices of the mesh (after any reordering done
+ * by kuhl_private_optimize_mesh()).
+ * @param numIndices Number of indices.
+ * @param positions The vertex positions of the mesh, in the same
+ * order as the geometry's vertices.
+ * @param meshNumber The index of the mesh in the aiScene.
+ */
+static void kuhl_private_lod_mesh(kuhl_geometry *geom, GLuint *indices, GLuint numIndices,
+                                  const GLfloat *positions, unsigned int meshNumber)
+{
+	kuhl_private_lod_entry *e = &(lodState.entries[meshNumber]);
+	unsigned int hash = kuhl_private_lod_hash(indices, numIndices, positions, geom->vertex_count);
+	if(e->lodCount > 0 && e->vertexCount == geom->vertex_count &&
+	   e->indexCount == numIndices && e->hash == hash)
+		lodState.cached++;
+	else
+	{
+		free(e->indices);
+		long start = kuhl_microseconds();
+		e->lodCount = kuhl_lod_generate(&(e->indices), e->lods, lodState.levels, indices, numIndices,
+		                                positions, geom->vertex_count, lodState.reduction);
+		lodState.time += kuhl_microseconds() - start;
+		e->vertexCount = geom->vertex_count;
+		e->indexCount = numIndices;
+		e->hash = hash;
+		lodState.changed = 1;
+	}
+	if(e->lodCount == 0)
+	{
+		kuhl_geometry_indices(geom, indices, numIndices);
+		return;
+	}
+
+	kuhl_geometry_lod(geom, e->indices, e->lods, e->lodCount, positions);
+	lodState.meshes++;
+	/* Meshes with fewer levels draw their last level at the
+	 * remaining levels. */
+	for(int l=0; l<lodState.levels; l++)
+		lodState.triangles[l] += e->lods[l < e->lodCount ? l : e->lodCount-1].count / 3;
+}
+
 /** Recursively calls itself to create one or more kuhl_geometry
  * structs for all of the nodes in the scene.
  *
@@ -3132,6 +6556,25 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 		geom->assimp_scene = (struct aiScene*) sc;
 		mat4f_copy(geom->matrix, currentTransform);
 
+		/* Get indices to draw with. If requested, reorder the
+		 * triangles for the vertex cache now so that the vertices
+		 * can be stored in the order they are drawn. */
+		GLuint numIndices = mesh->mNumFaces * meshPrimitiveType;
+		GLuint *meshIndices = NULL;
+		GLuint *remap = NULL;
+		if(mesh->mNumFaces > 0)
+		{
+			meshIndices = kuhl_malloc(sizeof(GLuint)*numIndices);
+			for(unsigned int t = 0; t<mesh->mNumFaces; t++) // for each face
+			{
+				const struct aiFace* face = &mesh->mFaces[t];
+				for(unsigned int x = 0; x < meshPrimitiveType; x++) // for each index
+					meshIndices[t*meshPrimitiveType+x] = face->mIndices[x];
+			}
+			if(meshPrimitiveTypeGL == GL_TRIANGLES && kuhl_config_boolean("model.optimize", 0, 0))
+				remap = kuhl_private_optimize_mesh(meshIndices, numIndices, mesh);
+		}
+
 		/* Store the vertex position attribute into the kuhl_geometry struct */
 		float *vertexPositions = kuhl_malloc(sizeof(float)*mesh->mNumVertices*3);
 		for(unsigned int i=0; i<mesh->mNumVertices; i++)
@@ -3140,8 +6583,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			vertexPositions[i*3+1] = (mesh->mVertices)[i].y;
 			vertexPositions[i*3+2] = (mesh->mVertices)[i].z;
 		}
-		kuhl_geometry_attrib(geom, vertexPositions, 3, "in_Position", 0);
-		free(vertexPositions);
+		kuhl_private_geometry_attrib(geom, vertexPositions, 3, "in_Position", 0, remap);
 
 		/* Store the normal vectors in the kuhl_geometry struct */
 		if(mesh->mNormals != NULL)
@@ -3153,7 +6595,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				normals[i*3+1] = (mesh->mNormals)[i].y;
 				normals[i*3+2] = (mesh->mNormals)[i].z;
 			}
-			kuhl_geometry_attrib(geom, normals, 3, "in_Normal", 0);
+			kuhl_private_geometry_attrib(geom, normals, 3, "in_Normal", 0, remap);
 			free(normals);
 		}
 
@@ -3174,7 +6616,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				if(colorComps == 4)
 					colors[i*colorComps+3] = mesh->mColors[0][i].a;
 			}
-			kuhl_geometry_attrib(geom, colors, colorComps, "in_Color", 0);
+			kuhl_private_geometry_attrib(geom, colors, colorComps, "in_Color", 0, remap);
 			free(colors);
 		}
 		/* If there are no vertex colors, try to use material colors instead */
@@ -3213,7 +6655,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 				texCoord[i*2+0] = mesh->mTextureCoords[0][i].x;
 				texCoord[i*2+1] = mesh->mTextureCoords[0][i].y;
 			}
-			kuhl_geometry_attrib(geom, texCoord, 2, "in_TexCoord", 1);
+			kuhl_private_geometry_attrib(geom, texCoord, 2, "in_TexCoord", 1, remap);
 			free(texCoord);
 		}
 
@@ -3272,8 +6714,8 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 					exit(EXIT_FAILURE);
 				}
 			}
-			kuhl_geometry_attrib(geom, indices, 4, "in_BoneIndex", 0);
-			kuhl_geometry_attrib(geom, weights, 4, "in_BoneWeight", 0);
+			kuhl_private_geometry_attrib(geom, indices, 4, "in_BoneIndex", 0, remap);
+			kuhl_private_geometry_attrib(geom, weights, 4, "in_BoneWeight", 0, remap);
 			free(indices);
 			free(weights);
 		} // end if there are bones 
@@ -3304,7 +6746,7 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			{
 				/* If model uses texture and we found the texture file,
 				   Make sure we repeat instead of clamp textures */
-				glBindTexture(GL_TEXTURE_2D, texture);
+				kuhl_bind_texture_active(texture);
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 				kuhl_errorcheck();
@@ -3313,20 +6755,18 @@ static kuhl_geometry* kuhl_private_load_model(const struct aiScene *sc,
 			}
 		}
 
-		if(mesh->mNumFaces > 0)
+		/* vertexPositions was put in the same order as the vertices
+		 * by kuhl_private_geometry_attrib(). */
+		if(meshIndices != NULL)
 		{
-			/* Get indices to draw with */
-			GLuint numIndices = mesh->mNumFaces * meshPrimitiveType;
-			GLuint *indices = kuhl_malloc(sizeof(GLuint)*numIndices);
-			for(unsigned int t = 0; t<mesh->mNumFaces; t++) // for each face
-			{
-				const struct aiFace* face = &mesh->mFaces[t];
-				for(unsigned int x = 0; x < meshPrimitiveType; x++) // for each index
-					indices[t*meshPrimitiveType+x] = face->mIndices[x];
-			}
-			kuhl_geometry_indices(geom, indices, numIndices);
-			free(indices);
+			if(meshPrimitiveTypeGL == GL_TRIANGLES && lodState.entries != NULL)
+				kuhl_private_lod_mesh(geom, meshIndices, numIndices, vertexPositions, nd->mMeshes[n]);
+			else
+				kuhl_geometry_indices(geom, meshIndices, numIndices);
+			free(meshIndices);
 		}
+		free(vertexPositions);
+		free(remap);
 
 
 		/* Initialize list of bone matrices if this mesh has bones. */
@@ -3459,6 +6899,36 @@ void kuhl_update_model(kuhl_geometry *first_geom, unsigned int animationNum, flo
 	} // end for each geometry
 }
 
+/** Adds up the size of the vertex attributes and indices in a list
+ * of geometries.
+ *
+ * @param geom The list of geometries.
+ * @param bytes Set to the number of bytes in their OpenGL buffers.
+ * @param floatBytes Set to the number of bytes the same data would
+ * use if it was stored as 32-bit floats and 32-bit indices.
+ */
+static void kuhl_geometry_buffer_bytes(const kuhl_geometry *geom, long *bytes, long *floatBytes)
+{
+	*bytes = 0;
+	*floatBytes = 0;
+	for(; geom != NULL; geom = geom->next)
+	{
+		for(unsigned int i=0; i<geom->attrib_count; i++)
+		{
+			const kuhl_attrib *attrib = &(geom->attribs[i]);
+			long floats = (long) sizeof(GLfloat)*attrib->components*geom->vertex_count;
+			*floatBytes += floats;
+			*bytes += attrib->stride > 0 ? (long) kuhl_attrib_bytes(attrib)*geom->vertex_count : floats;
+		}
+		/* Levels of detail are stored after the full-detail indices. */
+		GLuint indexCount = geom->indices_len;
+		if(geom->lod_count > 0)
+			indexCount = geom->lods[geom->lod_count-1].first + geom->lods[geom->lod_count-1].count;
+		*floatBytes += (long) sizeof(GLuint)*indexCount;
+		*bytes += (long) kuhl_geometry_index_size(geom)*indexCount;
+	}
+}
+
 /** Loads a model without drawing it.
  *
  * @param modelFilename The filename of the model.
@@ -3493,10 +6963,92 @@ kuhl_geometry* kuhl_load_model(const char *modelFilename, const char *textureDir
 	// Convert the information in aiScene into a kuhl_geometry object.
 	float transform[16];
 	mat4f_identity(transform);
+	memset(&optimizeStats, 0, sizeof(optimizeStats));
+
+	/* Make levels of detail for each triangle mesh if requested,
+	 * reusing the ones saved in the cache file next to the model. */
+	char *lodCacheFile = NULL;
+	if(kuhl_config_boolean("model.lod", 0, 0))
+	{
+		lodState.levels = kuhl_config_int("model.lod.levels", 4, 4);
+		if(lodState.levels < 2 || lodState.levels > KUHL_MAX_LODS)
+		{
+			msg(MSG_WARNING, "model.lod.levels must be between 2 and %d (it was %d). Using 4.", KUHL_MAX_LODS, lodState.levels);
+			lodState.levels = 4;
+		}
+		lodState.reduction = kuhl_config_float("model.lod.reduction", 0.5f, 0.5f);
+		if(lodState.reduction <= 0 || lodState.reduction >= 1)
+		{
+			msg(MSG_WARNING, "model.lod.reduction must be between 0 and 1 (it was %f). Using 0.5.", lodState.reduction);
+			lodState.reduction = 0.5f;
+		}
+		/* One extra entry so that the array isn't empty (kuhl_malloc()
+		 * returns NULL for 0 bytes). */
+		lodState.count = scene->mNumMeshes;
+		lodState.entries = (kuhl_private_lod_entry*) kuhl_malloc(sizeof(kuhl_private_lod_entry)*(scene->mNumMeshes+1));
+		memset(lodState.entries, 0, sizeof(kuhl_private_lod_entry)*(scene->mNumMeshes+1));
+		if(kuhl_config_boolean("model.lod.cache", 0, 0))
+		{
+			lodCacheFile = (char*) kuhl_malloc(strlen(newModelFilename)+5);
+			sprintf(lodCacheFile, "%s.lod", newModelFilename);
+			kuhl_private_lod_cache_read(lodCacheFile);
+		}
+	}
+
 	kuhl_geometry *ret = kuhl_private_load_model(scene, scene->mRootNode,
 	                                             program, transform,
 	                                             newModelFilename, textureDirname);
 
+	/* Report how much kuhl_private_optimize_mesh() reduced the
+	 * number of times vertices are processed. */
+	if(optimizeStats.triangles > 0)
+	{
+		kuhl_private_optimize_stats *st = &optimizeStats;
+		msg(MSG_INFO, "%s: Optimized %u meshes (%u triangles) for a %d vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f",
+		    modelFilename, st->meshes, st->triangles, KUHL_VERTEX_CACHE_REPORT_SIZE,
+		    st->missesBefore / (float) st->triangles, st->missesAfter / (float) st->triangles,
+		    st->missesBefore / (float) st->vertices, st->missesAfter / (float) st->vertices);
+	}
+
+	if(lodState.meshes > 0)
+	{
+		char levels[256] = "";
+		for(int l=0; l<lodState.levels; l++)
+		{
+			size_t len = strlen(levels);
+			snprintf(levels+len, sizeof(levels)-len, "%s%lu", l == 0 ? "" : ", ", lodState.triangles[l]);
+		}
+		msg(MSG_INFO, "%s: Levels of detail for %u meshes have %s triangles (%u reused from the cache, %.1f ms making the others)",
+		    modelFilename, lodState.meshes, levels, lodState.cached, lodState.time/1000.0);
+	}
+	if(lodCacheFile != NULL && lodState.changed)
+		kuhl_private_lod_cache_write(lodCacheFile);
+	free(lodCacheFile);
+	kuhl_private_lod_free();
+
+	/* Combine static meshes into shared buffers if the model isn't
+	 * animated (merged meshes can't be moved individually). */
+	if(kuhl_config_boolean("model.merge", 0, 0))
+	{
+		if(scene->mNumAnimations == 0)
+			ret = kuhl_geometry_merge(ret);
+		else
+			msg(MSG_INFO, "%s: Not merging meshes because the model is animated.", modelFilename);
+	}
+
+	/* Store the attributes of each mesh in one interleaved buffer,
+	 * optionally in formats that are smaller than floats. */
+	if(kuhl_config_boolean("model.compact", 0, 0))
+		kuhl_geometry_interleave(ret, KG_FULL_LIST | KG_COMPACT);
+	else if(kuhl_config_boolean("model.interleave", 1, 1))
+		kuhl_geometry_interleave(ret, KG_FULL_LIST);
+
+	long bytes, floatBytes;
+	kuhl_geometry_buffer_bytes(ret, &bytes, &floatBytes);
+	if(floatBytes > 0)
+		msg(MSG_INFO, "%s: Vertices and indices use %ld bytes, %ld bytes (%.0f%%) less than 32-bit floats and indices would.",
+		    modelFilename, bytes, floatBytes-bytes, 100.0*(floatBytes-bytes)/floatBytes);
+
 	/* Ensure model shows up in bind pose if the caller doesn't
 	 * also call kuhl_update_model(). */
 	kuhl_update_model(ret, 0, -1);
@@ -3667,6 +7219,7 @@ GLint kuhl_gen_framebuffer(int width, int height, GLuint *texture, GLuint *depth
 			msg(MSG_WARNING, "When generating a framebuffer, the 'texture' variable should be either NULL or zero. Remember that you only need to call kuhl_gen_framebuffer() once to create a framebuffer that is connected to a texture. Calling it repeatedly when only a single framebuffer is needed will result in a memory leak.");
 		}
 		glGenTextures(1, texture);
+		kuhl_gl_state_forget_texture(*texture);
 		glBindTexture(GL_TEXTURE_2D, *texture);
 		glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, width, height, 0, GL_RGB,
 		             GL_UNSIGNED_BYTE, 0);
@@ -3682,6 +7235,7 @@ GLint kuhl_gen_framebuffer(int width, int height, GLuint *texture, GLuint *depth
 			msg(MSG_WARNING, "When generating a framebuffer, the 'depthTexture' variable should be either NULL or zero. Remember that you only need to call kuhl_gen_framebuffer() once to create a framebuffer that is connected to a texture. Calling it repeatedly when only a single framebuffer is needed will result in a memory leak.");
 		}
 		glGenTextures(1, depthTexture);
+		kuhl_gl_state_forget_texture(*depthTexture);
 		glBindTexture(GL_TEXTURE_2D, *depthTexture);
 		glTexImage2D(GL_TEXTURE_2D, 0,GL_DEPTH24_STENCIL8, width, height, 0,
 		             GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0);
@@ -3797,6 +7351,7 @@ GLint kuhl_gen_framebuffer_msaa(int width, int height, GLuint *texture, GLuint *
 	if(texture != NULL)
 	{
 		glGenTextures(1, texture);
+		kuhl_gl_state_forget_texture(*texture);
 		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, *texture);
 		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, colorSamples, GL_RGB,
 		                        width, height, GL_TRUE);
@@ -3810,6 +7365,7 @@ GLint kuhl_gen_framebuffer_msaa(int width, int height, GLuint *texture, GLuint *
 	if(depthTexture != NULL)
 	{
 		glGenTextures(1, depthTexture);
+		kuhl_gl_state_forget_texture(*depthTexture);
 		glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, *depthTexture);
 		glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, depthSamples, GL_DEPTH24_STENCIL8, width, height, GL_TRUE);
 		kuhl_errorcheck();
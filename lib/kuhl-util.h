@@ -86,7 +86,8 @@ enum
 { /* Options used for some kuhl_geometry functions */
 	KG_NONE = 0,     /**< No options */
 	KG_WARN = 1,     /**< Warn if GLSL variable is missing */
-	KG_FULL_LIST = 2 /**< Apply to entire list of kuhl_geometry objects */
+	KG_FULL_LIST = 2, /**< Apply to entire list of kuhl_geometry objects */
+	KG_COMPACT = 4   /**< Store vertex attributes in smaller formats than 32-bit floats (see kuhl_geometry_interleave()) */
 };
 
 /** There is an array of kuhl_attrib structs inside of
@@ -94,7 +95,14 @@ enum
 typedef struct
 {
 	char*    name; /**< GLSL variable name the attribute information should be linked with. */
-	GLuint   bufferobject; /**< OpenGL buffer the attribute is stored in */
+	GLuint   bufferobject; /**< OpenGL buffer the attribute is stored in (shared with other attributes if the geometry was interleaved with kuhl_geometry_interleave()) */
+	GLuint   components; /**< Number of floats per vertex in this attribute */
+	GLenum   type; /**< How each component is stored in the buffer: GL_FLOAT unless the attribute was compacted by kuhl_geometry_interleave() */
+	GLboolean normalized; /**< GL_TRUE if integer components are mapped to [0,1] or [-1,1] */
+	GLuint   stride; /**< Number of bytes per vertex in an interleaved buffer, 0 if the buffer only contains this attribute (as floats) */
+	GLuint   offset; /**< Position (in bytes) of this attribute within each vertex of an interleaved buffer */
+	GLfloat* mapped; /**< Array returned by kuhl_geometry_attrib_get(): the pointer from glMapBuffer() or, for interleaved attributes, a copy that is kept until the geometry is deleted. NULL otherwise. */
+	GLboolean dirty; /**< GL_TRUE if the copy in mapped may have changed since it was written back into the interleaved buffer */
 } kuhl_attrib;
 
 /** There is an array of kuhl_texture structs inside of
@@ -102,9 +110,48 @@ typedef struct
 typedef struct
 {
 	char* name; /**< GLSL variable name the texture should be linked with. */
+	unsigned int name_hash; /**< Hash of name used to find the sampler in the program's uniform location cache */
 	GLuint textureId; /**< OpenGL texture id/name of the texture */
 } kuhl_texture;
 	
+/** One mesh in a kuhl_geometry created by kuhl_geometry_merge(). The
+ * layout matches the command that glMultiDrawElementsIndirect()
+ * reads. */
+typedef struct
+{
+	GLuint count;         /**< Number of indices */
+	GLuint instanceCount; /**< Number of instances (1) */
+	GLuint firstIndex;    /**< First index in the shared index buffer */
+	GLint  baseVertex;    /**< Added to each index: first vertex of the mesh in the shared vertex buffer */
+	GLuint baseInstance;  /**< Unused (0) */
+} kuhl_draw_command;
+
+/** Draw commands for a kuhl_geometry that contains several merged
+ * meshes. The commands are grouped by texture; each group is drawn
+ * with one multi-draw call. */
+typedef struct
+{
+	kuhl_draw_command *commands; /**< One command per mesh */
+	int command_count;           /**< Number of commands */
+	kuhl_texture *textures;      /**< Texture used by each group (textureId is 0 if the group is untextured) */
+	int *group_start;            /**< Index of the first command in each group; group_start[group_count] is command_count */
+	int group_count;             /**< Number of groups */
+	GLuint indirect_bufferobject; /**< Buffer holding the commands for glMultiDrawElementsIndirect(), 0 if it isn't supported */
+	GLsizei *counts;             /**< count of each command for glMultiDrawElementsBaseVertex() */
+	GLvoid **offsets;            /**< Byte offset of each command's first index for glMultiDrawElementsBaseVertex() */
+	GLint *base_vertices;        /**< baseVertex of each command for glMultiDrawElementsBaseVertex() */
+} kuhl_multidraw;
+
+/** One level of detail of a kuhl_geometry (see
+ * kuhl_geometry_lod()). Every level uses the geometry's vertices;
+ * only the triangles differ. */
+typedef struct
+{
+	GLuint first; /**< Position of the first index of this level in the geometry's index buffer */
+	GLuint count; /**< Number of indices in this level */
+	float error;  /**< Approximate distance (in the geometry's coordinates) between this level and the full-detail geometry */
+} kuhl_lod;
+
 /** The kuhl_geometry struct is used to quickly draw 3D objects in
  * OpenGL 3.0. For more information, see the example programs and the
  * documentation for kuhl_geometry_new() and kuhl_geometry_draw(). The
@@ -126,9 +173,15 @@ typedef struct _kuhl_geometry_
 
 	GLuint indices_len; /**< How many indices are there? - User should set this. */
 	GLuint indices_bufferobject; /**< What is the OpenGL buffer object that holds the indices? - Set by kuhl_geometry_init(). */
+	GLenum indices_type; /**< GL_UNSIGNED_SHORT or GL_UNSIGNED_INT - Set by kuhl_geometry_indices(). */
 
 	float matrix[16]; /**< A matrix that all of this geometry should be transformed by */
 	int has_been_drawn; /**< Has this piece of geometry been drawn yet? */
+	kuhl_multidraw *multidraw; /**< Meshes to draw if this geometry was created by kuhl_geometry_merge(), NULL otherwise */
+	kuhl_lod *lods; /**< Levels of detail from kuhl_geometry_lod(); lods[0] is full detail. NULL if there is only one level. */
+	int lod_count;  /**< Number of levels of detail (0 if lods is NULL) */
+	int lod_current; /**< Level that is drawn - set by kuhl_geometry_lod_select() */
+	float lod_bbox[6]; /**< Bounding box of the vertices (before matrix is applied) that kuhl_geometry_lod_select() projects */
 	
 #if KUHL_UTIL_USE_ASSIMP
 	struct aiNode *assimp_node; /**< Assimp node that this kuhl_geometry object was created from. */
@@ -140,6 +193,38 @@ typedef struct _kuhl_geometry_
 	
 } kuhl_geometry;
 
+/** One submission to a kuhl_renderqueue. */
+typedef struct
+{
+	kuhl_geometry *geom;  /**< Geometry to draw (only this object, not the rest of its list) */
+	float modelview[16];  /**< Value for the "ModelView" uniform variable */
+	int hasModelview;     /**< 0 if ModelView should be left alone */
+	unsigned long long key; /**< Sort key: program, texture set, vertex array object, depth */
+	int order;            /**< Position in the order that items were submitted */
+} kuhl_renderqueue_item;
+
+/** Counters describing the most recent kuhl_renderqueue_draw(). */
+typedef struct
+{
+	long draws;          /**< Geometries drawn */
+	long programChanges; /**< Times the GLSL program changed between draws */
+	long textureChanges; /**< Times the set of textures changed between draws */
+	long vaoChanges;     /**< Times the vertex array object changed between draws */
+	long changesAvoided; /**< Program, texture set and VAO changes that sorting avoided compared to drawing in submission order */
+	long submitTime;     /**< CPU time to sort and submit the draws (microseconds) */
+} kuhl_renderqueue_stats;
+
+/** A kuhl_renderqueue collects the geometry drawn during a frame and
+ * draws it sorted so that as little OpenGL state as possible changes
+ * between draws. See kuhl_renderqueue_init(). */
+typedef struct
+{
+	kuhl_renderqueue_item *items; /**< Submitted items */
+	int count;    /**< Number of items submitted */
+	int capacity; /**< Number of items allocated */
+	kuhl_renderqueue_stats stats; /**< Counters from the last kuhl_renderqueue_draw() */
+} kuhl_renderqueue;
+
 
 /** Call kuhl_errorcheck() with no parameters frequently for easy
  * OpenGL error checking. OpenGL doesn't report errors by
@@ -152,17 +237,31 @@ typedef struct _kuhl_geometry_
  * One alternative way to carefully check for errors is to set up a
  * OpenGL context with debugging enabled and then use
  * glDebugMessageCallback() to ask OpenGL to call a function that you
- * write every time an error occurs. We aren't using this seemingly
- * easier callback approach because it doesn't make it easy to narrow
- * down the line(s) of code causing an error.
+ * write every time an error occurs. kuhl_ogl_init() does this too
+ * (when the OpenGL implementation supports it), but the callback
+ * doesn't make it easy to narrow down the line(s) of code causing an
+ * error.
+ *
+ * Each glGetError() call can make the CPU wait for the graphics
+ * driver. Setting gl.errorcheck to false in the config file (see
+ * kuhl_errorcheck_enable()) makes kuhl_errorcheck() return
+ * immediately. Defining KUHL_UTIL_NO_ERRORCHECK (cmake
+ * -DKUHL_RELEASE=ON) removes the calls entirely. In both cases,
+ * errors are still reported by the debug output callback.
  */
+#ifdef KUHL_UTIL_NO_ERRORCHECK
+#define kuhl_errorcheck() kuhl_errorcheck_none()
+#else
 #define kuhl_errorcheck() kuhl_errorcheckFileLine(__FILE__, __LINE__, __func__)
+#endif
 
-
-
+/** kuhl_errorcheck() calls this function when KUHL_UTIL_NO_ERRORCHECK
+ * is defined. */
+static inline int kuhl_errorcheck_none(void) { return 0; }
 	
 // kuhl_errorcheck() calls this C function:
 int kuhl_errorcheckFileLine(const char *file, int line, const char *func);
+void kuhl_errorcheck_enable(int enable);
 // kuhl_malloc() calls this C function:
 void* kuhl_mallocFileLine(size_t size, const char *file, int line);
 
@@ -175,6 +274,13 @@ void kuhl_delete_program(GLuint program);
 void kuhl_print_program_log(GLuint program);
 void kuhl_print_program_info(GLuint program);
 GLint kuhl_get_uniform(const char *uniformName);
+void kuhl_uniform_cache_invalidate(GLuint program);
+void kuhl_use_program(GLuint program);
+GLuint kuhl_current_program(void);
+void kuhl_bind_vertex_array(GLuint vao);
+void kuhl_bind_buffer(GLenum target, GLuint buffer);
+void kuhl_bind_texture(GLuint unit, GLuint texture);
+void kuhl_gl_state_invalidate(void);
 GLint kuhl_get_attribute(GLuint program, const char *attributeName);
 
 
@@ -188,6 +294,11 @@ int kuhl_geometry_collide(kuhl_geometry *geom1, float mat1[16],
 
 void kuhl_geometry_new(kuhl_geometry *geom, GLuint program, unsigned int vertexCount, GLint primitive_type);
 void kuhl_geometry_draw(kuhl_geometry *geom);
+void kuhl_geometry_draw_instanced(kuhl_geometry *geom, const float *matrices, int count);
+void kuhl_renderqueue_init(kuhl_renderqueue *queue);
+void kuhl_renderqueue_add(kuhl_renderqueue *queue, kuhl_geometry *geom, const float modelview[16], int kg_options);
+void kuhl_renderqueue_draw(kuhl_renderqueue *queue);
+void kuhl_renderqueue_free(kuhl_renderqueue *queue);
 void kuhl_geometry_delete(kuhl_geometry *geom);
 unsigned int kuhl_geometry_count(const kuhl_geometry *geom);
 
@@ -195,6 +306,23 @@ void kuhl_geometry_program(kuhl_geometry *geom, GLuint program, int kg_options);
 GLfloat* kuhl_geometry_attrib_get(kuhl_geometry *geom, const char *name, GLint *size);
 void kuhl_geometry_indices(kuhl_geometry *geom, GLuint *indices, GLuint indexCount);
 void kuhl_geometry_attrib(kuhl_geometry *geom, const GLfloat *data, GLuint components, const char* name, int kg_options);
+void kuhl_geometry_interleave(kuhl_geometry *geom, int kg_options);
+kuhl_geometry* kuhl_geometry_merge(kuhl_geometry *geom);
+void kuhl_optimize_vertex_cache(GLuint *indices, GLuint indexCount, GLuint vertexCount);
+void kuhl_optimize_overdraw(GLuint *indices, GLuint indexCount, const GLfloat *positions, GLuint vertexCount);
+GLuint* kuhl_optimize_vertex_fetch(GLuint *indices, GLuint indexCount, GLuint vertexCount);
+void kuhl_vertex_cache_stats(const GLuint *indices, GLuint indexCount, GLuint vertexCount,
+                             int cacheSize, float *acmr, float *atvr);
+GLuint kuhl_simplify(GLuint *destination, const GLuint *indices, GLuint indexCount,
+                     const GLfloat *positions, GLuint vertexCount,
+                     GLuint targetIndexCount, float *error);
+int kuhl_lod_generate(GLuint **lodIndices, kuhl_lod *lods, int maxLevels,
+                      const GLuint *indices, GLuint indexCount,
+                      const GLfloat *positions, GLuint vertexCount, float reduction);
+void kuhl_geometry_lod(kuhl_geometry *geom, GLuint *lodIndices, const kuhl_lod *lods, int lodCount,
+                       const GLfloat *positions);
+void kuhl_geometry_lod_select(kuhl_geometry *geom, const float modelview[16], const float projection[16],
+                              const int viewport[4], float maxPixelError);
 void kuhl_geometry_texture(kuhl_geometry *geom, GLuint texture, const char* name, int kg_options);
 
 
@@ -0,0 +1,242 @@
+/* Copyright (c) 2015 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+ * @author Scott Kuhl
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lzcompress.h"
+
+#define LZ_MINMATCH 4      /**< Shortest match that is encoded */
+#define LZ_LASTLITERALS 5  /**< The last bytes of the input are always literals */
+#define LZ_MFLIMIT 12      /**< A match can't start within this many bytes of the end */
+#define LZ_MAXOFFSET 65535 /**< Offsets are stored in 2 bytes */
+#define LZ_HASHLOG 12      /**< The hash table has 2^LZ_HASHLOG entries */
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASHLOG);
+}
+
+/** Writes a length that didn't fit in the 4 bits of a token.
+ *
+ * @param op Where to write the length.
+ * @param oend The end of the output buffer.
+ * @param len The length minus 15.
+ * @return The location after the length or NULL if it didn't fit.
+ */
+static uint8_t* lz_write_length(uint8_t *op, const uint8_t *oend, int len)
+{
+	while(len >= 255)
+	{
+		if(op >= oend)
+			return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+	if(op >= oend)
+		return NULL;
+	*op++ = (uint8_t) len;
+	return op;
+}
+
+/** Writes one sequence: literals followed by a match. A match length
+ * of 0 indicates the final sequence (which has no match).
+ *
+ * @return The location after the sequence or NULL if it didn't fit.
+ */
+static uint8_t* lz_write_sequence(uint8_t *op, const uint8_t *oend,
+                                  const uint8_t *literals, int litLen,
+                                  int offset, int matchLen)
+{
+	if(op >= oend)
+		return NULL;
+	uint8_t *token = op++;
+	int mlCode = matchLen > 0 ? matchLen - LZ_MINMATCH : 0;
+	*token = (uint8_t) (((litLen < 15 ? litLen : 15) << 4) | (mlCode < 15 ? mlCode : 15));
+
+	if(litLen >= 15 && (op = lz_write_length(op, oend, litLen - 15)) == NULL)
+		return NULL;
+	if(op + litLen > oend)
+		return NULL;
+	memcpy(op, literals, litLen);
+	op += litLen;
+
+	if(matchLen == 0)
+		return op;
+	if(op + 2 > oend)
+		return NULL;
+	*op++ = (uint8_t) (offset & 0xff);
+	*op++ = (uint8_t) (offset >> 8);
+	if(mlCode >= 15 && (op = lz_write_length(op, oend, mlCode - 15)) == NULL)
+		return NULL;
+	return op;
+}
+
+/** Returns the largest size that compressing 'size' bytes can
+ * produce. Incompressible data grows slightly. */
+int lzcompress_bound(int size)
+{
+	return size + size/255 + 16;
+}
+
+/** Compresses data.
+ *
+ * @param src The data to compress.
+ * @param srcSize The number of bytes in src.
+ * @param dst Where the compressed data should be stored.
+ * @param dstCapacity The size of dst. Compression always succeeds if
+ * it is at least lzcompress_bound(srcSize).
+ *
+ * @return The number of bytes written to dst or 0 if the compressed
+ * data didn't fit in dst.
+ */
+int lzcompress(const void *src, int srcSize, void *dst, int dstCapacity)
+{
+	const uint8_t *base = (const uint8_t*) src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base; // start of the literals that haven't been written yet
+	const uint8_t *iend = base + srcSize;
+	const uint8_t *mflimit = iend - LZ_MFLIMIT;
+	const uint8_t *matchlimit = iend - LZ_LASTLITERALS;
+	uint8_t *op = (uint8_t*) dst;
+	const uint8_t *oend = op + dstCapacity;
+
+	/* Position (relative to base) of the most recent occurrence of
+	 * each hashed 4-byte sequence. */
+	uint32_t table[1 << LZ_HASHLOG];
+	memset(table, 0, sizeof(table));
+
+	if(srcSize > LZ_MFLIMIT)
+	{
+		ip++;
+		int misses = 0;
+		while(ip < mflimit)
+		{
+			uint32_t h = lz_hash(lz_read32(ip));
+			const uint8_t *ref = base + table[h];
+			table[h] = (uint32_t) (ip - base);
+
+			if(ip - ref > LZ_MAXOFFSET || lz_read32(ref) != lz_read32(ip))
+			{
+				/* Skip ahead faster in data that doesn't compress. */
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+
+			/* Extend the match backwards and forwards. */
+			while(ip > anchor && ref > base && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			int len = LZ_MINMATCH;
+			while(ip + len < matchlimit && ip[len] == ref[len])
+				len++;
+
+			op = lz_write_sequence(op, oend, anchor, (int) (ip - anchor), (int) (ip - ref), len);
+			if(op == NULL)
+				return 0;
+			ip += len;
+			anchor = ip;
+
+			/* Remember a position inside the match so that repeated
+			 * data is found again quickly. */
+			if(ip - 2 > base && ip < mflimit)
+				table[lz_hash(lz_read32(ip-2))] = (uint32_t) (ip - 2 - base);
+		}
+	}
+
+	/* The remaining bytes are literals. */
+	op = lz_write_sequence(op, oend, anchor, (int) (iend - anchor), 0, 0);
+	if(op == NULL)
+		return 0;
+	return (int) (op - (uint8_t*) dst);
+}
+
+/** Decompresses data that was compressed with lzcompress().
+ *
+ * @param src The compressed data.
+ * @param srcSize The number of bytes in src.
+ * @param dst Where the decompressed data should be stored.
+ * @param dstCapacity The size of dst.
+ *
+ * @return The number of bytes written to dst or -1 if the compressed
+ * data is malformed or wouldn't fit in dst.
+ */
+int lzdecompress(const void *src, int srcSize, void *dst, int dstCapacity)
+{
+	const uint8_t *ip = (const uint8_t*) src;
+	const uint8_t *iend = ip + srcSize;
+	uint8_t *op = (uint8_t*) dst;
+	uint8_t *oend = op + dstCapacity;
+
+	while(ip < iend)
+	{
+		int token = *ip++;
+
+		/* Literals */
+		int litLen = token >> 4;
+		if(litLen == 15)
+		{
+			int s;
+			do {
+				if(ip >= iend)
+					return -1;
+				s = *ip++;
+				litLen += s;
+			} while(s == 255);
+		}
+		if(litLen > iend - ip || litLen > oend - op)
+			return -1;
+		memcpy(op, ip, litLen);
+		ip += litLen;
+		op += litLen;
+		if(ip == iend) // the last sequence has no match
+			break;
+
+		/* Match */
+		if(iend - ip < 2)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op - (uint8_t*) dst)
+			return -1;
+		int matchLen = token & 15;
+		if(matchLen == 15)
+		{
+			int s;
+			do {
+				if(ip >= iend)
+					return -1;
+				s = *ip++;
+				matchLen += s;
+			} while(s == 255);
+		}
+		matchLen += LZ_MINMATCH;
+		if(matchLen > oend - op)
+			return -1;
+
+		const uint8_t *ref = op - offset;
+		if(offset >= matchLen)
+			memcpy(op, ref, matchLen);
+		else // the match overlaps the bytes it creates
+			for(int i=0; i<matchLen; i++)
+				op[i] = ref[i];
+		op += matchLen;
+	}
+	return (int) (op - (uint8_t*) dst);
+}
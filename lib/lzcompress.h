@@ -0,0 +1,29 @@
+/* Copyright (c) 2015 Scott Kuhl. All rights reserved.
+ * License: This code is licensed under a 3-clause BSD license. See
+ * the file named "LICENSE" for a full copy of the license.
+ */
+
+/** @file
+
+    A small and fast LZ77 compressor. The compressed data uses the
+    LZ4 block format: a sequence of literal bytes followed by a copy
+    of earlier bytes, repeated. The compressor uses a single hash
+    table lookup per position, so it compresses at hundreds of MB/s
+    and decompresses faster than that. It is intended for data that
+    is sent over a network every frame (see DGR), not for archiving.
+
+    @author Scott Kuhl
+ */
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int lzcompress_bound(int size);
+int lzcompress(const void *src, int srcSize, void *dst, int dstCapacity);
+int lzdecompress(const void *src, int srcSize, void *dst, int dstCapacity);
+
+#ifdef __cplusplus
+} // end extern "C"
+#endif
@@ -207,6 +207,16 @@ void viewmat_init(const float pos[3], const float look[3], const float up[3])
 		controlModeString = "none";
 	}
 
+	/* The view matrices change every frame and slaves need the newest
+	 * ones as soon as possible. Send them in their own small frames
+	 * ahead of the rest of the DGR records. */
+	if(dgr_is_enabled() == 1 && dgr_is_master() == 1)
+	{
+		int poseChannel = dgr_channel("pose", 0, 0);
+		dgr_channel_add(poseChannel, "!!viewmat");
+		dgr_channel_add(poseChannel, "!!viewMatPos");
+	}
+
 	/* Set viewmat_control_mode variable appropriately. */
 	static const char *controlStrings[] = { "none", "mouse", "vrpn", "orient", "oculus" };
 	static const ViewmatControlMode controlTypes[]    = { VIEWMAT_CONTROL_NONE, VIEWMAT_CONTROL_MOUSE, VIEWMAT_CONTROL_VRPN, VIEWMAT_CONTROL_ORIENT, VIEWMAT_CONTROL_OCULUS };
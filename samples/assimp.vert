@@ -14,6 +14,11 @@ uniform mat4 ModelView;
 uniform mat4 Projection;
 uniform mat4 GeomTransform;
 
+// Per-instance model matrices for kuhl_geometry_draw_instanced(). Each
+// matrix is stored as four texels (one per column).
+uniform samplerBuffer InstanceMat;
+uniform int UseInstanceMat;
+
 out vec2 out_TexCoord;
 out vec3 out_Color;
 out vec3 out_Normal;   // normal vector (camera coordinates)
@@ -25,17 +30,27 @@ void main()
 	out_TexCoord = in_TexCoord;
 	out_Color = in_Color;
 
-	mat4 actualModelView;
+	mat4 m;
 	if(NumBones > 0)
 	{
-		mat4 m = in_BoneWeight.x * BoneMat[int(in_BoneIndex.x)] +
+		m = in_BoneWeight.x * BoneMat[int(in_BoneIndex.x)] +
 			in_BoneWeight.y * BoneMat[int(in_BoneIndex.y)] +
 			in_BoneWeight.z * BoneMat[int(in_BoneIndex.z)] +
 			in_BoneWeight.w * BoneMat[int(in_BoneIndex.w)];
-		actualModelView = ModelView * m;
 	}
 	else
-		actualModelView = ModelView * GeomTransform;
+		m = GeomTransform;
+
+	if(UseInstanceMat != 0)
+	{
+		int i = gl_InstanceID*4;
+		mat4 instance = mat4(texelFetch(InstanceMat, i),
+		                     texelFetch(InstanceMat, i+1),
+		                     texelFetch(InstanceMat, i+2),
+		                     texelFetch(InstanceMat, i+3));
+		m = instance * m;
+	}
+	mat4 actualModelView = ModelView * m;
 
 	// Transform normal from object coordinates to camera coordinates
 	//out_Normal = normalize(NormalMat * in_Normal);
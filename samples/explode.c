@@ -297,7 +297,7 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		/* Send the perspective projection matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
@@ -325,7 +325,7 @@ void display()
 		kuhl_geometry_draw(modelgeom); /* Draw the model */
 		kuhl_errorcheck();
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
 	viewmat_end_frame();
@@ -4,7 +4,9 @@
  */
 
 /** @file Draws a single model repeatedly. Useful for doing very
- * simple performance measurements.
+ * simple performance measurements. Press 'i' to switch between
+ * drawing the models with kuhl_geometry_draw_instanced() and calling
+ * kuhl_geometry_draw() once for each model.
  *
  * @author Scott Kuhl
  */
@@ -39,6 +41,10 @@ static const float initCamUp[3]   = {0,1,0};
 
 #define NUM_MODELS 5000
 static float positions[NUM_MODELS][3];
+static float modelMats[NUM_MODELS][16]; /**< Model matrix for each copy of the model */
+
+/** Draw the models with kuhl_geometry_draw_instanced()? */
+static int instanced = 1;
 
 #define GLSL_VERT_FILE "assimp.vert"
 #define GLSL_FRAG_FILE "assimp.frag"
@@ -55,6 +61,10 @@ void keyboard(GLFWwindow* window, int key, int scancode, int action, int mods)
 		case GLFW_KEY_ESCAPE:
 			glfwSetWindowShouldClose(window, GL_TRUE);
 			break;
+		case GLFW_KEY_I:
+			instanced = !instanced;
+			printf("Drawing models %s.\n", instanced ? "with kuhl_geometry_draw_instanced()" : "one at a time");
+			break;
 #if 0
 		case 'f': // full screen
 			glutFullScreen();
@@ -94,8 +104,14 @@ void display()
 		if(fpscount % 10 == 0)
 		{
 			float fps = bufferswap_fps(); // get current fps
+			/* Number of draw calls that the models need with and
+			 * without instancing. */
+			int drawCalls = kuhl_geometry_count(modelgeom);
+			if(!instanced)
+				drawCalls *= NUM_MODELS;
 			char message[1024];
-			snprintf(message, 1024, "FPS: %0.2f", fps); // make a string with fps on it
+			snprintf(message, 1024, "FPS: %0.2f, %d draw calls (%s)", fps, drawCalls,
+			         instanced ? "instanced" : "not instanced"); // make a string with fps on it
 			float labelColor[3] = { 1,1,1 };
 			float labelBg[4] = { 0,0,0,.3 };
 
@@ -109,6 +125,7 @@ void display()
 	 * process. */
 	int renderStyle = 2;
 	dgr_setget("style", &renderStyle, sizeof(int));
+	dgr_setget("instanced", &instanced, sizeof(int));
 
 	
 	/* Render the scene once for each viewport. Frequently one
@@ -150,7 +167,7 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		/* Send the perspective projection matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
@@ -161,23 +178,31 @@ void display()
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
 		float modelview[16];
-		for(int i=0; i<NUM_MODELS; i++)
+		if(instanced)
 		{
-			float modelMat[16];
-			get_model_matrix(modelMat, positions[i]);
-
-			mat4f_mult_mat4f_new(modelview, viewMat, modelMat); // modelview = view * model
-
-			/* Send the modelview matrix to the vertex program. */
-			glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
-			                   1, // number of 4x4 float matrices
-			                   0, // transpose
-			                   modelview); // value
-
-			kuhl_errorcheck();
-			kuhl_geometry_draw(modelgeom); /* Draw the model */
+			/* The vertex program multiplies the view matrix by the
+			 * model matrix of each instance. */
+			glUniformMatrix4fv(kuhl_get_uniform("ModelView"), 1, 0, viewMat);
+			kuhl_geometry_draw_instanced(modelgeom, modelMats[0], NUM_MODELS);
 			kuhl_errorcheck();
 		}
+		else
+		{
+			for(int i=0; i<NUM_MODELS; i++)
+			{
+				mat4f_mult_mat4f_new(modelview, viewMat, modelMats[i]); // modelview = view * model
+
+				/* Send the modelview matrix to the vertex program. */
+				glUniformMatrix4fv(kuhl_get_uniform("ModelView"),
+				                   1, // number of 4x4 float matrices
+				                   0, // transpose
+				                   modelview); // value
+
+				kuhl_errorcheck();
+				kuhl_geometry_draw(modelgeom); /* Draw the model */
+				kuhl_errorcheck();
+			}
+		}
 
 		// aspect ratio will be zero when the program starts (and FPS hasn't been computed yet)
 		if(dgr_is_master())
@@ -205,16 +230,16 @@ void display()
 			kuhl_errorcheck();
 		}
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
 	viewmat_end_frame();
 
 	/* Update the model for the next frame based on the time. We
 	 * convert the time to seconds and then use mod to cause the
-	 * animation to repeat. */
-	double time = glfwGetTime();
-	dgr_setget("time", &time, sizeof(double));
+	 * animation to repeat. dgr_time() is the same on all DGR
+	 * processes. */
+	double time = dgr_time();
 	kuhl_update_model(modelgeom, 0, fmod(time,10));
 
 	/* Check for errors. If there are errors, consider adding more
@@ -262,6 +287,7 @@ int main(int argc, char** argv)
 		positions[i][0] = drand48()*50-25;
 		positions[i][1] = drand48()*50-25;
 		positions[i][2] = drand48()*50-25;
+		get_model_matrix(modelMats[i], positions[i]);
 	}
 	
 	while(!glfwWindowShouldClose(kuhl_get_window()))
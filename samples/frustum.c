@@ -124,7 +124,7 @@ void display()
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		
 		/* Send the perspective projection matrix to the vertex program. */
@@ -144,7 +144,7 @@ void display()
 		 * vertex programs immediately above */
 		kuhl_geometry_draw(modelgeom);
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
 	viewmat_end_frame();
@@ -178,7 +178,7 @@ int main(int argc, char** argv)
 
 
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	
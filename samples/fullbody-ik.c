@@ -449,7 +449,7 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		glUseProgram(program);
+		kuhl_use_program(program);
 
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
@@ -495,7 +495,7 @@ void display()
 
 		draw_model(viewMat);
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 
 		static int counter = 0;
 		counter++;
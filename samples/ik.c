@@ -451,7 +451,7 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		glUseProgram(program);
+		kuhl_use_program(program);
 
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
@@ -503,7 +503,7 @@ void display()
 		end_effector_loc(ealoc, arm2Mat);
 
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 
 		static int counter = 0;
 		counter++;
@@ -153,7 +153,7 @@ void display()
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		
 		/* Send the perspective projection matrix to the vertex program. */
@@ -423,7 +423,7 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program("texture.vert", "texture.frag");
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 
 	init_geometryQuad(&quad, program);
@@ -476,7 +476,7 @@ int main(int argc, char** argv)
 	
 	
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 
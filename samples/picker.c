@@ -75,12 +75,12 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		/* Calculate an angle to rotate the object. glfwGetTime() gets
-		 * the time in seconds since GLFW was initialized. Rotates 45 degrees every second. */
-		float angle = fmod(glfwGetTime()*45, 360);
-
-		/* Make sure all computers/processes use the same angle */
-		dgr_setget("angle", &angle, sizeof(GLfloat));
+		/* Calculate an angle to rotate the object. dgr_time() gets
+		 * the time in seconds since the DGR master started---and
+		 * returns the same time on all computers/processes, so they
+		 * all calculate the same angle. Rotates 45 degrees every
+		 * second. */
+		float angle = fmod(dgr_time()*45, 360);
 
 		/* Create a 4x4 rotation matrix based on the angle we computed. */
 		float rotateMat[16];
@@ -96,7 +96,7 @@ void display()
 		mat4f_mult_mat4f_new(modelview, modelview, rotateMat);
 
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		
 		/* Send the perspective projection matrix to the vertex program. */
@@ -167,7 +167,7 @@ void display()
 				printf("Cursor isn't on anything.\n");
 		}
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);		
 	} // finish viewport loop
 	viewmat_end_frame();
@@ -262,10 +262,10 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program("triangle-color.vert", "triangle-color.frag");
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	/* Create kuhl_geometry structs for the objects that we want to
 	 * draw. */
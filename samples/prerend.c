@@ -123,7 +123,7 @@ void display()
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		
 		/* Send the perspective projection matrix to the vertex program. */
@@ -175,7 +175,7 @@ void display()
 
 		/* Stop rendering to texture */
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glUseProgram(0);
+		kuhl_use_program(0);
 		kuhl_errorcheck();
 		
 #if USE_MSAA==1
@@ -193,7 +193,7 @@ void display()
 		/* Set up the viewport to draw on the screen */
 		glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 
-		glUseProgram(prerendProgram);
+		kuhl_use_program(prerendProgram);
 		kuhl_geometry_draw(&prerendQuad);
 
 
@@ -298,13 +298,13 @@ int main(int argc, char** argv)
 
 	/* Use the GLSL program so subsequent calls to glUniform*() send the variable to
 	   the correct program. */
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 	/* Set the uniform variable in the shader that is named "red" to the value 1. */
 	glUniform1i(kuhl_get_uniform("red"), 0);
 	kuhl_errorcheck();
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	/* Create kuhl_geometry structs for the objects that we want to
 	 * draw. */
@@ -136,13 +136,13 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program("triangle.vert", "triangle.frag");
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 	/* Set the uniform variable in the shader that is named "red" to the value 1. */
 	glUniform1i(kuhl_get_uniform("red"), 1);
 	kuhl_errorcheck();
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
@@ -115,7 +115,7 @@ void display()
 		mat4f_mult_mat4f_new(modelview, modelview, rotateMat);
 
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		/* Send the perspective projection matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
@@ -132,7 +132,7 @@ void display()
 		 * vertex programs immediately above */
 		kuhl_geometry_draw(&triangle);
 		
-		glUseProgram(program_font);
+		kuhl_use_program(program_font);
 		glDisable(GL_DEPTH_TEST); // turn off depth testing
 		kuhl_errorcheck();
 
@@ -202,7 +202,7 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program("texture.vert", "texture.frag");
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 
 	init_geometryTriangle(&triangle, program);
@@ -218,7 +218,7 @@ int main(int argc, char** argv)
 	
 	// Create text shader
 	program_font = kuhl_create_program("text.vert", "text.frag");
-	glUseProgram(program_font);
+	kuhl_use_program(program_font);
 	kuhl_errorcheck();
 
 	// Set text color.
@@ -232,7 +232,7 @@ int main(int argc, char** argv)
 	}
 	
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 	
@@ -100,7 +100,7 @@ void display()
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		
 		/* Send the perspective projection matrix to the vertex program. */
@@ -118,7 +118,7 @@ void display()
 		 * vertex programs immediately above */
 		kuhl_geometry_draw(&triangle);
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
 	viewmat_end_frame();
@@ -168,13 +168,13 @@ int main(int argc, char** argv)
 	/* Compile and link a GLSL program composed of a vertex shader and
 	 * a fragment shader. */
 	program = kuhl_create_program("texture.vert", "texture.frag");
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 
 	init_geometryTriangle(&triangle, program);
 	
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	dgr_init();     /* Initialize DGR based on environment variables. */
 
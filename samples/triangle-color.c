@@ -98,7 +98,7 @@ void display()
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		
 		/* Send the perspective projection matrix to the vertex program. */
@@ -116,7 +116,7 @@ void display()
 		 * vertex programs immediately above */
 		kuhl_geometry_draw(&triangle);
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
 	viewmat_end_frame();
@@ -165,11 +165,11 @@ int main(int argc, char** argv)
 
 	/* Use the GLSL program so subsequent calls to glUniform*() send the variable to
 	   the correct program. */
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	/* Create kuhl_geometry structs for the objects that we want to
 	 * draw. */
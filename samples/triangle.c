@@ -72,12 +72,12 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		/* Calculate an angle to rotate the object. glfwGetTime() gets
-		 * the time in seconds since GLFW was initialized. Rotates 45 degrees every second. */
-		float angle = fmodf((float) (glfwGetTime()*45.0), 360);
-
-		/* Make sure all computers/processes use the same angle */
-		dgr_setget("angle", &angle, sizeof(GLfloat));
+		/* Calculate an angle to rotate the object. dgr_time() gets
+		 * the time in seconds since the DGR master started---and
+		 * returns the same time on all computers/processes, so they
+		 * all calculate the same angle. Rotates 45 degrees every
+		 * second. */
+		float angle = fmodf((float) (dgr_time()*45.0), 360);
 
 		/* Create a 4x4 rotation matrix based on the angle we computed. */
 		float rotateMat[16];
@@ -100,7 +100,7 @@ void display()
 		/* Tell OpenGL which GLSL program the subsequent
 		 * glUniformMatrix4fv() calls are for. */
 		kuhl_errorcheck();
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		
 		/* Send the perspective projection matrix to the vertex program. */
@@ -125,7 +125,7 @@ void display()
 		 * kuhl_geometry_draw() again to draw that object again using
 		 * the new model matrix. */
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
 	viewmat_end_frame();
@@ -198,13 +198,13 @@ int main(int argc, char** argv)
 
 	/* Use the GLSL program so subsequent calls to glUniform*() send the variable to
 	   the correct program. */
-	glUseProgram(program);
+	kuhl_use_program(program);
 	kuhl_errorcheck();
 	/* Set the uniform variable in the shader that is named "red" to the value 1. */
 	glUniform1i(kuhl_get_uniform("red"), 0);
 	kuhl_errorcheck();
 	/* Good practice: Unbind objects until we really need them. */
-	glUseProgram(0);
+	kuhl_use_program(0);
 
 	/* Create kuhl_geometry structs for the objects that we want to
 	 * draw. */
@@ -33,6 +33,10 @@ static int fitToView=0;  // was --fit option used?
  * marker, the marker will be in object, world, etc coordinates. */
 static int showOrigin=0; // was --origin option used?
 
+/** Largest error (in pixels) allowed when choosing a level of detail
+ * for the model (model.lod.pixels in the config file). */
+static float lodPixelError = 1;
+
 
 /** Initial position of the camera. 1.55 is a good approximate
  * eyeheight in meters.*/
@@ -330,7 +334,7 @@ void display()
 		float viewMat[16], perspective[16];
 		viewmat_get(viewMat, perspective, viewportID);
 
-		glUseProgram(program);
+		kuhl_use_program(program);
 		kuhl_errorcheck();
 		/* Send the perspective projection matrix to the vertex program. */
 		glUniformMatrix4fv(kuhl_get_uniform("Projection"),
@@ -351,6 +355,11 @@ void display()
 
 		glUniform1i(kuhl_get_uniform("renderStyle"), renderStyle);
 
+		/* If the model has levels of detail (model.lod in the config
+		 * file), draw the ones that fit how large it is on the
+		 * screen. */
+		kuhl_geometry_lod_select(modelgeom, modelview, perspective, viewport, lodPixelError);
+
 		kuhl_errorcheck();
 		kuhl_geometry_draw(modelgeom); /* Draw the model */
 		kuhl_errorcheck();
@@ -402,7 +411,7 @@ void display()
 			kuhl_errorcheck();
 		}
 
-		glUseProgram(0); // stop using a GLSL program.
+		kuhl_use_program(0); // stop using a GLSL program.
 		viewmat_end_eye(viewportID);
 	} // finish viewport loop
 
@@ -487,6 +496,7 @@ int main(int argc, char** argv)
 
 	// Load the model from the file
 	modelgeom = kuhl_load_model(modelFilename, modelTexturePath, program, bbox);
+	lodPixelError = kuhl_config_float("model.lod.pixels", 1, 1);
 	origingeom = kuhl_load_model("../models/origin/origin.obj", modelTexturePath, program, NULL);
 
 
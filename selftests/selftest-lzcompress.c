@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "lzcompress.h"
+
+static int errors = 0;
+
+/* Compress and decompress the data. Ensure that we get the original
+ * data back and that corrupt input is rejected without writing past
+ * the end of the output buffer. */
+void test_roundtrip(const char *label, const unsigned char *data, int size)
+{
+	int bound = lzcompress_bound(size);
+	unsigned char *compressed = malloc(bound);
+	unsigned char *result = malloc(size+1);
+
+	int csize = lzcompress(data, size, compressed, bound);
+	if(csize <= 0)
+	{
+		printf("ERROR: %s: compression failed for %d bytes\n", label, size);
+		errors++;
+		return;
+	}
+	int dsize = lzdecompress(compressed, csize, result, size);
+	if(dsize != size || memcmp(data, result, size) != 0)
+	{
+		printf("ERROR: %s: roundtrip failed for %d bytes (got %d bytes)\n", label, size, dsize);
+		errors++;
+	}
+
+	/* Output buffer too small. */
+	if(size > 0 && lzdecompress(compressed, csize, result, size-1) != -1)
+	{
+		printf("ERROR: %s: decompression into a small buffer didn't fail\n", label);
+		errors++;
+	}
+
+	/* Truncated and corrupted input must not crash. */
+	lzdecompress(compressed, csize/2, result, size);
+	for(int i=0; i<csize; i += 7)
+		compressed[i] ^= 0x5a;
+	lzdecompress(compressed, csize, result, size);
+
+	free(compressed);
+	free(result);
+}
+
+int main(void)
+{
+	int size = 256*1024;
+	unsigned char *data = malloc(size);
+
+	memset(data, 0, size);
+	for(int i=0; i<size; i += 997)
+		test_roundtrip("zeros", data, i);
+
+	for(int i=0; i<size; i++)
+		data[i] = (unsigned char) (drand48()*256);
+	for(int i=0; i<100; i++)
+		test_roundtrip("random", data, i);
+	test_roundtrip("random", data, size);
+
+	for(int i=0; i<size; i++)
+		data[i] = "abcabcabd"[i%9];
+	test_roundtrip("pattern", data, size);
+
+	float *f = (float*) data;
+	for(int i=0; i<size/4; i++)
+		f[i] = sinf(i/100.0f);
+	test_roundtrip("floats", data, size);
+
+	/* Compression into a buffer that is too small fails. */
+	unsigned char small[16];
+	for(int i=0; i<size; i++)
+		data[i] = (unsigned char) (drand48()*256);
+	if(lzcompress(data, 1000, small, sizeof(small)) != 0)
+	{
+		printf("ERROR: compression into a small buffer didn't fail\n");
+		errors++;
+	}
+
+	free(data);
+	printf("%d errors\n", errors);
+	return errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}